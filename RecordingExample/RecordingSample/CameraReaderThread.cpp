@@ -2,6 +2,7 @@
 #include "CameraReaderThread.h"
 #include <Camera.h>
 #include <Logger.h>
+#include <SaturationMask.h>
 #include <deque>
 #include <chrono>
 #include <vector>
@@ -34,6 +35,8 @@ void CameraReaderThread::own_thread()
 	const size_t spatial_size = m_camera->getSpatialSize();
 	const size_t spectral_size = m_camera->getSpectralSize();
 
+	SaturationMask saturation;
+
 	while( !m_terminate )
 	{
 		ImageLine< unsigned short > raw_image = m_camera->getNextImage( HYSPEX_RAW, 500 ); // RAW data, timeout 500 ms.
@@ -44,18 +47,11 @@ void CameraReaderThread::own_thread()
             continue;
         }
 
-        bool saturated = false;
-        for( int i = 0; i < raw_image.saturated.size; i++ )
-        {
-            if( raw_image.saturated.data[ i ] > 0 )
-            {
-                saturated = true;
-            }
-        }
-
-        if( saturated )
+        // packs the saturation vectors of the library ( bands from Camera::setSaturationBands() ), the image is not scanned.
+        const SaturationSummary& summary = saturation.compute( raw_image );
+        if( summary.saturated_pixels > 0 )
         {
-            HYSPEX_LOG_INFO( "Saturation detected!" );
+            HYSPEX_LOG_INFO( "Saturation detected! Saturated pixels: " << summary.saturated_pixels << ", spatial pixels: " << summary.saturated_columns );
         }
 	}
 	HYSPEX_LOG_DEBUG( tid << " EXITTING function...");
@@ -0,0 +1,580 @@
+#ifndef HYSPEX_ACQUISITIONGROUP_H
+#define HYSPEX_ACQUISITIONGROUP_H
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "FileWriter.h"
+#include "ImageBuffer.h"
+#include "ProcessingGraph.h"
+
+namespace hyspex
+{
+    /*!
+    * Member camera of an AcquisitionGroup.
+    */
+    struct AcquisitionMember
+    {
+        Camera* camera{ nullptr };                         //!< Camera, owned by CameraManager.
+        ImageOptions options{ HYSPEX_RAW };                //!< Image options to read and record.
+        TriggerNumber trigger{ HYSPEX_TRIGGER_VNIR };      //!< Trigger output of the master electronics wired to this camera.
+        CameraDivisionFactor division{ HYSPEX_DIVISION_F1 }; //!< Frame rate division for this camera, F1 for every trigger.
+        int64_t timestamp_offset_ns{ 0 };                  //!< Added to timestamp_host_ns before matching, for sensor specific latency.
+        size_t queue_size{ 64 };                           //!< Max frames waiting for a match, the oldest is dropped when full.
+    };
+
+    /*!
+    * Matched frames from all cameras of an AcquisitionGroup, in the order the cameras were added.
+    */
+    struct AcquisitionFrames
+    {
+        uint64_t index{ 0 };                                //!< Shared frame index, also the line index in the recorded files.
+        uint64_t timestamp_ns{ 0 };                         //!< timestamp_host_ns of the first camera.
+        std::vector< ImageLine< unsigned short > > images;  //!< One image per camera, empty on timeout.
+    };
+
+    /*!
+    * @brief Several cameras acquiring together, delivered as timestamp matched frame tuples.
+    *
+    * start() configures shared triggering ( optional ): the master electronics drive every member's trigger output
+    * ( Camera::setTriggerOutput() with the member division factor ) and the other cameras use external trigger.
+    * The triggered cameras are started first, the master last, so all cameras see the first trigger.
+    *
+    * One reader thread per camera copies images into pooled buffers and passes them through a lock-free queue.
+    * A matcher thread merges the queues in timestamp order ( timestamp_host_ns + timestamp_offset_ns ): heads older than
+    * the newest head by more than the match tolerance are dropped as unmatched, and when all heads are within tolerance they
+    * form one tuple with the next shared frame index. Tuples are recorded, if enabled, and queued for getNextFrames().
+    * Each recorded file ( FileWriter, one per camera ) then holds exactly the matched frames, so line i of every file is tuple i.
+    *
+    * Not thread-safe: configure and start / stop from one thread, read tuples from one thread.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::AcquisitionGroup group;
+    * hyspex::AcquisitionMember vnir;
+    * vnir.camera = manager.getCameraByIndex( 0 );
+    * vnir.trigger = hyspex::HYSPEX_TRIGGER_VNIR;
+    * hyspex::AcquisitionMember swir;
+    * swir.camera = manager.getCameraByIndex( 1 );
+    * swir.trigger = hyspex::HYSPEX_TRIGGER_SWIR;
+    * group.addCamera( vnir );
+    * group.addCamera( swir );
+    * group.setTriggerMaster( 0 );
+    * group.setRecording( { "D:\\flight_vnir.hyspex", "D:\\flight_swir.hyspex" }, "line 12" ); // optional
+    *
+    * group.start();
+    * while( running )
+    * {
+    *     const hyspex::AcquisitionFrames& frames = group.getNextFrames( 500 );
+    *     if( frames.images.empty() )
+    *     {
+    *         continue; // timeout
+    *     }
+    *     // frames.images[ 0 ] is VNIR, frames.images[ 1 ] is SWIR, matched by timestamp.
+    *     if( group.getStatus() != hyspex::HYSPEX_OK )
+    *     {
+    *         // writing the recording failed, e.g. disk full.
+    *     }
+    * }
+    * group.stop();
+    * @endcode
+    */
+    class AcquisitionGroup : public CacheAligned
+    {
+    public:
+        AcquisitionGroup() : m_ready( 64 ), m_freeTuples( 66 )
+        {
+        }
+
+        ~AcquisitionGroup()
+        {
+            stop();
+            Tuple* tuple = nullptr;
+            while( m_freeTuples.tryPop( tuple ) )
+            {
+                delete tuple;
+            }
+        }
+
+        //! Add camera, returns its index in the tuples, or -1 if invalid or running.
+        int addCamera( const AcquisitionMember& a_member )
+        {
+            if( m_running || !a_member.camera || a_member.queue_size == 0 )
+            {
+                return -1;
+            }
+            for( auto& member : m_members )
+            {
+                if( member->config.camera == a_member.camera )
+                {
+                    return -1;
+                }
+            }
+            m_members.push_back( std::unique_ptr< Member >( new Member( a_member ) ) );
+            return static_cast< int >( m_members.size() ) - 1;
+        }
+
+        //! Camera whose electronics trigger the group, -1 ( default ) leaves triggering as configured.
+        ReturnCode setTriggerMaster( int a_index )
+        {
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+            if( a_index < -1 || a_index >= static_cast< int >( m_members.size() ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_master = a_index;
+            return HYSPEX_OK;
+        }
+
+        //! Max timestamp difference within a tuple, 0 ( default ) for half the frame period of the master ( or first ) camera.
+        ReturnCode setMatchTolerance( uint64_t a_toleranceNs )
+        {
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+            m_tolerance = a_toleranceNs;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Record matched frames to one file per camera ( same order as addCamera() ), opened in start() and closed in stop().
+        * Empty a_paths disables recording.
+        */
+        ReturnCode setRecording( const std::vector< std::string >& a_paths, const std::string& a_comment = std::string() )
+        {
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+            if( !a_paths.empty() && a_paths.size() != m_members.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_paths = a_paths;
+            m_comment = a_comment;
+            return HYSPEX_OK;
+        }
+
+        //! Configure triggering, open recordings and start acquisition on all cameras.
+        ReturnCode start()
+        {
+            if( m_members.empty() )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+
+            if( m_master >= 0 )
+            {
+                Camera* master = m_members[ m_master ]->config.camera;
+                for( size_t i = 0; i < m_members.size(); i++ )
+                {
+                    const AcquisitionMember& member = m_members[ i ]->config;
+                    HYSPEX_RETURN_IF_ERROR_VAL( master->setTriggerOutput( member.trigger, member.division ) );
+                    if( static_cast< int >( i ) != m_master )
+                    {
+                        HYSPEX_RETURN_IF_ERROR_VAL( member.camera->setUseExternalTrigger( true ) );
+                    }
+                }
+            }
+
+            const Camera* reference = m_members[ m_master >= 0 ? m_master : 0 ]->config.camera;
+            m_activeTolerance = m_tolerance > 0 ? m_tolerance : static_cast< uint64_t >( reference->getFramePeriod() ) * 500;
+
+            m_writers.clear();
+            for( size_t i = 0; i < m_paths.size(); i++ )
+            {
+                std::unique_ptr< FileWriter > writer( new FileWriter() );
+                const ImageOptions options = m_members[ i ]->config.options;
+                const bool re_corrected = options == HYSPEX_RE || options == HYSPEX_HSNR_RE;
+                if( !writer->open( m_paths[ i ].c_str() ) || !writer->writeHeader( m_members[ i ]->config.camera, m_comment.c_str(), re_corrected ) )
+                {
+                    m_writers.clear();
+                    return HYSPEX_FAILED_TO_SET_VALUE;
+                }
+                m_writers.push_back( std::move( writer ) );
+            }
+
+            m_index = 0;
+            m_status = HYSPEX_OK;
+            m_recording = !m_writers.empty();
+            m_terminate = false;
+            m_running = true;
+            for( auto& member : m_members )
+            {
+                m_threads.emplace_back( &AcquisitionGroup::readerThread, this, member.get() );
+            }
+            m_threads.emplace_back( &AcquisitionGroup::matcherThread, this );
+
+            // triggered cameras first, so they are waiting when the master starts triggering.
+            for( size_t i = 0; i < m_members.size(); i++ )
+            {
+                if( static_cast< int >( i ) == m_master )
+                {
+                    continue;
+                }
+                Camera* camera = m_members[ i ]->config.camera;
+                const ReturnCode result = m_master >= 0 ? camera->startAcquisitionNoWait() : camera->startAcquisition();
+                if( result < 1 )
+                {
+                    stop();
+                    return result;
+                }
+            }
+            if( m_master >= 0 )
+            {
+                const ReturnCode result = m_members[ m_master ]->config.camera->startAcquisition();
+                if( result < 1 )
+                {
+                    stop();
+                    return result;
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Stop acquisition ( master first ) and threads, and close recordings. Tuples not yet read are discarded.
+        ReturnCode stop()
+        {
+            if( !m_running )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( m_master >= 0 )
+            {
+                m_members[ m_master ]->config.camera->stopAcquisition();
+            }
+            for( size_t i = 0; i < m_members.size(); i++ )
+            {
+                if( static_cast< int >( i ) != m_master )
+                {
+                    m_members[ i ]->config.camera->stopAcquisition();
+                }
+            }
+
+            m_terminate = true;
+            for( auto& thread : m_threads )
+            {
+                thread.join();
+            }
+            m_threads.clear();
+
+            for( auto& writer : m_writers )
+            {
+                writer->close();
+            }
+            m_writers.clear();
+
+            releaseFrames();
+            Tuple* tuple = nullptr;
+            while( m_ready.tryPop( tuple ) )
+            {
+                recycle( tuple );
+            }
+            for( auto& member : m_members )
+            {
+                ImageBuffer< unsigned short >* buffer = nullptr;
+                while( member->queue.tryPop( buffer ) )
+                {
+                    member->release( buffer );
+                }
+            }
+            m_running = false;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Get next matched tuple, returns frames with empty images on timeout.
+        * The frames are valid until the next call or releaseFrames().
+        */
+        const AcquisitionFrames& getNextFrames( uint32_t a_timeoutMs = 0 )
+        {
+            releaseFrames();
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( a_timeoutMs );
+            unsigned int attempt = 0;
+            while( !m_ready.tryPop( m_current ) )
+            {
+                if( std::chrono::steady_clock::now() >= deadline )
+                {
+                    m_current = nullptr;
+                    return m_empty;
+                }
+                backoff( attempt );
+            }
+            return m_current->frames;
+        }
+
+        //! Return frames from the last getNextFrames() to the pools.
+        void releaseFrames()
+        {
+            if( m_current )
+            {
+                recycle( m_current );
+                m_current = nullptr;
+            }
+        }
+
+        size_t getCameraCount() const { return m_members.size(); } //!< Number of cameras.
+        bool isRunning() const { return m_running; } //!< True between start() and stop().
+        uint64_t getMatchedFrames() const { return m_index.load(); } //!< Tuples matched ( and recorded ) since start().
+        uint64_t getDroppedTuples() const { return m_droppedTuples.load(); } //!< Tuples dropped because getNextFrames() was not called fast enough.
+        uint64_t getUnmatchedImages( int a_index ) const { return valid( a_index ) ? m_members[ a_index ]->unmatched.load() : 0; } //!< Images of a_index without a match.
+        uint64_t getDroppedImages( int a_index ) const { return valid( a_index ) ? m_members[ a_index ]->dropped.load() : 0; } //!< Images of a_index dropped because its queue was full.
+        uint64_t getMatchTolerance() const { return m_activeTolerance; } //!< Tolerance in use, after start().
+
+        /*!
+        * HYSPEX_OK, or HYSPEX_FAILED_TO_SET_VALUE once writing a recorded frame failed. Recording of all cameras stops at the
+        * failing tuple, matched tuples are still delivered by getNextFrames(). Thread-safe, reset by start().
+        */
+        ReturnCode getStatus() const { return m_status.load(); }
+        bool isRecording() const { return m_recording.load(); } //!< Recordings are open and written, false after a failed write.
+
+    private:
+        struct Member : public CacheAligned
+        {
+            Member( const AcquisitionMember& a_config ) : config( a_config ), queue( a_config.queue_size ), free( a_config.queue_size + 4 )
+            {
+            }
+
+            ~Member()
+            {
+                ImageBuffer< unsigned short >* buffer = nullptr;
+                while( queue.tryPop( buffer ) )
+                {
+                    delete buffer;
+                }
+                while( free.tryPop( buffer ) )
+                {
+                    delete buffer;
+                }
+            }
+
+            //! Return a_buffer to the pool.
+            void release( ImageBuffer< unsigned short >* a_buffer )
+            {
+                if( !free.tryPush( a_buffer ) )
+                {
+                    delete a_buffer;
+                }
+            }
+
+            AcquisitionMember config; //!< Configuration.
+            BoundedQueue< ImageBuffer< unsigned short >* > queue; //!< Images waiting for a match, oldest first.
+            BoundedQueue< ImageBuffer< unsigned short >* > free; //!< Buffers for reuse.
+            std::atomic< uint64_t > dropped{ 0 }; //!< Images dropped, queue full.
+            std::atomic< uint64_t > unmatched{ 0 }; //!< Images without a match.
+        };
+
+        struct Tuple
+        {
+            AcquisitionFrames frames; //!< Views into buffers.
+            std::vector< ImageBuffer< unsigned short >* > buffers; //!< One per camera.
+        };
+
+        // disallow copy-constructors
+        AcquisitionGroup( const AcquisitionGroup& that );
+        AcquisitionGroup& operator=( const AcquisitionGroup& that );
+
+        bool valid( int a_index ) const { return a_index >= 0 && a_index < static_cast< int >( m_members.size() ); }
+
+        //! Back off while waiting for a queue, spin first, then yield, then sleep.
+        static void backoff( unsigned int& a_attempt )
+        {
+            if( a_attempt < 64 )
+            {
+                a_attempt++;
+            }
+            else if( a_attempt < 128 )
+            {
+                a_attempt++;
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+            }
+        }
+
+        //! Return buffers of a_tuple and a_tuple itself to the pools.
+        void recycle( Tuple* a_tuple )
+        {
+            for( size_t i = 0; i < a_tuple->buffers.size(); i++ )
+            {
+                m_members[ i ]->release( a_tuple->buffers[ i ] );
+                a_tuple->buffers[ i ] = nullptr;
+            }
+            if( !m_freeTuples.tryPush( a_tuple ) )
+            {
+                delete a_tuple;
+            }
+        }
+
+        //! Matched timestamp of a_buffer from a_member.
+        static int64_t matchTime( const Member& a_member, const ImageBuffer< unsigned short >& a_buffer )
+        {
+            return static_cast< int64_t >( a_buffer.line().timestamp_host_ns ) + a_member.config.timestamp_offset_ns;
+        }
+
+        void readerThread( Member* a_member )
+        {
+            Camera* camera = a_member->config.camera;
+            while( !m_terminate )
+            {
+                const ImageLine< unsigned short >& image = camera->getNextImage( a_member->config.options, 100 );
+                if( image.buffer.size == 0 )
+                {
+                    // got timeout on wait, retry.
+                    continue;
+                }
+
+                ImageBuffer< unsigned short >* buffer = nullptr;
+                if( !a_member->free.tryPop( buffer ) )
+                {
+                    buffer = new ImageBuffer< unsigned short >();
+                }
+                buffer->resize( image.spectral_size, image.spatial_size );
+                buffer->copyMetadata( image );
+                std::copy( image.buffer.data, image.buffer.data + image.buffer.size, buffer->data() );
+
+                while( !a_member->queue.tryPush( buffer ) )
+                {
+                    ImageBuffer< unsigned short >* oldest = nullptr;
+                    if( a_member->queue.tryPop( oldest ) )
+                    {
+                        a_member->dropped++;
+                        a_member->release( oldest );
+                    }
+                }
+            }
+            camera->releaseImage();
+        }
+
+        void matcherThread()
+        {
+            const size_t count = m_members.size();
+            std::vector< ImageBuffer< unsigned short >* > heads( count, nullptr );
+            const int64_t tolerance = static_cast< int64_t >( m_activeTolerance );
+            unsigned int attempt = 0;
+            while( !m_terminate )
+            {
+                bool complete = true;
+                for( size_t i = 0; i < count; i++ )
+                {
+                    if( !heads[ i ] && !m_members[ i ]->queue.tryPop( heads[ i ] ) )
+                    {
+                        complete = false;
+                    }
+                }
+                if( !complete )
+                {
+                    backoff( attempt );
+                    continue;
+                }
+                attempt = 0;
+
+                // drop heads that are too old to match the newest head, their partners were lost or divided away.
+                int64_t newest = matchTime( *m_members[ 0 ], *heads[ 0 ] );
+                for( size_t i = 1; i < count; i++ )
+                {
+                    newest = std::max( newest, matchTime( *m_members[ i ], *heads[ i ] ) );
+                }
+                bool matched = true;
+                for( size_t i = 0; i < count; i++ )
+                {
+                    if( matchTime( *m_members[ i ], *heads[ i ] ) < newest - tolerance )
+                    {
+                        m_members[ i ]->unmatched++;
+                        m_members[ i ]->release( heads[ i ] );
+                        heads[ i ] = nullptr;
+                        matched = false;
+                    }
+                }
+                if( matched )
+                {
+                    publish( heads );
+                    std::fill( heads.begin(), heads.end(), nullptr );
+                }
+            }
+            for( size_t i = 0; i < count; i++ )
+            {
+                if( heads[ i ] )
+                {
+                    m_members[ i ]->release( heads[ i ] );
+                }
+            }
+        }
+
+        //! Record a_heads ( while recording ) and queue them as the next tuple, dropping the oldest queued tuple if the queue is full.
+        void publish( const std::vector< ImageBuffer< unsigned short >* >& a_heads )
+        {
+            for( size_t i = 0; i < m_writers.size() && m_recording; i++ )
+            {
+                const ImageLine< unsigned short >& line = a_heads[ i ]->line();
+                if( !m_writers[ i ]->writeImage( line.buffer.data, static_cast< size_t >( line.buffer.size ) ) )
+                {
+                    // disk full or removed: stop all recordings, files keep the tuples written so far.
+                    m_recording = false;
+                    m_status = HYSPEX_FAILED_TO_SET_VALUE;
+                }
+            }
+
+            Tuple* tuple = nullptr;
+            if( !m_freeTuples.tryPop( tuple ) )
+            {
+                tuple = new Tuple();
+            }
+            tuple->buffers = a_heads;
+            tuple->frames.images.resize( a_heads.size() );
+            for( size_t i = 0; i < a_heads.size(); i++ )
+            {
+                tuple->frames.images[ i ] = a_heads[ i ]->line();
+            }
+            tuple->frames.timestamp_ns = a_heads[ 0 ]->line().timestamp_host_ns;
+            tuple->frames.index = m_index++;
+
+            while( !m_ready.tryPush( tuple ) )
+            {
+                Tuple* oldest = nullptr;
+                if( m_ready.tryPop( oldest ) )
+                {
+                    m_droppedTuples++;
+                    recycle( oldest );
+                }
+            }
+        }
+
+        std::vector< std::unique_ptr< Member > > m_members; //!< Cameras in order of addCamera().
+        std::vector< std::unique_ptr< FileWriter > > m_writers; //!< Open recordings, used by matcher thread.
+        std::vector< std::string > m_paths; //!< Recording paths, empty to disable.
+        std::string m_comment; //!< Recording comment.
+        BoundedQueue< Tuple* > m_ready; //!< Matched tuples waiting to be read.
+        BoundedQueue< Tuple* > m_freeTuples; //!< Tuples for reuse.
+        Tuple* m_current{ nullptr }; //!< Tuple returned by getNextFrames().
+        AcquisitionFrames m_empty; //!< Returned on timeout.
+        std::vector< std::thread > m_threads; //!< Reader and matcher threads.
+        int m_master{ -1 }; //!< Trigger master, -1 for none.
+        uint64_t m_tolerance{ 0 }; //!< Configured match tolerance, 0 for automatic.
+        uint64_t m_activeTolerance{ 0 }; //!< Match tolerance in use.
+        std::atomic< uint64_t > m_index{ 0 }; //!< Next shared frame index.
+        std::atomic< uint64_t > m_droppedTuples{ 0 }; //!< Tuples dropped.
+        std::atomic< ReturnCode > m_status{ HYSPEX_OK }; //!< Recording result, see getStatus().
+        std::atomic_bool m_recording{ false }; //!< Writers are used by the matcher thread.
+        std::atomic_bool m_terminate{ true }; //!< Set to stop threads.
+        bool m_running{ false }; //!< True between start() and stop().
+    };
+}
+
+#endif // HYSPEX_ACQUISITIONGROUP_H
@@ -0,0 +1,402 @@
+#ifndef HYSPEX_ANOMALYDETECTION_H
+#define HYSPEX_ANOMALYDETECTION_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+#include "ProcessingGraph.h"
+#include "SpectralStatistics.h"
+
+namespace hyspex
+{
+    /*!
+    * One pixel reported by RxDetector.
+    */
+    struct AnomalyHit
+    {
+        uint32_t pixel; //!< Spatial pixel.
+        float score;    //!< RX score ( squared Mahalanobis distance ).
+    };
+
+    /*!
+    * @brief Streaming RX anomaly detection.
+    *
+    * Scores every pixel spectrum x of a frame with the squared Mahalanobis distance to the background statistics:
+    *
+    *     score = ( x - mean )^T C^-1 ( x - mean ) = | W ( x - mean ) |^2, where C = L L^T and W = L^-1
+    *
+    * Mean and covariance are accumulated incrementally from the frames ( every getUpdateInterval() frame, optionally with
+    * exponential forgetting ). W is rebuilt by a regularized Cholesky factorization every getRefreshInterval() frames, and
+    * each time the sample count doubles while warming up. Frames are scored before they are added to the statistics.
+    * Scoring runs on blocks of 64 pixels, 8 pixels per SIMD lane group, with W applied as a triangular matrix product,
+    * i.e. spectral^2 / 2 multiply-adds per pixel. For large spectral sizes, raise the update interval to halve the cost.
+    * Scoring blocks and the statistics update ( one pixel range per thread ) run as one job on a WorkerPool, see setThreads().
+    * Not thread-safe.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::RxDetector detector;
+    * detector.setTopCount( 5 );
+    * detector.setThreads( 4 );
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * if( detector.apply( image ) == hyspex::HYSPEX_OK && detector.isReady() )
+    * {
+    *     const std::vector< float >& scores = detector.getScores(); // one per spatial pixel.
+    *     for( const hyspex::AnomalyHit& hit : detector.getTopHits() )
+    *     {
+    *         // hit.pixel, hit.score
+    *     }
+    * }
+    * @endcode
+    */
+    class RxDetector
+    {
+    public:
+        void setUpdateInterval( uint32_t a_frames ) { m_updateInterval = std::max( a_frames, 1u ); } //!< Add every n-th frame to the statistics.
+        void setRefreshInterval( uint32_t a_frames ) { m_refreshInterval = std::max( a_frames, 1u ); } //!< Rebuild inverse covariance every n frames.
+        void setTopCount( uint32_t a_count ) { m_topCount = a_count; } //!< Number of pixels in getTopHits().
+        void setRegularization( double a_factor ) { m_regularization = std::max( a_factor, 0.0 ); } //!< Added to the diagonal, relative to mean variance.
+        void setThreads( unsigned int a_threads ) { m_pool.setThreads( a_threads ); } //!< Threads per frame including the caller, 0 for one per core, default 1.
+        unsigned int getThreads() const { return m_pool.getThreads(); } //!< Threads per frame.
+
+        ReturnCode setForgetting( double a_factor ) { return m_statistics.setForgetting( a_factor ); } //!< Weight of old statistics per update ( 0 - 1 ], 1.0 keeps all frames.
+
+        uint32_t getUpdateInterval() const { return m_updateInterval; } //!< Statistics update interval in frames.
+        uint32_t getRefreshInterval() const { return m_refreshInterval; } //!< Inverse covariance refresh interval in frames.
+        bool isReady() const { return m_ready; } //!< Inverse covariance is available, i.e. scores are valid.
+        const std::vector< float >& getScores() const { return m_scores; } //!< Score per spatial pixel for last frame.
+        const std::vector< AnomalyHit >& getTopHits() const { return m_top; } //!< Highest scores for last frame, highest first.
+        const std::vector< float >& getMean() const { return m_mean; } //!< Mean spectrum of current model.
+
+        //! Clear statistics and model.
+        void reset()
+        {
+            m_spectralSize = 0;
+            m_spatialSize = 0;
+            m_frames = 0;
+            m_statistics.reset();
+            m_refreshedWeight = 0.0;
+            m_ready = false;
+            m_scores.clear();
+            m_top.clear();
+        }
+
+        //! Score a_image ( spectral x spatial ), then add it to the statistics. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        ReturnCode apply( const ImageLine< float >& a_image, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return apply( a_image.buffer.data, a_image.buffer.size, a_image.spectral_size, a_image.spatial_size );
+        }
+
+        //! Same as above for unsigned short input.
+        ReturnCode apply( const ImageLine< unsigned short >& a_image )
+        {
+            m_converted.resize( a_image.buffer.size );
+            convertToFloat( a_image.buffer.data, m_converted.data(), a_image.buffer.size );
+            return apply( m_converted.data(), a_image.buffer.size, a_image.spectral_size, a_image.spatial_size );
+        }
+
+        //! Same as above for a raw frame.
+        ReturnCode apply( const float* a_data, size_t a_size, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            if( !a_data || a_spectralSize == 0 || a_spatialSize == 0 || a_size != static_cast< size_t >( a_spectralSize ) * a_spatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( a_spectralSize != m_spectralSize || a_spatialSize != m_spatialSize )
+            {
+                initialize( a_spectralSize, a_spatialSize );
+            }
+
+            // frames are scored with the model from before they were added, so both run in one pass.
+            const bool scored = m_ready;
+            const bool update = m_frames % m_updateInterval == 0;
+            process( a_data, scored, update );
+            m_frames++;
+
+            // while the statistics are young, the model is also rebuilt every time the sample count doubles.
+            const double weight = m_statistics.getWeight();
+            if( ( weight > m_spectralSize && weight >= 2.0 * m_refreshedWeight ) || m_frames % m_refreshInterval == 0 )
+            {
+                refresh();
+            }
+            if( !scored && m_ready )
+            {
+                process( a_data, true, false );
+            }
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Rebuild mean and inverse covariance from the statistics. Called automatically, see setRefreshInterval().
+        * Returns HYSPEX_NOT_ACTIVE if there are too few samples, the previous model is kept if factorization fails.
+        */
+        ReturnCode refresh()
+        {
+            const size_t n = m_spectralSize;
+            std::vector< double > mean;
+            std::vector< double > covariance;
+            HYSPEX_RETURN_IF_ERROR_VAL( m_statistics.getMeanAndCovariance( &mean, &covariance ) );
+
+            double trace = 0.0;
+            for( size_t i = 0; i < n; i++ )
+            {
+                trace += covariance[ i * n + i ];
+            }
+
+            // retry with more regularization if the covariance is ( numerically ) singular.
+            double ridge = m_regularization * std::max( trace / n, 1e-12 );
+            bool factorized = false;
+            for( int attempt = 0; attempt < 6 && !factorized; attempt++, ridge *= 100.0 )
+            {
+                m_cholesky = covariance;
+                factorized = factorize( ridge );
+            }
+            if( !factorized )
+            {
+                return HYSPEX_FAILED_TO_SET_VALUE;
+            }
+
+            invertLower();
+            for( size_t i = 0; i < n; i++ )
+            {
+                m_mean[ i ] = static_cast< float >( mean[ i ] );
+            }
+            m_refreshedWeight = m_statistics.getWeight();
+            m_ready = true;
+            return HYSPEX_OK;
+        }
+
+    private:
+        static const uint32_t BLOCK = 64; //!< Pixels scored together.
+
+        void initialize( uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            reset();
+            m_spectralSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            const size_t n = a_spectralSize;
+            m_cholesky.assign( n * n, 0.0 );
+            m_whitening.assign( n * n, 0.0f );
+            m_mean.assign( n, 0.0f );
+            m_scores.assign( a_spatialSize, 0.0f );
+        }
+
+        //! In-place Cholesky of lower triangle of m_cholesky + a_ridge * I. Returns false if not positive definite.
+        bool factorize( double a_ridge )
+        {
+            const size_t n = m_spectralSize;
+            double* a = m_cholesky.data();
+            for( size_t j = 0; j < n; j++ )
+            {
+                double diagonal = a[ j * n + j ] + a_ridge;
+                for( size_t k = 0; k < j; k++ )
+                {
+                    diagonal -= a[ j * n + k ] * a[ j * n + k ];
+                }
+                if( !( diagonal > 0.0 ) )
+                {
+                    return false;
+                }
+                const double root = std::sqrt( diagonal );
+                a[ j * n + j ] = root;
+                for( size_t i = j + 1; i < n; i++ )
+                {
+                    double value = a[ i * n + j ];
+                    for( size_t k = 0; k < j; k++ )
+                    {
+                        value -= a[ i * n + k ] * a[ j * n + k ];
+                    }
+                    a[ i * n + j ] = value / root;
+                }
+            }
+            return true;
+        }
+
+        //! m_whitening = inverse of lower triangular m_cholesky.
+        void invertLower()
+        {
+            const size_t n = m_spectralSize;
+            const double* l = m_cholesky.data();
+            std::vector< double > inverse( n * n, 0.0 );
+            for( size_t i = 0; i < n; i++ )
+            {
+                inverse[ i * n + i ] = 1.0 / l[ i * n + i ];
+                for( size_t j = 0; j < i; j++ )
+                {
+                    double value = 0.0;
+                    for( size_t k = j; k < i; k++ )
+                    {
+                        value -= l[ i * n + k ] * inverse[ k * n + j ];
+                    }
+                    inverse[ i * n + j ] = value / l[ i * n + i ];
+                }
+            }
+            for( size_t i = 0; i < n * n; i++ )
+            {
+                m_whitening[ i ] = static_cast< float >( inverse[ i ] );
+            }
+        }
+
+        /*!
+        * Score all pixels of a_data into m_scores and update m_top ( a_score ), and add a_data to the statistics ( a_update ).
+        * Tasks are the statistics ranges, one per thread, followed by the scoring blocks.
+        */
+        void process( const float* a_data, bool a_score, bool a_update )
+        {
+            const size_t pixels = m_spatialSize;
+            const size_t ranges = a_update ? std::min< size_t >( m_pool.getThreads(), pixels ) : 0;
+            const size_t blocks = a_score ? ( pixels + BLOCK - 1 ) / BLOCK : 0;
+            if( a_update )
+            {
+                m_statistics.beginFrame( a_data, m_spectralSize, m_spatialSize );
+                m_ranges.resize( ranges );
+            }
+            m_blocks.resize( m_pool.getThreads() );
+
+            m_pool.run( ranges + blocks, [&]( size_t a_task, unsigned int a_worker )
+            {
+                if( a_task < ranges )
+                {
+                    const size_t first = pixels * a_task / ranges;
+                    const size_t last = pixels * ( a_task + 1 ) / ranges;
+                    m_statistics.accumulateRange( a_data, first, last - first, &m_ranges[ a_task ] );
+                }
+                else
+                {
+                    scoreBlock( a_data, ( a_task - ranges ) * BLOCK, m_blocks[ a_worker ] );
+                }
+            } );
+
+            for( size_t r = 0; r < ranges; r++ )
+            {
+                m_statistics.addRange( m_ranges[ r ] );
+            }
+            if( a_score )
+            {
+                updateTop();
+            }
+        }
+
+        //! m_scores[ x ] = | W ( a_data[ x ] - mean ) |^2 for the BLOCK pixels from a_first, a_block is scratch.
+        void scoreBlock( const float* a_data, size_t a_first, std::vector< float >& a_block )
+        {
+            const size_t n = m_spectralSize;
+            const size_t pixels = m_spatialSize;
+            const size_t count = std::min< size_t >( static_cast< size_t >( BLOCK ), pixels - a_first );
+            a_block.resize( n * BLOCK );
+            for( size_t j = 0; j < n; j++ )
+            {
+                float* centered = a_block.data() + j * BLOCK;
+                const float* input = a_data + j * pixels + a_first;
+                for( size_t x = 0; x < count; x++ )
+                {
+                    centered[ x ] = input[ x ] - m_mean[ j ];
+                }
+                for( size_t x = count; x < BLOCK; x++ )
+                {
+                    centered[ x ] = 0.0f;
+                }
+            }
+
+            const float* block = a_block.data();
+            float result[ BLOCK ];
+#ifdef HYSPEX_PROCESSING_AVX2
+            __m256 total[ BLOCK / 8 ];
+            for( size_t k = 0; k < BLOCK / 8; k++ )
+            {
+                total[ k ] = _mm256_setzero_ps();
+            }
+            for( size_t i = 0; i < n; i++ )
+            {
+                const float* w = m_whitening.data() + i * n;
+                __m256 z[ BLOCK / 8 ];
+                for( size_t k = 0; k < BLOCK / 8; k++ )
+                {
+                    z[ k ] = _mm256_setzero_ps();
+                }
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    const __m256 weight = _mm256_set1_ps( w[ j ] );
+                    const float* c = block + j * BLOCK;
+                    for( size_t k = 0; k < BLOCK / 8; k++ )
+                    {
+                        z[ k ] = _mm256_add_ps( z[ k ], _mm256_mul_ps( weight, _mm256_loadu_ps( c + k * 8 ) ) );
+                    }
+                }
+                for( size_t k = 0; k < BLOCK / 8; k++ )
+                {
+                    total[ k ] = _mm256_add_ps( total[ k ], _mm256_mul_ps( z[ k ], z[ k ] ) );
+                }
+            }
+            for( size_t k = 0; k < BLOCK / 8; k++ )
+            {
+                _mm256_storeu_ps( result + k * 8, total[ k ] );
+            }
+#else
+            std::fill( result, result + BLOCK, 0.0f );
+            float z[ BLOCK ];
+            for( size_t i = 0; i < n; i++ )
+            {
+                const float* w = m_whitening.data() + i * n;
+                std::fill( z, z + BLOCK, 0.0f );
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    const float* c = block + j * BLOCK;
+                    for( size_t x = 0; x < BLOCK; x++ )
+                    {
+                        z[ x ] += w[ j ] * c[ x ];
+                    }
+                }
+                for( size_t x = 0; x < BLOCK; x++ )
+                {
+                    result[ x ] += z[ x ] * z[ x ];
+                }
+            }
+#endif
+            std::copy( result, result + count, m_scores.data() + a_first );
+        }
+
+        void updateTop()
+        {
+            const size_t count = std::min< size_t >( m_topCount, m_spatialSize );
+            m_top.resize( m_spatialSize );
+            for( uint32_t x = 0; x < m_spatialSize; x++ )
+            {
+                m_top[ x ].pixel = x;
+                m_top[ x ].score = m_scores[ x ];
+            }
+            const auto higher = []( const AnomalyHit& a, const AnomalyHit& b ) { return a.score > b.score; };
+            std::nth_element( m_top.begin(), m_top.begin() + count, m_top.end(), higher );
+            m_top.resize( count );
+            std::sort( m_top.begin(), m_top.end(), higher );
+        }
+
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of model.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of frames.
+        uint64_t m_frames{ 0 }; //!< Frames seen since reset.
+        uint32_t m_updateInterval{ 1 }; //!< Add every n-th frame to statistics.
+        uint32_t m_refreshInterval{ 100 }; //!< Rebuild model every n frames.
+        uint32_t m_topCount{ 10 }; //!< Size of m_top.
+        double m_regularization{ 1e-6 }; //!< Diagonal loading relative to mean variance.
+        double m_refreshedWeight{ 0.0 }; //!< Statistics weight at last refresh().
+        bool m_ready{ false }; //!< m_whitening and m_mean are valid.
+        SpectralCovariance m_statistics; //!< Mean and covariance of frames.
+        std::vector< double > m_cholesky; //!< Covariance / Cholesky factor, scratch for refresh().
+        std::vector< float > m_whitening; //!< Inverse of Cholesky factor, lower triangular.
+        std::vector< float > m_mean; //!< Mean of model.
+        std::vector< std::vector< float > > m_blocks; //!< Centered pixel block per thread, spectral x BLOCK.
+        std::vector< SpectralCovarianceRange > m_ranges; //!< Statistics of each pixel range of a frame.
+        WorkerPool m_pool; //!< Threads for process().
+        std::vector< float > m_converted; //!< Float copy of unsigned short input.
+        std::vector< float > m_scores; //!< Score per pixel.
+        std::vector< AnomalyHit > m_top; //!< Highest scores.
+    };
+}
+
+#endif // HYSPEX_ANOMALYDETECTION_H
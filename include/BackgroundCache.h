@@ -0,0 +1,401 @@
+#ifndef HYSPEX_BACKGROUNDCACHE_H
+#define HYSPEX_BACKGROUNDCACHE_H
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+
+namespace hyspex
+{
+    /*!
+    * Camera settings a background matrix is valid for. The sensor temperature is matched separately, see BackgroundCache.
+    * Cameras that do not report a sensor temperature get has_temperature = 0 and are matched on the settings alone.
+    */
+    struct BackgroundCacheKey
+    {
+        uint32_t serial_number{ 0 };       //!< Camera serial number.
+        uint32_t integration_time_us{ 0 }; //!< Integration time.
+        uint32_t frame_period_us{ 0 };     //!< Frame period.
+        uint16_t spatial_binning{ 1 };     //!< Spatial binning.
+        uint16_t spectral_binning{ 1 };    //!< Spectral binning.
+        uint32_t spatial_start{ 0 };       //!< Spatial ROI start.
+        uint32_t spatial_size{ 0 };        //!< Spatial ROI size.
+        uint32_t spectral_roi_hash{ 0 };   //!< Hash of active spectral bands, 0 without spectral ROI.
+        uint32_t lens_id{ 0 };             //!< Lens id, selects calibration and gain mode.
+        int32_t gain_mode{ HYSPEX_GAINMODE_NONE }; //!< Gain mode ( GainMode ).
+        uint32_t has_temperature{ 1 };     //!< 0 if the sensor temperature was not available, entries then use temperature 0.
+
+        bool operator==( const BackgroundCacheKey& a_other ) const
+        {
+            return serial_number == a_other.serial_number && integration_time_us == a_other.integration_time_us && frame_period_us == a_other.frame_period_us &&
+                   spatial_binning == a_other.spatial_binning && spectral_binning == a_other.spectral_binning && spatial_start == a_other.spatial_start &&
+                   spatial_size == a_other.spatial_size && spectral_roi_hash == a_other.spectral_roi_hash && lens_id == a_other.lens_id &&
+                   gain_mode == a_other.gain_mode && has_temperature == a_other.has_temperature;
+        }
+    };
+
+    /*!
+    * Cached background.
+    */
+    struct BackgroundCacheEntry
+    {
+        BackgroundCacheKey key;             //!< Settings.
+        double temperature{ 0.0 };          //!< Sensor temperature when captured.
+        int64_t created_ms{ 0 };            //!< Capture time, ms since epoch ( system clock ).
+        uint32_t spectral_size{ 0 };        //!< Spectral size.
+        uint32_t spatial_size{ 0 };         //!< Spatial size.
+        std::vector< double > background;   //!< Background matrix ( spectral x spatial ).
+        std::vector< double > std_deviation; //!< Standard deviation matrix, may be empty.
+    };
+
+    //! Key for the current settings of a_camera, and its sensor temperature ( 0 if not available, see BackgroundCacheKey::has_temperature ).
+    inline ReturnCode getBackgroundCacheKey( Camera* a_camera, BackgroundCacheKey* a_key, double* a_temperature )
+    {
+        if( !a_camera )
+        {
+            return HYSPEX_INVALID_HANDLE;
+        }
+        if( !a_key || !a_temperature )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+
+        BackgroundCacheKey key;
+        key.serial_number = a_camera->getSerialNumber();
+        key.integration_time_us = a_camera->getIntegrationTime();
+        key.frame_period_us = a_camera->getFramePeriod();
+        key.spatial_binning = a_camera->getSpatialBinning();
+        key.spectral_binning = a_camera->getSpectralBinning();
+        key.lens_id = a_camera->getLensId();
+        key.gain_mode = static_cast< int32_t >( a_camera->getGainMode() );
+        unsigned int spatial_start = 0;
+        unsigned int spatial_size = 0;
+        if( a_camera->getSpatialROI( &spatial_start, &spatial_size ) == HYSPEX_OK )
+        {
+            key.spatial_start = spatial_start;
+            key.spatial_size = spatial_size;
+        }
+        if( a_camera->getROIEnabled() )
+        {
+            // FNV-1a over active bands.
+            uint32_t hash = 2166136261u;
+            for( int active : a_camera->getSpectralROI() )
+            {
+                hash = ( hash ^ static_cast< uint32_t >( active ) ) * 16777619u;
+            }
+            key.spectral_roi_hash = hash;
+        }
+
+        // without a sensor temperature, fall back to a key that is matched on the settings alone.
+        double temperature = 0.0;
+        if( a_camera->getTemperature( HYSPEX_TEMPERATURE_SENSOR, &temperature ) < 1 || !std::isfinite( temperature ) )
+        {
+            key.has_temperature = 0;
+            temperature = 0.0;
+        }
+        *a_temperature = temperature;
+        *a_key = key;
+        return HYSPEX_OK;
+    }
+
+    /*!
+    * @brief In-memory and on-disk cache of background matrices, so switching exposure does not require a new calculateBackground().
+    *
+    * Entries are keyed by BackgroundCacheKey and a sensor temperature bucket ( setTemperatureBucketSize() ).
+    * An entry is reused when it is younger than setMaxAge() and its temperature is within setTemperatureTolerance() of the
+    * current sensor temperature; the closest temperature wins. With a directory set, every entry is also written to one file per
+    * key and temperature bucket, and read back on a memory miss, so the cache survives restarts.
+    *
+    * The library keeps its own background internally, which can not be replaced from outside, so cached backgrounds are used by
+    * the header-only processing: FloatCorrection::setMatrices() / setBackground(), FloatImageReader and ProcessingGraph stages.
+    * Not thread-safe.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::BackgroundCache cache;
+    * cache.setDirectory( "C:/HySpex/background_cache" );
+    * cache.setMaxAge( 3600 );
+    * cache.setTemperatureTolerance( 0.5 );
+    *
+    * camera->setIntegrationTime( 5000 );
+    * bool hit = false;
+    * const hyspex::BackgroundCacheEntry* entry = nullptr;
+    * if( cache.getOrCalculate( camera, &entry, &hit ) == hyspex::HYSPEX_OK )
+    * {
+    *     const hyspex::ConstBuffer< double >& re = camera->getREMatrix();
+    *     correction.setMatrices( entry->background.data(), entry->background.size(), re.data, re.size, entry->spectral_size, entry->spatial_size );
+    * }
+    * @endcode
+    */
+    class BackgroundCache
+    {
+    public:
+        //! Directory for cache files, must exist. Empty for memory only.
+        void setDirectory( const std::string& a_directory ) { m_directory = a_directory; }
+        const std::string& getDirectory() const { return m_directory; } //!< Cache directory.
+
+        void setMaxAge( uint32_t a_seconds ) { m_maxAgeSeconds = a_seconds; } //!< Max age of reused entries, 0 for no limit.
+        uint32_t getMaxAge() const { return m_maxAgeSeconds; } //!< Max age in seconds.
+
+        void setTemperatureTolerance( double a_celsius ) { m_temperatureTolerance = a_celsius; } //!< Max difference in sensor temperature for reuse.
+        double getTemperatureTolerance() const { return m_temperatureTolerance; } //!< Temperature tolerance.
+
+        //! Width of temperature buckets, one entry is kept per key and bucket. Should not be smaller than the tolerance.
+        void setTemperatureBucketSize( double a_celsius ) { m_bucketSize = a_celsius > 0.0 ? a_celsius : m_bucketSize; }
+        double getTemperatureBucketSize() const { return m_bucketSize; } //!< Temperature bucket size.
+
+        uint64_t getHits() const { return m_hits; } //!< Number of lookups that found an entry.
+        uint64_t getMisses() const { return m_misses; } //!< Number of lookups that did not find an entry.
+        void clear() { m_entries.clear(); } //!< Remove all entries from memory, files are kept.
+
+        //! Store background and standard deviation matrices of a_camera ( after calculateBackground() ) under its current settings.
+        ReturnCode store( Camera* a_camera, const BackgroundCacheEntry** a_entry = nullptr )
+        {
+            BackgroundCacheKey key;
+            double temperature = 0.0;
+            HYSPEX_RETURN_IF_ERROR_VAL( getBackgroundCacheKey( a_camera, &key, &temperature ) );
+
+            const ConstBuffer< double >& background = a_camera->getBackgroundMatrix();
+            const ConstBuffer< double >& std_deviation = a_camera->getBackgroundStdDeviationMatrix();
+            return store( key, temperature, static_cast< uint32_t >( a_camera->getSpectralSize() ), static_cast< uint32_t >( a_camera->getSpatialSize() ),
+                          background.data, std_deviation.size == background.size ? std_deviation.data : nullptr, a_entry );
+        }
+
+        //! Store matrices of a_spectralSize x a_spatialSize, a_stdDeviation may be null. Returns HYSPEX_FAILED_TO_SET_VALUE if the file could not be written ( the entry is still kept in memory ).
+        ReturnCode store( const BackgroundCacheKey& a_key, double a_temperature, uint32_t a_spectralSize, uint32_t a_spatialSize,
+                          const double* a_background, const double* a_stdDeviation, const BackgroundCacheEntry** a_entry = nullptr )
+        {
+            const size_t size = static_cast< size_t >( a_spectralSize ) * a_spatialSize;
+            if( !a_background || size == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            std::unique_ptr< BackgroundCacheEntry > entry( new BackgroundCacheEntry() );
+            entry->key = a_key;
+            entry->temperature = a_temperature;
+            entry->created_ms = nowMs();
+            entry->spectral_size = a_spectralSize;
+            entry->spatial_size = a_spatialSize;
+            entry->background.assign( a_background, a_background + size );
+            if( a_stdDeviation )
+            {
+                entry->std_deviation.assign( a_stdDeviation, a_stdDeviation + size );
+            }
+
+            const bool written = m_directory.empty() || writeFile( *entry );
+            const BackgroundCacheEntry* stored = insert( std::move( entry ) );
+            if( a_entry )
+            {
+                *a_entry = stored;
+            }
+            return written ? HYSPEX_OK : HYSPEX_FAILED_TO_SET_VALUE;
+        }
+
+        /*!
+        * Find entry for a_key at a_temperature. Returns null and counts a miss if there is no entry within age and temperature tolerance.
+        * The entry is valid until the next call to store() or clear().
+        */
+        const BackgroundCacheEntry* find( const BackgroundCacheKey& a_key, double a_temperature )
+        {
+            const BackgroundCacheEntry* best = nullptr;
+            const int first_bucket = bucketOf( a_temperature - m_temperatureTolerance );
+            const int last_bucket = bucketOf( a_temperature + m_temperatureTolerance );
+            for( int bucket = first_bucket; bucket <= last_bucket; bucket++ )
+            {
+                const BackgroundCacheEntry* entry = findInMemory( a_key, bucket );
+                if( !entry && !m_directory.empty() )
+                {
+                    entry = readFile( a_key, bucket );
+                }
+                if( entry && usable( *entry, a_temperature ) &&
+                    ( !best || std::fabs( entry->temperature - a_temperature ) < std::fabs( best->temperature - a_temperature ) ) )
+                {
+                    best = entry;
+                }
+            }
+
+            if( best )
+            {
+                m_hits++;
+            }
+            else
+            {
+                m_misses++;
+            }
+            return best;
+        }
+
+        //! Find entry for current settings of a_camera. a_hit is set to true on hit.
+        ReturnCode find( Camera* a_camera, const BackgroundCacheEntry** a_entry, bool* a_hit )
+        {
+            if( !a_entry || !a_hit )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            BackgroundCacheKey key;
+            double temperature = 0.0;
+            HYSPEX_RETURN_IF_ERROR_VAL( getBackgroundCacheKey( a_camera, &key, &temperature ) );
+            *a_entry = find( key, temperature );
+            *a_hit = *a_entry != nullptr;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Find entry for current settings of a_camera, or run Camera::calculateBackground() on a miss and store the result.
+        * Acquisition must be started, as for calculateBackground().
+        */
+        ReturnCode getOrCalculate( Camera* a_camera, const BackgroundCacheEntry** a_entry, bool* a_hit, unsigned int a_timeoutMs = 0 )
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( find( a_camera, a_entry, a_hit ) );
+            if( *a_hit )
+            {
+                return HYSPEX_OK;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( a_camera->calculateBackground( a_timeoutMs ) );
+            return store( a_camera, a_entry );
+        }
+
+    private:
+        static int64_t nowMs()
+        {
+            return std::chrono::duration_cast< std::chrono::milliseconds >( std::chrono::system_clock::now().time_since_epoch() ).count();
+        }
+
+        int bucketOf( double a_temperature ) const
+        {
+            return static_cast< int >( std::floor( a_temperature / m_bucketSize ) );
+        }
+
+        bool usable( const BackgroundCacheEntry& a_entry, double a_temperature ) const
+        {
+            const bool fresh = m_maxAgeSeconds == 0 || nowMs() - a_entry.created_ms <= static_cast< int64_t >( m_maxAgeSeconds ) * 1000;
+            return fresh && std::fabs( a_entry.temperature - a_temperature ) <= m_temperatureTolerance;
+        }
+
+        //! Add a_entry to memory, replacing the entry with the same key and temperature bucket.
+        const BackgroundCacheEntry* insert( std::unique_ptr< BackgroundCacheEntry > a_entry )
+        {
+            const int bucket = bucketOf( a_entry->temperature );
+            for( std::unique_ptr< BackgroundCacheEntry >& entry : m_entries )
+            {
+                if( entry->key == a_entry->key && bucketOf( entry->temperature ) == bucket )
+                {
+                    entry = std::move( a_entry );
+                    return entry.get();
+                }
+            }
+            m_entries.push_back( std::move( a_entry ) );
+            return m_entries.back().get();
+        }
+
+        const BackgroundCacheEntry* findInMemory( const BackgroundCacheKey& a_key, int a_bucket ) const
+        {
+            for( const std::unique_ptr< BackgroundCacheEntry >& entry : m_entries )
+            {
+                if( entry->key == a_key && bucketOf( entry->temperature ) == a_bucket )
+                {
+                    return entry.get();
+                }
+            }
+            return nullptr;
+        }
+
+        std::string fileName( const BackgroundCacheKey& a_key, int a_bucket ) const
+        {
+            char name[ 192 ];
+            std::snprintf( name, sizeof( name ), "/background_%u_%u_%u_%ux%u_%u_%u_%08x_l%u_g%d_%s%d.bin",
+                           a_key.serial_number, a_key.integration_time_us, a_key.frame_period_us, a_key.spatial_binning, a_key.spectral_binning,
+                           a_key.spatial_start, a_key.spatial_size, a_key.spectral_roi_hash, a_key.lens_id, a_key.gain_mode,
+                           a_key.has_temperature ? "" : "nt", a_bucket );
+            return m_directory + name;
+        }
+
+        //! File layout: magic, version, created_ms, temperature, spectral_size, spatial_size, has_std_deviation, background, std deviation.
+        bool writeFile( const BackgroundCacheEntry& a_entry ) const
+        {
+            std::ofstream file( fileName( a_entry.key, bucketOf( a_entry.temperature ) ), std::ios::binary | std::ios::trunc );
+            if( !file )
+            {
+                return false;
+            }
+            const uint32_t header[ 2 ] = { c_magic, c_version };
+            const uint32_t sizes[ 3 ] = { a_entry.spectral_size, a_entry.spatial_size, a_entry.std_deviation.empty() ? 0u : 1u };
+            file.write( reinterpret_cast< const char* >( header ), sizeof( header ) );
+            file.write( reinterpret_cast< const char* >( &a_entry.created_ms ), sizeof( a_entry.created_ms ) );
+            file.write( reinterpret_cast< const char* >( &a_entry.temperature ), sizeof( a_entry.temperature ) );
+            file.write( reinterpret_cast< const char* >( sizes ), sizeof( sizes ) );
+            file.write( reinterpret_cast< const char* >( a_entry.background.data() ), a_entry.background.size() * sizeof( double ) );
+            file.write( reinterpret_cast< const char* >( a_entry.std_deviation.data() ), a_entry.std_deviation.size() * sizeof( double ) );
+            return static_cast< bool >( file );
+        }
+
+        //! Load entry from file into memory, null if there is no valid file.
+        const BackgroundCacheEntry* readFile( const BackgroundCacheKey& a_key, int a_bucket )
+        {
+            std::ifstream file( fileName( a_key, a_bucket ), std::ios::binary );
+            if( !file )
+            {
+                return nullptr;
+            }
+
+            uint32_t header[ 2 ] = { 0, 0 };
+            uint32_t sizes[ 3 ] = { 0, 0, 0 };
+            std::unique_ptr< BackgroundCacheEntry > entry( new BackgroundCacheEntry() );
+            entry->key = a_key;
+            file.read( reinterpret_cast< char* >( header ), sizeof( header ) );
+            file.read( reinterpret_cast< char* >( &entry->created_ms ), sizeof( entry->created_ms ) );
+            file.read( reinterpret_cast< char* >( &entry->temperature ), sizeof( entry->temperature ) );
+            file.read( reinterpret_cast< char* >( sizes ), sizeof( sizes ) );
+            if( !file || header[ 0 ] != c_magic || header[ 1 ] != c_version || bucketOf( entry->temperature ) != a_bucket )
+            {
+                return nullptr;
+            }
+
+            // check the sizes against the rest of the file before allocating, a truncated or corrupt file is a miss.
+            const std::streamoff data_start = file.tellg();
+            file.seekg( 0, std::ios::end );
+            const std::streamoff data_end = file.tellg();
+            file.seekg( data_start );
+            const uint64_t size = static_cast< uint64_t >( sizes[ 0 ] ) * sizes[ 1 ];
+            const uint64_t bytes_per_pixel = ( sizes[ 2 ] ? 2u : 1u ) * sizeof( double );
+            if( !file || sizes[ 2 ] > 1 || size == 0 || data_end < data_start ||
+                static_cast< uint64_t >( data_end - data_start ) / bytes_per_pixel != size )
+            {
+                return nullptr;
+            }
+
+            entry->spectral_size = sizes[ 0 ];
+            entry->spatial_size = sizes[ 1 ];
+            entry->background.resize( static_cast< size_t >( size ) );
+            entry->std_deviation.resize( sizes[ 2 ] ? static_cast< size_t >( size ) : 0 );
+            file.read( reinterpret_cast< char* >( entry->background.data() ), entry->background.size() * sizeof( double ) );
+            file.read( reinterpret_cast< char* >( entry->std_deviation.data() ), entry->std_deviation.size() * sizeof( double ) );
+            if( !file )
+            {
+                return nullptr;
+            }
+
+            return insert( std::move( entry ) );
+        }
+
+        static const uint32_t c_magic = 0x43425348; //!< "HSBC"
+        static const uint32_t c_version = 1; //!< File version.
+
+        std::string m_directory; //!< Cache directory, empty for memory only.
+        uint32_t m_maxAgeSeconds{ 0 }; //!< Max age, 0 for no limit.
+        double m_temperatureTolerance{ 1.0 }; //!< Max temperature difference.
+        double m_bucketSize{ 1.0 }; //!< Temperature bucket size.
+        uint64_t m_hits{ 0 }; //!< Lookups with hit.
+        uint64_t m_misses{ 0 }; //!< Lookups with miss.
+        std::vector< std::unique_ptr< BackgroundCacheEntry > > m_entries; //!< Entries in memory.
+    };
+}
+
+#endif // HYSPEX_BACKGROUNDCACHE_H
@@ -0,0 +1,322 @@
+#ifndef HYSPEX_BACKGROUNDESTIMATOR_H
+#define HYSPEX_BACKGROUNDESTIMATOR_H
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * Background and standard deviation published by BackgroundEstimator.
+    */
+    struct BackgroundSnapshot
+    {
+        std::vector< float > background;    //!< Mean per element ( spectral x spatial ).
+        std::vector< float > std_deviation; //!< Standard deviation per element.
+        uint32_t spectral_size{ 0 };        //!< Spectral size.
+        uint32_t spatial_size{ 0 };         //!< Spatial size.
+        uint32_t frames{ 0 };               //!< Number of frames in estimate.
+        uint64_t generation{ 0 };           //!< Increased for each publish, 0 means not published.
+        uint64_t last_frame_number{ 0 };    //!< stat.frame_number of newest frame in estimate.
+    };
+
+    /*!
+    * @brief Incremental background and standard deviation over a sliding window of dark frames.
+    *
+    * Each frame updates running integer sums ( sum in uint32, sum of squares in uint64 ) with SIMD: the new frame is added
+    * and the frame leaving the window is subtracted. Integer sums are exact, so the estimate never drifts no matter how long it runs.
+    * Every getPublishInterval() frames mean and standard deviation are computed from the sums and published.
+    *
+    * Publishing is lock-free: there are three snapshot buffers, the estimator writes into one that is neither current nor read,
+    * and then swaps the current index atomically. Readers use acquire(), which never blocks and never sees a half-written snapshot.
+    * If all other buffers are still being read, publishing is retried on the next frame instead of waiting.
+    *
+    * addFrame() must be called from one thread only ( frames captured with the shutter closed ), acquire() from any thread.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::BackgroundEstimator estimator;
+    * estimator.setWindow( 200 );
+    *
+    * // dark frame thread
+    * camera->closeShutter();
+    * const hyspex::ImageLine< unsigned short >& image = camera->getNextImage( hyspex::HYSPEX_RAW_BP );
+    * estimator.addFrame( image );
+    *
+    * // correction thread, never blocks
+    * hyspex::BackgroundEstimator::Reference snapshot = estimator.acquire();
+    * if( snapshot && snapshot->generation != last_generation )
+    * {
+    *     correction.setBackground( snapshot->background.data(), snapshot->background.size() );
+    *     last_generation = snapshot->generation;
+    * }
+    * @endcode
+    */
+    class BackgroundEstimator
+    {
+    public:
+        /*!
+        * Read access to a published snapshot, the snapshot is not reused while a Reference to it exists.
+        * Keep it only as long as needed, so the estimator can publish again.
+        */
+        class Reference
+        {
+        public:
+            Reference() = default;
+            Reference( Reference&& a_other ) noexcept : m_snapshot( a_other.m_snapshot ), m_readers( a_other.m_readers )
+            {
+                a_other.m_snapshot = nullptr;
+                a_other.m_readers = nullptr;
+            }
+            Reference& operator=( Reference&& a_other ) noexcept
+            {
+                release();
+                m_snapshot = a_other.m_snapshot;
+                m_readers = a_other.m_readers;
+                a_other.m_snapshot = nullptr;
+                a_other.m_readers = nullptr;
+                return *this;
+            }
+            ~Reference() { release(); }
+
+            explicit operator bool() const { return m_snapshot != nullptr; } //!< False if nothing has been published yet.
+            const BackgroundSnapshot* operator->() const { return m_snapshot; } //!< Snapshot.
+            const BackgroundSnapshot& operator*() const { return *m_snapshot; } //!< Snapshot.
+
+            //! Release snapshot before destruction.
+            void release()
+            {
+                if( m_readers )
+                {
+                    m_readers->fetch_sub( 1 );
+                }
+                m_snapshot = nullptr;
+                m_readers = nullptr;
+            }
+
+        private:
+            friend class BackgroundEstimator;
+            Reference( const BackgroundSnapshot* a_snapshot, std::atomic< uint32_t >* a_readers ) : m_snapshot( a_snapshot ), m_readers( a_readers )
+            {
+            }
+
+            // disallow copy-constructors
+            Reference( const Reference& that );
+            Reference& operator=( const Reference& that );
+
+            const BackgroundSnapshot* m_snapshot{ nullptr }; //!< Snapshot, null if none.
+            std::atomic< uint32_t >* m_readers{ nullptr }; //!< Reader count of snapshot.
+        };
+
+        BackgroundEstimator() = default;
+
+        //! Number of frames in sliding window ( 1 - 65535 ). Resets the estimate.
+        ReturnCode setWindow( uint32_t a_frames )
+        {
+            if( a_frames == 0 || a_frames > 65535 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_window = a_frames;
+            reset();
+            return HYSPEX_OK;
+        }
+
+        uint32_t getWindow() const { return m_window; } //!< Number of frames in sliding window.
+
+        //! Publish every a_frames frames once the window is full, 0 to publish once per window.
+        void setPublishInterval( uint32_t a_frames ) { m_publishInterval = a_frames; }
+        uint32_t getPublishInterval() const { return m_publishInterval == 0 ? m_window : m_publishInterval; } //!< Publish interval in frames.
+
+        //! Clear sums and window. Published snapshots stay available.
+        void reset()
+        {
+            m_sum.clear();
+            m_sumSquared.clear();
+            m_history.clear();
+            m_frames = 0;
+            m_next = 0;
+            m_sincePublish = 0;
+            m_publishPending = false;
+        }
+
+        //! Add dark frame. Size changes reset the estimate.
+        ReturnCode addFrame( const ImageLine< unsigned short >& a_image )
+        {
+            if( a_image.buffer.size == 0 || a_image.buffer.size != static_cast< uint64_t >( a_image.spectral_size ) * a_image.spatial_size )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t size = a_image.buffer.size;
+            if( a_image.spectral_size != m_spectralSize || a_image.spatial_size != m_spatialSize || m_sum.size() != size )
+            {
+                reset();
+                m_spectralSize = a_image.spectral_size;
+                m_spatialSize = a_image.spatial_size;
+                m_sum.assign( size, 0 );
+                m_sumSquared.assign( size, 0 );
+                m_history.assign( size * m_window, 0 );
+            }
+
+            unsigned short* slot = &m_history[ m_next * size ];
+            accumulate( a_image.buffer.data, m_frames == m_window ? slot : nullptr, size );
+            std::copy( a_image.buffer.data, a_image.buffer.data + size, slot );
+            m_next = ( m_next + 1 ) % m_window;
+            const bool filled = m_frames + 1 == m_window;
+            m_frames = m_frames < m_window ? m_frames + 1 : m_window;
+            m_lastFrameNumber = a_image.stat.frame_number;
+
+            // publish as soon as the window is full, and then every publish interval.
+            if( filled || ( m_frames == m_window && ++m_sincePublish >= getPublishInterval() ) )
+            {
+                m_publishPending = true;
+            }
+            if( m_publishPending )
+            {
+                m_publishPending = !publish();
+                m_sincePublish = m_publishPending ? m_sincePublish : 0;
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Publish current sums now, even if the window is not full. Returns false if there was nothing to publish or no free buffer.
+        bool publishNow()
+        {
+            return m_frames > 0 && publish();
+        }
+
+        uint32_t getFrameCount() const { return m_frames; } //!< Frames currently in window.
+        uint64_t getGeneration() const { return m_generation.load(); } //!< Generation of latest published snapshot, 0 if none. Thread-safe.
+
+        //! Get latest published snapshot. Lock-free and thread-safe.
+        Reference acquire() const
+        {
+            while( true )
+            {
+                const int index = m_current.load();
+                if( index < 0 )
+                {
+                    return Reference();
+                }
+                m_readers[ index ].fetch_add( 1 );
+                if( m_current.load() == index )
+                {
+                    return Reference( &m_snapshots[ index ], &m_readers[ index ] );
+                }
+                // republished in between, buffer may be about to be rewritten.
+                m_readers[ index ].fetch_sub( 1 );
+            }
+        }
+
+    private:
+        // disallow copy-constructors
+        BackgroundEstimator( const BackgroundEstimator& that );
+        BackgroundEstimator& operator=( const BackgroundEstimator& that );
+
+        //! Add a_input to sums, and subtract a_remove if not null.
+        void accumulate( const unsigned short* a_input, const unsigned short* a_remove, size_t a_size )
+        {
+            uint32_t* sum = m_sum.data();
+            uint64_t* sum_squared = m_sumSquared.data();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                const __m256i value = _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_input + i ) ) );
+                const __m256i square = _mm256_mullo_epi32( value, value ); // fits in 32 bits for 16 bit input.
+                __m256i s = _mm256_add_epi32( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum + i ) ), value );
+                __m256i q0 = _mm256_add_epi64( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum_squared + i ) ), _mm256_cvtepu32_epi64( _mm256_castsi256_si128( square ) ) );
+                __m256i q1 = _mm256_add_epi64( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum_squared + i + 4 ) ), _mm256_cvtepu32_epi64( _mm256_extracti128_si256( square, 1 ) ) );
+                if( a_remove )
+                {
+                    const __m256i old = _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_remove + i ) ) );
+                    const __m256i old_square = _mm256_mullo_epi32( old, old );
+                    s = _mm256_sub_epi32( s, old );
+                    q0 = _mm256_sub_epi64( q0, _mm256_cvtepu32_epi64( _mm256_castsi256_si128( old_square ) ) );
+                    q1 = _mm256_sub_epi64( q1, _mm256_cvtepu32_epi64( _mm256_extracti128_si256( old_square, 1 ) ) );
+                }
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( sum + i ), s );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( sum_squared + i ), q0 );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( sum_squared + i + 4 ), q1 );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                const uint32_t value = a_input[ i ];
+                sum[ i ] += value;
+                sum_squared[ i ] += static_cast< uint64_t >( value * value );
+                if( a_remove )
+                {
+                    const uint32_t old = a_remove[ i ];
+                    sum[ i ] -= old;
+                    sum_squared[ i ] -= static_cast< uint64_t >( old * old );
+                }
+            }
+        }
+
+        //! Compute snapshot into a free buffer and make it current. Returns false if no buffer is free.
+        bool publish()
+        {
+            const int current = m_current.load();
+            int target = -1;
+            for( int i = 0; i < 3 && target < 0; i++ )
+            {
+                if( i != current && m_readers[ i ].load() == 0 )
+                {
+                    target = i;
+                }
+            }
+            if( target < 0 )
+            {
+                return false;
+            }
+
+            BackgroundSnapshot& snapshot = m_snapshots[ target ];
+            const size_t size = m_sum.size();
+            snapshot.background.resize( size );
+            snapshot.std_deviation.resize( size );
+            const double scale = 1.0 / m_frames;
+            for( size_t i = 0; i < size; i++ )
+            {
+                const double mean = m_sum[ i ] * scale;
+                const double variance = static_cast< double >( m_sumSquared[ i ] ) * scale - mean * mean;
+                snapshot.background[ i ] = static_cast< float >( mean );
+                snapshot.std_deviation[ i ] = variance > 0.0 ? static_cast< float >( std::sqrt( variance ) ) : 0.0f;
+            }
+            snapshot.spectral_size = m_spectralSize;
+            snapshot.spatial_size = m_spatialSize;
+            snapshot.frames = m_frames;
+            snapshot.last_frame_number = m_lastFrameNumber;
+            snapshot.generation = m_generation.load() + 1;
+
+            m_current.store( target );
+            m_generation.store( snapshot.generation );
+            return true;
+        }
+
+        uint32_t m_window{ 100 }; //!< Frames in sliding window.
+        uint32_t m_publishInterval{ 0 }; //!< Frames between publish, 0 for window.
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of frames.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of frames.
+        uint32_t m_frames{ 0 }; //!< Frames in window.
+        uint32_t m_next{ 0 }; //!< Next history slot.
+        uint32_t m_sincePublish{ 0 }; //!< Frames since last publish.
+        bool m_publishPending{ false }; //!< Publish failed, retry on next frame.
+        uint64_t m_lastFrameNumber{ 0 }; //!< Newest frame number.
+        std::vector< uint32_t > m_sum; //!< Sum per element.
+        std::vector< uint64_t > m_sumSquared; //!< Sum of squares per element.
+        std::vector< unsigned short > m_history; //!< Frames in window, ring buffer.
+
+        BackgroundSnapshot m_snapshots[ 3 ]; //!< Published buffers.
+        mutable std::atomic< uint32_t > m_readers[ 3 ]{ { 0 }, { 0 }, { 0 } }; //!< Active readers per buffer.
+        std::atomic< int > m_current{ -1 }; //!< Current buffer, -1 before first publish.
+        std::atomic< uint64_t > m_generation{ 0 }; //!< Generation of current buffer.
+    };
+}
+
+#endif // HYSPEX_BACKGROUNDESTIMATOR_H
@@ -0,0 +1,600 @@
+#ifndef HYSPEX_BANDMATH_H
+#define HYSPEX_BANDMATH_H
+#pragma once
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Spectral indices ( band math ) compiled once and evaluated on whole frames.
+    *
+    * Each expression is parsed once into a small register program. Every instruction works on a whole spectral line
+    * ( all spatial pixels ) with SIMD, so nothing is interpreted per pixel.
+    * The output is one index image per frame: line i of the output is expression i, with the same spatial size as the input.
+    *
+    * Expression syntax:
+    * - b<index>: band by index, e.g. b12.
+    * - w<wavelength>: band closest to wavelength ( same unit as setWavelengths(), nm for cameras ), e.g. w670.
+    * - numbers, + - * /, parentheses and unary minus.
+    * - abs( x ), sqrt( x ), min( x, y ), max( x, y ).
+    *
+    * Division by zero follows IEEE rules ( inf / NaN ).
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::BandMath bandmath;
+    * bandmath.prepare( camera ); // wavelengths from HYSPEX_CALIB_SPECTRAL_PER_BAND
+    * std::string error;
+    * int ndvi = bandmath.addExpression( "( w800 - w670 ) / ( w800 + w670 )", &error );
+    *
+    * hyspex::ImageBuffer< float > indices;
+    * bandmath.apply( camera->getNextImage( hyspex::HYSPEX_RE ), indices );
+    * float value = indices.data()[ ndvi * indices.line().spatial_size + x ];
+    *
+    * // batch mode ( see FileBatch.h )
+    * hyspex::forEachImage< unsigned short >( reader, [&]( const hyspex::ImageLine< unsigned short >& a_image )
+    * {
+    *     bandmath.apply( a_image, indices );
+    *     return true;
+    * } );
+    * @endcode
+    */
+    class BandMath
+    {
+    public:
+        //! Use HYSPEX_CALIB_SPECTRAL_PER_BAND from a_camera as wavelengths.
+        ReturnCode prepare( const Camera* a_camera )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            const ConstBuffer< double >& wavelengths = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+            setWavelengths( std::vector< double >( wavelengths.data, wavelengths.data + wavelengths.size ) );
+            return HYSPEX_OK;
+        }
+
+        //! Center wavelength of each band, used to resolve w<wavelength> in expressions added after this call.
+        void setWavelengths( const std::vector< double >& a_wavelengths ) { m_wavelengths = a_wavelengths; }
+
+        /*!
+        * Compile and add expression, returns index of expression in output or -1 on error ( reason in a_error if not null ).
+        */
+        int addExpression( const std::string& a_expression, std::string* a_error = nullptr )
+        {
+            Program program;
+            Parser parser( a_expression, m_wavelengths );
+            const int root = parser.parse();
+            if( root < 0 )
+            {
+                if( a_error )
+                {
+                    *a_error = parser.error;
+                }
+                return -1;
+            }
+
+            unsigned int max_depth = 0;
+            program.result = compile( parser.nodes, root, 0, program, max_depth );
+            program.registers = max_depth;
+            m_programs.push_back( program );
+            m_spatialSize = 0; // force resize of scratch buffers.
+            return static_cast< int >( m_programs.size() - 1 );
+        }
+
+        size_t getExpressionCount() const { return m_programs.size(); } //!< Number of expressions.
+        void clear() { m_programs.clear(); m_spatialSize = 0; } //!< Remove all expressions.
+
+        //! Evaluate all expressions on a_input ( float, e.g. FloatImageReader ), output has one line per expression. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        ReturnCode apply( const ImageLine< float >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( begin( a_input.spectral_size, a_input.spatial_size, a_input.buffer.size, a_output ) );
+            a_output.copyMetadata( a_input );
+            m_input = a_input.buffer.data;
+            evaluate( a_output );
+            return HYSPEX_OK;
+        }
+
+        //! Evaluate all expressions on a_input ( unsigned short ), used bands are converted to float once per frame.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< float >& a_output )
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( begin( a_input.spectral_size, a_input.spatial_size, a_input.buffer.size, a_output ) );
+            a_output.copyMetadata( a_input );
+            m_converted.resize( a_input.buffer.size );
+            for( size_t b = 0; b < m_usedBands.size(); b++ )
+            {
+                if( m_usedBands[ b ] )
+                {
+                    convertToFloat( a_input.buffer.data + b * m_spatialSize, &m_converted[ b * m_spatialSize ], m_spatialSize );
+                }
+            }
+            m_input = m_converted.data();
+            evaluate( a_output );
+            return HYSPEX_OK;
+        }
+
+    private:
+        typedef enum
+        {
+            OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MIN, OP_MAX, OP_NEG, OP_ABS, OP_SQRT
+        } op_e;
+
+        typedef enum
+        {
+            OPERAND_CONSTANT, OPERAND_BAND, OPERAND_REGISTER
+        } operand_e;
+
+        struct Operand
+        {
+            operand_e type;
+            uint32_t index; //!< Band, register or constant index.
+        };
+
+        struct Instruction
+        {
+            op_e op;
+            Operand a;
+            Operand b; //!< unused for unary ops.
+            uint32_t destination; //!< register
+        };
+
+        struct Program
+        {
+            std::vector< Instruction > instructions;
+            std::vector< float > constants;
+            Operand result;
+            unsigned int registers;
+        };
+
+        struct Node
+        {
+            int kind; //!< 0: constant, 1: band, 2: unary, 3: binary
+            op_e op;
+            double value;
+            uint32_t band;
+            int left;
+            int right;
+        };
+
+        //! Recursive descent parser producing a node list.
+        struct Parser
+        {
+            Parser( const std::string& a_text, const std::vector< double >& a_wavelengths ) : text( a_text ), wavelengths( a_wavelengths )
+            {
+            }
+
+            int parse()
+            {
+                const int root = expression();
+                skipSpace();
+                if( root >= 0 && position != text.size() )
+                {
+                    return fail( "unexpected character" );
+                }
+                return root;
+            }
+
+            int expression()
+            {
+                int left = term();
+                while( left >= 0 )
+                {
+                    skipSpace();
+                    if( accept( '+' ) ) { left = binary( OP_ADD, left, term() ); }
+                    else if( accept( '-' ) ) { left = binary( OP_SUB, left, term() ); }
+                    else { break; }
+                }
+                return left;
+            }
+
+            int term()
+            {
+                int left = unary();
+                while( left >= 0 )
+                {
+                    skipSpace();
+                    if( accept( '*' ) ) { left = binary( OP_MUL, left, unary() ); }
+                    else if( accept( '/' ) ) { left = binary( OP_DIV, left, unary() ); }
+                    else { break; }
+                }
+                return left;
+            }
+
+            int unary()
+            {
+                skipSpace();
+                if( accept( '-' ) )
+                {
+                    const int operand = unary();
+                    return operand < 0 ? operand : add( Node{ 2, OP_NEG, 0.0, 0, operand, -1 } );
+                }
+                if( accept( '+' ) )
+                {
+                    return unary();
+                }
+                return primary();
+            }
+
+            int primary()
+            {
+                skipSpace();
+                if( accept( '(' ) )
+                {
+                    const int inner = expression();
+                    skipSpace();
+                    if( inner >= 0 && !accept( ')' ) )
+                    {
+                        return fail( "expected ')'" );
+                    }
+                    return inner;
+                }
+                if( position < text.size() && ( std::isdigit( static_cast< unsigned char >( text[ position ] ) ) || text[ position ] == '.' ) )
+                {
+                    double value = 0.0;
+                    if( !number( &value ) )
+                    {
+                        return fail( "invalid number" );
+                    }
+                    return add( Node{ 0, OP_ADD, value, 0, -1, -1 } );
+                }
+
+                const std::string name = identifier();
+                if( name == "abs" || name == "sqrt" )
+                {
+                    return function( name == "abs" ? OP_ABS : OP_SQRT, 1 );
+                }
+                if( name == "min" || name == "max" )
+                {
+                    return function( name == "min" ? OP_MIN : OP_MAX, 2 );
+                }
+                if( name == "b" || name == "w" )
+                {
+                    double value = 0.0;
+                    if( !number( &value ) )
+                    {
+                        return fail( "expected band index or wavelength" );
+                    }
+                    uint32_t band = 0;
+                    if( name == "b" )
+                    {
+                        // strtod also takes signs, fractions, exponents, inf and nan.
+                        if( !( value >= 0.0 ) || value > 4294967295.0 || std::floor( value ) != value )
+                        {
+                            return fail( "band index must be a non-negative integer" );
+                        }
+                        band = static_cast< uint32_t >( value );
+                    }
+                    else if( !closestBand( value, &band ) )
+                    {
+                        return fail( "wavelengths not set" );
+                    }
+                    return add( Node{ 1, OP_ADD, 0.0, band, -1, -1 } );
+                }
+                return fail( name.empty() ? "unexpected end of expression" : "unknown identifier '" + name + "'" );
+            }
+
+            int function( op_e a_op, int a_arguments )
+            {
+                skipSpace();
+                if( !accept( '(' ) )
+                {
+                    return fail( "expected '('" );
+                }
+                const int first = expression();
+                int second = -1;
+                if( first >= 0 && a_arguments == 2 )
+                {
+                    skipSpace();
+                    if( !accept( ',' ) )
+                    {
+                        return fail( "expected ','" );
+                    }
+                    second = expression();
+                    if( second < 0 )
+                    {
+                        return second;
+                    }
+                }
+                skipSpace();
+                if( first >= 0 && !accept( ')' ) )
+                {
+                    return fail( "expected ')'" );
+                }
+                if( first < 0 )
+                {
+                    return first;
+                }
+                return a_arguments == 2 ? binary( a_op, first, second ) : add( Node{ 2, a_op, 0.0, 0, first, -1 } );
+            }
+
+            int binary( op_e a_op, int a_left, int a_right )
+            {
+                return a_right < 0 ? a_right : add( Node{ 3, a_op, 0.0, 0, a_left, a_right } );
+            }
+
+            bool closestBand( double a_wavelength, uint32_t* a_band ) const
+            {
+                if( wavelengths.empty() )
+                {
+                    return false;
+                }
+                double best = std::fabs( wavelengths[ 0 ] - a_wavelength );
+                *a_band = 0;
+                for( size_t i = 1; i < wavelengths.size(); i++ )
+                {
+                    if( std::fabs( wavelengths[ i ] - a_wavelength ) < best )
+                    {
+                        best = std::fabs( wavelengths[ i ] - a_wavelength );
+                        *a_band = static_cast< uint32_t >( i );
+                    }
+                }
+                return true;
+            }
+
+            bool number( double* a_value )
+            {
+                const char* start = text.c_str() + position;
+                char* end = nullptr;
+                *a_value = std::strtod( start, &end );
+                if( end == start )
+                {
+                    return false;
+                }
+                position += static_cast< size_t >( end - start );
+                return true;
+            }
+
+            std::string identifier()
+            {
+                const size_t start = position;
+                while( position < text.size() && std::isalpha( static_cast< unsigned char >( text[ position ] ) ) )
+                {
+                    position++;
+                }
+                return text.substr( start, position - start );
+            }
+
+            void skipSpace()
+            {
+                while( position < text.size() && std::isspace( static_cast< unsigned char >( text[ position ] ) ) )
+                {
+                    position++;
+                }
+            }
+
+            bool accept( char a_character )
+            {
+                if( position < text.size() && text[ position ] == a_character )
+                {
+                    position++;
+                    return true;
+                }
+                return false;
+            }
+
+            int add( const Node& a_node )
+            {
+                nodes.push_back( a_node );
+                return static_cast< int >( nodes.size() - 1 );
+            }
+
+            int fail( const std::string& a_message )
+            {
+                if( error.empty() )
+                {
+                    error = a_message + " at position " + std::to_string( position );
+                }
+                return -1;
+            }
+
+            const std::string& text;
+            const std::vector< double >& wavelengths;
+            std::vector< Node > nodes;
+            std::string error;
+            size_t position{ 0 };
+        };
+
+        static double fold( op_e a_op, double a_a, double a_b )
+        {
+            switch( a_op )
+            {
+                case OP_ADD: return a_a + a_b;
+                case OP_SUB: return a_a - a_b;
+                case OP_MUL: return a_a * a_b;
+                case OP_DIV: return a_a / a_b;
+                case OP_MIN: return a_a < a_b ? a_a : a_b;
+                case OP_MAX: return a_a > a_b ? a_a : a_b;
+                case OP_NEG: return -a_a;
+                case OP_ABS: return std::fabs( a_a );
+                default: return std::sqrt( a_a );
+            }
+        }
+
+        //! Generate instructions for a_node, result in register a_depth unless it is a constant or band. Constants are folded.
+        static Operand compile( const std::vector< Node >& a_nodes, int a_node, unsigned int a_depth, Program& a_program, unsigned int& a_maxDepth )
+        {
+            const Node& node = a_nodes[ a_node ];
+            if( node.kind == 0 )
+            {
+                a_program.constants.push_back( static_cast< float >( node.value ) );
+                return Operand{ OPERAND_CONSTANT, static_cast< uint32_t >( a_program.constants.size() - 1 ) };
+            }
+            if( node.kind == 1 )
+            {
+                return Operand{ OPERAND_BAND, node.band };
+            }
+
+            const Operand a = compile( a_nodes, node.left, a_depth, a_program, a_maxDepth );
+            const Operand b = node.kind == 3 ? compile( a_nodes, node.right, a_depth + 1, a_program, a_maxDepth ) : a;
+            if( a.type == OPERAND_CONSTANT && b.type == OPERAND_CONSTANT )
+            {
+                const float value = static_cast< float >( fold( node.op, a_program.constants[ a.index ], a_program.constants[ b.index ] ) );
+                a_program.constants.push_back( value );
+                return Operand{ OPERAND_CONSTANT, static_cast< uint32_t >( a_program.constants.size() - 1 ) };
+            }
+
+            a_program.instructions.push_back( Instruction{ node.op, a, b, a_depth } );
+            if( a_depth + 1 > a_maxDepth )
+            {
+                a_maxDepth = a_depth + 1;
+            }
+            return Operand{ OPERAND_REGISTER, a_depth };
+        }
+
+        //! Validate input and size scratch buffers.
+        ReturnCode begin( uint32_t a_spectralSize, uint32_t a_spatialSize, uint64_t a_bufferSize, ImageBuffer< float >& a_output )
+        {
+            if( m_programs.empty() || a_bufferSize != static_cast< uint64_t >( a_spectralSize ) * a_spatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            if( a_spatialSize != m_spatialSize || a_spectralSize != m_spectralSize )
+            {
+                m_spatialSize = a_spatialSize;
+                m_spectralSize = a_spectralSize;
+                m_usedBands.assign( a_spectralSize, false );
+                unsigned int registers = 0;
+                size_t constants = 0;
+                for( const Program& program : m_programs )
+                {
+                    registers = program.registers > registers ? program.registers : registers;
+                    constants += program.constants.size();
+                    for( const Instruction& instruction : program.instructions )
+                    {
+                        markBand( instruction.a );
+                        markBand( instruction.b );
+                    }
+                    markBand( program.result );
+                }
+                if( m_bandOutOfRange )
+                {
+                    m_spatialSize = 0;
+                    m_bandOutOfRange = false;
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+
+                m_registers.assign( static_cast< size_t >( registers ) * a_spatialSize, 0.0f );
+                m_constantRows.resize( constants * a_spatialSize );
+                m_constantOffsets.clear();
+                size_t offset = 0;
+                for( const Program& program : m_programs )
+                {
+                    m_constantOffsets.push_back( offset );
+                    for( float constant : program.constants )
+                    {
+                        std::fill( m_constantRows.begin() + offset * a_spatialSize, m_constantRows.begin() + ( offset + 1 ) * a_spatialSize, constant );
+                        offset++;
+                    }
+                }
+            }
+
+            a_output.resize( static_cast< uint32_t >( m_programs.size() ), a_spatialSize );
+            return HYSPEX_OK;
+        }
+
+        void markBand( const Operand& a_operand )
+        {
+            if( a_operand.type == OPERAND_BAND )
+            {
+                if( a_operand.index < m_usedBands.size() )
+                {
+                    m_usedBands[ a_operand.index ] = true;
+                }
+                else
+                {
+                    m_bandOutOfRange = true;
+                }
+            }
+        }
+
+        const float* row( const Operand& a_operand, size_t a_constantOffset ) const
+        {
+            switch( a_operand.type )
+            {
+                case OPERAND_CONSTANT: return &m_constantRows[ ( a_constantOffset + a_operand.index ) * m_spatialSize ];
+                case OPERAND_BAND: return m_input + static_cast< size_t >( a_operand.index ) * m_spatialSize;
+                default: return &m_registers[ static_cast< size_t >( a_operand.index ) * m_spatialSize ];
+            }
+        }
+
+        void evaluate( ImageBuffer< float >& a_output )
+        {
+            for( size_t p = 0; p < m_programs.size(); p++ )
+            {
+                const Program& program = m_programs[ p ];
+                const size_t constant_offset = m_constantOffsets[ p ];
+                for( const Instruction& instruction : program.instructions )
+                {
+                    execute( instruction.op, row( instruction.a, constant_offset ), row( instruction.b, constant_offset ),
+                             &m_registers[ static_cast< size_t >( instruction.destination ) * m_spatialSize ], m_spatialSize );
+                }
+                const float* result = row( program.result, constant_offset );
+                std::copy( result, result + m_spatialSize, a_output.data() + p * m_spatialSize );
+            }
+        }
+
+        //! a_output = a_a op a_b for a_size elements.
+        static void execute( op_e a_op, const float* a_a, const float* a_b, float* a_output, size_t a_size )
+        {
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256 sign = _mm256_set1_ps( -0.0f );
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                const __m256 a = _mm256_loadu_ps( a_a + i );
+                const __m256 b = _mm256_loadu_ps( a_b + i );
+                __m256 r;
+                switch( a_op )
+                {
+                    case OP_ADD: r = _mm256_add_ps( a, b ); break;
+                    case OP_SUB: r = _mm256_sub_ps( a, b ); break;
+                    case OP_MUL: r = _mm256_mul_ps( a, b ); break;
+                    case OP_DIV: r = _mm256_div_ps( a, b ); break;
+                    case OP_MIN: r = _mm256_min_ps( a, b ); break;
+                    case OP_MAX: r = _mm256_max_ps( a, b ); break;
+                    case OP_NEG: r = _mm256_xor_ps( a, sign ); break;
+                    case OP_ABS: r = _mm256_andnot_ps( sign, a ); break;
+                    default: r = _mm256_sqrt_ps( a ); break;
+                }
+                _mm256_storeu_ps( a_output + i, r );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                a_output[ i ] = static_cast< float >( fold( a_op, a_a[ i ], a_b[ i ] ) );
+            }
+        }
+
+        std::vector< Program > m_programs; //!< Compiled expressions.
+        std::vector< size_t > m_constantOffsets; //!< First constant row of each program.
+        std::vector< double > m_wavelengths; //!< Center wavelength per band.
+        std::vector< bool > m_usedBands; //!< Bands referenced by any expression.
+        std::vector< float > m_registers; //!< Register rows.
+        std::vector< float > m_constantRows; //!< Constants broadcast to rows.
+        std::vector< float > m_converted; //!< Used bands converted to float.
+        const float* m_input{ nullptr }; //!< Current input image.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size scratch buffers are prepared for.
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size scratch buffers are prepared for.
+        bool m_bandOutOfRange{ false }; //!< Set by markBand().
+    };
+}
+
+#endif // HYSPEX_BANDMATH_H
@@ -0,0 +1,426 @@
+#ifndef HYSPEX_CALIBRATIONCACHE_H
+#define HYSPEX_CALIBRATIONCACHE_H
+#pragma once
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace hyspex
+{
+    /*!
+    * @brief Binary cache of the calibration matrices and parameters of a camera, memory-mapped on the next start.
+    *
+    * store() writes all available Camera::getCalibrationMatrix() entries of the current lens, the calibration parameters and
+    * sizes into one file per .set file and lens in the cache directory, tagged with a 64 bit FNV-1a hash of the .set file
+    * contents. open() hashes the .set file, maps the cache file read-only and checks the tag, so a changed .set file is a miss
+    * and the next store() replaces the stale file. Matrices are served from the mapping without parsing or copying.
+    *
+    * The library parses the .set files itself in CameraManager::readSettingsFromPath(), so the cache serves the header-only
+    * processing ( FloatCorrection, SmileKeystoneCorrection, SpectralResampler, SpectralMatcher, ... ), which can then be
+    * prepared from the .set path at startup, in parallel with or before camera detection and Camera::init().
+    * Cache files are native endian and meant for the machine that wrote them. Not thread-safe, the mapped data is read-only.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::CalibrationCache cache;
+    * cache.setDirectory( "C:/HySpex/calibration_cache" );
+    * if( cache.open( "C:/HySpex/settings/VNIR_1800_1234.set", 0 ) != hyspex::HYSPEX_OK )
+    * {
+    *     // miss or changed .set file: load through the library and store for the next start.
+    *     cache.store( camera );
+    *     cache.open( camera->getSettingsFilePath(), camera->getLensId() );
+    * }
+    * const hyspex::ConstBuffer< double >& re = cache.getCalibrationMatrix( hyspex::HYSPEX_CALIB_RE );
+    * @endcode
+    */
+    class CalibrationCache
+    {
+    public:
+        CalibrationCache()
+        {
+            clearMatrices();
+        }
+
+        ~CalibrationCache() { close(); }
+
+        //! Directory for cache files, must exist.
+        void setDirectory( const std::string& a_directory ) { m_directory = a_directory; }
+        const std::string& getDirectory() const { return m_directory; } //!< Cache directory.
+
+        //! 64 bit FNV-1a hash of the contents of a_path.
+        static ReturnCode hashFile( const std::string& a_path, uint64_t* a_hash )
+        {
+            if( !a_hash )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            std::ifstream file( a_path, std::ios::binary );
+            if( !file )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            uint64_t hash = 14695981039346656037ull;
+            char block[ 65536 ];
+            while( file )
+            {
+                file.read( block, sizeof( block ) );
+                const std::streamsize count = file.gcount();
+                for( std::streamsize i = 0; i < count; i++ )
+                {
+                    hash = ( hash ^ static_cast< unsigned char >( block[ i ] ) ) * 1099511628211ull;
+                }
+            }
+            *a_hash = hash;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Write calibration of the current lens of a_camera, tagged with the hash of Camera::getSettingsFilePath().
+        * Returns HYSPEX_FAILED_TO_SET_VALUE if the file could not be written.
+        */
+        ReturnCode store( const Camera* a_camera ) const
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            const std::string settings_path = a_camera->getSettingsFilePath();
+            Header header;
+            std::memset( &header, 0, sizeof( header ) );
+            HYSPEX_RETURN_IF_ERROR_VAL( hashFile( settings_path, &header.content_hash ) );
+            header.magic = c_magic;
+            header.version = c_version;
+            header.serial_number = a_camera->getSerialNumber();
+            header.lens_id = a_camera->getLensId();
+            header.spectral_size = static_cast< uint32_t >( a_camera->getSpectralSize() );
+            header.spatial_size = static_cast< uint32_t >( a_camera->getSpatialSize() );
+            header.parameters = a_camera->getCalibrationParameters();
+
+            // matrices follow the header, each on a 64 byte boundary.
+            uint64_t offset = align( sizeof( Header ) );
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                const calib_matrix_e matrix = static_cast< calib_matrix_e >( m );
+                if( a_camera->getCalibrationMatrixAvailable( matrix ) )
+                {
+                    header.counts[ m ] = a_camera->getCalibrationMatrix( matrix ).size;
+                    header.offsets[ m ] = offset;
+                    offset = align( offset + header.counts[ m ] * sizeof( double ) );
+                }
+            }
+
+            const std::string path = fileName( settings_path, header.lens_id );
+            const std::string temporary = path + ".tmp";
+            {
+                std::ofstream file( temporary, std::ios::binary | std::ios::trunc );
+                if( !file )
+                {
+                    return HYSPEX_FAILED_TO_SET_VALUE;
+                }
+                const char padding[ 64 ] = {};
+                file.write( reinterpret_cast< const char* >( &header ), sizeof( header ) );
+                uint64_t position = sizeof( header );
+                for( uint32_t m = 0; m < c_matrixCount; m++ )
+                {
+                    if( header.counts[ m ] == 0 )
+                    {
+                        continue;
+                    }
+                    file.write( padding, static_cast< std::streamsize >( header.offsets[ m ] - position ) );
+                    file.write( reinterpret_cast< const char* >( a_camera->getCalibrationMatrix( static_cast< calib_matrix_e >( m ) ).data ),
+                                static_cast< std::streamsize >( header.counts[ m ] * sizeof( double ) ) );
+                    position = header.offsets[ m ] + header.counts[ m ] * sizeof( double );
+                }
+                if( !file )
+                {
+                    file.close();
+                    std::remove( temporary.c_str() );
+                    return HYSPEX_FAILED_TO_SET_VALUE;
+                }
+            }
+            // replace in one step, so a concurrent open() never sees a partial file.
+            if( !replaceFile( temporary, path ) )
+            {
+                std::remove( temporary.c_str() );
+                return HYSPEX_FAILED_TO_SET_VALUE;
+            }
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Map the cache file of a_settingsPath and a_lensId. Returns HYSPEX_SETTING_NOT_FOUND on a miss, including a cache
+        * file written for different .set contents. Matrices stay valid until close() or the next open().
+        */
+        ReturnCode open( const std::string& a_settingsPath, unsigned int a_lensId = 0 )
+        {
+            close();
+            uint64_t hash = 0;
+            HYSPEX_RETURN_IF_ERROR_VAL( hashFile( a_settingsPath, &hash ) );
+            if( !map( fileName( a_settingsPath, a_lensId ) ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            const Header* header = reinterpret_cast< const Header* >( m_data );
+            bool valid = m_size >= sizeof( Header ) && header->magic == c_magic && header->version == c_version &&
+                         header->content_hash == hash && header->lens_id == a_lensId;
+            for( uint32_t m = 0; valid && m < c_matrixCount; m++ )
+            {
+                valid = header->counts[ m ] == 0 ||
+                        ( header->offsets[ m ] % sizeof( double ) == 0 && header->offsets[ m ] <= m_size &&
+                          header->counts[ m ] <= ( m_size - header->offsets[ m ] ) / sizeof( double ) );
+            }
+            if( !valid )
+            {
+                close();
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            m_header = header;
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                if( header->counts[ m ] > 0 )
+                {
+                    m_matrices[ m ].data = reinterpret_cast< const double* >( m_data + header->offsets[ m ] );
+                    m_matrices[ m ].size = static_cast< size_t >( header->counts[ m ] );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        //! open() for a_camera, or store() and open() on a miss.
+        ReturnCode openOrStore( const Camera* a_camera, bool* a_hit = nullptr )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            const std::string settings_path = a_camera->getSettingsFilePath();
+            const ReturnCode result = open( settings_path, a_camera->getLensId() );
+            if( a_hit )
+            {
+                *a_hit = result == HYSPEX_OK;
+            }
+            if( result == HYSPEX_OK )
+            {
+                return result;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( store( a_camera ) );
+            return open( settings_path, a_camera->getLensId() );
+        }
+
+        //! Unmap cache file.
+        void close()
+        {
+            clearMatrices();
+            m_header = nullptr;
+            unmap();
+        }
+
+        bool isOpen() const { return m_header != nullptr; } //!< A cache file is mapped.
+        uint64_t getContentHash() const { return m_header ? m_header->content_hash : 0; } //!< Hash of the .set file.
+        unsigned int getSerialNumber() const { return m_header ? m_header->serial_number : 0; } //!< Camera serial number.
+        unsigned int getLensId() const { return m_header ? m_header->lens_id : 0; } //!< Lens of the calibration.
+        size_t getSpectralSize() const { return m_header ? m_header->spectral_size : 0; } //!< Camera::getSpectralSize() when stored.
+        size_t getSpatialSize() const { return m_header ? m_header->spatial_size : 0; } //!< Camera::getSpatialSize() when stored.
+
+        //! Calibration parameters, zeroed if not open.
+        calibration_parameters_t getCalibrationParameters() const
+        {
+            calibration_parameters_t parameters;
+            if( m_header )
+            {
+                parameters = m_header->parameters;
+            }
+            else
+            {
+                std::memset( &parameters, 0, sizeof( parameters ) );
+            }
+            return parameters;
+        }
+
+        //! Same as Camera::getCalibrationMatrix(), empty buffer if not available.
+        const ConstBuffer< double >& getCalibrationMatrix( calib_matrix_e a_matrix ) const
+        {
+            static const ConstBuffer< double > empty = { 0, nullptr };
+            return static_cast< uint32_t >( a_matrix ) < c_matrixCount ? m_matrices[ a_matrix ] : empty;
+        }
+
+        //! Same as Camera::getCalibrationMatrixAvailable().
+        bool getCalibrationMatrixAvailable( calib_matrix_e a_matrix ) const
+        {
+            return static_cast< uint32_t >( a_matrix ) < c_matrixCount && m_matrices[ a_matrix ].size > 0;
+        }
+
+    private:
+        static const uint32_t c_magic = 0x43435348; //!< "HSCC"
+        static const uint32_t c_version = 1; //!< File version.
+        static const uint32_t c_matrixCount = HYSPEX_CALIB_RESAMPLED_CENTRAL_WAVELENGTHS_DELTA + 1; //!< Entries of calib_matrix_e.
+
+        //! File layout: header, then matrices at the listed offsets. counts[ m ] == 0 if not available.
+        struct Header
+        {
+            uint32_t magic;
+            uint32_t version;
+            uint64_t content_hash;
+            uint32_t serial_number;
+            uint32_t lens_id;
+            uint32_t spectral_size;
+            uint32_t spatial_size;
+            calibration_parameters_t parameters;
+            uint64_t offsets[ c_matrixCount ];
+            uint64_t counts[ c_matrixCount ];
+        };
+
+        // disallow copy-constructors
+        CalibrationCache( const CalibrationCache& that );
+        CalibrationCache& operator=( const CalibrationCache& that );
+
+        static uint64_t align( uint64_t a_offset )
+        {
+            return ( a_offset + 63 ) & ~static_cast< uint64_t >( 63 );
+        }
+
+        //! <directory>/<.set file name without extension>_lens<id>.calibcache
+        std::string fileName( const std::string& a_settingsPath, unsigned int a_lensId ) const
+        {
+            const size_t slash = a_settingsPath.find_last_of( "/\\" );
+            std::string stem = slash == std::string::npos ? a_settingsPath : a_settingsPath.substr( slash + 1 );
+            const size_t dot = stem.find_last_of( '.' );
+            if( dot != std::string::npos && dot > 0 )
+            {
+                stem.resize( dot );
+            }
+            char suffix[ 32 ];
+            std::snprintf( suffix, sizeof( suffix ), "_lens%u.calibcache", a_lensId );
+            return m_directory + "/" + stem + suffix;
+        }
+
+        void clearMatrices()
+        {
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                m_matrices[ m ].data = nullptr;
+                m_matrices[ m ].size = 0;
+            }
+        }
+
+#ifdef _WIN32
+        //! Move a_from over a_to, replacing it atomically.
+        static bool replaceFile( const std::string& a_from, const std::string& a_to )
+        {
+            return MoveFileExA( a_from.c_str(), a_to.c_str(), MOVEFILE_REPLACE_EXISTING ) != 0;
+        }
+
+        bool map( const std::string& a_path )
+        {
+            m_file = CreateFileA( a_path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr );
+            LARGE_INTEGER size;
+            if( m_file == INVALID_HANDLE_VALUE || !GetFileSizeEx( m_file, &size ) || size.QuadPart == 0 )
+            {
+                unmap();
+                return false;
+            }
+            m_mapping = CreateFileMappingA( m_file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            const void* view = m_mapping ? MapViewOfFile( m_mapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+            if( !view )
+            {
+                unmap();
+                return false;
+            }
+            m_data = static_cast< const char* >( view );
+            m_size = static_cast< size_t >( size.QuadPart );
+            return true;
+        }
+
+        void unmap()
+        {
+            if( m_data )
+            {
+                UnmapViewOfFile( m_data );
+            }
+            if( m_mapping )
+            {
+                CloseHandle( m_mapping );
+            }
+            if( m_file != INVALID_HANDLE_VALUE )
+            {
+                CloseHandle( m_file );
+            }
+            m_data = nullptr;
+            m_size = 0;
+            m_mapping = nullptr;
+            m_file = INVALID_HANDLE_VALUE;
+        }
+
+        HANDLE m_file{ INVALID_HANDLE_VALUE }; //!< Cache file.
+        HANDLE m_mapping{ nullptr }; //!< File mapping.
+#else
+        //! Move a_from over a_to, rename() replaces atomically.
+        static bool replaceFile( const std::string& a_from, const std::string& a_to )
+        {
+            return std::rename( a_from.c_str(), a_to.c_str() ) == 0;
+        }
+
+        bool map( const std::string& a_path )
+        {
+            const int file = ::open( a_path.c_str(), O_RDONLY );
+            if( file < 0 )
+            {
+                return false;
+            }
+            struct stat status;
+            void* view = MAP_FAILED;
+            if( fstat( file, &status ) == 0 && status.st_size > 0 )
+            {
+                view = mmap( nullptr, static_cast< size_t >( status.st_size ), PROT_READ, MAP_PRIVATE, file, 0 );
+            }
+            ::close( file );
+            if( view == MAP_FAILED )
+            {
+                return false;
+            }
+            m_data = static_cast< const char* >( view );
+            m_size = static_cast< size_t >( status.st_size );
+            return true;
+        }
+
+        void unmap()
+        {
+            if( m_data )
+            {
+                munmap( const_cast< char* >( m_data ), m_size );
+            }
+            m_data = nullptr;
+            m_size = 0;
+        }
+#endif
+
+        std::string m_directory{ "." }; //!< Cache directory.
+        const char* m_data{ nullptr }; //!< Mapped file.
+        size_t m_size{ 0 }; //!< Mapped size.
+        const Header* m_header{ nullptr }; //!< Header of the mapped file, null if not open.
+        ConstBuffer< double > m_matrices[ c_matrixCount ]; //!< Matrices in the mapped file.
+    };
+}
+
+#endif // HYSPEX_CALIBRATIONCACHE_H
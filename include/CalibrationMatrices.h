@@ -0,0 +1,230 @@
+#ifndef HYSPEX_CALIBRATIONMATRICES_H
+#define HYSPEX_CALIBRATIONMATRICES_H
+#pragma once
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "CalibrationCache.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Float32 working copies of calibration matrices, converted on first access.
+    *
+    * The source is either a Camera or a CalibrationCache. A float copy of a matrix is made the first time getMatrix() asks
+    * for it, so only matrices used by the current pipeline take memory. With a CalibrationCache as source, the double
+    * matrices are pages of a read-only file mapping, which the OS only loads when touched and can drop again.
+    * Only the float copies of the current lens are kept.
+    *
+    * prepare() converts a list of matrices up front and releases all others. useLensId() switches the lens of the camera
+    * ( and the cache file ) and converts the prepared list again, dropping copies of the previous lens.
+    * Not thread-safe; getMatrix() of prepared matrices, including prepared matrices the source does not have, only reads and
+    * can be called from several threads. Other matrices are looked up on first access.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::CalibrationCache cache;
+    * cache.setDirectory( "C:/HySpex/calibration_cache" );
+    * hyspex::CalibrationMatrices matrices;
+    * matrices.setSource( &cache );
+    * matrices.useLensId( camera, 1 ); // camera->useLensId( 1 ), then cache.openOrStore( camera )
+    * matrices.prepare( { hyspex::HYSPEX_CALIB_RE, hyspex::HYSPEX_CALIB_SPECTRAL_PER_BAND } );
+    *
+    * const hyspex::ConstBuffer< float >& re = matrices.getMatrix( hyspex::HYSPEX_CALIB_RE );
+    * correction.setFloatMatrices( nullptr, 0, re.data, re.size, camera->getSpectralSize(), camera->getSpatialSize() );
+    * @endcode
+    */
+    class CalibrationMatrices
+    {
+    public:
+        CalibrationMatrices()
+        {
+            release();
+        }
+
+        //! Use matrices of a_camera, releases all float copies.
+        void setSource( const Camera* a_camera )
+        {
+            m_camera = a_camera;
+            m_cache = nullptr;
+            release();
+        }
+
+        //! Use matrices of a_cache, which must stay alive. Releases all float copies.
+        void setSource( CalibrationCache* a_cache )
+        {
+            m_camera = nullptr;
+            m_cache = a_cache;
+            release();
+        }
+
+        //! Float copy of a_matrix, converted on first access. Empty buffer if the source does not have it, which is also only looked up once.
+        const ConstBuffer< float >& getMatrix( calib_matrix_e a_matrix )
+        {
+            const uint32_t index = static_cast< uint32_t >( a_matrix );
+            if( index >= c_matrixCount )
+            {
+                return m_empty;
+            }
+            if( !m_resolved[ index ] )
+            {
+                load( index );
+            }
+            return m_buffers[ index ];
+        }
+
+        //! Matrix is available from the source.
+        bool getMatrixAvailable( calib_matrix_e a_matrix ) const
+        {
+            if( static_cast< uint32_t >( a_matrix ) >= c_matrixCount )
+            {
+                return false;
+            }
+            if( m_cache )
+            {
+                return m_cache->getCalibrationMatrixAvailable( a_matrix );
+            }
+            return m_camera && m_camera->getCalibrationMatrixAvailable( a_matrix );
+        }
+
+        //! Float copy of a_matrix exists.
+        bool isLoaded( calib_matrix_e a_matrix ) const
+        {
+            return static_cast< uint32_t >( a_matrix ) < c_matrixCount && m_buffers[ a_matrix ].size > 0;
+        }
+
+        /*!
+        * Convert a_matrices now and release all other float copies. The list is kept for useLensId().
+        * Returns HYSPEX_SETTING_NOT_FOUND if one of them is not available from the source.
+        */
+        ReturnCode prepare( const std::vector< calib_matrix_e >& a_matrices )
+        {
+            if( !m_camera && !( m_cache && m_cache->isOpen() ) )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            m_prepared = a_matrices;
+            bool keep[ c_matrixCount ] = {};
+            ReturnCode result = HYSPEX_OK;
+            for( size_t i = 0; i < a_matrices.size(); i++ )
+            {
+                const uint32_t index = static_cast< uint32_t >( a_matrices[ i ] );
+                if( index >= c_matrixCount )
+                {
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+                if( getMatrix( a_matrices[ i ] ).size == 0 )
+                {
+                    result = HYSPEX_SETTING_NOT_FOUND;
+                }
+                keep[ index ] = true;
+            }
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                if( !keep[ m ] )
+                {
+                    release( static_cast< calib_matrix_e >( m ) );
+                }
+            }
+            return result;
+        }
+
+        /*!
+        * Camera::useLensId( a_lensId ) on a_camera, and with a cache as source CalibrationCache::openOrStore() for the new lens.
+        * Float copies of the previous lens are dropped and the list from prepare() is converted again.
+        */
+        ReturnCode useLensId( Camera* a_camera, unsigned int a_lensId )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            release();
+            HYSPEX_RETURN_IF_ERROR_VAL( a_camera->useLensId( a_lensId ) );
+            if( m_cache )
+            {
+                HYSPEX_RETURN_IF_ERROR_VAL( m_cache->openOrStore( a_camera ) );
+            }
+            else
+            {
+                m_camera = a_camera;
+            }
+            return m_prepared.empty() ? HYSPEX_OK : prepare( m_prepared );
+        }
+
+        //! Drop float copy of a_matrix.
+        void release( calib_matrix_e a_matrix )
+        {
+            const uint32_t index = static_cast< uint32_t >( a_matrix );
+            if( index < c_matrixCount )
+            {
+                std::vector< float >().swap( m_copies[ index ] );
+                m_buffers[ index ].data = nullptr;
+                m_buffers[ index ].size = 0;
+                m_resolved[ index ] = false;
+            }
+        }
+
+        //! Drop all float copies.
+        void release()
+        {
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                release( static_cast< calib_matrix_e >( m ) );
+            }
+            m_empty.data = nullptr;
+            m_empty.size = 0;
+        }
+
+        //! Bytes held by float copies.
+        size_t getMemoryUsage() const
+        {
+            size_t bytes = 0;
+            for( uint32_t m = 0; m < c_matrixCount; m++ )
+            {
+                bytes += m_copies[ m ].capacity() * sizeof( float );
+            }
+            return bytes;
+        }
+
+    private:
+        static const uint32_t c_matrixCount = HYSPEX_CALIB_RESAMPLED_CENTRAL_WAVELENGTHS_DELTA + 1; //!< Entries of calib_matrix_e.
+
+        // disallow copy-constructors
+        CalibrationMatrices( const CalibrationMatrices& that );
+        CalibrationMatrices& operator=( const CalibrationMatrices& that );
+
+        void load( uint32_t a_index )
+        {
+            const calib_matrix_e matrix = static_cast< calib_matrix_e >( a_index );
+            const ConstBuffer< double >* source = nullptr;
+            if( m_cache && m_cache->getCalibrationMatrixAvailable( matrix ) )
+            {
+                source = &m_cache->getCalibrationMatrix( matrix );
+            }
+            else if( !m_cache && m_camera && m_camera->getCalibrationMatrixAvailable( matrix ) )
+            {
+                source = &m_camera->getCalibrationMatrix( matrix );
+            }
+            // a missing matrix is resolved as well, so getMatrix() does not look it up again.
+            m_resolved[ a_index ] = true;
+            if( !source || !source->data )
+            {
+                return;
+            }
+            m_copies[ a_index ].assign( source->data, source->data + source->size );
+            m_buffers[ a_index ].data = m_copies[ a_index ].data();
+            m_buffers[ a_index ].size = m_copies[ a_index ].size();
+        }
+
+        const Camera* m_camera{ nullptr }; //!< Camera source.
+        CalibrationCache* m_cache{ nullptr }; //!< Cache source, takes precedence.
+        std::vector< calib_matrix_e > m_prepared; //!< Matrices from prepare().
+        std::vector< float > m_copies[ c_matrixCount ]; //!< Float copies.
+        ConstBuffer< float > m_buffers[ c_matrixCount ]; //!< Views of m_copies.
+        ConstBuffer< float > m_empty; //!< Returned for unknown matrices.
+        bool m_resolved[ c_matrixCount ] = {}; //!< Source was looked up, m_buffers is final until release().
+    };
+}
+
+#endif // HYSPEX_CALIBRATIONMATRICES_H
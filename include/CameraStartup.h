@@ -0,0 +1,228 @@
+#ifndef HYSPEX_CAMERASTARTUP_H
+#define HYSPEX_CAMERASTARTUP_H
+#pragma once
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "CameraManager.h"
+
+namespace hyspex
+{
+    /*!
+    * Startup timings for one camera in nanoseconds, 0 for phases that were not reported.
+    * Phases are measured from HYSPEX_EVENT_INIT_STATUS_CHANGED events ( Camera::getInitStatus() ).
+    */
+    typedef struct
+    {
+        Camera* camera;            //!< Camera instance, owned by CameraManager.
+        ReturnCode result;         //!< Result of the failing step, or HYSPEX_OK.
+        InitStatus status;         //!< Camera::getInitStatus() after startup.
+        uint64_t ready_ns;         //!< Waiting for Camera::readyForInit().
+        uint64_t electronics_ns;   //!< HYSPEX_INIT_PENDING_ELECTRONICS phase.
+        uint64_t sensor_ns;        //!< HYSPEX_INIT_PENDING_SENSOR phase.
+        uint64_t transport_ns;     //!< HYSPEX_INIT_PENDING_TRANSPORT phase.
+        uint64_t init_ns;          //!< Camera::init() in total.
+        uint64_t acquisition_ns;   //!< Camera::initAcquisition().
+        uint64_t total_ns;         //!< From start of the camera thread until ready.
+    } CameraStartupTiming;
+
+    /*!
+    * @brief Detects and initializes all cameras of a CameraManager in parallel.
+    *
+    * CameraManager::detectCameras() probes the .set files with a_requireReadyForInit = false, so detection does not wait
+    * for slow sensors one after another. Every detected camera then gets its own thread that waits for readyForInit(),
+    * runs init() ( electronics, sensor and transport bring-up ) and initAcquisition(). Time to ready is bounded by
+    * the slowest camera instead of the sum of all cameras.
+    *
+    * Per phase timings come from the init status events of each camera, see getTiming(). A notification callback is
+    * registered on each camera while run() is active.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::CameraManager manager( "C://settings//" );
+    * hyspex::CameraStartup startup;
+    * if( startup.run( manager ) == hyspex::HYSPEX_OK )
+    * {
+    *     for( size_t i = 0; i < startup.getCount(); i++ )
+    *     {
+    *         const hyspex::CameraStartupTiming& timing = startup.getTiming( i );
+    *         printf( "%s sensor %.1f ms\n", timing.camera->getId().c_str(), timing.sensor_ns * 1e-6 );
+    *     }
+    * }
+    * @endcode
+    */
+    class CameraStartup
+    {
+    public:
+        CameraStartup()
+        {
+        }
+
+        void setBuffers( unsigned int a_numBuffersRaw, unsigned int a_numBuffersPreProcessing ) { m_buffersRaw = a_numBuffersRaw; m_buffersPreProcessing = a_numBuffersPreProcessing; } //!< Buffers passed to Camera::init().
+        void setReadyTimeout( unsigned int a_timeoutMs ) { m_readyTimeoutMs = a_timeoutMs; } //!< Max wait for Camera::readyForInit(), default 60000 ms. Fails with HYSPEX_INIT_SENSOR_NOT_READY.
+        void setInitAcquisition( bool a_enable ) { m_initAcquisition = a_enable; } //!< Also call Camera::initAcquisition(), default true.
+
+        /*!
+        * Detect cameras of a_manager and initialize them in parallel. a_manager must have read the settings path.
+        * Returns HYSPEX_OK if all cameras are ready, otherwise the first failing result ( see getTiming() for each camera ),
+        * HYSPEX_NOT_ACTIVE if no camera was detected. A camera that is not readyForInit() within setReadyTimeout() fails with
+        * HYSPEX_INIT_SENSOR_NOT_READY.
+        */
+        ReturnCode run( CameraManager& a_manager )
+        {
+            const Clock::time_point start = Clock::now();
+            a_manager.detectCameras( false );
+            m_detectionNs = elapsed( start );
+
+            m_states.clear();
+            for( size_t i = 0; i < a_manager.getCount(); i++ )
+            {
+                Camera* camera = a_manager.getCameraByIndex( i );
+                if( camera )
+                {
+                    m_states.push_back( std::unique_ptr< State >( new State( camera ) ) );
+                }
+            }
+            if( m_states.empty() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+
+            std::vector< std::thread > threads;
+            threads.reserve( m_states.size() );
+            for( size_t i = 0; i < m_states.size(); i++ )
+            {
+                threads.push_back( std::thread( &CameraStartup::startCamera, this, m_states[ i ].get() ) );
+            }
+            for( size_t i = 0; i < threads.size(); i++ )
+            {
+                threads[ i ].join();
+            }
+            m_totalNs = elapsed( start );
+
+            for( size_t i = 0; i < m_states.size(); i++ )
+            {
+                if( m_states[ i ]->timing.result < 1 )
+                {
+                    return m_states[ i ]->timing.result;
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        size_t getCount() const { return m_states.size(); } //!< Cameras handled by the last run().
+        const CameraStartupTiming& getTiming( size_t a_index ) const { return m_states.at( a_index )->timing; } //!< Timings and result for camera a_index.
+        uint64_t getDetectionTime() const { return m_detectionNs; } //!< CameraManager::detectCameras() in ns.
+        uint64_t getTotalTime() const { return m_totalNs; } //!< Detection until all cameras are ready in ns.
+
+    private:
+        typedef std::chrono::steady_clock Clock;
+
+        struct State
+        {
+            explicit State( Camera* a_camera )
+            {
+                timing = CameraStartupTiming();
+                timing.camera = a_camera;
+                timing.result = HYSPEX_NOT_ACTIVE;
+                timing.status = HYSPEX_INIT_NOT_STARTED;
+            }
+
+            CameraStartupTiming timing; //!< Result for this camera.
+            std::mutex mutex; //!< Guards phase and phase timings, events may arrive on another thread.
+            Clock::time_point phase_start; //!< Start of the current init phase.
+            int phase{ 0 }; //!< Current init status, 0 outside init().
+        };
+
+        // disallow copy-constructors
+        CameraStartup( const CameraStartup& that );
+        CameraStartup& operator=( const CameraStartup& that );
+
+        static uint64_t elapsed( Clock::time_point a_start )
+        {
+            return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( Clock::now() - a_start ).count() );
+        }
+
+        //! Add time since phase start to the phase that ends, and start a_next.
+        static void switchPhase( State* a_state, int a_next )
+        {
+            std::lock_guard< std::mutex > lock( a_state->mutex );
+            const int current = a_state->phase;
+            if( current == a_next )
+            {
+                return;
+            }
+            a_state->phase = a_next;
+            const Clock::time_point now = Clock::now();
+            const uint64_t duration = static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( now - a_state->phase_start ).count() );
+            switch( current )
+            {
+            case HYSPEX_INIT_PENDING_ELECTRONICS: a_state->timing.electronics_ns += duration; break;
+            case HYSPEX_INIT_PENDING_SENSOR: a_state->timing.sensor_ns += duration; break;
+            case HYSPEX_INIT_PENDING_TRANSPORT: a_state->timing.transport_ns += duration; break;
+            default: break;
+            }
+            a_state->phase_start = now;
+        }
+
+        static void HYSPEX_CB_CALLING_CONVENTION callback_router( void* a_handle, int a_eventId, int a_value )
+        {
+            State* state = static_cast< State* >( a_handle );
+            if( a_eventId == HYSPEX_EVENT_INIT_STATUS_CHANGED )
+            {
+                switchPhase( state, a_value );
+            }
+        }
+
+        void startCamera( State* a_state )
+        {
+            CameraStartupTiming& timing = a_state->timing;
+            Camera* camera = timing.camera;
+            const Clock::time_point start = Clock::now();
+
+            while( !camera->readyForInit() )
+            {
+                if( elapsed( start ) >= static_cast< uint64_t >( m_readyTimeoutMs ) * 1000000u )
+                {
+                    timing.result = HYSPEX_INIT_SENSOR_NOT_READY;
+                    timing.status = camera->getInitStatus();
+                    timing.ready_ns = timing.total_ns = elapsed( start );
+                    return;
+                }
+                std::this_thread::sleep_for( std::chrono::milliseconds( 10 ) );
+            }
+            timing.ready_ns = elapsed( start );
+
+            camera->registerNotificationCallback( &CameraStartup::callback_router, a_state );
+            const Clock::time_point init_start = Clock::now();
+            switchPhase( a_state, HYSPEX_INIT_PENDING_ELECTRONICS );
+            timing.result = camera->init( m_buffersRaw, m_buffersPreProcessing );
+            timing.init_ns = elapsed( init_start );
+            camera->unregisterNotificationCallback( &CameraStartup::callback_router );
+            switchPhase( a_state, 0 );
+            timing.status = camera->getInitStatus();
+
+            if( timing.result >= 1 && m_initAcquisition )
+            {
+                const Clock::time_point acquisition_start = Clock::now();
+                timing.result = camera->initAcquisition();
+                timing.acquisition_ns = elapsed( acquisition_start );
+            }
+            timing.total_ns = elapsed( start );
+        }
+
+        std::vector< std::unique_ptr< State > > m_states; //!< One per detected camera.
+        unsigned int m_buffersRaw{ 1024 }; //!< Camera::init() raw buffers.
+        unsigned int m_buffersPreProcessing{ 128 }; //!< Camera::init() processing buffers.
+        unsigned int m_readyTimeoutMs{ 60000 }; //!< readyForInit() timeout.
+        bool m_initAcquisition{ true }; //!< Call initAcquisition().
+        uint64_t m_detectionNs{ 0 }; //!< Time spent in detectCameras().
+        uint64_t m_totalNs{ 0 }; //!< Time of last run().
+    };
+}
+
+#endif // HYSPEX_CAMERASTARTUP_H
@@ -0,0 +1,262 @@
+#ifndef HYSPEX_DESTRIPING_H
+#define HYSPEX_DESTRIPING_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * Correction modes for Destriping.
+    */
+    typedef enum
+    {
+        HYSPEX_DESTRIPE_OFFSET = 0,     //!< Match column mean to band mean.
+        HYSPEX_DESTRIPE_GAIN_OFFSET = 1 //!< Match column mean and standard deviation to band mean and standard deviation.
+    } DestripingMode;
+
+    /*!
+    * @brief Streaming column destriping ( fixed pattern noise removal ) for push-broom data.
+    *
+    * Keeps the sum and sum of squares of every band / column element over the last getWindow() frames.
+    * After each frame the column statistics are matched to the band statistics ( average over all columns ):
+    *
+    *     output = input * gain[ y, x ] + offset[ y, x ]
+    *     gain   = band std / column std ( 1.0 for HYSPEX_DESTRIPE_OFFSET ), offset = band mean - gain * column mean
+    *
+    * Work is constant per pixel ( one add / subtract for the window, one table update, one multiply-add ), and memory is
+    * window frames plus four tables, so files are destriped in the same single pass as live data.
+    * Frames pass through unchanged until getMinimumFrames() frames are in the window, then the statistics of the frames seen
+    * so far are used until the window is full. Non-finite input values are not added to the statistics ( they stay non-finite
+    * in the output ). Size changes reset the statistics.
+    * Not thread-safe.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::Destriping destriping;
+    * destriping.setWindow( 256 );
+    * hyspex::ImageBuffer< float > output;
+    *
+    * // live:
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * destriping.apply( image, output );
+    *
+    * // batch:
+    * hyspex::forEachImage< float >( file_reader, [&]( const hyspex::ImageLine< float >& a_image )
+    * {
+    *     return destriping.apply( a_image, output ) == hyspex::HYSPEX_OK;
+    * } );
+    * @endcode
+    */
+    class Destriping
+    {
+    public:
+        //! Frames in sliding window ( 2 - 65535 ). Resets statistics.
+        ReturnCode setWindow( uint32_t a_frames )
+        {
+            if( a_frames < 2 || a_frames > 65535 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_window = a_frames;
+            reset();
+            return HYSPEX_OK;
+        }
+
+        //! Frames needed before the correction starts, earlier frames pass through unchanged. 0 ( default ) for half the window.
+        void setMinimumFrames( uint32_t a_frames ) { m_minimumFrames = a_frames; }
+
+        //! Correction mode, takes effect from the next frame.
+        void setMode( DestripingMode a_mode ) { m_mode = a_mode; }
+
+        uint32_t getWindow() const { return m_window; } //!< Frames in sliding window.
+        uint32_t getMinimumFrames() const { return std::min( m_minimumFrames == 0 ? m_window / 2 : m_minimumFrames, m_window ); } //!< Frames needed before the correction starts.
+        DestripingMode getMode() const { return m_mode; } //!< Correction mode.
+        uint32_t getFrameCount() const { return m_frames; } //!< Frames currently in the window.
+
+        //! Clear statistics.
+        void reset()
+        {
+            m_history.clear();
+            m_sum.clear();
+            m_sumSquares.clear();
+            m_counts.clear();
+            m_gain.clear();
+            m_offset.clear();
+            m_frames = 0;
+            m_next = 0;
+            m_spectralSize = 0;
+            m_spatialSize = 0;
+        }
+
+        //! Add a_input to the statistics and write the destriped frame to a_output, including metadata. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        ReturnCode apply( const ImageLine< float >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( update( a_input.buffer.data, a_input.buffer.size, a_input.spectral_size, a_input.spatial_size ) );
+            a_output.resize( a_input.spectral_size, a_input.spatial_size );
+            a_output.copyMetadata( a_input );
+            correct( a_input.buffer.data, a_output.data(), a_input.buffer.size );
+            return HYSPEX_OK;
+        }
+
+        //! Same as above for unsigned short input, e.g. HYSPEX_RAW_BP.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< float >& a_output )
+        {
+            if( a_input.buffer.size == 0 || a_input.buffer.size != static_cast< size_t >( a_input.spectral_size ) * a_input.spatial_size )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            a_output.resize( a_input.spectral_size, a_input.spatial_size );
+            a_output.copyMetadata( a_input );
+            convertToFloat( a_input.buffer.data, a_output.data(), a_input.buffer.size );
+            HYSPEX_RETURN_IF_ERROR_VAL( update( a_output.data(), a_input.buffer.size, a_input.spectral_size, a_input.spatial_size ) );
+            correct( a_output.data(), a_output.data(), a_input.buffer.size );
+            return HYSPEX_OK;
+        }
+
+        const float* gains() const { return m_gain.data(); } //!< Current gain per element, empty before first frame, 1 until getMinimumFrames().
+        const float* offsets() const { return m_offset.data(); } //!< Current offset per element, empty before first frame, 0 until getMinimumFrames().
+
+    private:
+        //! Slide window and rebuild gain / offset tables.
+        ReturnCode update( const float* a_input, size_t a_size, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            if( !a_input || a_size == 0 || a_size != static_cast< size_t >( a_spectralSize ) * a_spatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( a_spectralSize != m_spectralSize || a_spatialSize != m_spatialSize )
+            {
+                reset();
+                m_spectralSize = a_spectralSize;
+                m_spatialSize = a_spatialSize;
+                m_history.assign( a_size * m_window, 0.0f );
+                m_sum.assign( a_size, 0.0 );
+                m_sumSquares.assign( a_size, 0.0 );
+                m_counts.assign( a_size, 0 );
+                m_gain.assign( a_size, 1.0f );
+                m_offset.assign( a_size, 0.0f );
+            }
+
+            float* slot = m_history.data() + m_next * a_size;
+            const bool full = m_frames == m_window;
+            for( size_t i = 0; i < a_size; i++ )
+            {
+                // non-finite values are kept in the window, so they are also skipped when they leave it.
+                if( full && std::isfinite( slot[ i ] ) )
+                {
+                    const double old = slot[ i ];
+                    m_sum[ i ] -= old;
+                    m_sumSquares[ i ] -= old * old;
+                    m_counts[ i ]--;
+                }
+                if( std::isfinite( a_input[ i ] ) )
+                {
+                    const double value = a_input[ i ];
+                    m_sum[ i ] += value;
+                    m_sumSquares[ i ] += value * value;
+                    m_counts[ i ]++;
+                }
+                slot[ i ] = a_input[ i ];
+            }
+            m_next = ( m_next + 1 ) % m_window;
+            if( !full )
+            {
+                m_frames++;
+            }
+            if( m_frames < getMinimumFrames() )
+            {
+                return HYSPEX_OK;
+            }
+
+            for( uint32_t y = 0; y < a_spectralSize; y++ )
+            {
+                const size_t line = static_cast< size_t >( y ) * a_spatialSize;
+                double band_mean = 0.0;
+                double band_std = 0.0;
+                uint32_t columns = 0;
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    const double count = m_counts[ line + x ];
+                    if( count > 0.0 )
+                    {
+                        const double mean = m_sum[ line + x ] / count;
+                        band_mean += mean;
+                        band_std += std::sqrt( std::max( m_sumSquares[ line + x ] / count - mean * mean, 0.0 ) );
+                        columns++;
+                    }
+                }
+                if( columns == 0 )
+                {
+                    continue;
+                }
+                band_mean /= columns;
+                band_std /= columns;
+
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    const double count = m_counts[ line + x ];
+                    if( count == 0.0 )
+                    {
+                        // no finite value in the window, left uncorrected.
+                        m_gain[ line + x ] = 1.0f;
+                        m_offset[ line + x ] = 0.0f;
+                        continue;
+                    }
+                    const double mean = m_sum[ line + x ] / count;
+                    double gain = 1.0;
+                    if( m_mode == HYSPEX_DESTRIPE_GAIN_OFFSET )
+                    {
+                        // columns without variation ( dead, or too few frames ) are only offset corrected.
+                        const double column_std = std::sqrt( std::max( m_sumSquares[ line + x ] / count - mean * mean, 0.0 ) );
+                        gain = column_std > 1e-6 * ( band_std + 1.0 ) ? band_std / column_std : 1.0;
+                    }
+                    m_gain[ line + x ] = static_cast< float >( gain );
+                    m_offset[ line + x ] = static_cast< float >( band_mean - gain * mean );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        //! a_output = a_input * gain + offset, a_input may equal a_output.
+        void correct( const float* a_input, float* a_output, size_t a_size ) const
+        {
+            const float* gain = m_gain.data();
+            const float* offset = m_offset.data();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                _mm256_storeu_ps( a_output + i, _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( a_input + i ), _mm256_loadu_ps( gain + i ) ), _mm256_loadu_ps( offset + i ) ) );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                a_output[ i ] = a_input[ i ] * gain[ i ] + offset[ i ];
+            }
+        }
+
+        std::vector< float > m_history; //!< Last m_window frames, ring buffer.
+        std::vector< double > m_sum; //!< Sum per element over window.
+        std::vector< double > m_sumSquares; //!< Sum of squares per element over window.
+        std::vector< uint16_t > m_counts; //!< Finite values per element in window.
+        std::vector< float > m_gain; //!< Gain per element.
+        std::vector< float > m_offset; //!< Offset per element.
+        DestripingMode m_mode{ HYSPEX_DESTRIPE_GAIN_OFFSET }; //!< Correction mode.
+        uint32_t m_window{ 128 }; //!< Frames in window.
+        uint32_t m_minimumFrames{ 0 }; //!< Frames before correction starts, 0 for half the window.
+        uint32_t m_frames{ 0 }; //!< Frames in window so far.
+        uint32_t m_next{ 0 }; //!< Next slot in m_history.
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of statistics.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of statistics.
+    };
+}
+
+#endif // HYSPEX_DESTRIPING_H
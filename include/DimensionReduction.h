@@ -0,0 +1,527 @@
+#ifndef HYSPEX_DIMENSIONREDUCTION_H
+#define HYSPEX_DIMENSIONREDUCTION_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "FloatCubeWriter.h"
+#include "SpectralStatistics.h"
+
+namespace hyspex
+{
+    /*!
+    * Methods for SpectralProjection.
+    */
+    typedef enum
+    {
+        HYSPEX_REDUCTION_PCA = 0, //!< Principal components of the data covariance.
+        HYSPEX_REDUCTION_MNF = 1  //!< Minimum noise fraction: principal components after whitening with the noise variance per band.
+    } ReductionMethod;
+
+    /*!
+    * Eigenvalues ( descending ) and eigenvectors ( as rows, same order ) of the symmetric a_size x a_size matrix a_matrix.
+    * Cyclic Jacobi rotations, accurate for the few hundred bands of a HySpex camera.
+    */
+    inline void symmetricEigen( std::vector< double > a_matrix, size_t a_size, std::vector< double >* a_values, std::vector< double >* a_vectors )
+    {
+        const size_t n = a_size;
+        std::vector< double > v( n * n, 0.0 );
+        for( size_t i = 0; i < n; i++ )
+        {
+            v[ i * n + i ] = 1.0;
+        }
+
+        double* a = a_matrix.data();
+        for( int sweep = 0; sweep < 50; sweep++ )
+        {
+            double off = 0.0;
+            double total = 0.0;
+            for( size_t i = 0; i < n; i++ )
+            {
+                for( size_t j = 0; j < n; j++ )
+                {
+                    total += a[ i * n + j ] * a[ i * n + j ];
+                    off += i != j ? a[ i * n + j ] * a[ i * n + j ] : 0.0;
+                }
+            }
+            if( off <= 1e-22 * total )
+            {
+                break;
+            }
+
+            for( size_t p = 0; p + 1 < n; p++ )
+            {
+                for( size_t q = p + 1; q < n; q++ )
+                {
+                    const double apq = a[ p * n + q ];
+                    if( std::fabs( apq ) < 1e-300 )
+                    {
+                        continue;
+                    }
+                    const double theta = ( a[ q * n + q ] - a[ p * n + p ] ) / ( 2.0 * apq );
+                    const double t = ( theta >= 0.0 ? 1.0 : -1.0 ) / ( std::fabs( theta ) + std::sqrt( theta * theta + 1.0 ) );
+                    const double c = 1.0 / std::sqrt( t * t + 1.0 );
+                    const double s = t * c;
+
+                    for( size_t k = 0; k < n; k++ )
+                    {
+                        const double akp = a[ k * n + p ];
+                        const double akq = a[ k * n + q ];
+                        a[ k * n + p ] = c * akp - s * akq;
+                        a[ k * n + q ] = s * akp + c * akq;
+                    }
+                    for( size_t k = 0; k < n; k++ )
+                    {
+                        const double apk = a[ p * n + k ];
+                        const double aqk = a[ q * n + k ];
+                        a[ p * n + k ] = c * apk - s * aqk;
+                        a[ q * n + k ] = s * apk + c * aqk;
+                    }
+                    // rows of v are eigenvectors.
+                    for( size_t k = 0; k < n; k++ )
+                    {
+                        const double vpk = v[ p * n + k ];
+                        const double vqk = v[ q * n + k ];
+                        v[ p * n + k ] = c * vpk - s * vqk;
+                        v[ q * n + k ] = s * vpk + c * vqk;
+                    }
+                }
+            }
+        }
+
+        std::vector< size_t > order( n );
+        for( size_t i = 0; i < n; i++ )
+        {
+            order[ i ] = i;
+        }
+        std::sort( order.begin(), order.end(), [&]( size_t a_left, size_t a_right ) { return a[ a_left * n + a_left ] > a[ a_right * n + a_right ]; } );
+
+        a_values->resize( n );
+        a_vectors->resize( n * n );
+        for( size_t i = 0; i < n; i++ )
+        {
+            ( *a_values )[ i ] = a[ order[ i ] * n + order[ i ] ];
+            std::copy( v.begin() + order[ i ] * n, v.begin() + ( order[ i ] + 1 ) * n, a_vectors->begin() + i * n );
+        }
+    }
+
+    /*!
+    * @brief Online PCA / MNF dimensionality reduction.
+    *
+    * Learns components from the first getTrainingFrames() frames passed to apply(), then projects every frame:
+    *
+    *     output[ c, x ] = sum over y of projection[ c, y ] * ( input[ y, x ] - mean[ y ] )
+    *
+    * The output is an ImageLine< float > with spectral_size = components, so it can be passed on like any other frame.
+    * For MNF, the noise variance per band is set with setNoise() ( e.g. from the background standard deviation ) and
+    * the projection is eigenvectors of the noise whitened covariance times the whitening.
+    * getReconstruction() maps components back to bands. The projection is a register blocked matrix product
+    * ( see multiplySpectra() ), components x spectral multiply-adds per pixel.
+    * apply() keeps a copy of each training frame ( see setKeepTrainingFrames() ), and once trained, nextTrainingFrame()
+    * returns them projected in order, so no frame of a recording is lost to training.
+    * Not thread-safe, but project() is const and can be called from several threads once trained.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SpectralProjection projection;
+    * projection.setMethod( hyspex::HYSPEX_REDUCTION_MNF );
+    * projection.setNoise( camera, hyspex::HYSPEX_RE );
+    * projection.setComponents( 24 );
+    * projection.setTrainingFrames( 500 );
+    *
+    * hyspex::ImageBuffer< float > reduced;
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * const hyspex::ReturnCode result = projection.apply( image, reduced );
+    * if( result == hyspex::HYSPEX_OK )
+    * {
+    *     // reduced.line() has 24 "bands".
+    * }
+    * else if( result == hyspex::HYSPEX_NOT_ACTIVE )
+    * {
+    *     while( projection.nextTrainingFrame( reduced ) == hyspex::HYSPEX_OK )
+    *     {
+    *         // training frames, in order, once the last one trained the projection.
+    *     }
+    * }
+    * @endcode
+    */
+    class SpectralProjection
+    {
+    public:
+        void setMethod( ReductionMethod a_method ) { m_method = a_method; } //!< PCA or MNF, used by the next train().
+        void setTrainingFrames( uint32_t a_frames ) { m_trainingFrames = std::max( a_frames, 1u ); } //!< Frames to learn from before projecting.
+        void setKeepTrainingFrames( bool a_keep ) { m_keepTrainingFrames = a_keep; } //!< Copy training frames in apply() for nextTrainingFrame(), default true. Holds getTrainingFrames() frames in memory.
+        uint32_t getTrainingFrames() const { return m_trainingFrames; } //!< Frames to learn from.
+
+        //! Number of output components, used by the next train().
+        ReturnCode setComponents( uint32_t a_components )
+        {
+            if( a_components == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_components = a_components;
+            return HYSPEX_OK;
+        }
+
+        //! Noise variance per band for MNF.
+        ReturnCode setNoise( const std::vector< double >& a_variance )
+        {
+            for( size_t y = 0; y < a_variance.size(); y++ )
+            {
+                if( !( a_variance[ y ] > 0.0 ) )
+                {
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+            }
+            m_noise = a_variance;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Noise variance per band from the background standard deviation of a_camera ( mean over spatial pixels ).
+        * For HYSPEX_RE / HYSPEX_HSNR_RE data, the standard deviation is scaled by 1 / RE like the data.
+        */
+        ReturnCode setNoise( const Camera* a_camera, ImageOptions a_options = HYSPEX_RE )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            const uint32_t spectral_size = static_cast< uint32_t >( a_camera->getSpectralSize() );
+            const uint32_t spatial_size = static_cast< uint32_t >( a_camera->getSpatialSize() );
+            const size_t size = static_cast< size_t >( spectral_size ) * spatial_size;
+            const ConstBuffer< double >& deviation = a_camera->getBackgroundStdDeviationMatrix();
+            const ConstBuffer< double >& re = a_camera->getREMatrix();
+            const bool responsivity = a_options == HYSPEX_RE || a_options == HYSPEX_HSNR_RE;
+            if( size == 0 || deviation.size != size || ( responsivity && re.size != size ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            std::vector< double > variance( spectral_size, 0.0 );
+            for( uint32_t y = 0; y < spectral_size; y++ )
+            {
+                for( uint32_t x = 0; x < spatial_size; x++ )
+                {
+                    const size_t i = static_cast< size_t >( y ) * spatial_size + x;
+                    const double sigma = responsivity ? ( re.data[ i ] != 0.0 ? deviation.data[ i ] / re.data[ i ] : 0.0 ) : deviation.data[ i ];
+                    variance[ y ] += sigma * sigma;
+                }
+                // bands without noise estimate ( e.g. dead ) get a tiny variance instead of failing.
+                variance[ y ] = std::max( variance[ y ] / spatial_size, 1e-12 );
+            }
+            return setNoise( variance );
+        }
+
+        ReductionMethod getMethod() const { return m_method; } //!< PCA or MNF.
+        uint32_t getComponents() const { return m_trained ? m_trainedComponents : m_components; } //!< Number of output components.
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Input bands of trained projection.
+        bool isTrained() const { return m_trained; } //!< Projection is available.
+        const std::vector< float >& getMean() const { return m_mean; } //!< Mean spectrum, spectral.
+        const std::vector< float >& getProjection() const { return m_projection; } //!< components x spectral.
+        const std::vector< float >& getReconstruction() const { return m_reconstruction; } //!< spectral x components: input ~= mean + reconstruction * output.
+        const std::vector< double >& getEigenvalues() const { return m_eigenvalues; } //!< Variance ( PCA ) or signal to noise + 1 ( MNF ) per component.
+
+        //! Forget training statistics, kept training frames and projection.
+        void reset()
+        {
+            m_statistics.reset();
+            m_frames = 0;
+            m_trained = false;
+            m_pending.clear();
+            m_nextPending = 0;
+        }
+
+        //! Training frames kept by apply() and not yet returned by nextTrainingFrame().
+        size_t getPendingTrainingFrames() const { return m_pending.size() - m_nextPending; }
+
+        /*!
+        * Project the oldest training frame kept by apply() into a_output, including metadata.
+        * Returns HYSPEX_NOT_ACTIVE while not trained or when all kept frames were returned.
+        */
+        ReturnCode nextTrainingFrame( ImageBuffer< float >& a_output )
+        {
+            if( !m_trained || m_nextPending >= m_pending.size() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            const ImageLine< float >& input = m_pending[ m_nextPending++ ].line();
+            ReturnCode result = HYSPEX_INVALID_ARGUMENTS;
+            if( input.spectral_size == m_spectralSize )
+            {
+                a_output.resize( m_trainedComponents, input.spatial_size );
+                a_output.copyMetadata( input );
+                project( input.buffer.data, input.spatial_size, a_output.data() );
+                result = HYSPEX_OK;
+            }
+            if( m_nextPending >= m_pending.size() )
+            {
+                std::vector< ImageBuffer< float > >().swap( m_pending );
+                m_nextPending = 0;
+            }
+            return result;
+        }
+
+        //! Add a_input ( spectral x spatial ) to the training statistics, without training.
+        ReturnCode addTrainingFrame( const float* a_input, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( m_statistics.accumulate( a_input, a_spectralSize, a_spatialSize ) );
+            m_frames++;
+            return HYSPEX_OK;
+        }
+
+        //! Compute projection from the training statistics.
+        ReturnCode train()
+        {
+            std::vector< double > mean;
+            std::vector< double > covariance;
+            HYSPEX_RETURN_IF_ERROR_VAL( m_statistics.getMeanAndCovariance( &mean, &covariance ) );
+            const size_t n = mean.size();
+            if( m_method == HYSPEX_REDUCTION_MNF && m_noise.size() != n )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            // MNF: covariance of noise whitened data, whitening[ y ] = 1 / noise std.
+            std::vector< double > whitening( n, 1.0 );
+            if( m_method == HYSPEX_REDUCTION_MNF )
+            {
+                for( size_t y = 0; y < n; y++ )
+                {
+                    whitening[ y ] = 1.0 / std::sqrt( m_noise[ y ] );
+                }
+                for( size_t i = 0; i < n; i++ )
+                {
+                    for( size_t j = 0; j < n; j++ )
+                    {
+                        covariance[ i * n + j ] *= whitening[ i ] * whitening[ j ];
+                    }
+                }
+            }
+
+            std::vector< double > vectors;
+            symmetricEigen( covariance, n, &m_eigenvalues, &vectors );
+
+            const size_t components = std::min< size_t >( m_components, n );
+            m_eigenvalues.resize( components );
+            m_projection.assign( components * n, 0.0f );
+            m_reconstruction.assign( n * components, 0.0f );
+            m_mean.assign( n, 0.0f );
+            for( size_t y = 0; y < n; y++ )
+            {
+                m_mean[ y ] = static_cast< float >( mean[ y ] );
+            }
+            for( size_t c = 0; c < components; c++ )
+            {
+                for( size_t y = 0; y < n; y++ )
+                {
+                    m_projection[ c * n + y ] = static_cast< float >( vectors[ c * n + y ] * whitening[ y ] );
+                    m_reconstruction[ y * components + c ] = static_cast< float >( vectors[ c * n + y ] / whitening[ y ] );
+                }
+            }
+            finishProjection( static_cast< uint32_t >( n ), static_cast< uint32_t >( components ) );
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Use a projection from elsewhere ( e.g. a previous flight ), a_projection is components x spectral and a_reconstruction
+        * spectral x components. Without a_reconstruction getReconstruction() is empty and ProjectionWriter refuses to open.
+        */
+        ReturnCode setProjection( const std::vector< float >& a_mean, const std::vector< float >& a_projection, uint32_t a_components,
+                                  const std::vector< float >& a_reconstruction = std::vector< float >() )
+        {
+            if( a_mean.empty() || a_components == 0 || a_projection.size() != a_mean.size() * a_components ||
+                ( !a_reconstruction.empty() && a_reconstruction.size() != a_projection.size() ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_mean = a_mean;
+            m_projection = a_projection;
+            m_reconstruction = a_reconstruction;
+            m_eigenvalues.clear();
+            finishProjection( static_cast< uint32_t >( a_mean.size() ), a_components );
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Training: add a_input to the statistics ( and keep a copy for nextTrainingFrame() ), train after getTrainingFrames()
+        * frames, returns HYSPEX_NOT_ACTIVE.
+        * Trained: project a_input into a_output ( components x spatial ), including metadata. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        */
+        ReturnCode apply( const ImageLine< float >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( a_input.buffer.size != static_cast< size_t >( a_input.spectral_size ) * a_input.spatial_size || a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( !m_trained )
+            {
+                HYSPEX_RETURN_IF_ERROR_VAL( addTrainingFrame( a_input.buffer.data, a_input.spectral_size, a_input.spatial_size ) );
+                if( m_keepTrainingFrames )
+                {
+                    m_pending.emplace_back();
+                    ImageBuffer< float >& copy = m_pending.back();
+                    copy.resize( a_input.spectral_size, a_input.spatial_size );
+                    copy.copyMetadata( a_input );
+                    std::copy( a_input.buffer.data, a_input.buffer.data + a_input.buffer.size, copy.data() );
+                }
+                if( m_frames >= m_trainingFrames )
+                {
+                    HYSPEX_RETURN_IF_ERROR_VAL( train() );
+                }
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( a_input.spectral_size != m_spectralSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            a_output.resize( m_trainedComponents, a_input.spatial_size );
+            a_output.copyMetadata( a_input );
+            project( a_input.buffer.data, a_input.spatial_size, a_output.data() );
+            return HYSPEX_OK;
+        }
+
+        //! Same as above for unsigned short input.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< float >& a_output )
+        {
+            m_converted.resize( a_input.spectral_size, a_input.spatial_size );
+            m_converted.copyMetadata( a_input );
+            convertToFloat( a_input.buffer.data, m_converted.data(), std::min( a_input.buffer.size, m_converted.size() ) );
+            if( a_input.buffer.size != m_converted.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return apply( m_converted.line(), a_output );
+        }
+
+        //! Project a_input ( spectral x a_spatialSize ) into a_output ( components x a_spatialSize ). Must be trained.
+        void project( const float* a_input, uint32_t a_spatialSize, float* a_output ) const
+        {
+            multiplySpectra( m_projection.data(), m_trainedComponents, m_spectralSize, m_bias.data(),
+                             a_input, a_spatialSize, a_spatialSize, a_output, a_spatialSize );
+        }
+
+    private:
+        //! Set sizes and bias = projection * mean, so project() needs no centering pass.
+        void finishProjection( uint32_t a_spectralSize, uint32_t a_components )
+        {
+            m_spectralSize = a_spectralSize;
+            m_trainedComponents = a_components;
+            m_bias.assign( a_components, 0.0f );
+            for( size_t c = 0; c < a_components; c++ )
+            {
+                double bias = 0.0;
+                for( size_t y = 0; y < a_spectralSize; y++ )
+                {
+                    bias += static_cast< double >( m_projection[ c * a_spectralSize + y ] ) * m_mean[ y ];
+                }
+                m_bias[ c ] = static_cast< float >( bias );
+            }
+            m_trained = true;
+        }
+
+        ReductionMethod m_method{ HYSPEX_REDUCTION_PCA }; //!< PCA or MNF.
+        uint32_t m_components{ 24 }; //!< Requested components.
+        uint32_t m_trainingFrames{ 200 }; //!< Frames to learn from.
+        uint32_t m_frames{ 0 }; //!< Training frames so far.
+        uint32_t m_spectralSize{ 0 }; //!< Input bands of projection.
+        uint32_t m_trainedComponents{ 0 }; //!< Output components of projection.
+        bool m_trained{ false }; //!< Projection is valid.
+        bool m_keepTrainingFrames{ true }; //!< Copy training frames in apply().
+        std::vector< ImageBuffer< float > > m_pending; //!< Training frames kept by apply().
+        size_t m_nextPending{ 0 }; //!< Next frame of m_pending for nextTrainingFrame().
+        SpectralCovariance m_statistics; //!< Training statistics.
+        std::vector< double > m_noise; //!< Noise variance per band, for MNF.
+        std::vector< double > m_eigenvalues; //!< Eigenvalue per component.
+        std::vector< float > m_mean; //!< Mean spectrum.
+        std::vector< float > m_projection; //!< components x spectral.
+        std::vector< float > m_reconstruction; //!< spectral x components.
+        std::vector< float > m_bias; //!< projection * mean.
+        ImageBuffer< float > m_converted; //!< Float copy of unsigned short input.
+    };
+
+    /*!
+    * @brief Writes reduced frames from SpectralProjection as an ENVI float32 BIL cube with FloatCubeWriter.
+    *
+    * The header holds the mean, projection and reconstruction in "hyspex projection ..." fields, so the bands can be
+    * restored: band = mean + reconstruction * components. Frames are written as they arrive, the header on close().
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::ProjectionWriter writer;
+    * writer.open( "flight_01_mnf", projection ); // flight_01_mnf.raw and flight_01_mnf.hdr
+    * writer.writeFrame( reduced.line() );
+    * writer.close();
+    * @endcode
+    */
+    class ProjectionWriter
+    {
+    public:
+        ProjectionWriter()
+        {
+        }
+
+        ~ProjectionWriter() { close(); }
+
+        //! Create a_baseName.raw, a_projection must be trained, have a reconstruction and outlive the writer.
+        bool open( const std::string& a_baseName, const SpectralProjection& a_projection )
+        {
+            close();
+            if( !a_projection.isTrained() || a_projection.getReconstruction().empty() || !m_cube.open( a_baseName ) )
+            {
+                return false;
+            }
+            m_projection = &a_projection;
+            return true;
+        }
+
+        //! Append one reduced frame ( components x spatial ).
+        bool writeFrame( const ImageLine< float >& a_frame )
+        {
+            if( !m_projection || a_frame.spectral_size != m_projection->getComponents() )
+            {
+                return false;
+            }
+            return m_cube.writeFrame( a_frame );
+        }
+
+        //! Close cube and write a_baseName.hdr.
+        bool close()
+        {
+            if( !m_projection )
+            {
+                return false;
+            }
+            const uint32_t components = m_projection->getComponents();
+            std::vector< std::string > names( components );
+            for( uint32_t c = 0; c < components; c++ )
+            {
+                names[ c ] = "component " + std::to_string( c + 1 );
+            }
+            m_cube.setDescription( m_projection->getMethod() == HYSPEX_REDUCTION_MNF ? "MNF components" : "PCA components" );
+            m_cube.setBandNames( names );
+            m_cube.addHeaderField( "hyspex projection bands", std::to_string( m_projection->getSpectralSize() ) );
+            m_cube.addHeaderField( "hyspex projection mean", m_projection->getMean() );
+            m_cube.addHeaderField( "hyspex projection matrix", m_projection->getProjection() );
+            m_cube.addHeaderField( "hyspex projection reconstruction", m_projection->getReconstruction() );
+            m_projection = nullptr;
+            return m_cube.close();
+        }
+
+    private:
+        // disallow copy-constructors
+        ProjectionWriter( const ProjectionWriter& that );
+        ProjectionWriter& operator=( const ProjectionWriter& that );
+
+        FloatCubeWriter m_cube; //!< Cube file.
+        const SpectralProjection* m_projection{ nullptr }; //!< Projection of frames.
+    };
+}
+
+#endif // HYSPEX_DIMENSIONREDUCTION_H
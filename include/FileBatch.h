@@ -0,0 +1,189 @@
+#ifndef HYSPEX_FILEBATCH_H
+#define HYSPEX_FILEBATCH_H
+#pragma once
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "FileReader.h"
+
+namespace hyspex
+{
+    //! Read spectral and spatial size of images in a_reader from the "spectral_size" and "spatial_size" properties.
+    inline ReturnCode getFileImageSize( const FileReader& a_reader, uint32_t* a_spectralSize, uint32_t* a_spatialSize )
+    {
+        if( !a_spectralSize || !a_spatialSize )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+
+        bool spectral_ok = false;
+        bool spatial_ok = false;
+        const std::string spectral = a_reader.getPropertyValue( "spectral_size", &spectral_ok );
+        const std::string spatial = a_reader.getPropertyValue( "spatial_size", &spatial_ok );
+        if( !spectral_ok || !spatial_ok )
+        {
+            return HYSPEX_SETTING_NOT_FOUND;
+        }
+
+        *a_spectralSize = static_cast< uint32_t >( std::strtoul( spectral.c_str(), nullptr, 10 ) );
+        *a_spatialSize = static_cast< uint32_t >( std::strtoul( spatial.c_str(), nullptr, 10 ) );
+        return ( *a_spectralSize > 0 && *a_spatialSize > 0 ) ? HYSPEX_OK : HYSPEX_INVALID_ARGUMENTS;
+    }
+
+    /*!
+    * Read "wavelength" ( and "fwhm", empty if missing ) from the ENVI header written next to a recording, in nm.
+    * Values are converted from micrometers when "wavelength units" says so.
+    */
+    inline ReturnCode readEnviWavelengths( const std::string& a_headerPath, std::vector< double >* a_wavelengths, std::vector< double >* a_fwhm = nullptr )
+    {
+        if( !a_wavelengths )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+        std::ifstream file( a_headerPath );
+        if( !file )
+        {
+            return HYSPEX_SETTING_NOT_FOUND;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        const std::string header = contents.str();
+
+        // value of "a_key = ...", lower case key match at the start of a line, braces may span lines.
+        auto find_value = [&]( const std::string& a_key, std::string* a_value )
+        {
+            size_t start = 0;
+            while( start < header.size() )
+            {
+                size_t end = header.find( '\n', start );
+                end = end == std::string::npos ? header.size() : end;
+                const size_t equals = header.find( '=', start );
+                if( equals < end )
+                {
+                    std::string key = header.substr( start, equals - start );
+                    key.erase( key.find_last_not_of( " \t" ) + 1 );
+                    for( size_t i = 0; i < key.size(); i++ )
+                    {
+                        key[ i ] = static_cast< char >( std::tolower( static_cast< unsigned char >( key[ i ] ) ) );
+                    }
+                    if( key == a_key )
+                    {
+                        const size_t open = header.find_first_not_of( " \t", equals + 1 );
+                        if( open != std::string::npos && header[ open ] == '{' )
+                        {
+                            const size_t close = header.find( '}', open );
+                            end = close == std::string::npos ? header.size() : close;
+                            *a_value = header.substr( open + 1, end - open - 1 );
+                        }
+                        else
+                        {
+                            *a_value = open < end ? header.substr( open, end - open ) : std::string();
+                        }
+                        return true;
+                    }
+                }
+                start = end + 1;
+            }
+            return false;
+        };
+        auto parse_list = []( const std::string& a_text, std::vector< double >* a_values )
+        {
+            a_values->clear();
+            const char* text = a_text.c_str();
+            while( *text )
+            {
+                char* end = nullptr;
+                const double value = std::strtod( text, &end );
+                if( end == text )
+                {
+                    text++;
+                    continue;
+                }
+                a_values->push_back( value );
+                text = end;
+            }
+        };
+
+        std::string value;
+        if( !find_value( "wavelength", &value ) )
+        {
+            return HYSPEX_SETTING_NOT_FOUND;
+        }
+        parse_list( value, a_wavelengths );
+        double scale = 1.0;
+        if( find_value( "wavelength units", &value ) && ( value.find( "icro" ) != std::string::npos || value.find( "um" ) == 0 ) )
+        {
+            scale = 1000.0;
+        }
+        for( size_t i = 0; i < a_wavelengths->size(); i++ )
+        {
+            ( *a_wavelengths )[ i ] *= scale;
+        }
+        if( a_fwhm )
+        {
+            a_fwhm->clear();
+            if( find_value( "fwhm", &value ) )
+            {
+                parse_list( value, a_fwhm );
+                for( size_t i = 0; i < a_fwhm->size(); i++ )
+                {
+                    ( *a_fwhm )[ i ] *= scale;
+                }
+            }
+        }
+        return a_wavelengths->empty() ? HYSPEX_INVALID_ARGUMENTS : HYSPEX_OK;
+    }
+
+    inline ConstBuffer< unsigned short > readFileImage( FileReader& a_reader, size_t a_index, unsigned short* ) { return a_reader.getImage( a_index ); } //!< Used by forEachImage().
+    inline ConstBuffer< float > readFileImage( FileReader& a_reader, size_t a_index, float* ) { return a_reader.getFloatImage( a_index ); } //!< Used by forEachImage().
+
+    /*!
+    * Call a_function( const ImageLine< T >& ) for every image in a_reader, so stages written for Camera images can be used in batch mode.
+    * T is unsigned short ( FileReader::getImage() ) or float ( FileReader::getFloatImage() ).
+    * stat.frame_number is the image index, other statistics and timestamps are 0. Return false from a_function to stop.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::FileReader reader;
+    * reader.open( "test.hyspex" );
+    * hyspex::forEachImage< unsigned short >( reader, [&]( const hyspex::ImageLine< unsigned short >& a_image )
+    * {
+    *     // do processing on image here.
+    *     return true;
+    * } );
+    * @endcode
+    */
+    template< typename T, typename Function >
+    ReturnCode forEachImage( FileReader& a_reader, Function a_function )
+    {
+        uint32_t spectral_size = 0;
+        uint32_t spatial_size = 0;
+        HYSPEX_RETURN_IF_ERROR_VAL( getFileImageSize( a_reader, &spectral_size, &spatial_size ) );
+
+        ImageLine< T > line = ImageLine< T >();
+        line.spectral_size = spectral_size;
+        line.spatial_size = spatial_size;
+
+        const size_t count = a_reader.getImageCount();
+        for( size_t i = 0; i < count; i++ )
+        {
+            line.buffer = readFileImage( a_reader, i, static_cast< T* >( nullptr ) );
+            if( line.buffer.size != static_cast< size_t >( spectral_size ) * spatial_size )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            line.stat.frame_number = i;
+            if( !a_function( static_cast< const ImageLine< T >& >( line ) ) )
+            {
+                break;
+            }
+        }
+        return HYSPEX_OK;
+    }
+}
+
+#endif // HYSPEX_FILEBATCH_H
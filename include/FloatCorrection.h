@@ -0,0 +1,303 @@
+#ifndef HYSPEX_FLOATCORRECTION_H
+#define HYSPEX_FLOATCORRECTION_H
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Background subtraction and responsivity correction with float32 output.
+    *
+    * HYSPEX_BGSUB and HYSPEX_RE images are rounded and clamped back into unsigned short by the library.
+    * This class does the same correction in one pass directly into float, so negative values after background
+    * subtraction and the fractional part after responsivity correction are kept:
+    *
+    *     output = ( input - background ) * gain, where gain = a_scale / RE ( or a_scale for HYSPEX_BGSUB ).
+    *
+    * The input should be bad pixel corrected, i.e. HYSPEX_RAW_BP ( or HYSPEX_HSNR_RAW_BP ).
+    * Tables are float copies of the camera matrices, call prepare() again after a new background has been calculated.
+    * This class is not thread-safe, but apply() is const and can be called from several threads once prepared.
+    */
+    class FloatCorrection
+    {
+    public:
+        /*!
+        * Build tables from the current background and RE matrix of a_camera.
+        * HYSPEX_RAW / HYSPEX_RAW_BP gives a plain conversion, HYSPEX_BGSUB subtracts background, HYSPEX_RE also corrects responsivity.
+        * Returns HYSPEX_SETTING_NOT_FOUND if a matrix needed for a_options is missing or does not match the image size.
+        */
+        ReturnCode prepare( const Camera* a_camera, ImageOptions a_options, float a_scale = 1.0f )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+
+            const ConstBuffer< double >& background = a_camera->getBackgroundMatrix();
+            const ConstBuffer< double >& re = a_camera->getREMatrix();
+
+            const bool subtract = a_options == HYSPEX_BGSUB || a_options == HYSPEX_RE || a_options == HYSPEX_HSNR_RE;
+            const bool responsivity = a_options == HYSPEX_RE || a_options == HYSPEX_HSNR_RE;
+            const size_t size = a_camera->getSpectralSize() * a_camera->getSpatialSize();
+            if( ( subtract && ( !background.data || background.size != size ) ) || ( responsivity && ( !re.data || re.size != size ) ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            return setMatrices( subtract ? background.data : nullptr, subtract ? background.size : 0,
+                                responsivity ? re.data : nullptr, responsivity ? re.size : 0,
+                                static_cast< uint32_t >( a_camera->getSpectralSize() ), static_cast< uint32_t >( a_camera->getSpatialSize() ), a_scale );
+        }
+
+        /*!
+        * Build tables from user supplied matrices ( spectral x spatial ), for instance binned matrices.
+        * a_background and a_re may be null, in which case 0.0 and 1.0 are used. Removes band and element factors.
+        */
+        ReturnCode setMatrices( const double* a_background, size_t a_backgroundSize, const double* a_re, size_t a_reSize,
+                                uint32_t a_spectralSize, uint32_t a_spatialSize, float a_scale = 1.0f )
+        {
+            return fillTables( a_background, a_backgroundSize, a_re, a_reSize, a_spectralSize, a_spatialSize, a_scale );
+        }
+
+        //! Same as setMatrices() for float matrices, e.g. from CalibrationMatrices.
+        ReturnCode setFloatMatrices( const float* a_background, size_t a_backgroundSize, const float* a_re, size_t a_reSize,
+                                     uint32_t a_spectralSize, uint32_t a_spatialSize, float a_scale = 1.0f )
+        {
+            return fillTables( a_background, a_backgroundSize, a_re, a_reSize, a_spectralSize, a_spatialSize, a_scale );
+        }
+
+        /*!
+        * Multiply the gain of every element in band y by a_factors[ y ], e.g. from TemperatureCompensation.
+        * Factors replace those from the previous call, the gains from setMatrices() / prepare() are kept as base.
+        * a_spectralSize must equal the spectral size of the tables, a model for other bands ( binning, ROI ) is rejected.
+        */
+        ReturnCode setBandFactors( const float* a_factors, uint32_t a_spectralSize )
+        {
+            if( !a_factors || a_spectralSize == 0 || a_spectralSize != m_spectralSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_bandFactors.assign( a_factors, a_factors + a_spectralSize );
+            updateGains();
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Multiply the gain of every element by a_factors[ i ], e.g. from ReflectanceConversion. Null removes the factors.
+        * Combined with band factors, the output is still one subtract and one multiply per element.
+        */
+        ReturnCode setElementFactors( const float* a_factors, size_t a_size )
+        {
+            if( !a_factors )
+            {
+                m_elementFactors.clear();
+            }
+            else if( a_size != m_baseGain.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            else
+            {
+                m_elementFactors.assign( a_factors, a_factors + a_size );
+            }
+            updateGains();
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Replace background table only, gains are kept. For backgrounds estimated while running, e.g. by BackgroundEstimator.
+        * a_size must match size(). Not thread-safe with apply(), use one FloatCorrection per thread when updating while running.
+        */
+        ReturnCode setBackground( const float* a_background, size_t a_size )
+        {
+            if( !a_background || a_size != m_offset.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            std::copy( a_background, a_background + a_size, m_offset.begin() );
+            return HYSPEX_OK;
+        }
+
+        size_t size() const { return m_offset.size(); } //!< Number of elements in tables, 0 if not prepared.
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Spectral size of tables.
+        uint32_t getSpatialSize() const { return m_spatialSize; } //!< Spatial size of tables.
+        const float* offsets() const { return m_offset.data(); } //!< Background table.
+        const float* gains() const { return m_gain.data(); } //!< Gain table.
+
+        //! Correct a_size elements from a_input into a_output. a_size must not exceed size().
+        void apply( const unsigned short* a_input, float* a_output, size_t a_size ) const
+        {
+            const float* offset = m_offset.data();
+            const float* gain = m_gain.data();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; i + 16 <= a_size; i += 16 )
+            {
+                const __m256i raw = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_input + i ) );
+                const __m256 lo = _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_castsi256_si128( raw ) ) );
+                const __m256 hi = _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_extracti128_si256( raw, 1 ) ) );
+                _mm256_storeu_ps( a_output + i,     _mm256_mul_ps( _mm256_sub_ps( lo, _mm256_loadu_ps( offset + i ) ),     _mm256_loadu_ps( gain + i ) ) );
+                _mm256_storeu_ps( a_output + i + 8, _mm256_mul_ps( _mm256_sub_ps( hi, _mm256_loadu_ps( offset + i + 8 ) ), _mm256_loadu_ps( gain + i + 8 ) ) );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                a_output[ i ] = ( static_cast< float >( a_input[ i ] ) - offset[ i ] ) * gain[ i ];
+            }
+        }
+
+        /*!
+        * Correct a frame ( a_spectralSize x a_spatialSize, must match size() ) and write it transposed to a_output
+        * ( a_spatialSize x a_spectralSize, one spectrum per pixel ). Done in 8 x 8 blocks, transposed in registers with AVX2,
+        * so the BIP frame costs no extra pass over memory.
+        */
+        void applyTransposed( const unsigned short* a_input, float* a_output, uint32_t a_spectralSize, uint32_t a_spatialSize ) const
+        {
+            const float* offset = m_offset.data();
+            const float* gain = m_gain.data();
+            const size_t spectral = a_spectralSize;
+            const size_t spatial = a_spatialSize;
+            size_t x0 = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            // 8 pixels at a time over all bands, so the 8 output spectra are written sequentially.
+            for( ; x0 + 8 <= spatial; x0 += 8 )
+            {
+                size_t y0 = 0;
+                for( ; y0 + 8 <= spectral; y0 += 8 )
+                {
+                    __m256 rows[ 8 ];
+                    for( size_t k = 0; k < 8; k++ )
+                    {
+                        const size_t i = ( y0 + k ) * spatial + x0;
+                        const __m256 raw = _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_input + i ) ) ) );
+                        rows[ k ] = _mm256_mul_ps( _mm256_sub_ps( raw, _mm256_loadu_ps( offset + i ) ), _mm256_loadu_ps( gain + i ) );
+                    }
+                    transpose8x8( rows );
+                    for( size_t k = 0; k < 8; k++ )
+                    {
+                        _mm256_storeu_ps( a_output + ( x0 + k ) * spectral + y0, rows[ k ] );
+                    }
+                }
+                for( ; y0 < spectral; y0++ )
+                {
+                    for( size_t x = x0; x < x0 + 8; x++ )
+                    {
+                        const size_t i = y0 * spatial + x;
+                        a_output[ x * spectral + y0 ] = ( static_cast< float >( a_input[ i ] ) - offset[ i ] ) * gain[ i ];
+                    }
+                }
+            }
+#endif
+            // scalar: blocks of 32 pixels keep the output spectra in cache while the bands are walked.
+            for( ; x0 < spatial; x0 += 32 )
+            {
+                const size_t x1 = std::min( x0 + 32, spatial );
+                for( size_t y = 0; y < spectral; y++ )
+                {
+                    for( size_t x = x0; x < x1; x++ )
+                    {
+                        const size_t i = y * spatial + x;
+                        a_output[ x * spectral + y ] = ( static_cast< float >( a_input[ i ] ) - offset[ i ] ) * gain[ i ];
+                    }
+                }
+            }
+        }
+
+        /*!
+        * Correct a_input into a_output, including metadata. Returns HYSPEX_INVALID_ARGUMENTS if a_input does not match the tables.
+        * With HYSPEX_LAYOUT_BIP the output data is spatial x spectral ( sizes in the ImageLine are unchanged, layout is set ),
+        * see applyTransposed().
+        */
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( a_input.spectral_size != m_spectralSize || a_input.buffer.size != size() ||
+                a_input.buffer.size != static_cast< size_t >( a_input.spectral_size ) * a_input.spatial_size ||
+                ( a_layout != HYSPEX_LAYOUT_BIL && a_layout != HYSPEX_LAYOUT_BIP ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            a_output.resize( a_input.spectral_size, a_input.spatial_size );
+            a_output.copyMetadata( a_input );
+            a_output.setLayout( a_layout );
+            if( a_layout == HYSPEX_LAYOUT_BIP )
+            {
+                applyTransposed( a_input.buffer.data, a_output.data(), a_input.spectral_size, a_input.spatial_size );
+            }
+            else
+            {
+                apply( a_input.buffer.data, a_output.data(), a_input.buffer.size );
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        template< typename T >
+        ReturnCode fillTables( const T* a_background, size_t a_backgroundSize, const T* a_re, size_t a_reSize, uint32_t a_spectralSize, uint32_t a_spatialSize, float a_scale )
+        {
+            const size_t size = static_cast< size_t >( a_spectralSize ) * a_spatialSize;
+            if( size == 0 || ( a_background && a_backgroundSize != size ) || ( a_re && a_reSize != size ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            m_offset.assign( size, 0.0f );
+            m_gain.assign( size, a_scale );
+
+            for( size_t i = 0; i < size; i++ )
+            {
+                if( a_background )
+                {
+                    m_offset[ i ] = static_cast< float >( a_background[ i ] );
+                }
+                if( a_re )
+                {
+                    // pixels without responsivity are set to 0.0 rather than inf.
+                    m_gain[ i ] = a_re[ i ] != 0.0 ? static_cast< float >( a_scale / a_re[ i ] ) : 0.0f;
+                }
+            }
+            m_baseGain = m_gain;
+            m_spectralSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            m_bandFactors.clear();
+            m_elementFactors.clear();
+            return HYSPEX_OK;
+        }
+
+        //! m_gain = m_baseGain * band factor * element factor.
+        void updateGains()
+        {
+            m_gain = m_baseGain;
+            if( !m_bandFactors.empty() )
+            {
+                const size_t spatial_size = m_spatialSize;
+                for( size_t y = 0; y < m_bandFactors.size(); y++ )
+                {
+                    float* gain = m_gain.data() + y * spatial_size;
+                    for( size_t x = 0; x < spatial_size; x++ )
+                    {
+                        gain[ x ] *= m_bandFactors[ y ];
+                    }
+                }
+            }
+            for( size_t i = 0; i < m_elementFactors.size(); i++ )
+            {
+                m_gain[ i ] *= m_elementFactors[ i ];
+            }
+        }
+
+        std::vector< float > m_offset; //!< Background per element.
+        std::vector< float > m_gain; //!< Gain per element.
+        std::vector< float > m_baseGain; //!< Gain per element without factors.
+        std::vector< float > m_bandFactors; //!< Factor per band, empty if not used.
+        std::vector< float > m_elementFactors; //!< Factor per element, empty if not used.
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of tables.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of tables.
+    };
+}
+
+#endif // HYSPEX_FLOATCORRECTION_H
@@ -0,0 +1,163 @@
+#ifndef HYSPEX_FLOATCUBEWRITER_H
+#define HYSPEX_FLOATCUBEWRITER_H
+#pragma once
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Writes float frames as an ENVI float32 BIL cube ( <base>.raw and <base>.hdr ), like the ENVI files next to a .hyspex recording.
+    * Frames written with HYSPEX_LAYOUT_BIP are written as a BIP cube, all frames must have the same layout.
+    *
+    * FileWriter stores unsigned short frames of the camera band layout. Derived products with other "bands"
+    * ( components, abundances, indices ) are written with this class instead. Frames are written as they arrive,
+    * the header with the final line count on close(). Extra header fields can be added before close().
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::FloatCubeWriter writer;
+    * writer.open( "scene_abundances" );
+    * writer.setBandNames( { "calcite", "kaolinite" } );
+    * writer.writeFrame( abundances.line() );
+    * writer.close();
+    * @endcode
+    */
+    class FloatCubeWriter
+    {
+    public:
+        FloatCubeWriter()
+        {
+        }
+
+        ~FloatCubeWriter() { close(); }
+
+        //! Create a_baseName.raw. Closes a cube already open.
+        bool open( const std::string& a_baseName )
+        {
+            close();
+            m_file.open( a_baseName + ".raw", std::ios::binary | std::ios::trunc );
+            if( !m_file )
+            {
+                return false;
+            }
+            m_baseName = a_baseName;
+            m_description.clear();
+            m_bandNames.clear();
+            m_fields.clear();
+            m_lines = 0;
+            m_bands = 0;
+            m_samples = 0;
+            m_layout = HYSPEX_LAYOUT_BIL;
+            m_open = true;
+            return true;
+        }
+
+        bool isOpen() const { return m_open; } //!< Cube is open.
+        uint64_t getLineCount() const { return m_lines; } //!< Frames written.
+        void setDescription( const std::string& a_description ) { m_description = a_description; } //!< ENVI description.
+        void setBandNames( const std::vector< std::string >& a_names ) { m_bandNames = a_names; } //!< ENVI band names, one per band.
+
+        //! Add "a_name = a_value" to the header.
+        void addHeaderField( const std::string& a_name, const std::string& a_value )
+        {
+            m_fields.push_back( a_name + " = " + a_value );
+        }
+
+        //! Add "a_name = { values }" to the header.
+        void addHeaderField( const std::string& a_name, const std::vector< float >& a_values )
+        {
+            std::string field = a_name + " = {";
+            char value[ 32 ];
+            for( size_t i = 0; i < a_values.size(); i++ )
+            {
+                std::snprintf( value, sizeof( value ), "%s%.9g", i ? ", " : " ", a_values[ i ] );
+                field += value;
+            }
+            m_fields.push_back( field + " }" );
+        }
+
+        //! Append one frame ( bands x spatial, or spatial x bands for BIP ), all frames must have the same size and layout.
+        bool writeFrame( const ImageLine< float >& a_frame, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( !m_open || a_frame.buffer.size != static_cast< size_t >( a_frame.spectral_size ) * a_frame.spatial_size ||
+                ( a_layout != HYSPEX_LAYOUT_BIL && a_layout != HYSPEX_LAYOUT_BIP ) ||
+                ( m_lines > 0 && ( a_frame.spectral_size != m_bands || a_frame.spatial_size != m_samples || a_layout != m_layout ) ) )
+            {
+                return false;
+            }
+            m_bands = a_frame.spectral_size;
+            m_samples = a_frame.spatial_size;
+            m_layout = a_layout;
+            m_file.write( reinterpret_cast< const char* >( a_frame.buffer.data ), a_frame.buffer.size * sizeof( float ) );
+            m_lines++;
+            return static_cast< bool >( m_file );
+        }
+
+        //! Close cube and write a_baseName.hdr.
+        bool close()
+        {
+            if( !m_open )
+            {
+                return false;
+            }
+            m_open = false;
+            m_file.close();
+            return !m_file.fail() && writeHeader();
+        }
+
+    private:
+        // disallow copy-constructors
+        FloatCubeWriter( const FloatCubeWriter& that );
+        FloatCubeWriter& operator=( const FloatCubeWriter& that );
+
+        bool writeHeader() const
+        {
+            std::ofstream header( m_baseName + ".hdr", std::ios::trunc );
+            header << "ENVI\n";
+            if( !m_description.empty() )
+            {
+                header << "description = { " << m_description << " }\n";
+            }
+            header << "samples = " << m_samples << "\n";
+            header << "lines = " << m_lines << "\n";
+            header << "bands = " << m_bands << "\n";
+            header << "header offset = 0\n";
+            header << "file type = ENVI Standard\n";
+            header << "data type = 4\n";
+            header << ( m_layout == HYSPEX_LAYOUT_BIP ? "interleave = bip\n" : "interleave = bil\n" );
+            header << "byte order = 0\n";
+            if( m_bandNames.size() == m_bands && m_bands > 0 )
+            {
+                header << "band names = {";
+                for( size_t b = 0; b < m_bandNames.size(); b++ )
+                {
+                    header << ( b ? ", " : " " ) << m_bandNames[ b ];
+                }
+                header << " }\n";
+            }
+            for( size_t i = 0; i < m_fields.size(); i++ )
+            {
+                header << m_fields[ i ] << "\n";
+            }
+            return static_cast< bool >( header );
+        }
+
+        std::ofstream m_file; //!< Cube file.
+        std::string m_baseName; //!< Path without extension.
+        std::string m_description; //!< ENVI description.
+        std::vector< std::string > m_bandNames; //!< ENVI band names.
+        std::vector< std::string > m_fields; //!< Extra header lines.
+        uint64_t m_lines{ 0 }; //!< Frames written.
+        uint32_t m_bands{ 0 }; //!< Bands per frame.
+        uint32_t m_samples{ 0 }; //!< Spatial size.
+        ImageLayout m_layout{ HYSPEX_LAYOUT_BIL }; //!< Layout of frames.
+        bool m_open{ false }; //!< m_file is open.
+    };
+}
+
+#endif // HYSPEX_FLOATCUBEWRITER_H
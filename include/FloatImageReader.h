@@ -0,0 +1,320 @@
+#ifndef HYSPEX_FLOATIMAGEREADER_H
+#define HYSPEX_FLOATIMAGEREADER_H
+#pragma once
+#include <atomic>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "FloatCorrection.h"
+#include "TemperatureCompensation.h"
+#include "ReflectanceConversion.h"
+
+namespace hyspex
+{
+    /*!
+    * Image options to request from the library when producing float images for a_options.
+    * Background and responsivity correction is done by FloatCorrection, so only bad pixel correction is requested.
+    */
+    inline ImageOptions floatInputOptions( ImageOptions a_options )
+    {
+        switch( a_options )
+        {
+            case HYSPEX_RAW:
+            case HYSPEX_HSNR_RAW:
+                return a_options;
+            case HYSPEX_HSNR_RE:
+            case HYSPEX_HSNR_RAW_BP:
+                return HYSPEX_HSNR_RAW_BP;
+            default:
+                return HYSPEX_RAW_BP;
+        }
+    }
+
+    /*!
+    * @brief Reads float32 images from a Camera.
+    *
+    * Same as Camera::getNextImage(), but corrected modes are delivered as ImageLine< float > without rounding to unsigned short.
+    * The conversion to float is fused into the correction ( see FloatCorrection ), so there is no extra pass or buffer.
+    * setLayout( HYSPEX_LAYOUT_BIP ) delivers one spectrum per pixel for per pixel consumers, transposed in the same pass.
+    * The ImageLine does not carry the layout, pass getLayout() to the consumer: SpectralMatcher, Unmixer and FloatCubeWriter
+    * accept both, other consumers return HYSPEX_INVALID_ARGUMENTS for HYSPEX_LAYOUT_BIP.
+    * An empty image is returned on timeout or error, getStatus() tells which.
+    * Use one instance per reading thread, just like Camera::getNextImage().
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::FloatImageReader reader( camera );
+    * for( int i = 0; i < 100; i++ )
+    * {
+    *     const hyspex::ImageLine< float >& image = reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    *     if( image.buffer.size == 0 )
+    *     {
+    *         if( reader.getStatus() == hyspex::HYSPEX_TIMEOUT_REACHED )
+    *         {
+    *             continue;
+    *         }
+    *         break; // e.g. HYSPEX_SETTING_NOT_FOUND, no RE matrix for HYSPEX_RE.
+    *     }
+    *     float value = image.buffer.data[ y * image.spatial_size + x ];
+    * }
+    * reader.releaseImage();
+    * @endcode
+    */
+    class FloatImageReader
+    {
+    public:
+        FloatImageReader( Camera* a_camera ) : m_camera( a_camera )
+        {
+        }
+
+        //! Get next image from camera as float. Returns an image with buffer.size == 0 on timeout or error, see getStatus(). The image is valid until next call.
+        const ImageLine< float >& getNextImage( ImageOptions a_options = HYSPEX_RE, uint32_t a_timeoutMs = 0 )
+        {
+            if( !m_camera )
+            {
+                m_status = HYSPEX_INVALID_HANDLE;
+                return m_empty;
+            }
+
+            const ImageLine< unsigned short >& image = m_camera->getNextImage( floatInputOptions( a_options ), a_timeoutMs );
+            if( image.buffer.size == 0 )
+            {
+                m_status = HYSPEX_TIMEOUT_REACHED;
+                return m_empty;
+            }
+
+            bool prepared = false;
+            if( m_invalid.exchange( false ) || a_options != m_preparedOptions || image.buffer.size != m_correction.size() )
+            {
+                m_status = m_correction.prepare( m_camera, a_options );
+                if( m_status != HYSPEX_OK )
+                {
+                    // tables are not usable, try again on the next image.
+                    m_invalid = true;
+                    return m_empty;
+                }
+                m_preparedOptions = a_options;
+                prepared = true;
+            }
+            if( prepared )
+            {
+                m_compensated = false;
+            }
+            if( m_compensation && ( m_compensation->update( m_camera ) || !m_compensated ) )
+            {
+                m_status = m_compensation->applyTo( m_correction );
+                if( m_status == HYSPEX_NOT_ACTIVE )
+                {
+                    // no temperature yet, the tables are fine but not compensated. Try again on the next image.
+                    m_compensated = false;
+                    return m_empty;
+                }
+                if( m_status != HYSPEX_OK )
+                {
+                    // e.g. model bands do not match the image, do not deliver uncompensated images.
+                    m_invalid = true;
+                    return m_empty;
+                }
+                m_compensated = true;
+            }
+            if( m_reflectance && ( prepared || m_reflectance->getGeneration() != m_reflectanceGeneration ) )
+            {
+                m_status = m_reflectance->applyTo( m_correction );
+                if( m_status != HYSPEX_OK )
+                {
+                    // no or mismatched white reference, do not deliver radiance as reflectance.
+                    m_invalid = true;
+                    return m_empty;
+                }
+                m_reflectanceGeneration = m_reflectance->getGeneration();
+            }
+
+            m_status = m_correction.apply( image, m_output, m_layout );
+            if( m_status != HYSPEX_OK )
+            {
+                return m_empty;
+            }
+            return m_output.line();
+        }
+
+        //! Result of the last getNextImage(): HYSPEX_OK, HYSPEX_TIMEOUT_REACHED or the error that gave an empty image. HYSPEX_NOT_ACTIVE while temperature compensation has no temperature yet.
+        ReturnCode getStatus() const { return m_status; }
+
+        void invalidate() { m_invalid = true; } //!< Rebuild correction tables on next image, call this after a new background has been calculated. Thread-safe.
+        void setTemperatureCompensation( TemperatureCompensation* a_compensation ) { m_compensation = a_compensation; m_invalid = true; } //!< Apply live temperature compensation, nullptr to disable. Call from the reading thread.
+        void setReflectanceConversion( ReflectanceConversion* a_reflectance ) { m_reflectance = a_reflectance; m_invalid = true; } //!< Output reflectance instead of radiance, nullptr to disable. Needs a white reference of the image size. Call from the reading thread.
+        void setLayout( ImageLayout a_layout ) { m_layout = a_layout; } //!< Deliver frames as BIL ( default ) or BIP, transposed in the correction pass. Call from the reading thread.
+        ImageLayout getLayout() const { return m_layout; } //!< Layout of delivered frames.
+        void releaseImage() { if( m_camera ) { m_camera->releaseImage(); } } //!< See Camera::releaseImage().
+
+    private:
+        // disallow copy-constructors
+        FloatImageReader( const FloatImageReader& that );
+        FloatImageReader& operator=( const FloatImageReader& that );
+
+        Camera* m_camera{ nullptr }; //!< Camera to read from.
+        FloatCorrection m_correction; //!< Correction tables.
+        TemperatureCompensation* m_compensation{ nullptr }; //!< Optional temperature compensation.
+        ReflectanceConversion* m_reflectance{ nullptr }; //!< Optional reflectance conversion.
+        uint64_t m_reflectanceGeneration{ 0 }; //!< White reference generation folded into m_correction.
+        ImageBuffer< float > m_output; //!< Current image.
+        ImageLine< float > m_empty{}; //!< Returned on timeout.
+        ImageOptions m_preparedOptions{ HYSPEX_RAW }; //!< Options m_correction was prepared for.
+        ImageLayout m_layout{ HYSPEX_LAYOUT_BIL }; //!< Layout of delivered frames.
+        ReturnCode m_status{ HYSPEX_OK }; //!< Result of last getNextImage().
+        bool m_compensated{ false }; //!< Temperature compensation is folded into m_correction.
+        std::atomic_bool m_invalid{ true }; //!< Set when tables must be rebuilt.
+    };
+
+    /*!
+    * @brief Convenience class to receive float32 images through Camera::registerImageCallback().
+    *
+    * Subclass and implement imageReceived(). The conversion runs on the library callback thread.
+    * Images that can not be corrected are not delivered, getStatus() returns the error ( HYSPEX_NOT_ACTIVE while temperature
+    * compensation has no temperature yet ).
+    * NB: Camera::unregisterImageCallback() removes by function, so only use one instance per Camera.
+    *
+    * EXAMPLE:
+    * @code
+    * class RadianceConsumer : public hyspex::FloatImageCallback
+    * {
+    * public:
+    *     ~RadianceConsumer() { setCameraForCallback( nullptr ); }
+    *     void imageReceived( hyspex::ImageOptions a_options, const hyspex::ImageLine< float >& a_image ) override
+    *     {
+    *         // do stuff with image here.
+    *     }
+    * };
+    *
+    * RadianceConsumer consumer;
+    * consumer.setCameraForCallback( camera, hyspex::HYSPEX_RE );
+    * @endcode
+    */
+    class FloatImageCallback
+    {
+    public:
+        FloatImageCallback() : m_callback( FloatImageCallback::callback_router )
+        {
+        }
+
+        //! Set camera to receive images from, nullptr to stop receiving.
+        bool setCameraForCallback( Camera* a_camera, ImageOptions a_options = HYSPEX_RE )
+        {
+            if( m_camera )
+            {
+                m_camera->unregisterImageCallback( m_callback );
+                m_camera = nullptr;
+            }
+
+            if( a_camera )
+            {
+                m_camera = a_camera;
+                m_options = a_options;
+                m_invalid = true;
+                m_camera->registerImageCallback( m_callback, floatInputOptions( a_options ), this );
+                return true;
+            }
+            return false;
+        }
+
+        void invalidate() { m_invalid = true; } //!< Rebuild correction tables on next image, call this after a new background has been calculated. Thread-safe.
+        void setTemperatureCompensation( TemperatureCompensation* a_compensation ) { m_compensation = a_compensation; m_invalid = true; } //!< Apply live temperature compensation, nullptr to disable. Call before setCameraForCallback().
+        void setReflectanceConversion( ReflectanceConversion* a_reflectance ) { m_reflectance = a_reflectance; m_invalid = true; } //!< Output reflectance instead of radiance, nullptr to disable. Call before setCameraForCallback().
+        void setLayout( ImageLayout a_layout ) { m_layout = a_layout; } //!< Deliver frames as BIL ( default ) or BIP, transposed in the correction pass. Call before setCameraForCallback().
+        ImageLayout getLayout() const { return m_layout; } //!< Layout of delivered frames.
+        ReturnCode getStatus() const { return m_status; } //!< HYSPEX_OK, or the error that stopped the last image from being delivered ( HYSPEX_NOT_ACTIVE: no temperature yet ). Thread-safe.
+
+        //! Called for each image.
+        virtual void imageReceived( ImageOptions /* a_options */, const ImageLine< float >& /* a_image */ )
+        {
+            // implement this so that we do not get virtual pointer nullreference error.
+        }
+
+        virtual ~FloatImageCallback()
+        {
+            setCameraForCallback( nullptr );
+        }
+
+    protected:
+        //! Route callback to correct instance.
+        static void HYSPEX_CB_CALLING_CONVENTION callback_router( void* a_handle, ImageOptions /* a_options */, const ImageLine< unsigned short >& a_image )
+        {
+            FloatImageCallback* cb = reinterpret_cast< FloatImageCallback* >( a_handle );
+            if( a_image.buffer.size == 0 || !cb->m_camera )
+            {
+                return;
+            }
+
+            bool prepared = false;
+            if( cb->m_invalid.exchange( false ) || a_image.buffer.size != cb->m_correction.size() )
+            {
+                const ReturnCode result = cb->m_correction.prepare( cb->m_camera, cb->m_options );
+                if( result != HYSPEX_OK )
+                {
+                    // tables are not usable, try again on the next image.
+                    cb->m_invalid = true;
+                    cb->m_status = result;
+                    return;
+                }
+                prepared = true;
+            }
+            if( prepared )
+            {
+                cb->m_compensated = false;
+            }
+            if( cb->m_compensation && ( cb->m_compensation->update( cb->m_camera ) || !cb->m_compensated ) )
+            {
+                const ReturnCode result = cb->m_compensation->applyTo( cb->m_correction );
+                if( result == HYSPEX_NOT_ACTIVE )
+                {
+                    // no temperature yet, the tables are fine but not compensated. Try again on the next image.
+                    cb->m_compensated = false;
+                    cb->m_status = result;
+                    return;
+                }
+                if( result != HYSPEX_OK )
+                {
+                    // e.g. model bands do not match the image, do not deliver uncompensated images.
+                    cb->m_invalid = true;
+                    cb->m_status = result;
+                    return;
+                }
+                cb->m_compensated = true;
+            }
+            if( cb->m_reflectance && ( prepared || cb->m_reflectance->getGeneration() != cb->m_reflectanceGeneration ) )
+            {
+                const ReturnCode result = cb->m_reflectance->applyTo( cb->m_correction );
+                if( result != HYSPEX_OK )
+                {
+                    // no or mismatched white reference, do not deliver radiance as reflectance.
+                    cb->m_invalid = true;
+                    cb->m_status = result;
+                    return;
+                }
+                cb->m_reflectanceGeneration = cb->m_reflectance->getGeneration();
+            }
+
+            const ReturnCode result = cb->m_correction.apply( a_image, cb->m_output, cb->m_layout );
+            cb->m_status = result;
+            if( result == HYSPEX_OK )
+            {
+                cb->imageReceived( cb->m_options, cb->m_output.line() );
+            }
+        }
+
+        imageCallBackFnType m_callback{ nullptr }; //!< Callback function
+        Camera* m_camera{ nullptr }; //!< Camera we are registered with.
+        ImageOptions m_options{ HYSPEX_RE }; //!< Requested options.
+        FloatCorrection m_correction; //!< Correction tables.
+        TemperatureCompensation* m_compensation{ nullptr }; //!< Optional temperature compensation.
+        ReflectanceConversion* m_reflectance{ nullptr }; //!< Optional reflectance conversion.
+        uint64_t m_reflectanceGeneration{ 0 }; //!< White reference generation folded into m_correction.
+        ImageBuffer< float > m_output; //!< Current image.
+        ImageLayout m_layout{ HYSPEX_LAYOUT_BIL }; //!< Layout of delivered frames.
+        std::atomic< ReturnCode > m_status{ HYSPEX_OK }; //!< Result of last image.
+        bool m_compensated{ false }; //!< Temperature compensation is folded into m_correction.
+        std::atomic_bool m_invalid{ true }; //!< Set when tables must be rebuilt.
+    };
+}
+
+#endif // HYSPEX_FLOATIMAGEREADER_H
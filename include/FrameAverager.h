@@ -0,0 +1,537 @@
+#ifndef HYSPEX_FRAMEAVERAGER_H
+#define HYSPEX_FRAMEAVERAGER_H
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "ProcessingGraph.h"
+
+namespace hyspex
+{
+    /*!
+    * Averaging modes for FrameAverager.
+    */
+    typedef enum
+    {
+        HYSPEX_AVERAGE_BOXCAR = 0,     //!< Average of each block of frames, one output per block ( like setAverageFrames() ).
+        HYSPEX_AVERAGE_SLIDING = 1,    //!< Average of the last frames, output every output_interval frames.
+        HYSPEX_AVERAGE_EXPONENTIAL = 2 //!< Exponential moving average with time constant frames ( rounded to power of two ), output every output_interval frames.
+    } AveragingMode;
+
+    /*!
+    * Settings for FrameAverager and AveragingEngine slots.
+    */
+    struct AveragingConfig
+    {
+        AveragingMode mode{ HYSPEX_AVERAGE_BOXCAR }; //!< Averaging mode.
+        uint32_t frames{ 8 };                        //!< Frames to average ( 1 - 32768 ), time constant for exponential.
+        uint32_t output_interval{ 1 };               //!< Sliding and exponential: output every n frames once the window is full.
+        ImageOptions options{ HYSPEX_RAW_BP };       //!< AveragingEngine: image options to read from camera.
+        size_t queue_size{ 8 };                      //!< AveragingEngine: max averaged images waiting to be read, the oldest is dropped when full.
+    };
+
+    /*!
+    * @brief Temporal averaging of unsigned short frames with uint32 SIMD accumulators.
+    *
+    * Boxcar and sliding window keep exact integer sums, the sliding window subtracts the frame leaving the window.
+    * Exponential averaging uses 16.16 fixed point: acc += ( x << 16 - acc ) >> k, with frames = 2^k.
+    * Output is rounded to unsigned short with the metadata of the newest frame.
+    * Not thread-safe, see AveragingEngine for averaging in the background.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::AveragingConfig config;
+    * config.mode = hyspex::HYSPEX_AVERAGE_SLIDING;
+    * config.frames = 16;
+    * hyspex::FrameAverager averager;
+    * averager.configure( config );
+    *
+    * const hyspex::ImageLine< unsigned short >& image = camera->getNextImage( hyspex::HYSPEX_RAW_BP );
+    * if( averager.addFrame( image ) )
+    * {
+    *     const hyspex::ImageLine< unsigned short >& average = averager.getOutput();
+    * }
+    * @endcode
+    */
+    class FrameAverager
+    {
+    public:
+        //! Apply settings and reset.
+        ReturnCode configure( const AveragingConfig& a_config )
+        {
+            if( a_config.frames == 0 || a_config.frames > 32768 || a_config.output_interval == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_config = a_config;
+            m_shift = 0;
+            while( ( 1u << ( m_shift + 1 ) ) <= a_config.frames )
+            {
+                m_shift++;
+            }
+            reset();
+            return HYSPEX_OK;
+        }
+
+        const AveragingConfig& getConfig() const { return m_config; } //!< Current settings.
+
+        //! Clear accumulators.
+        void reset()
+        {
+            m_accumulator.clear();
+            m_history.clear();
+            m_frames = 0;
+            m_next = 0;
+            m_sinceOutput = 0;
+        }
+
+        //! Add frame, returns true when a new average is available from getOutput(). Size changes reset the accumulators.
+        bool addFrame( const ImageLine< unsigned short >& a_image )
+        {
+            const size_t size = a_image.buffer.size;
+            if( size == 0 || size != static_cast< uint64_t >( a_image.spectral_size ) * a_image.spatial_size )
+            {
+                return false;
+            }
+            if( size != m_accumulator.size() || a_image.spatial_size != m_output.line().spatial_size )
+            {
+                reset();
+                m_accumulator.assign( size, 0 );
+                m_history.assign( m_config.mode == HYSPEX_AVERAGE_SLIDING ? size * m_config.frames : 0, 0 );
+                m_output.resize( a_image.spectral_size, a_image.spatial_size );
+            }
+
+            const unsigned short* input = a_image.buffer.data;
+            switch( m_config.mode )
+            {
+                case HYSPEX_AVERAGE_BOXCAR:
+                    accumulate( input, nullptr, size );
+                    m_frames++;
+                    if( m_frames < m_config.frames )
+                    {
+                        return false;
+                    }
+                    writeMean( m_frames );
+                    std::fill( m_accumulator.begin(), m_accumulator.end(), 0u );
+                    m_frames = 0;
+                    break;
+
+                case HYSPEX_AVERAGE_SLIDING:
+                {
+                    unsigned short* slot = &m_history[ m_next * size ];
+                    accumulate( input, m_frames == m_config.frames ? slot : nullptr, size );
+                    std::copy( input, input + size, slot );
+                    m_next = ( m_next + 1 ) % m_config.frames;
+                    m_frames = std::min( m_frames + 1, m_config.frames );
+                    if( m_frames < m_config.frames || ++m_sinceOutput < m_config.output_interval )
+                    {
+                        return false;
+                    }
+                    writeMean( m_frames );
+                    break;
+                }
+
+                case HYSPEX_AVERAGE_EXPONENTIAL:
+                    exponential( input, size, m_frames == 0 );
+                    m_frames = std::min( m_frames + 1, m_config.frames );
+                    if( ++m_sinceOutput < m_config.output_interval )
+                    {
+                        return false;
+                    }
+                    writeExponential();
+                    break;
+            }
+
+            m_sinceOutput = 0;
+            m_output.copyMetadata( a_image );
+            return true;
+        }
+
+        const ImageLine< unsigned short >& getOutput() const { return m_output.line(); } //!< Latest average, valid until next addFrame().
+        uint32_t getFrameCount() const { return m_frames; } //!< Frames currently accumulated.
+
+    private:
+        //! Add a_input to sums, and subtract a_remove if not null.
+        void accumulate( const unsigned short* a_input, const unsigned short* a_remove, size_t a_size )
+        {
+            uint32_t* sum = m_accumulator.data();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                __m256i s = _mm256_add_epi32( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum + i ) ),
+                                              _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_input + i ) ) ) );
+                if( a_remove )
+                {
+                    s = _mm256_sub_epi32( s, _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_remove + i ) ) ) );
+                }
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( sum + i ), s );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                sum[ i ] += a_input[ i ];
+                if( a_remove )
+                {
+                    sum[ i ] -= a_remove[ i ];
+                }
+            }
+        }
+
+        //! acc = acc - ( acc >> k ) + ( x << ( 16 - k ) ), which converges to x << 16. a_first initializes to the first frame.
+        void exponential( const unsigned short* a_input, size_t a_size, bool a_first )
+        {
+            uint32_t* acc = m_accumulator.data();
+            const int shift = static_cast< int >( m_shift );
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m128i count = _mm_cvtsi32_si128( shift );
+            const __m128i input_count = _mm_cvtsi32_si128( a_first ? 16 : 16 - shift );
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                const __m256i x = _mm256_sll_epi32( _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_input + i ) ) ), input_count );
+                __m256i a = a_first ? _mm256_setzero_si256() : _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + i ) );
+                a = _mm256_add_epi32( _mm256_sub_epi32( a, _mm256_srl_epi32( a, count ) ), x );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( acc + i ), a );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                const uint32_t x = static_cast< uint32_t >( a_input[ i ] );
+                acc[ i ] = a_first ? x << 16 : acc[ i ] - ( acc[ i ] >> shift ) + ( x << ( 16 - shift ) );
+            }
+        }
+
+        //! Output = round( sum / a_frames ).
+        void writeMean( uint32_t a_frames )
+        {
+            const uint32_t* sum = m_accumulator.data();
+            unsigned short* output = m_output.data();
+            const size_t size = m_accumulator.size();
+            const float inverse = 1.0f / static_cast< float >( a_frames );
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256 inverse_v = _mm256_set1_ps( inverse );
+            for( ; i + 16 <= size; i += 16 )
+            {
+                // sums are below 2^31 since frames <= 32768, so the signed conversion is exact in range.
+                const __m256i lo = _mm256_cvtps_epi32( _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum + i ) ) ), inverse_v ) );
+                const __m256i hi = _mm256_cvtps_epi32( _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sum + i + 8 ) ) ), inverse_v ) );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( output + i ), _mm256_permute4x64_epi64( _mm256_packus_epi32( lo, hi ), 0xD8 ) );
+            }
+#endif
+            for( ; i < size; i++ )
+            {
+                const float value = std::nearbyint( static_cast< float >( static_cast< int32_t >( sum[ i ] ) ) * inverse );
+                output[ i ] = static_cast< unsigned short >( std::min( value, 65535.0f ) );
+            }
+        }
+
+        //! Output = ( acc + 0.5 ) >> 16.
+        void writeExponential()
+        {
+            const uint32_t* acc = m_accumulator.data();
+            unsigned short* output = m_output.data();
+            const size_t size = m_accumulator.size();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256i half = _mm256_set1_epi32( 0x8000 );
+            for( ; i + 16 <= size; i += 16 )
+            {
+                const __m256i lo = _mm256_srli_epi32( _mm256_add_epi32( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + i ) ), half ), 16 );
+                const __m256i hi = _mm256_srli_epi32( _mm256_add_epi32( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + i + 8 ) ), half ), 16 );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( output + i ), _mm256_permute4x64_epi64( _mm256_packus_epi32( lo, hi ), 0xD8 ) );
+            }
+#endif
+            for( ; i < size; i++ )
+            {
+                output[ i ] = static_cast< unsigned short >( std::min( ( acc[ i ] + 0x8000u ) >> 16, 65535u ) );
+            }
+        }
+
+        AveragingConfig m_config; //!< Settings.
+        uint32_t m_shift{ 3 }; //!< Exponential: log2 of frames.
+        uint32_t m_frames{ 0 }; //!< Frames accumulated.
+        uint32_t m_next{ 0 }; //!< Sliding: next history slot.
+        uint32_t m_sinceOutput{ 0 }; //!< Frames since last output.
+        std::vector< uint32_t > m_accumulator; //!< Sums or fixed point average.
+        std::vector< unsigned short > m_history; //!< Sliding: frames in window.
+        ImageBuffer< unsigned short > m_output; //!< Latest average.
+    };
+
+    /*!
+    * @brief Runs several FrameAverager slots in the background and delivers averaged images like Camera::getNextImage().
+    *
+    * One reader thread per ImageOptions feeds all slots using those options, so acquisition is never blocked and the camera frame
+    * rate is kept. Each slot queues its averaged images; when a slot is not read fast enough, its oldest image is dropped.
+    * Read each slot from one thread only.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::AveragingEngine engine( camera );
+    * hyspex::AveragingConfig fast;
+    * fast.mode = hyspex::HYSPEX_AVERAGE_SLIDING;
+    * fast.frames = 4;
+    * hyspex::AveragingConfig slow;
+    * slow.mode = hyspex::HYSPEX_AVERAGE_BOXCAR;
+    * slow.frames = 64;
+    * int fast_slot = engine.addSlot( fast );
+    * int slow_slot = engine.addSlot( slow );
+    * engine.start();
+    * camera->startAcquisition();
+    *
+    * const hyspex::ImageLine< unsigned short >& image = engine.getNextImage( slow_slot, 1000 );
+    * if( image.buffer.size > 0 )
+    * {
+    *     // do stuff with image here.
+    * }
+    * engine.releaseImage( slow_slot );
+    * @endcode
+    */
+    class AveragingEngine
+    {
+    public:
+        AveragingEngine( Camera* a_camera ) : m_camera( a_camera )
+        {
+        }
+
+        ~AveragingEngine()
+        {
+            stop();
+        }
+
+        //! Add slot, returns slot id, or -1 if invalid or engine is running.
+        int addSlot( const AveragingConfig& a_config )
+        {
+            if( m_running || a_config.queue_size == 0 )
+            {
+                return -1;
+            }
+            std::unique_ptr< Slot > slot( new Slot( a_config.queue_size ) );
+            if( slot->averager.configure( a_config ) != HYSPEX_OK )
+            {
+                return -1;
+            }
+            m_slots.push_back( std::move( slot ) );
+            return static_cast< int >( m_slots.size() - 1 );
+        }
+
+        //! Start reading from camera. Camera acquisition is started separately.
+        ReturnCode start()
+        {
+            if( !m_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+
+            m_terminate = false;
+            m_running = true;
+            std::vector< ImageOptions > options;
+            for( auto& slot : m_slots )
+            {
+                slot->averager.reset();
+                if( std::find( options.begin(), options.end(), slot->averager.getConfig().options ) == options.end() )
+                {
+                    options.push_back( slot->averager.getConfig().options );
+                }
+            }
+            for( ImageOptions option : options )
+            {
+                m_threads.emplace_back( &AveragingEngine::readerThread, this, option );
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Stop reading. Queued images can still be read.
+        ReturnCode stop()
+        {
+            if( !m_running )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            m_terminate = true;
+            for( auto& thread : m_threads )
+            {
+                thread.join();
+            }
+            m_threads.clear();
+            m_running = false;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Get next averaged image from a_slot, returns an image with buffer.size == 0 on timeout.
+        * The image is valid until the next call for the same slot.
+        */
+        const ImageLine< unsigned short >& getNextImage( int a_slot, uint32_t a_timeoutMs = 0 )
+        {
+            if( a_slot < 0 || a_slot >= static_cast< int >( m_slots.size() ) )
+            {
+                return m_empty;
+            }
+
+            Slot& slot = *m_slots[ a_slot ];
+            releaseImage( a_slot );
+            const auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds( a_timeoutMs );
+            unsigned int attempt = 0;
+            while( !slot.ready.tryPop( slot.current ) )
+            {
+                if( std::chrono::steady_clock::now() >= deadline )
+                {
+                    return m_empty;
+                }
+                backoff( attempt );
+            }
+            return slot.current->line();
+        }
+
+        //! Return image from last getNextImage() on a_slot to the pool.
+        void releaseImage( int a_slot )
+        {
+            if( a_slot >= 0 && a_slot < static_cast< int >( m_slots.size() ) && m_slots[ a_slot ]->current )
+            {
+                Slot& slot = *m_slots[ a_slot ];
+                if( !slot.free.tryPush( slot.current ) )
+                {
+                    delete slot.current;
+                }
+                slot.current = nullptr;
+            }
+        }
+
+        uint64_t getDroppedImages( int a_slot ) const { return validSlot( a_slot ) ? m_slots[ a_slot ]->dropped.load() : 0; } //!< Averaged images dropped because a_slot was not read.
+        uint64_t getProducedImages( int a_slot ) const { return validSlot( a_slot ) ? m_slots[ a_slot ]->produced.load() : 0; } //!< Averaged images produced by a_slot.
+        size_t getSlotCount() const { return m_slots.size(); } //!< Number of slots.
+        bool isRunning() const { return m_running; } //!< True if started.
+
+    private:
+        struct Slot : public CacheAligned
+        {
+            Slot( size_t a_queueSize ) : ready( a_queueSize ), free( a_queueSize + 2 )
+            {
+            }
+
+            ~Slot()
+            {
+                ImageBuffer< unsigned short >* buffer = nullptr;
+                while( ready.tryPop( buffer ) )
+                {
+                    delete buffer;
+                }
+                while( free.tryPop( buffer ) )
+                {
+                    delete buffer;
+                }
+                delete current;
+            }
+
+            FrameAverager averager; //!< Used by reader thread only.
+            BoundedQueue< ImageBuffer< unsigned short >* > ready; //!< Averaged images waiting to be read.
+            BoundedQueue< ImageBuffer< unsigned short >* > free; //!< Buffers for reuse.
+            ImageBuffer< unsigned short >* current{ nullptr }; //!< Image returned by getNextImage().
+            std::atomic< uint64_t > dropped{ 0 }; //!< Images dropped.
+            std::atomic< uint64_t > produced{ 0 }; //!< Images produced.
+        };
+
+        // disallow copy-constructors
+        AveragingEngine( const AveragingEngine& that );
+        AveragingEngine& operator=( const AveragingEngine& that );
+
+        bool validSlot( int a_slot ) const { return a_slot >= 0 && a_slot < static_cast< int >( m_slots.size() ); }
+
+        //! Back off while waiting for a queue, spin first, then yield, then sleep.
+        static void backoff( unsigned int& a_attempt )
+        {
+            if( a_attempt < 64 )
+            {
+                a_attempt++;
+            }
+            else if( a_attempt < 128 )
+            {
+                a_attempt++;
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+            }
+        }
+
+        //! Queue latest output of a_slot, dropping the oldest queued image if the queue is full.
+        static void publish( Slot& a_slot )
+        {
+            ImageBuffer< unsigned short >* buffer = nullptr;
+            if( !a_slot.free.tryPop( buffer ) )
+            {
+                buffer = new ImageBuffer< unsigned short >();
+            }
+            const ImageLine< unsigned short >& output = a_slot.averager.getOutput();
+            buffer->resize( output.spectral_size, output.spatial_size );
+            buffer->copyMetadata( output );
+            std::copy( output.buffer.data, output.buffer.data + output.buffer.size, buffer->data() );
+
+            while( !a_slot.ready.tryPush( buffer ) )
+            {
+                ImageBuffer< unsigned short >* oldest = nullptr;
+                if( a_slot.ready.tryPop( oldest ) )
+                {
+                    a_slot.dropped++;
+                    if( !a_slot.free.tryPush( oldest ) )
+                    {
+                        delete oldest;
+                    }
+                }
+            }
+            a_slot.produced++;
+        }
+
+        void readerThread( ImageOptions a_options )
+        {
+            std::vector< Slot* > slots;
+            for( auto& slot : m_slots )
+            {
+                if( slot->averager.getConfig().options == a_options )
+                {
+                    slots.push_back( slot.get() );
+                }
+            }
+
+            while( !m_terminate )
+            {
+                const ImageLine< unsigned short >& image = m_camera->getNextImage( a_options, 100 );
+                if( image.buffer.size == 0 )
+                {
+                    // got timeout on wait, retry.
+                    continue;
+                }
+                for( Slot* slot : slots )
+                {
+                    if( slot->averager.addFrame( image ) )
+                    {
+                        publish( *slot );
+                    }
+                }
+            }
+            m_camera->releaseImage();
+        }
+
+        Camera* m_camera{ nullptr }; //!< Camera to read from.
+        std::vector< std::unique_ptr< Slot > > m_slots; //!< Slots in order of addSlot().
+        std::vector< std::thread > m_threads; //!< Reader threads.
+        ImageLine< unsigned short > m_empty{}; //!< Returned on timeout.
+        std::atomic_bool m_terminate{ true }; //!< Set to stop threads.
+        bool m_running{ false }; //!< True between start() and stop().
+    };
+}
+
+#endif // HYSPEX_FRAMEAVERAGER_H
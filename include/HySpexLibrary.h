@@ -38,6 +38,35 @@
  *  - libXIMC ( for Standa stages support ).
  *  - Performax ( for Newmark stages support ).
  *
+ *  Header-only processing helpers ( not included by this file, include them as needed ):
+ *  - FloatImageReader.h: float32 images from Camera::getNextImage() and Camera::registerImageCallback(), in BIL or BIP layout.
+ *  - SaturationMask.h: bit-packed saturation mask and per-frame saturation summary from the library saturation vectors.
+ *  - ProcessingGraph.h: user processing stages on worker threads with bounded lock-free queues.
+ *  - SoftwareBinning.h: spatial/spectral binning and spectral band subsetting for cameras without hardware support.
+ *  - BandMath.h: spectral index expressions ( e.g. NDVI ) compiled once and evaluated on whole frames.
+ *  - FileBatch.h: run the same per-image code on images from FileReader ( batch mode ).
+ *  - SpectralResampler.h: resample whole frames to another wavelength grid and FWHM with precomputed sparse per band or per pixel kernels.
+ *  - SpectraBatch.h: [ spatial, samples ] float32 batches of resampled, normalized spectra for inference.
+ *  - SmileKeystoneCorrection.h: resample frames onto a smile and keystone free grid from the spectral and spatial calibration.
+ *  - BackgroundEstimator.h: sliding window background and standard deviation from dark frames, published lock-free.
+ *  - BackgroundCache.h: in-memory and on-disk background cache keyed by exposure, binning, ROI and sensor temperature.
+ *  - FrameAverager.h: boxcar, sliding window and exponential frame averaging, with concurrent averaging slots read like Camera::getNextImage().
+ *  - TemperatureCompensation.h: live sensor temperature compensation with cached per-bucket band factors, used by FloatImageReader.
+ *  - ReflectanceConversion.h: radiance to reflectance from an averaged white reference panel, fused into FloatCorrection or applied to recorded radiance.
+ *  - Destriping.h: streaming column destriping from sliding window band / column statistics, live or in batch mode.
+ *  - AnomalyDetection.h: streaming RX anomaly scores and top-k pixels per frame from incrementally updated mean and covariance.
+ *  - SpectralStatistics.h: incremental mean and covariance of pixel spectra, shared by the detectors and projections.
+ *  - DimensionReduction.h: online PCA / MNF projection to a few components, and an ENVI float32 writer for the reduced cube with its basis.
+ *  - SpectralMatcher.h: SAM / SID matching of every pixel against a preloaded ( USGS splib07 ) spectral library resampled to the camera bands.
+ *  - Unmixing.h: non-negative, sum-to-one linear unmixing against library endmembers, per frame or for a whole FileReader across threads.
+ *  - FloatCubeWriter.h: writing derived float frames ( abundances, components ) as ENVI float32 BIL cubes.
+ *  - SpectralFilter.h: Savitzky-Golay smoothing / spectral derivatives and other spectral convolutions with precomputed per band kernels.
+ *  - AcquisitionGroup.h: several cameras with shared triggering, started together and delivered / recorded as timestamp matched frame tuples.
+ *  - SpectralFusion.h: VNIR / SWIR fusion onto the VNIR spatial grid with a crossover wavelength.
+ *  - CameraStartup.h: parallel camera detection and initialization with per phase timings.
+ *  - CalibrationCache.h: memory-mapped binary cache of calibration matrices, invalidated by .set file content hash.
+ *  - CalibrationMatrices.h: float32 calibration matrices converted on first access, per lens.
+ *
  *  Notes:
  *  - Installing a version of Teledyne DALSA Sapera LT newer than 8.2 will break compatibility with older (pre 4.x) versions of HySpex Ground.
  *  - This version of the library is intended to be used with a computer that supports Intel(R) AVX(R) instructions. If support for older hardware is desired, please contact us.
@@ -0,0 +1,274 @@
+#ifndef HYSPEX_IMAGEBUFFER_H
+#define HYSPEX_IMAGEBUFFER_H
+#pragma once
+#include <cstddef>
+#include <utility>
+#include <vector>
+#include "datatypes.h"
+
+// The header-only processing helpers use AVX2 when the compiler targets it ( /arch:AVX2 or -mavx2 ),
+// and fall back to plain C++ otherwise. Define HYSPEX_PROCESSING_NO_SIMD to force the fallback.
+#if defined( __AVX2__ ) && !defined( HYSPEX_PROCESSING_NO_SIMD )
+#define HYSPEX_PROCESSING_AVX2
+#include <immintrin.h>
+#endif
+
+namespace hyspex
+{
+    /*!
+    * Memory layout of frames from the header-only readers. ImageLine does not carry it: float consumers take it as an
+    * argument ( HYSPEX_LAYOUT_BIL by default ), and ImageBuffer keeps it next to its line ( getLayout() ).
+    */
+    typedef enum
+    {
+        HYSPEX_LAYOUT_BIL = 0, //!< Band interleaved by line, as from the camera: data[ y * spatial_size + x ].
+        HYSPEX_LAYOUT_BIP = 1  //!< Band interleaved by pixel, one spectrum per pixel: data[ x * spectral_size + y ].
+    } ImageLayout;
+
+    /*!
+    * @brief Owning storage for an ImageLine produced by the header-only processing helpers.
+    *
+    * Images returned by Camera::getNextImage() are owned by the library and only valid until the next call from the same thread.
+    * This class keeps a processed image (and a copy of its saturation vectors) alive and exposes it as a regular ImageLine.
+    * The data layout is the same as for the camera: spectral lines after each other, spatial pixels contiguous.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::ImageBuffer< float > output;
+    * const hyspex::ImageLine< unsigned short >& image = camera->getNextImage( hyspex::HYSPEX_RAW_BP );
+    *
+    * output.resize( image.spectral_size, image.spatial_size );
+    * output.copyMetadata( image );
+    * for( size_t i = 0; i < image.buffer.size; i++ )
+    * {
+    *     output.data()[ i ] = static_cast< float >( image.buffer.data[ i ] );
+    * }
+    * const hyspex::ImageLine< float >& line = output.line();
+    * @endcode
+    */
+    template< typename T >
+    class ImageBuffer
+    {
+    public:
+        ImageBuffer() = default;
+
+        ImageBuffer( const ImageBuffer& a_other ) : m_data( a_other.m_data )
+                                                  , m_saturated( a_other.m_saturated )
+                                                  , m_maxSaturation( a_other.m_maxSaturation )
+                                                  , m_line( a_other.m_line )
+                                                  , m_layout( a_other.m_layout )
+        {
+            updatePointers();
+        }
+
+        ImageBuffer& operator=( const ImageBuffer& a_other )
+        {
+            m_data = a_other.m_data;
+            m_saturated = a_other.m_saturated;
+            m_maxSaturation = a_other.m_maxSaturation;
+            m_line = a_other.m_line;
+            m_layout = a_other.m_layout;
+            updatePointers();
+            return *this;
+        }
+
+        ImageBuffer( ImageBuffer&& a_other ) noexcept : m_data( std::move( a_other.m_data ) )
+                                                      , m_saturated( std::move( a_other.m_saturated ) )
+                                                      , m_maxSaturation( std::move( a_other.m_maxSaturation ) )
+                                                      , m_line( a_other.m_line )
+                                                      , m_layout( a_other.m_layout )
+        {
+            updatePointers();
+            a_other.updatePointers();
+        }
+
+        ImageBuffer& operator=( ImageBuffer&& a_other ) noexcept
+        {
+            m_data = std::move( a_other.m_data );
+            m_saturated = std::move( a_other.m_saturated );
+            m_maxSaturation = std::move( a_other.m_maxSaturation );
+            m_line = a_other.m_line;
+            m_layout = a_other.m_layout;
+            updatePointers();
+            a_other.updatePointers();
+            return *this;
+        }
+
+        /*!
+        * Resize to a_spectralSize x a_spatialSize elements. Capacity is kept, so resizing to the same size every frame does not allocate.
+        * The layout is reset to HYSPEX_LAYOUT_BIL, producers of other layouts call setLayout() after resizing.
+        */
+        void resize( uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            m_data.resize( static_cast< size_t >( a_spectralSize ) * a_spatialSize );
+            m_line.spectral_size = a_spectralSize;
+            m_line.spatial_size = a_spatialSize;
+            m_layout = HYSPEX_LAYOUT_BIL;
+            updatePointers();
+        }
+
+        void setLayout( ImageLayout a_layout ) { m_layout = a_layout; } //!< Layout of the data, pass getLayout() along with line() to consumers.
+        ImageLayout getLayout() const { return m_layout; } //!< Layout of the data.
+
+        //! Copy statistics, stage metadata, timestamps and saturation vectors from a_source. Image data, sizes and layout are not touched.
+        template< typename U >
+        void copyMetadata( const ImageLine< U >& a_source )
+        {
+            m_line.stat.frame_number = a_source.stat.frame_number;
+            m_line.stat.read_lost_frames = a_source.stat.read_lost_frames;
+            m_line.stat.behind_frames = a_source.stat.behind_frames;
+            m_line.stat.processing_time_spent_us = a_source.stat.processing_time_spent_us;
+            m_line.stage.valid = a_source.stage.valid;
+            m_line.stage.moving = a_source.stage.moving;
+            m_line.stage.target_speed_reached = a_source.stage.target_speed_reached;
+            m_line.timestamp_ns = a_source.timestamp_ns;
+            m_line.timestamp_host_ns = a_source.timestamp_host_ns;
+            m_line.missed_triggers = a_source.missed_triggers;
+            m_line.aborted_write = a_source.aborted_write;
+
+            m_saturated.assign( a_source.saturated.data, a_source.saturated.data + ( a_source.saturated.data ? a_source.saturated.size : 0 ) );
+            m_maxSaturation.assign( a_source.max_saturation.data, a_source.max_saturation.data + ( a_source.max_saturation.data ? a_source.max_saturation.size : 0 ) );
+            updatePointers();
+        }
+
+        T* data() { return m_data.data(); } //!< Writable image data.
+        const T* data() const { return m_data.data(); } //!< Read-only image data.
+        size_t size() const { return m_data.size(); } //!< Number of elements in image data.
+        const ImageLine< T >& line() const { return m_line; } //!< Image as ImageLine, valid until this buffer is resized or destroyed.
+
+    private:
+        void updatePointers()
+        {
+            m_line.buffer.size = m_data.size();
+            m_line.buffer.data = m_data.data();
+            m_line.saturated.size = m_saturated.size();
+            m_line.saturated.data = m_saturated.empty() ? nullptr : m_saturated.data();
+            m_line.max_saturation.size = m_maxSaturation.size();
+            m_line.max_saturation.data = m_maxSaturation.empty() ? nullptr : m_maxSaturation.data();
+        }
+
+        std::vector< T > m_data; //!< Image data.
+        std::vector< T > m_saturated; //!< Copy of saturation vector.
+        std::vector< T > m_maxSaturation; //!< Copy of max saturation vector.
+        ImageLine< T > m_line{}; //!< View into the vectors above.
+        ImageLayout m_layout{ HYSPEX_LAYOUT_BIL }; //!< Layout of m_data.
+    };
+
+    //! Convert a_size elements from unsigned short to float.
+    inline void convertToFloat( const unsigned short* a_input, float* a_output, size_t a_size )
+    {
+        size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+        for( ; i + 16 <= a_size; i += 16 )
+        {
+            const __m256i raw = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_input + i ) );
+            _mm256_storeu_ps( a_output + i,     _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_castsi256_si128( raw ) ) ) );
+            _mm256_storeu_ps( a_output + i + 8, _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm256_extracti128_si256( raw, 1 ) ) ) );
+        }
+#endif
+        for( ; i < a_size; i++ )
+        {
+            a_output[ i ] = static_cast< float >( a_input[ i ] );
+        }
+    }
+
+#ifdef HYSPEX_PROCESSING_AVX2
+    //! Transpose 8 x 8 floats held in a_rows in registers.
+    inline void transpose8x8( __m256* a_rows )
+    {
+        const __m256 t0 = _mm256_unpacklo_ps( a_rows[ 0 ], a_rows[ 1 ] );
+        const __m256 t1 = _mm256_unpackhi_ps( a_rows[ 0 ], a_rows[ 1 ] );
+        const __m256 t2 = _mm256_unpacklo_ps( a_rows[ 2 ], a_rows[ 3 ] );
+        const __m256 t3 = _mm256_unpackhi_ps( a_rows[ 2 ], a_rows[ 3 ] );
+        const __m256 t4 = _mm256_unpacklo_ps( a_rows[ 4 ], a_rows[ 5 ] );
+        const __m256 t5 = _mm256_unpackhi_ps( a_rows[ 4 ], a_rows[ 5 ] );
+        const __m256 t6 = _mm256_unpacklo_ps( a_rows[ 6 ], a_rows[ 7 ] );
+        const __m256 t7 = _mm256_unpackhi_ps( a_rows[ 6 ], a_rows[ 7 ] );
+        const __m256 s0 = _mm256_shuffle_ps( t0, t2, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+        const __m256 s1 = _mm256_shuffle_ps( t0, t2, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+        const __m256 s2 = _mm256_shuffle_ps( t1, t3, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+        const __m256 s3 = _mm256_shuffle_ps( t1, t3, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+        const __m256 s4 = _mm256_shuffle_ps( t4, t6, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+        const __m256 s5 = _mm256_shuffle_ps( t4, t6, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+        const __m256 s6 = _mm256_shuffle_ps( t5, t7, _MM_SHUFFLE( 1, 0, 1, 0 ) );
+        const __m256 s7 = _mm256_shuffle_ps( t5, t7, _MM_SHUFFLE( 3, 2, 3, 2 ) );
+        a_rows[ 0 ] = _mm256_permute2f128_ps( s0, s4, 0x20 );
+        a_rows[ 1 ] = _mm256_permute2f128_ps( s1, s5, 0x20 );
+        a_rows[ 2 ] = _mm256_permute2f128_ps( s2, s6, 0x20 );
+        a_rows[ 3 ] = _mm256_permute2f128_ps( s3, s7, 0x20 );
+        a_rows[ 4 ] = _mm256_permute2f128_ps( s0, s4, 0x31 );
+        a_rows[ 5 ] = _mm256_permute2f128_ps( s1, s5, 0x31 );
+        a_rows[ 6 ] = _mm256_permute2f128_ps( s2, s6, 0x31 );
+        a_rows[ 7 ] = _mm256_permute2f128_ps( s3, s7, 0x31 );
+    }
+#endif
+
+    /*!
+    * Transpose a_rows x a_columns elements from a_input into a_output ( a_columns x a_rows ).
+    * Done in blocks, so both reads and writes stay in cache for large frames.
+    */
+    template< typename T >
+    void transposeImage( const T* a_input, size_t a_rows, size_t a_columns, T* a_output )
+    {
+        const size_t block = 32;
+        for( size_t r0 = 0; r0 < a_rows; r0 += block )
+        {
+            const size_t r1 = r0 + block < a_rows ? r0 + block : a_rows;
+            for( size_t c0 = 0; c0 < a_columns; c0 += block )
+            {
+                const size_t c1 = c0 + block < a_columns ? c0 + block : a_columns;
+                for( size_t r = r0; r < r1; r++ )
+                {
+                    for( size_t c = c0; c < c1; c++ )
+                    {
+                        a_output[ c * a_rows + r ] = a_input[ r * a_columns + c ];
+                    }
+                }
+            }
+        }
+    }
+
+    //! Same as above for float, with 8 x 8 blocks transposed in registers when AVX2 is available.
+    inline void transposeImage( const float* a_input, size_t a_rows, size_t a_columns, float* a_output )
+    {
+#ifdef HYSPEX_PROCESSING_AVX2
+        const size_t rows = a_rows - a_rows % 8;
+        const size_t columns = a_columns - a_columns % 8;
+        for( size_t c0 = 0; c0 < columns; c0 += 8 )
+        {
+            for( size_t r0 = 0; r0 < rows; r0 += 8 )
+            {
+                __m256 block[ 8 ];
+                for( size_t k = 0; k < 8; k++ )
+                {
+                    block[ k ] = _mm256_loadu_ps( a_input + ( r0 + k ) * a_columns + c0 );
+                }
+                transpose8x8( block );
+                for( size_t k = 0; k < 8; k++ )
+                {
+                    _mm256_storeu_ps( a_output + ( c0 + k ) * a_rows + r0, block[ k ] );
+                }
+            }
+        }
+        // edges: remaining rows of the full columns, then the remaining columns.
+        for( size_t r = rows; r < a_rows; r++ )
+        {
+            for( size_t c = 0; c < columns; c++ )
+            {
+                a_output[ c * a_rows + r ] = a_input[ r * a_columns + c ];
+            }
+        }
+        for( size_t r = 0; r < a_rows; r++ )
+        {
+            for( size_t c = columns; c < a_columns; c++ )
+            {
+                a_output[ c * a_rows + r ] = a_input[ r * a_columns + c ];
+            }
+        }
+#else
+        transposeImage< float >( a_input, a_rows, a_columns, a_output );
+#endif
+    }
+}
+
+#endif // HYSPEX_IMAGEBUFFER_H
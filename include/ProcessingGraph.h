@@ -0,0 +1,730 @@
+#ifndef HYSPEX_PROCESSINGGRAPH_H
+#define HYSPEX_PROCESSINGGRAPH_H
+#pragma once
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * Base for types with cache line aligned members ( alignas( 64 ) ), so new honours the alignment also before C++17 aligned new.
+    * Types holding such a type by value and allocated with new derive from it as well.
+    */
+    struct CacheAligned
+    {
+        static const size_t c_cacheLine = 64; //!< Alignment of allocations.
+
+        static void* operator new( size_t a_size )
+        {
+            // over-allocate, align, and keep the block start just before the returned address.
+            void* block = ::operator new( a_size + c_cacheLine + sizeof( void* ) );
+            const uintptr_t address = ( reinterpret_cast< uintptr_t >( block ) + sizeof( void* ) + c_cacheLine - 1 ) & ~static_cast< uintptr_t >( c_cacheLine - 1 );
+            reinterpret_cast< void** >( address )[ -1 ] = block;
+            return reinterpret_cast< void* >( address );
+        }
+
+        static void operator delete( void* a_pointer )
+        {
+            if( a_pointer )
+            {
+                ::operator delete( static_cast< void** >( a_pointer )[ -1 ] );
+            }
+        }
+    };
+
+    /*!
+    * @brief Bounded lock-free multi-producer multi-consumer queue.
+    *
+    * Capacity is rounded up to a power of two. Each slot carries a sequence number,
+    * so producers and consumers only contend on one atomic index each ( D. Vyukov's bounded MPMC queue ).
+    * The indices are on their own cache lines, so the queue is 64 byte aligned ( see CacheAligned ).
+    */
+    template< typename T >
+    class BoundedQueue : public CacheAligned
+    {
+    public:
+        BoundedQueue( size_t a_capacity )
+        {
+            size_t capacity = 2;
+            while( capacity < a_capacity )
+            {
+                capacity *= 2;
+            }
+            m_mask = capacity - 1;
+            m_slots = std::unique_ptr< Slot[] >( new Slot[ capacity ] );
+            for( size_t i = 0; i < capacity; i++ )
+            {
+                m_slots[ i ].sequence.store( i, std::memory_order_relaxed );
+            }
+        }
+
+        //! Push a_value, returns false if queue is full.
+        bool tryPush( const T& a_value )
+        {
+            size_t position = m_enqueue.load( std::memory_order_relaxed );
+            for( ;; )
+            {
+                Slot& slot = m_slots[ position & m_mask ];
+                const size_t sequence = slot.sequence.load( std::memory_order_acquire );
+                const intptr_t difference = static_cast< intptr_t >( sequence ) - static_cast< intptr_t >( position );
+                if( difference == 0 )
+                {
+                    if( m_enqueue.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) )
+                    {
+                        slot.value = a_value;
+                        slot.sequence.store( position + 1, std::memory_order_release );
+                        return true;
+                    }
+                }
+                else if( difference < 0 )
+                {
+                    return false;
+                }
+                else
+                {
+                    position = m_enqueue.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        //! Pop into a_value, returns false if queue is empty.
+        bool tryPop( T& a_value )
+        {
+            size_t position = m_dequeue.load( std::memory_order_relaxed );
+            for( ;; )
+            {
+                Slot& slot = m_slots[ position & m_mask ];
+                const size_t sequence = slot.sequence.load( std::memory_order_acquire );
+                const intptr_t difference = static_cast< intptr_t >( sequence ) - static_cast< intptr_t >( position + 1 );
+                if( difference == 0 )
+                {
+                    if( m_dequeue.compare_exchange_weak( position, position + 1, std::memory_order_relaxed ) )
+                    {
+                        a_value = slot.value;
+                        slot.sequence.store( position + m_mask + 1, std::memory_order_release );
+                        return true;
+                    }
+                }
+                else if( difference < 0 )
+                {
+                    return false;
+                }
+                else
+                {
+                    position = m_dequeue.load( std::memory_order_relaxed );
+                }
+            }
+        }
+
+        //! Approximate number of elements in queue.
+        size_t size() const
+        {
+            const size_t enqueue = m_enqueue.load( std::memory_order_relaxed );
+            const size_t dequeue = m_dequeue.load( std::memory_order_relaxed );
+            return enqueue > dequeue ? enqueue - dequeue : 0;
+        }
+
+        size_t capacity() const { return m_mask + 1; } //!< Capacity of queue.
+
+    private:
+        struct Slot
+        {
+            std::atomic< size_t > sequence;
+            T value;
+        };
+
+        // disallow copy-constructors
+        BoundedQueue( const BoundedQueue& that );
+        BoundedQueue& operator=( const BoundedQueue& that );
+
+        std::unique_ptr< Slot[] > m_slots; //!< Ring buffer.
+        size_t m_mask{ 0 }; //!< Capacity - 1.
+        // producer and consumer index on their own cache lines.
+        alignas( 64 ) std::atomic< size_t > m_enqueue{ 0 }; //!< Next position to write.
+        alignas( 64 ) std::atomic< size_t > m_dequeue{ 0 }; //!< Next position to read.
+    };
+
+    /*!
+    * @brief Persistent worker threads that split one job into tasks, for per-frame work that is too short for new threads.
+    *
+    * run() hands tasks 0 - a_tasks-1 to the workers and the calling thread, which claim them one at a time, and returns when
+    * all are done. Idle workers back off like the ProcessingGraph queues ( spin, yield, then sleep ).
+    * Not thread-safe: call run() from one thread.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::WorkerPool pool;
+    * pool.setThreads( 4 );
+    * std::vector< float > sums( pool.getThreads() ); // per worker scratch
+    * pool.run( blocks, [&]( size_t a_task, unsigned int a_worker ) { sums[ a_worker ] += process( a_task ); } );
+    * @endcode
+    */
+    class WorkerPool
+    {
+    public:
+        typedef std::function< void( size_t a_task, unsigned int a_worker ) > Job; //!< Task function, a_worker < getThreads().
+
+        WorkerPool()
+        {
+        }
+
+        ~WorkerPool() { stop(); }
+
+        //! Threads including the calling thread, 0 for one per core. Running workers are stopped, new ones start on the next run().
+        void setThreads( unsigned int a_threads )
+        {
+            stop();
+            m_threads = a_threads == 0 ? std::max( 1u, std::thread::hardware_concurrency() ) : a_threads;
+        }
+
+        unsigned int getThreads() const { return m_threads; } //!< Threads including the calling thread.
+
+        //! Call a_job( task, worker ) for every task in 0 - a_tasks-1 and wait for all of them.
+        void run( size_t a_tasks, const Job& a_job )
+        {
+            if( m_threads <= 1 || a_tasks <= 1 )
+            {
+                for( size_t task = 0; task < a_tasks; task++ )
+                {
+                    a_job( task, 0 );
+                }
+                return;
+            }
+            if( m_workers.empty() )
+            {
+                start();
+            }
+
+            // close the task counter first, so a worker that wakes late can not claim a task of the new job early.
+            m_next = c_closed;
+            m_job = &a_job;
+            m_tasks = a_tasks;
+            m_finished = 0;
+            m_next = 0;
+            m_generation++;
+
+            work( 0 );
+            m_next = c_closed;
+            // also wait for workers still inside work(), so none of them sees the next job with a stale claim.
+            unsigned int attempt = 0;
+            while( m_finished.load() < a_tasks || m_busy.load() > 0 )
+            {
+                backoff( attempt );
+            }
+        }
+
+    private:
+        static const size_t c_closed = static_cast< size_t >( 1 ) << ( sizeof( size_t ) * 8 - 2 ); //!< Task counter value without tasks.
+
+        // disallow copy-constructors
+        WorkerPool( const WorkerPool& that );
+        WorkerPool& operator=( const WorkerPool& that );
+
+        //! Back off while waiting, spin first, then yield, then sleep.
+        static void backoff( unsigned int& a_attempt )
+        {
+            if( a_attempt < 64 )
+            {
+                a_attempt++;
+            }
+            else if( a_attempt < 128 )
+            {
+                a_attempt++;
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+            }
+        }
+
+        void start()
+        {
+            m_terminate = false;
+            for( unsigned int w = 1; w < m_threads; w++ )
+            {
+                m_workers.emplace_back( &WorkerPool::workerThread, this, w );
+            }
+        }
+
+        void stop()
+        {
+            m_terminate = true;
+            for( auto& worker : m_workers )
+            {
+                worker.join();
+            }
+            m_workers.clear();
+        }
+
+        //! Claim and run tasks of the current job until none are left.
+        void work( unsigned int a_worker )
+        {
+            for( ;; )
+            {
+                const size_t task = m_next.fetch_add( 1 );
+                if( task >= m_tasks.load() )
+                {
+                    return;
+                }
+                ( *m_job )( task, a_worker );
+                m_finished++;
+            }
+        }
+
+        void workerThread( unsigned int a_worker )
+        {
+            uint64_t generation = m_generation.load();
+            unsigned int attempt = 0;
+            while( !m_terminate )
+            {
+                if( m_generation.load() == generation )
+                {
+                    backoff( attempt );
+                    continue;
+                }
+                generation = m_generation.load();
+                attempt = 0;
+                m_busy++;
+                work( a_worker );
+                m_busy--;
+            }
+        }
+
+        unsigned int m_threads{ 1 }; //!< Threads including the caller.
+        std::vector< std::thread > m_workers; //!< Worker threads 1 - m_threads-1.
+        const Job* m_job{ nullptr }; //!< Current job, valid during run().
+        std::atomic< size_t > m_tasks{ 0 }; //!< Tasks of the current job.
+        std::atomic< size_t > m_next{ c_closed }; //!< Next task to claim.
+        std::atomic< size_t > m_finished{ 0 }; //!< Tasks done.
+        std::atomic< unsigned int > m_busy{ 0 }; //!< Workers inside work().
+        std::atomic< uint64_t > m_generation{ 0 }; //!< Incremented for every job.
+        std::atomic_bool m_terminate{ false }; //!< Set to stop workers.
+    };
+
+    /*!
+    * What to do when a stage queue is full.
+    */
+    typedef enum
+    {
+        HYSPEX_QUEUE_BLOCK = 0,       //!< Wait until there is room ( backpressure ). The camera buffers frames meanwhile, check ImageLine::stat.read_lost_frames.
+        HYSPEX_QUEUE_DROP_NEWEST = 1, //!< Drop the incoming frame.
+        HYSPEX_QUEUE_DROP_OLDEST = 2  //!< Drop the oldest queued frame to make room for the incoming frame.
+    } QueuePolicy;
+
+    /*!
+    * Frame passed between processing stages.
+    */
+    struct ProcessingFrame
+    {
+        ImageOptions options;          //!< Options the image was read with.
+        ImageBuffer< unsigned short > image; //!< Copy of image from camera.
+        ImageBuffer< float > output;   //!< Free for use by stages, for instance float or index images.
+        uint64_t source_time_ns;       //!< steady_clock time when the image was read from camera.
+        std::atomic< int > references; //!< Internal: number of queues / workers holding the frame.
+    };
+
+    /*!
+    * Stage function, return false to stop the frame from being passed to downstream stages.
+    * If a stage has more than one downstream stage, they share the frame and must not modify it.
+    */
+    typedef std::function< bool( ProcessingFrame& a_frame ) > ProcessingStageFunction;
+
+    /*!
+    * Configuration for one processing stage.
+    */
+    struct ProcessingStageConfig
+    {
+        std::string name;                   //!< Name, for logging.
+        ProcessingStageFunction function;   //!< Function to call for every frame.
+        ImageOptions options{ HYSPEX_RAW }; //!< Image options to read from camera, ignored if input_stage >= 0.
+        unsigned int threads{ 1 };          //!< Worker threads. With more than one thread, frames may complete out of order.
+        size_t queue_size{ 64 };            //!< Max number of frames waiting in the input queue ( rounded up to power of two ).
+        QueuePolicy policy{ HYSPEX_QUEUE_BLOCK }; //!< What to do when input queue is full.
+        int input_stage{ -1 };              //!< Stage to receive frames from, -1 to read directly from camera.
+    };
+
+    /*!
+    * Statistics for one processing stage.
+    */
+    typedef struct
+    {
+        uint64_t processed;           //!< Frames processed.
+        uint64_t dropped;             //!< Frames dropped because queue was full.
+        uint64_t queue_depth;         //!< Frames currently waiting in input queue.
+        uint64_t max_queue_depth;     //!< Max frames waiting in input queue.
+        double average_processing_us; //!< Average time spent in stage function.
+        double average_latency_us;    //!< Average time from image read from camera until stage function returned.
+        uint64_t max_latency_us;      //!< Max time from image read from camera until stage function returned.
+    } ProcessingStageStatistics;
+
+    /*!
+    * @brief Runs user processing stages on their own worker threads.
+    *
+    * Heavy processing in an image callback stalls the thread delivering images. This class reads images from the camera
+    * on its own threads ( one per ImageOptions used ), copies them into pooled frames and passes them through bounded lock-free
+    * queues to the registered stages. Each stage runs on its own workers, and can feed downstream stages.
+    * Full queues are handled by the stage QueuePolicy.
+    *
+    * This class is not thread-safe: add stages before start(), statistics may be read from any thread.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::ProcessingGraph graph( camera );
+    *
+    * hyspex::ProcessingStageConfig correction;
+    * correction.name = "correction";
+    * correction.options = hyspex::HYSPEX_RE;
+    * correction.function = []( hyspex::ProcessingFrame& a_frame ) { return true; }; // do stuff with a_frame.image here.
+    * int first = graph.addStage( correction );
+    *
+    * hyspex::ProcessingStageConfig analytics;
+    * analytics.name = "analytics";
+    * analytics.threads = 4;
+    * analytics.policy = hyspex::HYSPEX_QUEUE_DROP_OLDEST;
+    * analytics.input_stage = first;
+    * analytics.function = []( hyspex::ProcessingFrame& a_frame ) { return true; };
+    * int second = graph.addStage( analytics );
+    *
+    * graph.start();
+    * camera->startAcquisition();
+    * // ...
+    * camera->stopAcquisition();
+    * graph.stop();
+    *
+    * hyspex::ProcessingStageStatistics stats;
+    * graph.getStageStatistics( second, &stats );
+    * @endcode
+    */
+    class ProcessingGraph : public CacheAligned
+    {
+    public:
+        ProcessingGraph( Camera* a_camera ) : m_camera( a_camera ), m_pool( 1024 )
+        {
+        }
+
+        ~ProcessingGraph()
+        {
+            stop();
+            ProcessingFrame* frame = nullptr;
+            while( m_pool.tryPop( frame ) )
+            {
+                delete frame;
+            }
+        }
+
+        //! Add stage, returns stage id, or -1 if invalid or graph is running.
+        int addStage( const ProcessingStageConfig& a_config )
+        {
+            if( m_running || !a_config.function || a_config.threads == 0 || a_config.queue_size == 0 ||
+                a_config.input_stage >= static_cast< int >( m_stages.size() ) )
+            {
+                return -1;
+            }
+
+            std::unique_ptr< Stage > stage( new Stage( a_config ) );
+            const int id = static_cast< int >( m_stages.size() );
+            if( a_config.input_stage >= 0 )
+            {
+                m_stages[ a_config.input_stage ]->children.push_back( stage.get() );
+            }
+            else
+            {
+                sourceFor( a_config.options ).children.push_back( stage.get() );
+            }
+            m_stages.push_back( std::move( stage ) );
+            return id;
+        }
+
+        size_t getStageCount() const { return m_stages.size(); } //!< Number of stages.
+        bool isRunning() const { return m_running; } //!< True if started.
+
+        //! Start reading from camera and processing. Camera acquisition is started separately.
+        ReturnCode start()
+        {
+            if( !m_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( m_running )
+            {
+                return HYSPEX_ALREADY_ACTIVE;
+            }
+
+            m_terminate = false;
+            m_running = true;
+            for( auto& stage : m_stages )
+            {
+                for( unsigned int i = 0; i < stage->config.threads; i++ )
+                {
+                    m_threads.emplace_back( &ProcessingGraph::workerThread, this, stage.get() );
+                }
+            }
+            for( auto& source : m_sources )
+            {
+                m_threads.emplace_back( &ProcessingGraph::sourceThread, this, source.get() );
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Stop reading and processing, frames still in queues are discarded.
+        ReturnCode stop()
+        {
+            if( !m_running )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+
+            m_terminate = true;
+            for( auto& thread : m_threads )
+            {
+                thread.join();
+            }
+            m_threads.clear();
+
+            for( auto& stage : m_stages )
+            {
+                ProcessingFrame* frame = nullptr;
+                while( stage->queue.tryPop( frame ) )
+                {
+                    release( frame );
+                }
+            }
+            m_running = false;
+            return HYSPEX_OK;
+        }
+
+        //! Get statistics for stage a_stage.
+        ReturnCode getStageStatistics( int a_stage, ProcessingStageStatistics* a_stats ) const
+        {
+            if( !a_stats || a_stage < 0 || a_stage >= static_cast< int >( m_stages.size() ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const Stage& stage = *m_stages[ a_stage ];
+            const uint64_t processed = stage.processed.load();
+            a_stats->processed = processed;
+            a_stats->dropped = stage.dropped.load();
+            a_stats->queue_depth = stage.queue.size();
+            a_stats->max_queue_depth = stage.max_queue_depth.load();
+            a_stats->average_processing_us = processed ? static_cast< double >( stage.processing_ns.load() ) / processed / 1000.0 : 0.0;
+            a_stats->average_latency_us = processed ? static_cast< double >( stage.latency_ns.load() ) / processed / 1000.0 : 0.0;
+            a_stats->max_latency_us = stage.max_latency_ns.load() / 1000;
+            return HYSPEX_OK;
+        }
+
+    private:
+        struct Stage : public CacheAligned
+        {
+            Stage( const ProcessingStageConfig& a_config ) : config( a_config ), queue( a_config.queue_size )
+            {
+            }
+
+            ProcessingStageConfig config;
+            BoundedQueue< ProcessingFrame* > queue;
+            std::vector< Stage* > children;
+            std::atomic< uint64_t > processed{ 0 };
+            std::atomic< uint64_t > dropped{ 0 };
+            std::atomic< uint64_t > max_queue_depth{ 0 };
+            std::atomic< uint64_t > processing_ns{ 0 };
+            std::atomic< uint64_t > latency_ns{ 0 };
+            std::atomic< uint64_t > max_latency_ns{ 0 };
+        };
+
+        struct Source
+        {
+            ImageOptions options;
+            std::vector< Stage* > children;
+        };
+
+        // disallow copy-constructors
+        ProcessingGraph( const ProcessingGraph& that );
+        ProcessingGraph& operator=( const ProcessingGraph& that );
+
+        static uint64_t nowNs()
+        {
+            return static_cast< uint64_t >( std::chrono::duration_cast< std::chrono::nanoseconds >( std::chrono::steady_clock::now().time_since_epoch() ).count() );
+        }
+
+        static void updateMax( std::atomic< uint64_t >& a_max, uint64_t a_value )
+        {
+            uint64_t current = a_max.load( std::memory_order_relaxed );
+            while( a_value > current && !a_max.compare_exchange_weak( current, a_value, std::memory_order_relaxed ) )
+            {
+            }
+        }
+
+        //! Back off while waiting for a queue, spin first, then yield, then sleep.
+        static void backoff( unsigned int& a_attempt )
+        {
+            if( a_attempt < 64 )
+            {
+                a_attempt++;
+            }
+            else if( a_attempt < 128 )
+            {
+                a_attempt++;
+                std::this_thread::yield();
+            }
+            else
+            {
+                std::this_thread::sleep_for( std::chrono::microseconds( 100 ) );
+            }
+        }
+
+        Source& sourceFor( ImageOptions a_options )
+        {
+            for( auto& source : m_sources )
+            {
+                if( source->options == a_options )
+                {
+                    return *source;
+                }
+            }
+            m_sources.push_back( std::unique_ptr< Source >( new Source() ) );
+            m_sources.back()->options = a_options;
+            return *m_sources.back();
+        }
+
+        ProcessingFrame* acquire()
+        {
+            ProcessingFrame* frame = nullptr;
+            if( !m_pool.tryPop( frame ) )
+            {
+                frame = new ProcessingFrame();
+            }
+            frame->references = 1;
+            return frame;
+        }
+
+        void release( ProcessingFrame* a_frame )
+        {
+            if( a_frame->references.fetch_sub( 1 ) == 1 && !m_pool.tryPush( a_frame ) )
+            {
+                delete a_frame;
+            }
+        }
+
+        //! Pass a_frame on to a_children according to their queue policy.
+        void dispatch( ProcessingFrame* a_frame, const std::vector< Stage* >& a_children )
+        {
+            for( Stage* child : a_children )
+            {
+                a_frame->references++;
+                bool pushed = child->queue.tryPush( a_frame );
+                unsigned int attempt = 0;
+                while( !pushed )
+                {
+                    if( child->config.policy == HYSPEX_QUEUE_DROP_NEWEST )
+                    {
+                        break;
+                    }
+                    if( child->config.policy == HYSPEX_QUEUE_DROP_OLDEST )
+                    {
+                        ProcessingFrame* oldest = nullptr;
+                        if( child->queue.tryPop( oldest ) )
+                        {
+                            child->dropped++;
+                            release( oldest );
+                        }
+                    }
+                    else if( m_terminate )
+                    {
+                        break;
+                    }
+                    else
+                    {
+                        backoff( attempt );
+                    }
+                    pushed = child->queue.tryPush( a_frame );
+                }
+
+                if( pushed )
+                {
+                    updateMax( child->max_queue_depth, child->queue.size() );
+                }
+                else
+                {
+                    child->dropped++;
+                    release( a_frame );
+                }
+            }
+        }
+
+        void sourceThread( Source* a_source )
+        {
+            while( !m_terminate )
+            {
+                const ImageLine< unsigned short >& image = m_camera->getNextImage( a_source->options, 100 );
+                if( image.buffer.size == 0 )
+                {
+                    // got timeout on wait, retry.
+                    continue;
+                }
+
+                ProcessingFrame* frame = acquire();
+                frame->options = a_source->options;
+                frame->source_time_ns = nowNs();
+                frame->image.resize( image.spectral_size, image.spatial_size );
+                frame->image.copyMetadata( image );
+                std::copy( image.buffer.data, image.buffer.data + image.buffer.size, frame->image.data() );
+
+                dispatch( frame, a_source->children );
+                release( frame );
+            }
+            m_camera->releaseImage();
+        }
+
+        void workerThread( Stage* a_stage )
+        {
+            unsigned int attempt = 0;
+            while( !m_terminate )
+            {
+                ProcessingFrame* frame = nullptr;
+                if( !a_stage->queue.tryPop( frame ) )
+                {
+                    backoff( attempt );
+                    continue;
+                }
+                attempt = 0;
+
+                const uint64_t start = nowNs();
+                const bool forward = a_stage->config.function( *frame );
+                const uint64_t end = nowNs();
+
+                a_stage->processing_ns += end - start;
+                a_stage->latency_ns += end - frame->source_time_ns;
+                updateMax( a_stage->max_latency_ns, end - frame->source_time_ns );
+                a_stage->processed++;
+
+                if( forward )
+                {
+                    dispatch( frame, a_stage->children );
+                }
+                release( frame );
+            }
+        }
+
+        Camera* m_camera{ nullptr }; //!< Camera to read from.
+        std::vector< std::unique_ptr< Stage > > m_stages; //!< Stages in order of addStage().
+        std::vector< std::unique_ptr< Source > > m_sources; //!< One source per ImageOptions.
+        std::vector< std::thread > m_threads; //!< Source and worker threads.
+        BoundedQueue< ProcessingFrame* > m_pool; //!< Frames ready for reuse.
+        std::atomic_bool m_terminate{ true }; //!< Set to stop threads.
+        bool m_running{ false }; //!< True between start() and stop().
+    };
+}
+
+#endif // HYSPEX_PROCESSINGGRAPH_H
@@ -0,0 +1,267 @@
+#ifndef HYSPEX_REFLECTANCECONVERSION_H
+#define HYSPEX_REFLECTANCECONVERSION_H
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+#include "FloatCorrection.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Radiance to reflectance conversion from a white reference panel.
+    *
+    *     reflectance = radiance * panel reflectance[ y ] / white radiance[ y, x ]
+    *
+    * The white radiance is the average of frames of the panel, captured with the same settings as the data.
+    * It is turned into a reciprocal float table once, so the conversion is a single multiply per element.
+    * Live, the table is folded into the FloatCorrection gains ( applyTo(), or FloatImageReader::setReflectanceConversion() ),
+    * so raw images go to reflectance in the same single pass as the radiometric correction.
+    * For recorded radiance ( FileReader::getFloatImage() ), apply() does the multiply.
+    * This class is not thread-safe, but apply() is const and can be called from several threads once the white reference is set.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::FloatImageReader reader( camera );
+    * hyspex::ReflectanceConversion reflectance;
+    * reflectance.setPanelReflectance( 0.99 );
+    * // point camera at white panel.
+    * reflectance.captureWhiteReference( reader, 100, hyspex::HYSPEX_RE, 1000 );
+    *
+    * reader.setReflectanceConversion( &reflectance );
+    * const hyspex::ImageLine< float >& image = reader.getNextImage( hyspex::HYSPEX_RE, 500 ); // reflectance.
+    *
+    * // batch:
+    * hyspex::ImageBuffer< float > output;
+    * hyspex::forEachImage< float >( file_reader, [&]( const hyspex::ImageLine< float >& a_image )
+    * {
+    *     return reflectance.apply( a_image, output ) == hyspex::HYSPEX_OK;
+    * } );
+    * @endcode
+    */
+    class ReflectanceConversion
+    {
+    public:
+        //! Reflectance of the panel, for all bands. Call before the white reference is set.
+        ReturnCode setPanelReflectance( double a_reflectance )
+        {
+            if( a_reflectance <= 0.0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_panel.assign( 1, a_reflectance );
+            return HYSPEX_OK;
+        }
+
+        //! Reflectance of the panel per band. Call before the white reference is set.
+        ReturnCode setPanelReflectance( const std::vector< double >& a_reflectance )
+        {
+            if( a_reflectance.empty() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            for( size_t y = 0; y < a_reflectance.size(); y++ )
+            {
+                if( a_reflectance[ y ] <= 0.0 )
+                {
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+            }
+            m_panel = a_reflectance;
+            return HYSPEX_OK;
+        }
+
+        //! White radiance at or below this gives reflectance 0.0 instead of a huge value.
+        void setMinimumWhite( float a_minimum ) { m_minimumWhite = a_minimum; }
+
+        //! Start averaging white frames.
+        void beginWhiteReference()
+        {
+            m_sum.clear();
+            m_frames = 0;
+            m_accumulatedSpectral = 0;
+            m_accumulatedSpatial = 0;
+        }
+
+        //! Add one white frame, all frames must have the same size. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        ReturnCode addWhiteFrame( const ImageLine< float >& a_image, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            const size_t size = static_cast< size_t >( a_image.spectral_size ) * a_image.spatial_size;
+            if( size == 0 || a_image.buffer.size != size || a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( m_frames == 0 )
+            {
+                m_sum.assign( size, 0.0 );
+                m_accumulatedSpectral = a_image.spectral_size;
+                m_accumulatedSpatial = a_image.spatial_size;
+            }
+            else if( a_image.spectral_size != m_accumulatedSpectral || a_image.spatial_size != m_accumulatedSpatial )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            for( size_t i = 0; i < size; i++ )
+            {
+                m_sum[ i ] += a_image.buffer.data[ i ];
+            }
+            m_frames++;
+            return HYSPEX_OK;
+        }
+
+        //! Build the reciprocal table from the frames added since beginWhiteReference().
+        ReturnCode endWhiteReference()
+        {
+            if( m_frames == 0 )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            std::vector< float > white( m_sum.size() );
+            for( size_t i = 0; i < m_sum.size(); i++ )
+            {
+                white[ i ] = static_cast< float >( m_sum[ i ] / m_frames );
+            }
+            const ReturnCode result = setWhiteReference( white.data(), m_accumulatedSpectral, m_accumulatedSpatial );
+            beginWhiteReference();
+            return result;
+        }
+
+        /*!
+        * Average a_frames images from a_reader ( e.g. FloatImageReader ) as white reference. Gives up after a_frames timeouts ( or images withheld with HYSPEX_NOT_ACTIVE ),
+        * and returns the reader's getStatus() if it fails for another reason.
+        * a_reader must deliver the same units as the data to convert, and must not have this conversion attached. BIP readers are rejected ( getLayout() ).
+        */
+        template< typename Reader >
+        ReturnCode captureWhiteReference( Reader& a_reader, uint32_t a_frames, ImageOptions a_options = HYSPEX_RE, uint32_t a_timeoutMs = 1000 )
+        {
+            if( a_frames == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            beginWhiteReference();
+            uint32_t timeouts = 0;
+            while( m_frames < a_frames && timeouts < a_frames )
+            {
+                const ImageLine< float >& image = a_reader.getNextImage( a_options, a_timeoutMs );
+                if( image.buffer.size == 0 )
+                {
+                    const ReturnCode status = a_reader.getStatus();
+                    // HYSPEX_NOT_ACTIVE: temperature compensation is waiting for its first temperature.
+                    if( status != HYSPEX_TIMEOUT_REACHED && status != HYSPEX_NOT_ACTIVE && status < 1 )
+                    {
+                        beginWhiteReference();
+                        return status;
+                    }
+                    timeouts++;
+                    continue;
+                }
+                HYSPEX_RETURN_IF_ERROR_VAL( addWhiteFrame( image, a_reader.getLayout() ) );
+            }
+            return endWhiteReference();
+        }
+
+        //! Set white radiance ( spectral x spatial ) directly.
+        ReturnCode setWhiteReference( const float* a_white, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            if( !a_white || a_spectralSize == 0 || a_spatialSize == 0 ||
+                ( m_panel.size() != 1 && m_panel.size() != a_spectralSize ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            m_factors.resize( static_cast< size_t >( a_spectralSize ) * a_spatialSize );
+            for( uint32_t y = 0; y < a_spectralSize; y++ )
+            {
+                const double panel = m_panel.size() == 1 ? m_panel[ 0 ] : m_panel[ y ];
+                const size_t offset = static_cast< size_t >( y ) * a_spatialSize;
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    const float white = a_white[ offset + x ];
+                    m_factors[ offset + x ] = white > m_minimumWhite ? static_cast< float >( panel / white ) : 0.0f;
+                }
+            }
+            m_spectralSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            m_generation++;
+            return HYSPEX_OK;
+        }
+
+        bool isReady() const { return !m_factors.empty(); } //!< White reference has been set.
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Spectral size of white reference.
+        uint32_t getSpatialSize() const { return m_spatialSize; } //!< Spatial size of white reference.
+        uint64_t getGeneration() const { return m_generation; } //!< Incremented every time the white reference is set.
+        const std::vector< float >& getFactors() const { return m_factors; } //!< Panel reflectance / white radiance per element.
+
+        //! Fold the table into the gains of a_correction, see FloatCorrection::setElementFactors(). HYSPEX_INVALID_ARGUMENTS if the white reference does not match its tables.
+        ReturnCode applyTo( FloatCorrection& a_correction ) const
+        {
+            if( !isReady() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( a_correction.getSpectralSize() != m_spectralSize || a_correction.getSpatialSize() != m_spatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return a_correction.setElementFactors( m_factors.data(), m_factors.size() );
+        }
+
+        //! Convert a_size elements of radiance in place. a_size must not exceed the white reference size.
+        void apply( float* a_data, size_t a_size ) const
+        {
+            apply( a_data, a_data, a_size );
+        }
+
+        //! Convert a_size elements of radiance from a_input into a_output, may be the same buffer.
+        void apply( const float* a_input, float* a_output, size_t a_size ) const
+        {
+            const float* factor = m_factors.data();
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                _mm256_storeu_ps( a_output + i, _mm256_mul_ps( _mm256_loadu_ps( a_input + i ), _mm256_loadu_ps( factor + i ) ) );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                a_output[ i ] = a_input[ i ] * factor[ i ];
+            }
+        }
+
+        //! Convert a_input into a_output, including metadata. Returns HYSPEX_INVALID_ARGUMENTS if a_input does not match the white reference or a_layout is not BIL.
+        ReturnCode apply( const ImageLine< float >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( !isReady() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( a_input.spectral_size != m_spectralSize || a_input.spatial_size != m_spatialSize || a_input.buffer.size != m_factors.size() ||
+                a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            a_output.resize( a_input.spectral_size, a_input.spatial_size );
+            a_output.copyMetadata( a_input );
+            apply( a_input.buffer.data, a_output.data(), a_input.buffer.size );
+            return HYSPEX_OK;
+        }
+
+    private:
+        std::vector< double > m_panel{ 1.0 }; //!< Panel reflectance, one value or one per band.
+        std::vector< float > m_factors; //!< Panel reflectance / white radiance per element.
+        std::vector< double > m_sum; //!< Sum of white frames while averaging.
+        uint32_t m_frames{ 0 }; //!< White frames in m_sum.
+        uint32_t m_accumulatedSpectral{ 0 }; //!< Spectral size of frames in m_sum.
+        uint32_t m_accumulatedSpatial{ 0 }; //!< Spatial size of frames in m_sum.
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of m_factors.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of m_factors.
+        uint64_t m_generation{ 0 }; //!< Incremented when m_factors changes.
+        float m_minimumWhite{ 1e-6f }; //!< Smallest usable white radiance.
+    };
+}
+
+#endif // HYSPEX_REFLECTANCECONVERSION_H
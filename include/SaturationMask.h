@@ -0,0 +1,192 @@
+#ifndef HYSPEX_SATURATIONMASK_H
+#define HYSPEX_SATURATIONMASK_H
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace hyspex
+{
+    //! Number of bits set in a_value.
+    inline unsigned int popCount64( uint64_t a_value )
+    {
+#if defined( _MSC_VER ) && defined( _M_X64 )
+        return static_cast< unsigned int >( __popcnt64( a_value ) );
+#elif defined( __GNUC__ )
+        return static_cast< unsigned int >( __builtin_popcountll( a_value ) );
+#else
+        unsigned int count = 0;
+        for( ; a_value; count++ )
+        {
+            a_value &= a_value - 1;
+        }
+        return count;
+#endif
+    }
+
+    /*!
+    * Per-frame saturation summary, computed by SaturationMask::compute().
+    */
+    typedef struct
+    {
+        uint64_t frame_number;      //!< Frame number of the image the summary belongs to.
+        uint64_t saturated_pixels;  //!< Saturated pixels inside the saturation bands, sum of ImageLine::saturated.
+        uint32_t saturated_columns; //!< Spatial pixels with at least one saturated band, bits set in the mask.
+        unsigned short max_value;   //!< Highest value of ImageLine::max_saturation.
+        uint32_t start_band;        //!< First saturation band.
+        uint32_t end_band;          //!< Last saturation band ( inclusive ).
+    } SaturationSummary;
+
+    /*!
+    * @brief Bit-packed saturation mask with per-frame summary, from the saturation vectors the library delivers.
+    *
+    * The library counts saturated pixels per spatial pixel within the bands of Camera::setSaturationBands() while it reads the
+    * frame ( ImageLine::saturated and ImageLine::max_saturation, spatial_size values each ). compute() reads only these two
+    * vectors, never the image: one SIMD compare and movemask packs saturated > 0 into one bit per spatial pixel, and the
+    * saturated pixel count and max value are accumulated in the same pass.
+    * Bit x % 64 of word x / 64 is set if spatial pixel x is saturated in any of the saturation bands.
+    *
+    * Set the bands through setSaturationBands( camera, ... ), so the camera and the summary use the same bands.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SaturationMask saturation;
+    * saturation.setSaturationBands( camera, 10, 100 ); // also calls camera->setSaturationBands( 10, 100 ).
+    *
+    * const hyspex::ImageLine< unsigned short >& image = camera->getNextImage( hyspex::HYSPEX_RAW );
+    * const hyspex::SaturationSummary& summary = saturation.compute( image );
+    * if( summary.saturated_pixels > 0 )
+    * {
+    *     bool saturated = saturation.isSaturated( 200 );
+    * }
+    * @endcode
+    */
+    class SaturationMask
+    {
+    public:
+        SaturationMask()
+        {
+            m_summary = SaturationSummary();
+            m_summary.end_band = UINT32_MAX;
+        }
+
+        //! Camera::setSaturationBands( a_startBand, a_endBand ) on a_camera, and report the same bands in the summary.
+        ReturnCode setSaturationBands( Camera* a_camera, unsigned int a_startBand, unsigned int a_endBand )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( a_startBand > a_endBand )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( a_camera->setSaturationBands( a_startBand, a_endBand ) );
+            m_summary.start_band = a_startBand;
+            m_summary.end_band = a_endBand;
+            return HYSPEX_OK;
+        }
+
+        //! Compute mask and summary for a_image. The summary is valid until next call.
+        const SaturationSummary& compute( const ImageLine< unsigned short >& a_image )
+        {
+            const unsigned short* max_saturation = a_image.max_saturation.size == a_image.saturated.size ? a_image.max_saturation.data : nullptr;
+            return compute( a_image.saturated.data, max_saturation, a_image.saturated.size, a_image.stat.frame_number );
+        }
+
+        //! Compute mask and summary from a_size saturation counts at a_saturated, and max values at a_maxSaturation ( may be null ).
+        const SaturationSummary& compute( const unsigned short* a_saturated, const unsigned short* a_maxSaturation, size_t a_size, uint64_t a_frameNumber = 0 )
+        {
+            m_size = a_saturated ? a_size : 0;
+            m_mask.assign( ( m_size + 63 ) / 64, 0 );
+
+            uint64_t total = 0;
+            uint32_t columns = 0;
+            unsigned short max_value = 0;
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256i zero = _mm256_setzero_si256();
+            __m256i sums = zero;
+            __m256i maxima = zero;
+            for( ; x + 64 <= m_size; x += 64 )
+            {
+                uint64_t word = 0;
+                for( size_t half = 0; half < 2; half++ )
+                {
+                    const __m256i a = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_saturated + x + 32 * half ) );
+                    const __m256i b = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_saturated + x + 32 * half + 16 ) );
+                    // zero lanes give 0xFFFF, packs works per 128-bit lane so the quadwords must be reordered.
+                    const __m256i packed = _mm256_permute4x64_epi64( _mm256_packs_epi16( _mm256_cmpeq_epi16( a, zero ), _mm256_cmpeq_epi16( b, zero ) ), 0xD8 );
+                    word |= static_cast< uint64_t >( ~static_cast< uint32_t >( _mm256_movemask_epi8( packed ) ) ) << ( 32 * half );
+                    // widen to 32 bits, so counts up to 65535 do not overflow.
+                    sums = _mm256_add_epi32( sums, _mm256_add_epi32( _mm256_unpacklo_epi16( a, zero ), _mm256_unpackhi_epi16( a, zero ) ) );
+                    sums = _mm256_add_epi32( sums, _mm256_add_epi32( _mm256_unpacklo_epi16( b, zero ), _mm256_unpackhi_epi16( b, zero ) ) );
+                    if( a_maxSaturation )
+                    {
+                        maxima = _mm256_max_epu16( maxima, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_maxSaturation + x + 32 * half ) ) );
+                        maxima = _mm256_max_epu16( maxima, _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_maxSaturation + x + 32 * half + 16 ) ) );
+                    }
+                }
+                m_mask[ x / 64 ] = word;
+                columns += popCount64( word );
+            }
+            uint32_t lanes[ 8 ];
+            _mm256_storeu_si256( reinterpret_cast< __m256i* >( lanes ), sums );
+            unsigned short max_lanes[ 16 ];
+            _mm256_storeu_si256( reinterpret_cast< __m256i* >( max_lanes ), maxima );
+            for( int k = 0; k < 8; k++ )
+            {
+                total += lanes[ k ];
+            }
+            for( int k = 0; k < 16; k++ )
+            {
+                max_value = max_lanes[ k ] > max_value ? max_lanes[ k ] : max_value;
+            }
+#endif
+            for( ; x < m_size; x++ )
+            {
+                if( a_saturated[ x ] > 0 )
+                {
+                    m_mask[ x / 64 ] |= uint64_t( 1 ) << ( x % 64 );
+                    total += a_saturated[ x ];
+                    columns++;
+                }
+                if( a_maxSaturation && a_maxSaturation[ x ] > max_value )
+                {
+                    max_value = a_maxSaturation[ x ];
+                }
+            }
+
+            m_summary.frame_number = a_frameNumber;
+            m_summary.saturated_pixels = total;
+            m_summary.saturated_columns = columns;
+            m_summary.max_value = max_value;
+            return m_summary;
+        }
+
+        const SaturationSummary& getSummary() const { return m_summary; } //!< Summary from last compute().
+        ConstBuffer< uint64_t > getMask() const { return ConstBuffer< uint64_t >{ m_mask.size(), m_mask.data() }; } //!< Packed mask from last compute().
+
+        //! True if spatial pixel a_pixel was saturated in any saturation band in last compute().
+        bool isSaturated( uint32_t a_pixel ) const
+        {
+            if( a_pixel >= m_size )
+            {
+                return false;
+            }
+            return ( m_mask[ a_pixel / 64 ] >> ( a_pixel % 64 ) ) & 1u;
+        }
+
+    private:
+        std::vector< uint64_t > m_mask; //!< Packed mask, one bit per spatial pixel.
+        SaturationSummary m_summary; //!< Summary from last compute().
+        size_t m_size{ 0 }; //!< Spatial pixels of last compute().
+    };
+}
+
+#endif // HYSPEX_SATURATIONMASK_H
@@ -0,0 +1,304 @@
+#ifndef HYSPEX_SMILEKEYSTONECORRECTION_H
+#define HYSPEX_SMILEKEYSTONECORRECTION_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "SpectralResampler.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Resamples frames onto a smile and keystone free grid.
+    *
+    * Keystone: every spectral line is resampled along the spatial axis, so spatial pixel x has the same position in all bands.
+    * The position of each detector pixel comes from HYSPEX_CALIB_SPATIAL, the target position of column x is the mean over all bands.
+    * Smile: every spatial pixel is then resampled along the spectral axis from HYSPEX_CALIB_SPECTRAL_PER_PIXEL
+    * ( moved through the keystone tables as well ) to HYSPEX_CALIB_SPECTRAL_PER_BAND, see SpectralResampler.
+    *
+    * Both are linear interpolations from tables built once in prepare(). The keystone pass uses gathers with AVX2.
+    * Use it in a ProcessingGraph stage for live data, or with forEachImage() ( FileBatch.h ) for files.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SmileKeystoneCorrection correction;
+    * correction.prepare( camera );
+    *
+    * hyspex::ProcessingStageConfig config;
+    * config.name = "smile_keystone";
+    * config.options = hyspex::HYSPEX_RAW_BP;
+    * config.threads = 2;
+    * config.function = [&correction]( hyspex::ProcessingFrame& a_frame )
+    * {
+    *     return correction.apply( a_frame.image.line(), a_frame.output ) == hyspex::HYSPEX_OK; // apply() is const, so this is thread-safe.
+    * };
+    * graph.addStage( config );
+    * @endcode
+    */
+    class SmileKeystoneCorrection
+    {
+    public:
+        /*!
+        * Build tables from camera calibration. Corrections whose matrices are not available are skipped, see hasKeystoneCorrection()
+        * and hasSmileCorrection(). Returns HYSPEX_SETTING_NOT_FOUND if neither could be built ( apply() then only copies ).
+        */
+        ReturnCode prepare( const Camera* a_camera )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+
+            const uint32_t spectral_size = static_cast< uint32_t >( a_camera->getSpectralSize() );
+            const uint32_t spatial_size = static_cast< uint32_t >( a_camera->getSpatialSize() );
+            const size_t size = static_cast< size_t >( spectral_size ) * spatial_size;
+            const double* spectral = matrix( a_camera, HYSPEX_CALIB_SPECTRAL_PER_PIXEL, size );
+            const double* spatial = matrix( a_camera, HYSPEX_CALIB_SPATIAL, size );
+
+            std::vector< double > wavelengths;
+            const double* per_band = matrix( a_camera, HYSPEX_CALIB_SPECTRAL_PER_BAND, spectral_size );
+            if( per_band )
+            {
+                wavelengths.assign( per_band, per_band + spectral_size );
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( prepare( spectral, spatial, spectral_size, spatial_size, wavelengths ) );
+            return m_keystone || m_smile ? HYSPEX_OK : HYSPEX_SETTING_NOT_FOUND;
+        }
+
+        /*!
+        * Build tables from matrices of a_spectralSize x a_spatialSize: wavelength per pixel ( a_spectral ) and spatial position per pixel ( a_spatial ).
+        * Either may be nullptr to skip that correction. a_wavelengths is the target wavelength per band, empty for the mean of each band.
+        */
+        ReturnCode prepare( const double* a_spectral, const double* a_spatial, uint32_t a_spectralSize, uint32_t a_spatialSize, const std::vector< double >& a_wavelengths )
+        {
+            if( a_spectralSize == 0 || a_spatialSize == 0 || ( !a_wavelengths.empty() && a_wavelengths.size() != a_spectralSize ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            m_spectralSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            m_keystone = a_spatial != nullptr && a_spatialSize > 1;
+            m_smile = a_spectral != nullptr && a_spectralSize > 1;
+            m_indices.clear();
+            m_weights.clear();
+
+            const size_t size = static_cast< size_t >( a_spectralSize ) * a_spatialSize;
+            std::vector< double > spectral;
+            if( m_smile )
+            {
+                spectral.assign( a_spectral, a_spectral + size );
+            }
+
+            if( m_keystone )
+            {
+                HYSPEX_RETURN_IF_ERROR_VAL( buildKeystone( a_spatial ) );
+                if( m_smile )
+                {
+                    // wavelengths of the keystone corrected pixels.
+                    for( uint32_t y = 0; y < a_spectralSize; y++ )
+                    {
+                        const double* input = a_spectral + static_cast< size_t >( y ) * a_spatialSize;
+                        for( uint32_t x = 0; x < a_spatialSize; x++ )
+                        {
+                            const size_t i = static_cast< size_t >( y ) * a_spatialSize + x;
+                            spectral[ i ] = input[ m_indices[ i ] ] + m_weights[ i ] * ( input[ m_indices[ i ] + 1 ] - input[ m_indices[ i ] ] );
+                        }
+                    }
+                }
+            }
+
+            if( m_smile )
+            {
+                std::vector< double > wavelengths = a_wavelengths;
+                if( wavelengths.empty() )
+                {
+                    wavelengths.resize( a_spectralSize );
+                    for( uint32_t y = 0; y < a_spectralSize; y++ )
+                    {
+                        wavelengths[ y ] = mean( &spectral[ static_cast< size_t >( y ) * a_spatialSize ], a_spatialSize, 1 );
+                    }
+                }
+                HYSPEX_RETURN_IF_ERROR_VAL( m_smileResampler.prepareGaussianPerPixel( spectral.data(), a_spectralSize, a_spatialSize, {}, wavelengths, {} ) );
+            }
+            return HYSPEX_OK;
+        }
+
+        bool hasKeystoneCorrection() const { return m_keystone; } //!< True if keystone is corrected.
+        bool hasSmileCorrection() const { return m_smile; } //!< True if smile is corrected.
+
+        //! Correct a_input ( spectral x spatial as prepared ) into a_output. Thread-safe, a_scratch must hold as many elements as a_input.
+        ReturnCode apply( const float* a_input, float* a_output, float* a_scratch ) const
+        {
+            if( !a_input || !a_output || !a_scratch || m_spectralSize == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t size = static_cast< size_t >( m_spectralSize ) * m_spatialSize;
+            if( !m_keystone && !m_smile )
+            {
+                std::copy( a_input, a_input + size, a_output );
+                return HYSPEX_OK;
+            }
+
+            float* keystone_output = m_smile ? a_scratch : a_output;
+            if( m_keystone )
+            {
+                for( uint32_t y = 0; y < m_spectralSize; y++ )
+                {
+                    const size_t offset = static_cast< size_t >( y ) * m_spatialSize;
+                    gatherLine( a_input + offset, &m_indices[ offset ], &m_weights[ offset ], keystone_output + offset );
+                }
+            }
+            return m_smile ? m_smileResampler.apply( m_keystone ? a_scratch : a_input, m_spatialSize, a_output ) : HYSPEX_OK;
+        }
+
+        //! Correct a_input into a_output. Only a_layout HYSPEX_LAYOUT_BIL is supported. Thread-safe.
+        ReturnCode apply( const ImageLine< float >& a_input, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            HYSPEX_RETURN_IF_ERROR_VAL( checkInput( a_input.spectral_size, a_input.spatial_size, a_input.buffer.size ) );
+            std::vector< float >& scratch = threadScratch( a_input.buffer.size );
+            a_output.resize( m_spectralSize, m_spatialSize );
+            a_output.copyMetadata( a_input );
+            return apply( a_input.buffer.data, a_output.data(), scratch.data() );
+        }
+
+        //! Correct a_input into a_output. Thread-safe.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< float >& a_output ) const
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( checkInput( a_input.spectral_size, a_input.spatial_size, a_input.buffer.size ) );
+            const size_t size = a_input.buffer.size;
+            std::vector< float >& scratch = threadScratch( 2 * size );
+            convertToFloat( a_input.buffer.data, scratch.data() + size, size );
+            a_output.resize( m_spectralSize, m_spatialSize );
+            a_output.copyMetadata( a_input );
+            return apply( scratch.data() + size, a_output.data(), scratch.data() );
+        }
+
+        //! Correct a_input into a_output, rounded to unsigned short ( e.g. for writing corrected files ). Thread-safe.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< unsigned short >& a_output ) const
+        {
+            thread_local ImageBuffer< float > output;
+            HYSPEX_RETURN_IF_ERROR_VAL( apply( a_input, output ) );
+            a_output.resize( m_spectralSize, m_spatialSize );
+            a_output.copyMetadata( a_input );
+            for( size_t i = 0; i < output.size(); i++ )
+            {
+                const float value = std::nearbyint( output.data()[ i ] );
+                a_output.data()[ i ] = value <= 0.0f ? 0 : ( value >= 65535.0f ? 65535 : static_cast< unsigned short >( value ) );
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        static const double* matrix( const Camera* a_camera, calib_matrix_e a_matrix, size_t a_size )
+        {
+            if( !a_camera->getCalibrationMatrixAvailable( a_matrix ) )
+            {
+                return nullptr;
+            }
+            const ConstBuffer< double >& buffer = a_camera->getCalibrationMatrix( a_matrix );
+            return buffer.size == a_size ? buffer.data : nullptr;
+        }
+
+        static double mean( const double* a_data, size_t a_count, size_t a_stride )
+        {
+            double sum = 0.0;
+            for( size_t i = 0; i < a_count; i++ )
+            {
+                sum += a_data[ i * a_stride ];
+            }
+            return sum / a_count;
+        }
+
+        ReturnCode checkInput( uint32_t a_spectralSize, uint32_t a_spatialSize, uint64_t a_bufferSize ) const
+        {
+            const bool valid = m_spectralSize != 0 && a_spectralSize == m_spectralSize && a_spatialSize == m_spatialSize &&
+                               a_bufferSize == static_cast< uint64_t >( m_spectralSize ) * m_spatialSize;
+            return valid ? HYSPEX_OK : HYSPEX_INVALID_ARGUMENTS;
+        }
+
+        //! Scratch buffer per thread, so apply() can be const and called from several worker threads without allocating per frame.
+        static std::vector< float >& threadScratch( size_t a_size )
+        {
+            thread_local std::vector< float > scratch;
+            scratch.resize( a_size );
+            return scratch;
+        }
+
+        //! Index and weight per pixel, so that target position x lies between source columns index and index + 1.
+        ReturnCode buildKeystone( const double* a_spatial )
+        {
+            const size_t size = static_cast< size_t >( m_spectralSize ) * m_spatialSize;
+            m_indices.resize( size );
+            m_weights.resize( size );
+            std::vector< double > targets( m_spatialSize );
+            for( uint32_t x = 0; x < m_spatialSize; x++ )
+            {
+                targets[ x ] = mean( a_spatial + x, m_spectralSize, m_spatialSize );
+            }
+
+            for( uint32_t y = 0; y < m_spectralSize; y++ )
+            {
+                const double* positions = a_spatial + static_cast< size_t >( y ) * m_spatialSize;
+                const bool increasing = positions[ m_spatialSize - 1 ] >= positions[ 0 ];
+                uint32_t lower = 0; // targets are monotonic as well, so the search continues from previous column.
+                for( uint32_t x = 0; x < m_spatialSize; x++ )
+                {
+                    const double target = targets[ x ];
+                    while( lower + 2 < m_spatialSize && ( increasing ? positions[ lower + 1 ] < target : positions[ lower + 1 ] > target ) )
+                    {
+                        lower++;
+                    }
+                    const double span = positions[ lower + 1 ] - positions[ lower ];
+                    double weight = span != 0.0 ? ( target - positions[ lower ] ) / span : 0.0;
+                    weight = weight < 0.0 ? 0.0 : ( weight > 1.0 ? 1.0 : weight );
+
+                    const size_t i = static_cast< size_t >( y ) * m_spatialSize + x;
+                    m_indices[ i ] = static_cast< int32_t >( lower );
+                    m_weights[ i ] = static_cast< float >( weight );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        //! a_output[ x ] = a_input[ i ] + w * ( a_input[ i + 1 ] - a_input[ i ] ) with i and w from the tables.
+        void gatherLine( const float* a_input, const int32_t* a_indices, const float* a_weights, float* a_output ) const
+        {
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; x + 8 <= m_spatialSize; x += 8 )
+            {
+                const __m256i indices = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_indices + x ) );
+                const __m256 a = _mm256_i32gather_ps( a_input, indices, 4 );
+                const __m256 b = _mm256_i32gather_ps( a_input + 1, indices, 4 );
+                _mm256_storeu_ps( a_output + x, _mm256_add_ps( a, _mm256_mul_ps( _mm256_loadu_ps( a_weights + x ), _mm256_sub_ps( b, a ) ) ) );
+            }
+#endif
+            for( ; x < m_spatialSize; x++ )
+            {
+                const float a = a_input[ a_indices[ x ] ];
+                const float b = a_input[ a_indices[ x ] + 1 ];
+                a_output[ x ] = a + a_weights[ x ] * ( b - a );
+            }
+        }
+
+        uint32_t m_spectralSize{ 0 }; //!< Prepared spectral size.
+        uint32_t m_spatialSize{ 0 }; //!< Prepared spatial size.
+        bool m_keystone{ false }; //!< Keystone tables are valid.
+        bool m_smile{ false }; //!< Smile resampler is valid.
+        std::vector< int32_t > m_indices; //!< Keystone: left source column per pixel.
+        std::vector< float > m_weights; //!< Keystone: weight of right source column per pixel.
+        SpectralResampler m_smileResampler; //!< Smile: per pixel linear kernels.
+    };
+}
+
+#endif // HYSPEX_SMILEKEYSTONECORRECTION_H
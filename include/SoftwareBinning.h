@@ -0,0 +1,320 @@
+#ifndef HYSPEX_SOFTWAREBINNING_H
+#define HYSPEX_SOFTWAREBINNING_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Spatial/spectral binning and spectral band subsetting in software.
+    *
+    * For cameras where Camera::getBinningSupported() or Camera::getSpectralROISupport() returns false.
+    * Use on HYSPEX_RAW or HYSPEX_RAW_BP images, before correction and recording, to reduce bytes per frame by the binning factor.
+    * Binned pixels are the average of the binned sensor pixels, rounded to nearest, so the value range is unchanged.
+    *
+    * Calibration matrices must be binned the same way as the image, see binMatrix(). Correction with binned matrices is done with
+    * FloatCorrection::setMatrices().
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SoftwareBinning binning;
+    * binning.setSpatialBinning( 2 );
+    * binning.setSpectralBinning( 2 );
+    * binning.prepare( camera );
+    *
+    * std::vector< double > background;
+    * std::vector< double > re;
+    * binning.binMatrix( camera->getBackgroundMatrix(), background );
+    * binning.binMatrix( camera->getREMatrix(), re );
+    *
+    * hyspex::FloatCorrection correction;
+    * correction.setMatrices( background.data(), background.size(), re.data(), re.size(),
+    *                         binning.getOutputSpectralSize(), binning.getOutputSpatialSize() );
+    *
+    * hyspex::ImageBuffer< unsigned short > binned;
+    * hyspex::ImageBuffer< float > corrected;
+    * binning.apply( camera->getNextImage( hyspex::HYSPEX_RAW_BP ), binned );
+    * correction.apply( binned.line(), corrected );
+    * @endcode
+    */
+    class SoftwareBinning
+    {
+    public:
+        //! Set spatial binning. Spatial size has to be divisible by spatial binning.
+        ReturnCode setSpatialBinning( unsigned short a_spatialBinning )
+        {
+            if( a_spatialBinning == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_spatialBinning = a_spatialBinning;
+            return HYSPEX_OK;
+        }
+
+        //! Set spectral binning. Number of active bands has to be divisible by spectral binning.
+        ReturnCode setSpectralBinning( unsigned short a_spectralBinning )
+        {
+            if( a_spectralBinning == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_spectralBinning = a_spectralBinning;
+            return HYSPEX_OK;
+        }
+
+        //! Set Spectral ROI, 0: inactive, 1: active ( one entry per band ). Empty means all bands.
+        ReturnCode setSpectralROI( const std::vector< int >& a_activeBands )
+        {
+            m_roi = a_activeBands;
+            return HYSPEX_OK;
+        }
+
+        unsigned short getSpatialBinning() const { return m_spatialBinning; } //!< Get spatial binning
+        unsigned short getSpectralBinning() const { return m_spectralBinning; } //!< Get spectral binning
+        std::vector< int > getSpectralROI() const { return m_roi; } //!< Get Spectral ROI
+
+        //! Prepare for images of a_camera's current size.
+        ReturnCode prepare( const Camera* a_camera )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            return prepare( static_cast< uint32_t >( a_camera->getSpectralSize() ), static_cast< uint32_t >( a_camera->getSpatialSize() ) );
+        }
+
+        //! Prepare for images of a_spectralSize x a_spatialSize. Must be called after changing binning or ROI.
+        ReturnCode prepare( uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            if( !m_roi.empty() && m_roi.size() != a_spectralSize )
+            {
+                return HYSPEX_ROI_SPECTRAL_EXCEEDED_IMAGE_SIZE;
+            }
+            if( a_spatialSize % m_spatialBinning != 0 )
+            {
+                return HYSPEX_ROI_SPATIAL_NOT_DIVISIBLE_BY_RESTRICTION;
+            }
+
+            m_bands.clear();
+            for( uint32_t y = 0; y < a_spectralSize; y++ )
+            {
+                if( m_roi.empty() || m_roi[ y ] != 0 )
+                {
+                    m_bands.push_back( y );
+                }
+            }
+            if( m_bands.empty() || m_bands.size() % m_spectralBinning != 0 )
+            {
+                m_bands.clear();
+                return HYSPEX_BINNING_NOT_SUPPORTED;
+            }
+
+            m_inputSpectralSize = a_spectralSize;
+            m_inputSpatialSize = a_spatialSize;
+            m_outputSpectralSize = static_cast< uint32_t >( m_bands.size() / m_spectralBinning );
+            m_outputSpatialSize = a_spatialSize / m_spatialBinning;
+            m_accumulator.resize( a_spatialSize );
+            m_sums.resize( m_outputSpatialSize );
+            return HYSPEX_OK;
+        }
+
+        uint32_t getOutputSpectralSize() const { return m_outputSpectralSize; } //!< Spectral size after binning and ROI.
+        uint32_t getOutputSpatialSize() const { return m_outputSpatialSize; } //!< Spatial size after binning.
+        size_t getOutputSize() const { return static_cast< size_t >( m_outputSpectralSize ) * m_outputSpatialSize; } //!< Elements per binned image.
+
+        //! Bin a_input into a_output, including metadata. Saturation vectors are copied unbinned.
+        ReturnCode apply( const ImageLine< unsigned short >& a_input, ImageBuffer< unsigned short >& a_output )
+        {
+            if( m_bands.empty() || a_input.spectral_size != m_inputSpectralSize || a_input.spatial_size != m_inputSpatialSize ||
+                a_input.buffer.size != static_cast< size_t >( m_inputSpectralSize ) * m_inputSpatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            a_output.resize( m_outputSpectralSize, m_outputSpatialSize );
+            a_output.copyMetadata( a_input );
+            apply( a_input.buffer.data, a_output.data() );
+            return HYSPEX_OK;
+        }
+
+        //! Bin a_input ( prepared input size ) into a_output ( getOutputSize() elements ).
+        void apply( const unsigned short* a_input, unsigned short* a_output )
+        {
+            const float scale = 1.0f / static_cast< float >( m_spatialBinning * m_spectralBinning );
+            for( uint32_t yo = 0; yo < m_outputSpectralSize; yo++ )
+            {
+                std::fill( m_accumulator.begin(), m_accumulator.end(), 0u );
+                for( uint32_t b = 0; b < m_spectralBinning; b++ )
+                {
+                    addRow( a_input + static_cast< size_t >( m_bands[ yo * m_spectralBinning + b ] ) * m_inputSpatialSize );
+                }
+                sumSpatial();
+                scaleRow( scale, a_output + static_cast< size_t >( yo ) * m_outputSpatialSize );
+            }
+        }
+
+        /*!
+        * Bin calibration matrix a_input the same way as images, by averaging.
+        * Accepts spectral x spatial matrices, per band vectors ( spectral ) and per pixel vectors ( spatial ), determined by size.
+        */
+        ReturnCode binMatrix( const ConstBuffer< double >& a_input, std::vector< double >& a_output ) const
+        {
+            if( m_bands.empty() || !a_input.data )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t full = static_cast< size_t >( m_inputSpectralSize ) * m_inputSpatialSize;
+            const bool per_band = a_input.size == m_inputSpectralSize;
+            const bool per_pixel = a_input.size == m_inputSpatialSize;
+            if( a_input.size != full && !per_band && !per_pixel )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const uint32_t spectral = per_pixel ? 1 : m_outputSpectralSize;
+            const uint32_t spatial = per_band ? 1 : m_outputSpatialSize;
+            const uint32_t spectral_binning = per_pixel ? 1 : m_spectralBinning;
+            const uint32_t spatial_binning = per_band ? 1 : m_spatialBinning;
+            const uint32_t stride = per_band ? 1 : m_inputSpatialSize;
+            a_output.assign( static_cast< size_t >( spectral ) * spatial, 0.0 );
+
+            for( uint32_t yo = 0; yo < spectral; yo++ )
+            {
+                for( uint32_t b = 0; b < spectral_binning; b++ )
+                {
+                    const size_t y = per_pixel ? 0 : m_bands[ yo * m_spectralBinning + b ];
+                    for( uint32_t xo = 0; xo < spatial; xo++ )
+                    {
+                        for( uint32_t s = 0; s < spatial_binning; s++ )
+                        {
+                            a_output[ yo * spatial + xo ] += a_input.data[ y * stride + xo * spatial_binning + s ];
+                        }
+                    }
+                }
+            }
+
+            const double scale = 1.0 / ( spectral_binning * spatial_binning );
+            for( double& value : a_output )
+            {
+                value *= scale;
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Bin calibration matrix a_matrix from a_camera, see binMatrix().
+        ReturnCode binCalibrationMatrix( const Camera* a_camera, calib_matrix_e a_matrix, std::vector< double >& a_output ) const
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_camera->getCalibrationMatrixAvailable( a_matrix ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            return binMatrix( a_camera->getCalibrationMatrix( a_matrix ), a_output );
+        }
+
+    private:
+        //! m_accumulator += a_row
+        void addRow( const unsigned short* a_row )
+        {
+            uint32_t* acc = m_accumulator.data();
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; x + 16 <= m_inputSpatialSize; x += 16 )
+            {
+                const __m256i raw = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( a_row + x ) );
+                __m256i* lo = reinterpret_cast< __m256i* >( acc + x );
+                __m256i* hi = reinterpret_cast< __m256i* >( acc + x + 8 );
+                _mm256_storeu_si256( lo, _mm256_add_epi32( _mm256_loadu_si256( lo ), _mm256_cvtepu16_epi32( _mm256_castsi256_si128( raw ) ) ) );
+                _mm256_storeu_si256( hi, _mm256_add_epi32( _mm256_loadu_si256( hi ), _mm256_cvtepu16_epi32( _mm256_extracti128_si256( raw, 1 ) ) ) );
+            }
+#endif
+            for( ; x < m_inputSpatialSize; x++ )
+            {
+                acc[ x ] += a_row[ x ];
+            }
+        }
+
+        //! m_sums[ xo ] = sum of m_accumulator[ xo * binning .. ( xo + 1 ) * binning - 1 ]
+        void sumSpatial()
+        {
+            const uint32_t* acc = m_accumulator.data();
+            uint32_t* sums = m_sums.data();
+            size_t xo = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            // hadd works within 128-bit lanes, permute restores order.
+            if( m_spatialBinning == 2 )
+            {
+                for( ; xo + 8 <= m_outputSpatialSize; xo += 8 )
+                {
+                    const __m256i a = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + xo * 2 ) );
+                    const __m256i b = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + xo * 2 + 8 ) );
+                    _mm256_storeu_si256( reinterpret_cast< __m256i* >( sums + xo ), _mm256_permute4x64_epi64( _mm256_hadd_epi32( a, b ), 0xD8 ) );
+                }
+            }
+            else if( m_spatialBinning == 4 )
+            {
+                for( ; xo + 4 <= m_outputSpatialSize; xo += 4 )
+                {
+                    const __m256i a = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + xo * 4 ) );
+                    const __m256i b = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( acc + xo * 4 + 8 ) );
+                    const __m256i pairs = _mm256_hadd_epi32( a, b ); // a01 a23 b01 b23 | a45 a67 b45 b67
+                    const __m256i quads = _mm256_hadd_epi32( pairs, pairs ); // a0123 b0123 .. | a4567 b4567 ..
+                    const __m256i ordered = _mm256_permutevar8x32_epi32( quads, _mm256_setr_epi32( 0, 4, 1, 5, 0, 0, 0, 0 ) );
+                    _mm_storeu_si128( reinterpret_cast< __m128i* >( sums + xo ), _mm256_castsi256_si128( ordered ) );
+                }
+            }
+#endif
+            for( ; xo < m_outputSpatialSize; xo++ )
+            {
+                uint32_t sum = 0;
+                for( uint32_t s = 0; s < m_spatialBinning; s++ )
+                {
+                    sum += acc[ xo * m_spatialBinning + s ];
+                }
+                sums[ xo ] = sum;
+            }
+        }
+
+        //! a_output = round( m_sums * a_scale )
+        void scaleRow( float a_scale, unsigned short* a_output ) const
+        {
+            const uint32_t* sums = m_sums.data();
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256 scale = _mm256_set1_ps( a_scale );
+            for( ; x + 16 <= m_outputSpatialSize; x += 16 )
+            {
+                const __m256i lo = _mm256_cvtps_epi32( _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sums + x ) ) ), scale ) );
+                const __m256i hi = _mm256_cvtps_epi32( _mm256_mul_ps( _mm256_cvtepi32_ps( _mm256_loadu_si256( reinterpret_cast< const __m256i* >( sums + x + 8 ) ) ), scale ) );
+                _mm256_storeu_si256( reinterpret_cast< __m256i* >( a_output + x ), _mm256_permute4x64_epi64( _mm256_packus_epi32( lo, hi ), 0xD8 ) );
+            }
+#endif
+            for( ; x < m_outputSpatialSize; x++ )
+            {
+                a_output[ x ] = static_cast< unsigned short >( std::nearbyint( static_cast< float >( sums[ x ] ) * a_scale ) );
+            }
+        }
+
+        unsigned short m_spatialBinning{ 1 }; //!< Spatial binning.
+        unsigned short m_spectralBinning{ 1 }; //!< Spectral binning.
+        std::vector< int > m_roi; //!< Spectral ROI, empty for all bands.
+        std::vector< uint32_t > m_bands; //!< Active bands.
+        std::vector< uint32_t > m_accumulator; //!< Sum of bands in current spectral bin.
+        std::vector< uint32_t > m_sums; //!< Sum of current spectral and spatial bin.
+        uint32_t m_inputSpectralSize{ 0 }; //!< Spectral size of input.
+        uint32_t m_inputSpatialSize{ 0 }; //!< Spatial size of input.
+        uint32_t m_outputSpectralSize{ 0 }; //!< Spectral size of output.
+        uint32_t m_outputSpatialSize{ 0 }; //!< Spatial size of output.
+    };
+}
+
+#endif // HYSPEX_SOFTWAREBINNING_H
@@ -0,0 +1,261 @@
+#ifndef HYSPEX_SPECTRABATCH_H
+#define HYSPEX_SPECTRABATCH_H
+#pragma once
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "FloatImageReader.h"
+#include "SpectralResampler.h"
+
+namespace hyspex
+{
+    /*!
+    * Normalization applied to each spectrum in a SpectraBatch.
+    */
+    typedef enum
+    {
+        HYSPEX_NORMALIZE_NONE = 0,    //!< Resampled values as is.
+        HYSPEX_NORMALIZE_SCALE = 1,   //!< value * scale + offset.
+        HYSPEX_NORMALIZE_L2 = 2,      //!< Divide by L2 norm of spectrum.
+        HYSPEX_NORMALIZE_MINMAX = 3,  //!< Map min and max of spectrum to 0 and 1.
+        HYSPEX_NORMALIZE_STANDARD = 4 //!< Zero mean and unit standard deviation per spectrum.
+    } SpectraNormalization;
+
+    /*!
+    * @brief Converts a frame into a batch of resampled, normalized spectra for inference.
+    *
+    * The output is one contiguous float32 array of shape [ spatial_size, target samples ] ( C order ), i.e. one spectrum per
+    * spatial pixel with the samples contiguous, ready to be passed as a batch to a 1D CNN. Resampling to the target grid is done
+    * on whole spectral lines ( see SpectralResampler ), followed by a blocked transpose and per-spectrum normalization.
+    *
+    * The batch is owned by this class and valid until the next call to apply(). getBatch() can be wrapped by numpy or a tensor
+    * library without copying, e.g. numpy.frombuffer() or torch::from_blob().
+    *
+    * EXAMPLE:
+    * @code
+    * std::vector< double > grid( 256 );
+    * for( size_t i = 0; i < grid.size(); i++ )
+    * {
+    *     grid[ i ] = 400.0 + i * 2.0;
+    * }
+    * hyspex::SpectraBatch batch;
+    * batch.prepare( camera, grid );
+    * batch.setNormalization( hyspex::HYSPEX_NORMALIZE_L2 );
+    *
+    * hyspex::FloatImageReader reader( camera );
+    * const hyspex::ImageLine< float >& image = reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * if( image.buffer.size > 0 && batch.apply( image ) == hyspex::HYSPEX_OK )
+    * {
+    *     run_inference( batch.getBatch(), batch.getBatchSize(), batch.getSampleCount() );
+    * }
+    * @endcode
+    */
+    class SpectraBatch
+    {
+    public:
+        //! Resample from HYSPEX_CALIB_SPECTRAL_PER_BAND of a_camera to a_target wavelengths.
+        ReturnCode prepare( const Camera* a_camera, const std::vector< double >& a_target )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            const ConstBuffer< double >& wavelengths = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+            return prepare( std::vector< double >( wavelengths.data, wavelengths.data + wavelengths.size ), a_target );
+        }
+
+        //! Resample from a_source to a_target wavelengths. Both must be increasing.
+        ReturnCode prepare( const std::vector< double >& a_source, const std::vector< double >& a_target )
+        {
+            return m_resampler.prepareLinear( a_source, a_target );
+        }
+
+        //! Resampler used, for other kernels than linear interpolation ( e.g. SpectralResampler::prepare() with FWHM and per pixel kernels ).
+        SpectralResampler& resampler() { return m_resampler; }
+
+        //! Set normalization, a_scale and a_offset are only used by HYSPEX_NORMALIZE_SCALE.
+        void setNormalization( SpectraNormalization a_mode, float a_scale = 1.0f, float a_offset = 0.0f )
+        {
+            m_normalization = a_mode;
+            m_scale = a_scale;
+            m_offset = a_offset;
+        }
+
+        SpectraNormalization getNormalization() const { return m_normalization; } //!< Get normalization.
+
+        //! Build batch from a_image, which must have getSourceSize() spectral lines. Only a_layout HYSPEX_LAYOUT_BIL is supported.
+        ReturnCode apply( const ImageLine< float >& a_image, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( m_resampler.getTargetSize() == 0 || a_image.spectral_size != m_resampler.getSourceSize() ||
+                a_image.buffer.size != static_cast< uint64_t >( a_image.spectral_size ) * a_image.spatial_size || a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t samples = m_resampler.getTargetSize();
+            m_resampled.resize( samples * a_image.spatial_size );
+            m_batch.resize( samples * a_image.spatial_size );
+            HYSPEX_RETURN_IF_ERROR_VAL( m_resampler.apply( a_image.buffer.data, a_image.spatial_size, m_resampled.data() ) );
+            transposeImage( m_resampled.data(), samples, a_image.spatial_size, m_batch.data() );
+
+            for( uint32_t i = 0; i < a_image.spatial_size; i++ )
+            {
+                normalize( &m_batch[ i * samples ], samples );
+            }
+            m_batchSize = a_image.spatial_size;
+            m_frameNumber = a_image.stat.frame_number;
+            return HYSPEX_OK;
+        }
+
+        //! Same as above for unsigned short images ( e.g. from FileReader::getImage() ).
+        ReturnCode apply( const ImageLine< unsigned short >& a_image )
+        {
+            if( a_image.buffer.size != static_cast< uint64_t >( a_image.spectral_size ) * a_image.spatial_size )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_converted.resize( a_image.spectral_size, a_image.spatial_size );
+            m_converted.copyMetadata( a_image );
+            convertToFloat( a_image.buffer.data, m_converted.data(), a_image.buffer.size );
+            return apply( m_converted.line() );
+        }
+
+        const float* getBatch() const { return m_batch.data(); } //!< Batch data, [ getBatchSize(), getSampleCount() ] in C order.
+        uint32_t getBatchSize() const { return m_batchSize; } //!< Number of spectra ( spatial size of last image ).
+        size_t getSampleCount() const { return m_resampler.getTargetSize(); } //!< Number of samples per spectrum.
+        uint64_t getFrameNumber() const { return m_frameNumber; } //!< Frame number of last image.
+
+    private:
+        void normalize( float* a_spectrum, size_t a_size ) const
+        {
+            float scale = 1.0f;
+            float offset = 0.0f;
+            switch( m_normalization )
+            {
+                case HYSPEX_NORMALIZE_NONE:
+                    return;
+                case HYSPEX_NORMALIZE_SCALE:
+                    scale = m_scale;
+                    offset = m_offset;
+                    break;
+                case HYSPEX_NORMALIZE_L2:
+                {
+                    double sum = 0.0;
+                    for( size_t i = 0; i < a_size; i++ )
+                    {
+                        sum += static_cast< double >( a_spectrum[ i ] ) * a_spectrum[ i ];
+                    }
+                    scale = sum > 0.0 ? static_cast< float >( 1.0 / std::sqrt( sum ) ) : 0.0f;
+                    break;
+                }
+                case HYSPEX_NORMALIZE_MINMAX:
+                {
+                    float min = a_spectrum[ 0 ];
+                    float max = a_spectrum[ 0 ];
+                    for( size_t i = 1; i < a_size; i++ )
+                    {
+                        min = a_spectrum[ i ] < min ? a_spectrum[ i ] : min;
+                        max = a_spectrum[ i ] > max ? a_spectrum[ i ] : max;
+                    }
+                    scale = max > min ? 1.0f / ( max - min ) : 0.0f;
+                    offset = -min * scale;
+                    break;
+                }
+                case HYSPEX_NORMALIZE_STANDARD:
+                {
+                    double sum = 0.0;
+                    double sum_squared = 0.0;
+                    for( size_t i = 0; i < a_size; i++ )
+                    {
+                        sum += a_spectrum[ i ];
+                        sum_squared += static_cast< double >( a_spectrum[ i ] ) * a_spectrum[ i ];
+                    }
+                    const double mean = sum / a_size;
+                    const double variance = sum_squared / a_size - mean * mean;
+                    scale = variance > 0.0 ? static_cast< float >( 1.0 / std::sqrt( variance ) ) : 0.0f;
+                    offset = static_cast< float >( -mean ) * scale;
+                    break;
+                }
+            }
+
+            size_t i = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            const __m256 scale_v = _mm256_set1_ps( scale );
+            const __m256 offset_v = _mm256_set1_ps( offset );
+            for( ; i + 8 <= a_size; i += 8 )
+            {
+                _mm256_storeu_ps( a_spectrum + i, _mm256_add_ps( _mm256_mul_ps( _mm256_loadu_ps( a_spectrum + i ), scale_v ), offset_v ) );
+            }
+#endif
+            for( ; i < a_size; i++ )
+            {
+                a_spectrum[ i ] = a_spectrum[ i ] * scale + offset;
+            }
+        }
+
+        SpectralResampler m_resampler; //!< Source to target wavelengths.
+        SpectraNormalization m_normalization{ HYSPEX_NORMALIZE_NONE }; //!< Normalization per spectrum.
+        float m_scale{ 1.0f }; //!< Used by HYSPEX_NORMALIZE_SCALE.
+        float m_offset{ 0.0f }; //!< Used by HYSPEX_NORMALIZE_SCALE.
+        ImageBuffer< float > m_converted; //!< Input converted from unsigned short.
+        std::vector< float > m_resampled; //!< Resampled image, target x spatial.
+        std::vector< float > m_batch; //!< Output, spatial x target.
+        uint32_t m_batchSize{ 0 }; //!< Spectra in m_batch.
+        uint64_t m_frameNumber{ 0 }; //!< Frame number of last image.
+    };
+
+    /*!
+    * @brief Receives spectra batches through Camera::registerImageCallback().
+    *
+    * Subclass and implement batchReceived(). Correction, resampling and normalization run on the library callback thread,
+    * so the batch is ready when batchReceived() is called. Configure batch() before calling setCameraForCallback().
+    * Only HYSPEX_LAYOUT_BIL is supported, with setLayout( HYSPEX_LAYOUT_BIP ) no batches are delivered.
+    *
+    * EXAMPLE:
+    * @code
+    * class Classifier : public hyspex::SpectraBatchCallback
+    * {
+    * public:
+    *     ~Classifier() { setCameraForCallback( nullptr ); }
+    *     void batchReceived( const hyspex::SpectraBatch& a_batch ) override
+    *     {
+    *         run_inference( a_batch.getBatch(), a_batch.getBatchSize(), a_batch.getSampleCount() );
+    *     }
+    * };
+    *
+    * Classifier classifier;
+    * classifier.batch().prepare( camera, grid );
+    * classifier.setCameraForCallback( camera, hyspex::HYSPEX_RE );
+    * @endcode
+    */
+    class SpectraBatchCallback : public FloatImageCallback
+    {
+    public:
+        SpectraBatch& batch() { return m_batch; } //!< Batch settings, do not change while receiving images.
+
+        //! Called for each image.
+        virtual void batchReceived( const SpectraBatch& /* a_batch */ )
+        {
+            // implement this so that we do not get virtual pointer nullreference error.
+        }
+
+        void imageReceived( ImageOptions /* a_options */, const ImageLine< float >& a_image ) override
+        {
+            if( m_batch.apply( a_image, getLayout() ) == HYSPEX_OK )
+            {
+                batchReceived( m_batch );
+            }
+        }
+
+    private:
+        SpectraBatch m_batch; //!< Batch built from each image.
+    };
+}
+
+#endif // HYSPEX_SPECTRABATCH_H
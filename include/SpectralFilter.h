@@ -0,0 +1,394 @@
+#ifndef HYSPEX_SPECTRALFILTER_H
+#define HYSPEX_SPECTRALFILTER_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Savitzky-Golay smoothing and spectral derivatives, or any other convolution along the spectral axis of frames.
+    *
+    * prepare() precomputes one kernel per output band: the least squares polynomial fit over the window around the band,
+    * evaluated ( or differentiated ) at the band. Inside the frame this is the classic symmetric Savitzky-Golay kernel,
+    * at the edges the window is shifted into the frame instead of padding. With wavelengths, the fit uses the real band
+    * positions, so uneven band spacing is handled and derivatives are per nm.
+    *
+    * apply() is a strided convolution along the spectral axis: spatial pixels are contiguous in a frame, so the SIMD
+    * lanes are pixels and every kernel weight is one broadcast multiply-add over a spectral line.
+    * apply() is const, so one prepared filter can be shared by the workers of a ProcessingGraph stage.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SpectralFilter filter;
+    * filter.setSavitzkyGolay( 11, 2, 1 ); // 11 band window, quadratic fit, first derivative.
+    * filter.prepare( camera );
+    *
+    * // live:
+    * hyspex::ProcessingStageConfig config;
+    * config.name = "derivative";
+    * config.options = hyspex::HYSPEX_RE;
+    * config.threads = 2;
+    * config.function = [&filter]( hyspex::ProcessingFrame& a_frame )
+    * {
+    *     return filter.apply( a_frame.image.line(), a_frame.output ) == hyspex::HYSPEX_OK;
+    * };
+    * graph.addStage( config );
+    *
+    * // batch:
+    * hyspex::ImageBuffer< float > output;
+    * hyspex::forEachImage< float >( file_reader, [&]( const hyspex::ImageLine< float >& a_image )
+    * {
+    *     return filter.apply( a_image, output ) == hyspex::HYSPEX_OK;
+    * } );
+    * @endcode
+    */
+    class SpectralFilter
+    {
+    public:
+        /*!
+        * Savitzky-Golay filter over a_window bands ( odd, >= 3 ) with a polynomial of a_order ( < a_window ),
+        * returning derivative a_derivative ( 0 = smoothing, 1, 2, <= a_order ). Call prepare() afterwards.
+        */
+        ReturnCode setSavitzkyGolay( uint32_t a_window, uint32_t a_order, uint32_t a_derivative = 0 )
+        {
+            if( a_window < 3 || a_window % 2 == 0 || a_order >= a_window || a_derivative > a_order || a_derivative > 2 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_window = a_window;
+            m_order = a_order;
+            m_derivative = a_derivative;
+            m_kernel.clear();
+            m_spectralSize = 0;
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Custom kernel ( odd size ), output[ y ] = sum of a_kernel[ j ] * input[ y + j - size / 2 ].
+        * Bands outside the frame are replaced by the first / last band. Call prepare() afterwards.
+        */
+        ReturnCode setKernel( const std::vector< float >& a_kernel )
+        {
+            if( a_kernel.empty() || a_kernel.size() % 2 == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_kernel = a_kernel;
+            m_window = static_cast< uint32_t >( a_kernel.size() );
+            m_spectralSize = 0;
+            return HYSPEX_OK;
+        }
+
+        //! Prepare for the spectral size, and with Savitzky-Golay the band wavelengths ( HYSPEX_CALIB_SPECTRAL_PER_BAND ), of a_camera.
+        ReturnCode prepare( const Camera* a_camera )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            const uint32_t spectral_size = static_cast< uint32_t >( a_camera->getSpectralSize() );
+            if( a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) )
+            {
+                const ConstBuffer< double >& wavelengths = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+                if( wavelengths.size == spectral_size )
+                {
+                    return prepare( std::vector< double >( wavelengths.data, wavelengths.data + wavelengths.size ) );
+                }
+            }
+            return prepare( spectral_size );
+        }
+
+        //! Prepare for frames of a_spectralSize evenly spaced bands, derivatives are per band.
+        ReturnCode prepare( uint32_t a_spectralSize )
+        {
+            std::vector< double > positions( a_spectralSize );
+            for( uint32_t y = 0; y < a_spectralSize; y++ )
+            {
+                positions[ y ] = static_cast< double >( y );
+            }
+            return prepare( positions );
+        }
+
+        //! Prepare for frames with one band per a_wavelengths ( increasing ), derivatives are per wavelength unit.
+        ReturnCode prepare( const std::vector< double >& a_wavelengths )
+        {
+            const size_t bands = a_wavelengths.size();
+            if( bands < m_window )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            for( size_t y = 1; y < bands; y++ )
+            {
+                if( !( a_wavelengths[ y ] > a_wavelengths[ y - 1 ] ) )
+                {
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+            }
+
+            const uint32_t half = m_window / 2;
+            std::vector< uint32_t > starts( bands );
+            std::vector< float > weights( bands * m_window, 0.0f );
+            for( size_t y = 0; y < bands; y++ )
+            {
+                float* row = weights.data() + y * m_window;
+                const size_t start = std::min( y > half ? y - half : 0, bands - m_window );
+                starts[ y ] = static_cast< uint32_t >( start );
+                if( !m_kernel.empty() )
+                {
+                    // fold taps outside the frame onto the edge bands, so every row reads a window inside the frame.
+                    for( uint32_t j = 0; j < m_window; j++ )
+                    {
+                        const long band = static_cast< long >( y ) + static_cast< long >( j ) - static_cast< long >( half );
+                        const long clamped = std::min( std::max( band, 0L ), static_cast< long >( bands ) - 1 );
+                        row[ clamped - static_cast< long >( start ) ] += m_kernel[ j ];
+                    }
+                }
+                else
+                {
+                    HYSPEX_RETURN_IF_ERROR_VAL( fitKernel( a_wavelengths.data() + start, a_wavelengths[ y ], row ) );
+                }
+            }
+            m_starts.swap( starts );
+            m_weights.swap( weights );
+            m_spectralSize = static_cast< uint32_t >( bands );
+            return HYSPEX_OK;
+        }
+
+        bool isPrepared() const { return m_spectralSize > 0; } //!< prepare() succeeded.
+        uint32_t getWindow() const { return m_window; } //!< Kernel size in bands.
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Spectral size prepared for.
+        const std::vector< float >& getWeights() const { return m_weights; } //!< Kernel per output band, spectral size x window.
+        const std::vector< uint32_t >& getStarts() const { return m_starts; } //!< First input band of each kernel.
+
+        //! Filter a_image into a_output, including metadata. Only a_layout HYSPEX_LAYOUT_BIL is supported. Thread-safe.
+        ReturnCode apply( const ImageLine< float >& a_image, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return applyLine( a_image, a_output );
+        }
+
+        //! Same as above for unsigned short input, converted on load.
+        ReturnCode apply( const ImageLine< unsigned short >& a_image, ImageBuffer< float >& a_output ) const
+        {
+            return applyLine( a_image, a_output );
+        }
+
+        //! Filter a frame ( spectral x a_spatialSize ) from a_input into a_output. Thread-safe.
+        ReturnCode apply( const float* a_input, uint32_t a_spatialSize, float* a_output ) const
+        {
+            return filter( a_input, a_spatialSize, a_output );
+        }
+
+        //! Same as above for unsigned short input.
+        ReturnCode apply( const unsigned short* a_input, uint32_t a_spatialSize, float* a_output ) const
+        {
+            return filter( a_input, a_spatialSize, a_output );
+        }
+
+    private:
+        template< typename T >
+        ReturnCode applyLine( const ImageLine< T >& a_image, ImageBuffer< float >& a_output ) const
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( a_image.spectral_size != m_spectralSize || a_image.buffer.size != static_cast< size_t >( a_image.spectral_size ) * a_image.spatial_size )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            a_output.resize( a_image.spectral_size, a_image.spatial_size );
+            a_output.copyMetadata( a_image );
+            return filter( a_image.buffer.data, a_image.spatial_size, a_output.data() );
+        }
+
+        //! Weights in a_row of the derivative at a_center of the polynomial fitted over m_window bands at a_positions.
+        ReturnCode fitKernel( const double* a_positions, double a_center, float* a_row ) const
+        {
+            // positions relative to the center, scaled by the window width for conditioning.
+            const double scale = ( a_positions[ m_window - 1 ] - a_positions[ 0 ] ) / ( m_window - 1 );
+            const size_t terms = m_order + 1;
+            std::vector< double > t( m_window );
+            for( uint32_t j = 0; j < m_window; j++ )
+            {
+                t[ j ] = ( a_positions[ j ] - a_center ) / scale;
+            }
+
+            // normal equations ( V' V ) c = V' f, solve for the unit vector of the derivative term: weights = e_d' ( V' V )^-1 V'.
+            std::vector< double > normal( terms * terms, 0.0 );
+            for( size_t r = 0; r < terms; r++ )
+            {
+                for( size_t c = 0; c < terms; c++ )
+                {
+                    for( uint32_t j = 0; j < m_window; j++ )
+                    {
+                        normal[ r * terms + c ] += std::pow( t[ j ], static_cast< double >( r + c ) );
+                    }
+                }
+            }
+            std::vector< double > solution( terms, 0.0 );
+            solution[ m_derivative ] = 1.0;
+            if( !solveSymmetric( normal, terms, solution ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            double factorial = 1.0;
+            for( uint32_t d = 2; d <= m_derivative; d++ )
+            {
+                factorial *= d;
+            }
+            const double factor = factorial / std::pow( scale, static_cast< double >( m_derivative ) );
+            for( uint32_t j = 0; j < m_window; j++ )
+            {
+                double weight = 0.0;
+                double power = 1.0;
+                for( size_t r = 0; r < terms; r++ )
+                {
+                    weight += solution[ r ] * power;
+                    power *= t[ j ];
+                }
+                a_row[ j ] = static_cast< float >( weight * factor );
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Gaussian elimination with partial pivoting, a_vector is replaced by the solution.
+        static bool solveSymmetric( std::vector< double > a_matrix, size_t a_size, std::vector< double >& a_vector )
+        {
+            for( size_t c = 0; c < a_size; c++ )
+            {
+                size_t pivot = c;
+                for( size_t r = c + 1; r < a_size; r++ )
+                {
+                    if( std::fabs( a_matrix[ r * a_size + c ] ) > std::fabs( a_matrix[ pivot * a_size + c ] ) )
+                    {
+                        pivot = r;
+                    }
+                }
+                if( std::fabs( a_matrix[ pivot * a_size + c ] ) < 1e-300 )
+                {
+                    return false;
+                }
+                for( size_t k = 0; k < a_size; k++ )
+                {
+                    std::swap( a_matrix[ c * a_size + k ], a_matrix[ pivot * a_size + k ] );
+                }
+                std::swap( a_vector[ c ], a_vector[ pivot ] );
+                for( size_t r = c + 1; r < a_size; r++ )
+                {
+                    const double ratio = a_matrix[ r * a_size + c ] / a_matrix[ c * a_size + c ];
+                    for( size_t k = c; k < a_size; k++ )
+                    {
+                        a_matrix[ r * a_size + k ] -= ratio * a_matrix[ c * a_size + k ];
+                    }
+                    a_vector[ r ] -= ratio * a_vector[ c ];
+                }
+            }
+            for( size_t r = a_size; r-- > 0; )
+            {
+                double sum = a_vector[ r ];
+                for( size_t k = r + 1; k < a_size; k++ )
+                {
+                    sum -= a_matrix[ r * a_size + k ] * a_vector[ k ];
+                }
+                a_vector[ r ] = sum / a_matrix[ r * a_size + r ];
+            }
+            return true;
+        }
+
+#ifdef HYSPEX_PROCESSING_AVX2
+        static __m256 load8( const float* a_input ) { return _mm256_loadu_ps( a_input ); }
+        static __m256 load8( const unsigned short* a_input )
+        {
+            return _mm256_cvtepi32_ps( _mm256_cvtepu16_epi32( _mm_loadu_si128( reinterpret_cast< const __m128i* >( a_input ) ) ) );
+        }
+#endif
+
+        template< typename T >
+        ReturnCode filter( const T* a_input, uint32_t a_spatialSize, float* a_output ) const
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( !a_input || !a_output )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t stride = a_spatialSize;
+            for( uint32_t y = 0; y < m_spectralSize; y++ )
+            {
+                const float* row = m_weights.data() + static_cast< size_t >( y ) * m_window;
+                const T* input = a_input + static_cast< size_t >( m_starts[ y ] ) * stride;
+                float* output = a_output + static_cast< size_t >( y ) * stride;
+                size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+                // 32 pixels per pass, so the kernel weights are broadcast once per four vectors.
+                for( ; x + 32 <= stride; x += 32 )
+                {
+                    __m256 acc0 = _mm256_setzero_ps();
+                    __m256 acc1 = _mm256_setzero_ps();
+                    __m256 acc2 = _mm256_setzero_ps();
+                    __m256 acc3 = _mm256_setzero_ps();
+                    for( uint32_t j = 0; j < m_window; j++ )
+                    {
+                        const __m256 weight = _mm256_set1_ps( row[ j ] );
+                        const T* band = input + j * stride + x;
+                        acc0 = _mm256_add_ps( acc0, _mm256_mul_ps( weight, load8( band ) ) );
+                        acc1 = _mm256_add_ps( acc1, _mm256_mul_ps( weight, load8( band + 8 ) ) );
+                        acc2 = _mm256_add_ps( acc2, _mm256_mul_ps( weight, load8( band + 16 ) ) );
+                        acc3 = _mm256_add_ps( acc3, _mm256_mul_ps( weight, load8( band + 24 ) ) );
+                    }
+                    _mm256_storeu_ps( output + x, acc0 );
+                    _mm256_storeu_ps( output + x + 8, acc1 );
+                    _mm256_storeu_ps( output + x + 16, acc2 );
+                    _mm256_storeu_ps( output + x + 24, acc3 );
+                }
+                for( ; x + 8 <= stride; x += 8 )
+                {
+                    __m256 acc = _mm256_setzero_ps();
+                    for( uint32_t j = 0; j < m_window; j++ )
+                    {
+                        acc = _mm256_add_ps( acc, _mm256_mul_ps( _mm256_set1_ps( row[ j ] ), load8( input + j * stride + x ) ) );
+                    }
+                    _mm256_storeu_ps( output + x, acc );
+                }
+#endif
+                if( x < stride )
+                {
+                    std::fill( output + x, output + stride, 0.0f );
+                    for( uint32_t j = 0; j < m_window; j++ )
+                    {
+                        const float weight = row[ j ];
+                        const T* band = input + j * stride;
+                        for( size_t i = x; i < stride; i++ )
+                        {
+                            output[ i ] += weight * static_cast< float >( band[ i ] );
+                        }
+                    }
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+        uint32_t m_window{ 7 };            //!< Kernel size in bands.
+        uint32_t m_order{ 2 };             //!< Savitzky-Golay polynomial order.
+        uint32_t m_derivative{ 0 };        //!< Savitzky-Golay derivative.
+        std::vector< float > m_kernel;     //!< Custom kernel, empty for Savitzky-Golay.
+        uint32_t m_spectralSize{ 0 };      //!< Spectral size prepared for.
+        std::vector< uint32_t > m_starts;  //!< First input band per output band.
+        std::vector< float > m_weights;    //!< Kernel per output band, spectral size x m_window.
+    };
+}
+
+#endif // HYSPEX_SPECTRALFILTER_H
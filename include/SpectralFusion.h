@@ -0,0 +1,352 @@
+#ifndef HYSPEX_SPECTRALFUSION_H
+#define HYSPEX_SPECTRALFUSION_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "FloatCubeWriter.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Fuses a VNIR and a SWIR frame into one frame on the VNIR spatial grid, with one stacked spectrum per pixel.
+    *
+    * prepare() builds the cross-sensor table once: the view angle of every spatial pixel of both cameras comes from the lens
+    * field of view ( getLensFieldOfView(), degrees ), distributed over the pixels by the band averaged HYSPEX_CALIB_SPATIAL positions
+    * when available ( evenly otherwise ), plus an optional boresight offset of the SWIR camera. Each VNIR pixel gets the two
+    * neighbouring SWIR pixels and a linear weight.
+    *
+    * Output bands are the VNIR bands below the crossover wavelength followed by the SWIR bands at or above it. Per frame, the
+    * VNIR lines are copied and every SWIR line is resampled with the table ( AVX2 gathers ). VNIR pixels outside the SWIR field
+    * of view get 0 in the SWIR bands, see getValidRange(). Frames should be radiance or reflectance ( FloatImageReader ),
+    * e.g. the two images of an AcquisitionGroup tuple after FloatCorrection.
+    * apply() is const and thread-safe once prepared.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SpectralFusion fusion;
+    * fusion.setCrossover( 950.0 );
+    * fusion.prepare( vnir_camera, swir_camera );
+    *
+    * hyspex::FloatCubeWriter writer; // optional fused recording
+    * writer.open( "flight_fused" );
+    * fusion.describe( writer );
+    *
+    * hyspex::ImageBuffer< float > fused;
+    * if( fusion.apply( vnir_radiance.line(), swir_radiance.line(), fused ) == hyspex::HYSPEX_OK )
+    * {
+    *     writer.writeFrame( fused.line() );
+    * }
+    * @endcode
+    */
+    class SpectralFusion
+    {
+    public:
+        void setCrossover( double a_wavelength ) { m_crossover = a_wavelength; } //!< Wavelength ( nm ) where the SWIR bands take over, default 950. Call before prepare().
+        void setBoresightOffset( double a_radians ) { m_boresight = a_radians; } //!< Angle ( radians ) added to the SWIR view angles, from a boresight calibration. Call before prepare().
+        double getCrossover() const { return m_crossover; } //!< Crossover wavelength.
+        double getBoresightOffset() const { return m_boresight; } //!< SWIR boresight offset.
+
+        /*!
+        * View angle ( radians, 0 at the center of the field of view ) of every spatial pixel of a_camera, from the lens field of view,
+        * distributed by the band averaged spatial calibration when available.
+        */
+        static ReturnCode getViewAngles( const Camera* a_camera, std::vector< double >* a_angles )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_angles )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            // getLensFieldOfView() reports degrees, view angles are radians.
+            double field_of_view_degrees = 0.0;
+            HYSPEX_RETURN_IF_ERROR_VAL( a_camera->getLensFieldOfView( &field_of_view_degrees ) );
+            const double field_of_view_radians = field_of_view_degrees * 3.14159265358979323846 / 180.0;
+
+            const size_t spectral_size = a_camera->getSpectralSize();
+            const size_t spatial_size = a_camera->getSpatialSize();
+            if( spatial_size < 2 || !( field_of_view_radians > 0.0 ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            // relative position of each pixel center, 0 - 1 across the spatial size.
+            std::vector< double > positions( spatial_size );
+            for( size_t x = 0; x < spatial_size; x++ )
+            {
+                positions[ x ] = static_cast< double >( x );
+            }
+            if( a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPATIAL ) )
+            {
+                const ConstBuffer< double >& spatial = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPATIAL );
+                if( spatial.size == spectral_size * spatial_size )
+                {
+                    for( size_t x = 0; x < spatial_size; x++ )
+                    {
+                        double sum = 0.0;
+                        for( size_t y = 0; y < spectral_size; y++ )
+                        {
+                            sum += spatial.data[ y * spatial_size + x ];
+                        }
+                        positions[ x ] = sum / static_cast< double >( spectral_size );
+                    }
+                }
+            }
+
+            const double first = positions.front();
+            const double span = positions.back() - first;
+            if( span == 0.0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            // pixel centers span ( n - 1 ) / n of the field of view.
+            const double scale = field_of_view_radians * static_cast< double >( spatial_size - 1 ) / static_cast< double >( spatial_size );
+            a_angles->resize( spatial_size );
+            for( size_t x = 0; x < spatial_size; x++ )
+            {
+                ( *a_angles )[ x ] = ( ( positions[ x ] - first ) / span - 0.5 ) * scale;
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Build tables from the spectral calibration ( HYSPEX_CALIB_SPECTRAL_PER_BAND ) and view angles of both cameras.
+        ReturnCode prepare( const Camera* a_vnir, const Camera* a_swir )
+        {
+            if( !a_vnir || !a_swir )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_vnir->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) || !a_swir->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            const ConstBuffer< double >& vnir_wavelengths = a_vnir->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+            const ConstBuffer< double >& swir_wavelengths = a_swir->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+            std::vector< double > vnir_angles;
+            std::vector< double > swir_angles;
+            HYSPEX_RETURN_IF_ERROR_VAL( getViewAngles( a_vnir, &vnir_angles ) );
+            HYSPEX_RETURN_IF_ERROR_VAL( getViewAngles( a_swir, &swir_angles ) );
+            return prepare( std::vector< double >( vnir_wavelengths.data, vnir_wavelengths.data + vnir_wavelengths.size ), vnir_angles,
+                            std::vector< double >( swir_wavelengths.data, swir_wavelengths.data + swir_wavelengths.size ), swir_angles );
+        }
+
+        /*!
+        * Build tables from wavelengths ( nm, increasing ) and view angles ( radians, monotonic ) per spatial pixel of both cameras.
+        * The boresight offset is added to a_swirAngles.
+        */
+        ReturnCode prepare( const std::vector< double >& a_vnirWavelengths, const std::vector< double >& a_vnirAngles,
+                            const std::vector< double >& a_swirWavelengths, const std::vector< double >& a_swirAngles )
+        {
+            if( a_vnirWavelengths.empty() || a_swirWavelengths.empty() || a_vnirAngles.empty() || a_swirAngles.size() < 2 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            uint32_t vnir_bands = 0;
+            while( vnir_bands < a_vnirWavelengths.size() && a_vnirWavelengths[ vnir_bands ] < m_crossover )
+            {
+                vnir_bands++;
+            }
+            uint32_t swir_first = 0;
+            while( swir_first < a_swirWavelengths.size() && a_swirWavelengths[ swir_first ] < m_crossover )
+            {
+                swir_first++;
+            }
+            if( vnir_bands + a_swirWavelengths.size() - swir_first == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            // SWIR angles as increasing sequence, indices refer to the original order.
+            const size_t swir_size = a_swirAngles.size();
+            const bool reversed = a_swirAngles.back() < a_swirAngles.front();
+            std::vector< double > swir_angles( swir_size );
+            for( size_t x = 0; x < swir_size; x++ )
+            {
+                swir_angles[ x ] = a_swirAngles[ reversed ? swir_size - 1 - x : x ] + m_boresight;
+            }
+
+            const size_t vnir_size = a_vnirAngles.size();
+            std::vector< int32_t > indices( vnir_size, 0 );
+            std::vector< float > weights( vnir_size, 0.0f );
+            std::vector< float > mask( vnir_size, 0.0f );
+            uint32_t valid_first = static_cast< uint32_t >( vnir_size );
+            uint32_t valid_last = 0;
+            for( size_t x = 0; x < vnir_size; x++ )
+            {
+                const double angle = a_vnirAngles[ x ];
+                if( angle < swir_angles.front() || angle > swir_angles.back() )
+                {
+                    continue;
+                }
+                const size_t upper = std::min( static_cast< size_t >( std::upper_bound( swir_angles.begin(), swir_angles.end(), angle ) - swir_angles.begin() ), swir_size - 1 );
+                const size_t lower = upper - 1;
+                const double span = swir_angles[ upper ] - swir_angles[ lower ];
+                double weight = span > 0.0 ? ( angle - swir_angles[ lower ] ) / span : 0.0;
+                weight = std::min( std::max( weight, 0.0 ), 1.0 );
+                // table holds the left pixel in original order and the weight of the pixel to its right.
+                if( reversed )
+                {
+                    indices[ x ] = static_cast< int32_t >( swir_size - 1 - upper );
+                    weights[ x ] = static_cast< float >( 1.0 - weight );
+                }
+                else
+                {
+                    indices[ x ] = static_cast< int32_t >( lower );
+                    weights[ x ] = static_cast< float >( weight );
+                }
+                mask[ x ] = 1.0f;
+                valid_first = std::min( valid_first, static_cast< uint32_t >( x ) );
+                valid_last = static_cast< uint32_t >( x );
+            }
+
+            m_wavelengths.assign( a_vnirWavelengths.begin(), a_vnirWavelengths.begin() + vnir_bands );
+            m_wavelengths.insert( m_wavelengths.end(), a_swirWavelengths.begin() + swir_first, a_swirWavelengths.end() );
+            m_vnirSpectralSize = static_cast< uint32_t >( a_vnirWavelengths.size() );
+            m_vnirSpatialSize = static_cast< uint32_t >( vnir_size );
+            m_swirSpectralSize = static_cast< uint32_t >( a_swirWavelengths.size() );
+            m_swirSpatialSize = static_cast< uint32_t >( swir_size );
+            m_vnirBands = vnir_bands;
+            m_swirFirst = swir_first;
+            m_indices.swap( indices );
+            m_weights.swap( weights );
+            m_mask.swap( mask );
+            m_validFirst = valid_first;
+            m_validLast = valid_first < vnir_size ? valid_last : 0;
+            return HYSPEX_OK;
+        }
+
+        bool isPrepared() const { return !m_wavelengths.empty(); } //!< prepare() succeeded.
+        uint32_t getSpectralSize() const { return static_cast< uint32_t >( m_wavelengths.size() ); } //!< Bands of fused frames.
+        uint32_t getSpatialSize() const { return m_vnirSpatialSize; } //!< Spatial size of fused frames ( VNIR ).
+        uint32_t getVnirBandCount() const { return m_vnirBands; } //!< Leading bands from VNIR.
+        uint32_t getSwirFirstBand() const { return m_swirFirst; } //!< First SWIR band used.
+        const std::vector< double >& getWavelengths() const { return m_wavelengths; } //!< Wavelength of each fused band.
+
+        //! First and last VNIR pixel inside the SWIR field of view, first > last if none.
+        void getValidRange( uint32_t* a_first, uint32_t* a_last ) const
+        {
+            if( a_first )
+            {
+                *a_first = m_validFirst;
+            }
+            if( a_last )
+            {
+                *a_last = m_validLast;
+            }
+        }
+
+        //! Add wavelengths of the fused bands to a_writer, for a fused recording.
+        void describe( FloatCubeWriter& a_writer ) const
+        {
+            a_writer.setDescription( "VNIR / SWIR fused" );
+            a_writer.addHeaderField( "wavelength units", std::string( "nm" ) );
+            a_writer.addHeaderField( "wavelength", std::vector< float >( m_wavelengths.begin(), m_wavelengths.end() ) );
+        }
+
+        //! Fuse a_vnir and a_swir ( both in a_layout ) into a_output, with the metadata of a_vnir. Only HYSPEX_LAYOUT_BIL is supported. Thread-safe.
+        ReturnCode apply( const ImageLine< float >& a_vnir, const ImageLine< float >& a_swir, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( a_layout != HYSPEX_LAYOUT_BIL )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return fuse( a_vnir, a_swir, a_output );
+        }
+
+        //! Same as above for unsigned short frames, converted on the fly.
+        ReturnCode apply( const ImageLine< unsigned short >& a_vnir, const ImageLine< unsigned short >& a_swir, ImageBuffer< float >& a_output ) const
+        {
+            return fuse( a_vnir, a_swir, a_output );
+        }
+
+    private:
+        template< typename T >
+        ReturnCode fuse( const ImageLine< T >& a_vnir, const ImageLine< T >& a_swir, ImageBuffer< float >& a_output ) const
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( a_vnir.spectral_size != m_vnirSpectralSize || a_vnir.spatial_size != m_vnirSpatialSize ||
+                a_swir.spectral_size != m_swirSpectralSize || a_swir.spatial_size != m_swirSpatialSize ||
+                a_vnir.buffer.size != static_cast< size_t >( m_vnirSpectralSize ) * m_vnirSpatialSize ||
+                a_swir.buffer.size != static_cast< size_t >( m_swirSpectralSize ) * m_swirSpatialSize )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t spatial = m_vnirSpatialSize;
+            a_output.resize( getSpectralSize(), m_vnirSpatialSize );
+            a_output.copyMetadata( a_vnir );
+            float* output = a_output.data();
+            for( uint32_t y = 0; y < m_vnirBands; y++ )
+            {
+                const T* input = a_vnir.buffer.data + y * spatial;
+                std::transform( input, input + spatial, output + y * spatial, []( T a_value ) { return static_cast< float >( a_value ); } );
+            }
+            for( uint32_t y = m_swirFirst; y < m_swirSpectralSize; y++ )
+            {
+                resampleLine( a_swir.buffer.data + static_cast< size_t >( y ) * m_swirSpatialSize,
+                              output + static_cast< size_t >( m_vnirBands + y - m_swirFirst ) * spatial );
+            }
+            return HYSPEX_OK;
+        }
+
+        //! a_output[ x ] = mask * ( in[ i ] + w * ( in[ i + 1 ] - in[ i ] ) ), i and w from the table.
+        void resampleLine( const float* a_input, float* a_output ) const
+        {
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; x + 8 <= m_vnirSpatialSize; x += 8 )
+            {
+                const __m256i index = _mm256_loadu_si256( reinterpret_cast< const __m256i* >( m_indices.data() + x ) );
+                const __m256 left = _mm256_i32gather_ps( a_input, index, 4 );
+                const __m256 right = _mm256_i32gather_ps( a_input + 1, index, 4 );
+                const __m256 value = _mm256_add_ps( left, _mm256_mul_ps( _mm256_loadu_ps( m_weights.data() + x ), _mm256_sub_ps( right, left ) ) );
+                _mm256_storeu_ps( a_output + x, _mm256_mul_ps( value, _mm256_loadu_ps( m_mask.data() + x ) ) );
+            }
+#endif
+            for( ; x < m_vnirSpatialSize; x++ )
+            {
+                const float left = a_input[ m_indices[ x ] ];
+                const float right = a_input[ m_indices[ x ] + 1 ];
+                a_output[ x ] = m_mask[ x ] * ( left + m_weights[ x ] * ( right - left ) );
+            }
+        }
+
+        //! Same as above for unsigned short input.
+        void resampleLine( const unsigned short* a_input, float* a_output ) const
+        {
+            for( size_t x = 0; x < m_vnirSpatialSize; x++ )
+            {
+                const float left = static_cast< float >( a_input[ m_indices[ x ] ] );
+                const float right = static_cast< float >( a_input[ m_indices[ x ] + 1 ] );
+                a_output[ x ] = m_mask[ x ] * ( left + m_weights[ x ] * ( right - left ) );
+            }
+        }
+
+        double m_crossover{ 950.0 }; //!< Crossover wavelength in nm.
+        double m_boresight{ 0.0 }; //!< SWIR boresight offset in radians.
+        std::vector< double > m_wavelengths; //!< Fused band wavelengths.
+        uint32_t m_vnirSpectralSize{ 0 }; //!< VNIR bands.
+        uint32_t m_vnirSpatialSize{ 0 }; //!< VNIR pixels, also fused pixels.
+        uint32_t m_swirSpectralSize{ 0 }; //!< SWIR bands.
+        uint32_t m_swirSpatialSize{ 0 }; //!< SWIR pixels.
+        uint32_t m_vnirBands{ 0 }; //!< VNIR bands below crossover.
+        uint32_t m_swirFirst{ 0 }; //!< First SWIR band at or above crossover.
+        uint32_t m_validFirst{ 0 }; //!< First VNIR pixel inside SWIR field of view.
+        uint32_t m_validLast{ 0 }; //!< Last VNIR pixel inside SWIR field of view.
+        std::vector< int32_t > m_indices; //!< SWIR pixel left of each VNIR pixel.
+        std::vector< float > m_weights; //!< Weight of the SWIR pixel right of the index.
+        std::vector< float > m_mask; //!< 1 inside the SWIR field of view, 0 outside.
+    };
+}
+
+#endif // HYSPEX_SPECTRALFUSION_H
@@ -0,0 +1,522 @@
+#ifndef HYSPEX_SPECTRALMATCHER_H
+#define HYSPEX_SPECTRALMATCHER_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <string>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+#include "SpectralResampler.h"
+#include "SpectralStatistics.h"
+
+namespace hyspex
+{
+    /*!
+    * Read a spectrum in USGS splib07 ASCII format: one description line followed by one value per line.
+    * Used for both spectra and wavelength files. Values are returned as is, including the -1.23e34 "no data" marker.
+    */
+    inline bool readSplibFile( const std::string& a_path, std::string* a_description, std::vector< double >* a_values )
+    {
+        std::ifstream file( a_path );
+        if( !file || !a_values )
+        {
+            return false;
+        }
+
+        std::string line;
+        std::getline( file, line );
+        if( a_description )
+        {
+            const size_t end = line.find_last_not_of( " \t\r\n" );
+            *a_description = end == std::string::npos ? std::string() : line.substr( 0, end + 1 );
+        }
+
+        a_values->clear();
+        while( std::getline( file, line ) )
+        {
+            char* end = nullptr;
+            const double value = std::strtod( line.c_str(), &end );
+            if( end != line.c_str() )
+            {
+                a_values->push_back( value );
+            }
+        }
+        return !a_values->empty();
+    }
+
+    /*!
+    * @brief Reference spectra for SpectralMatcher, each with its own wavelength grid.
+    *
+    * EXAMPLE:
+    * @code
+    * std::vector< double > asd_wavelengths;
+    * hyspex::SpectralLibrary::loadSplibWavelengths( "splib07a_Wavelengths_ASD_0.35-2.5_microns_2151ch.txt", &asd_wavelengths );
+    * hyspex::SpectralLibrary library;
+    * library.loadSplibSpectrum( "splib07a_Actinolite_HS22.1B_ASDFRb_AREF.txt", asd_wavelengths );
+    * @endcode
+    */
+    class SpectralLibrary
+    {
+    public:
+        //! Add spectrum, a_wavelengths in nm and increasing. Samples that are not finite or below -1e6 ( no data ) are dropped.
+        ReturnCode addSpectrum( const std::string& a_name, const std::vector< double >& a_wavelengths, const std::vector< double >& a_values )
+        {
+            if( a_wavelengths.size() != a_values.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            Entry entry;
+            entry.name = a_name;
+            for( size_t i = 0; i < a_values.size(); i++ )
+            {
+                if( std::isfinite( a_values[ i ] ) && a_values[ i ] > -1e6 && std::isfinite( a_wavelengths[ i ] ) )
+                {
+                    if( !entry.wavelengths.empty() && a_wavelengths[ i ] <= entry.wavelengths.back() )
+                    {
+                        return HYSPEX_INVALID_ARGUMENTS;
+                    }
+                    entry.wavelengths.push_back( a_wavelengths[ i ] );
+                    entry.values.push_back( a_values[ i ] );
+                }
+            }
+            if( entry.values.size() < 2 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_entries.push_back( entry );
+            return HYSPEX_OK;
+        }
+
+        //! Add a splib07 spectrum file, named by its description line. a_wavelengths in nm, see loadSplibWavelengths().
+        ReturnCode loadSplibSpectrum( const std::string& a_path, const std::vector< double >& a_wavelengths )
+        {
+            std::string description;
+            std::vector< double > values;
+            if( !readSplibFile( a_path, &description, &values ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            return addSpectrum( description, a_wavelengths, values );
+        }
+
+        //! Read a splib07 wavelength file into nm, a_scale converts from the file unit ( microns ).
+        static ReturnCode loadSplibWavelengths( const std::string& a_path, std::vector< double >* a_wavelengths, double a_scale = 1000.0 )
+        {
+            if( !a_wavelengths )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( !readSplibFile( a_path, nullptr, a_wavelengths ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+            for( size_t i = 0; i < a_wavelengths->size(); i++ )
+            {
+                ( *a_wavelengths )[ i ] *= a_scale;
+            }
+            return HYSPEX_OK;
+        }
+
+        size_t getCount() const { return m_entries.size(); } //!< Number of spectra.
+        const std::string& getName( size_t a_index ) const { return m_entries.at( a_index ).name; } //!< Name of spectrum.
+        const std::vector< double >& getWavelengths( size_t a_index ) const { return m_entries.at( a_index ).wavelengths; } //!< Wavelengths of spectrum in nm.
+        const std::vector< double >& getValues( size_t a_index ) const { return m_entries.at( a_index ).values; } //!< Values of spectrum.
+        void clear() { m_entries.clear(); } //!< Remove all spectra.
+
+    private:
+        struct Entry
+        {
+            std::string name;                 //!< Name.
+            std::vector< double > wavelengths; //!< Valid wavelengths in nm.
+            std::vector< double > values;      //!< Values at wavelengths.
+        };
+
+        std::vector< Entry > m_entries; //!< Spectra.
+    };
+
+    //! Spectral calibration ( nm ) of a_camera, and FWHM per band when available ( a_fwhm empty otherwise ).
+    inline ReturnCode getCameraWavelengths( const Camera* a_camera, std::vector< double >* a_wavelengths, std::vector< double >* a_fwhm )
+    {
+        if( !a_camera )
+        {
+            return HYSPEX_INVALID_HANDLE;
+        }
+        if( !a_wavelengths || !a_fwhm )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+        if( !a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_PER_BAND ) )
+        {
+            return HYSPEX_SETTING_NOT_FOUND;
+        }
+        const ConstBuffer< double >& wavelengths = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_PER_BAND );
+        a_wavelengths->assign( wavelengths.data, wavelengths.data + wavelengths.size );
+        a_fwhm->clear();
+        if( a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_FWHM ) )
+        {
+            const ConstBuffer< double >& camera_fwhm = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_FWHM );
+            if( camera_fwhm.size == wavelengths.size )
+            {
+                a_fwhm->assign( camera_fwhm.data, camera_fwhm.data + camera_fwhm.size );
+            }
+        }
+        return HYSPEX_OK;
+    }
+
+    /*!
+    * Resample every spectrum of a_library to a_wavelengths ( nm, increasing ), with a_fwhm per band ( or one for all, empty for linear
+    * interpolation ), restricted to the bands covered by all spectra. These are a contiguous range, as each spectrum covers an interval:
+    * a_bandCount bands from a_firstBand. a_resampled is spectra x a_bandCount. Used by SpectralMatcher and Unmixer.
+    */
+    inline ReturnCode resampleLibrary( const SpectralLibrary& a_library, const std::vector< double >& a_wavelengths, const std::vector< double >& a_fwhm,
+                                       std::vector< float >* a_resampled, uint32_t* a_firstBand, uint32_t* a_bandCount )
+    {
+        const size_t count = a_library.getCount();
+        if( count == 0 || a_wavelengths.empty() || !a_resampled || !a_firstBand || !a_bandCount )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+
+        double lowest = -std::numeric_limits< double >::max();
+        double highest = std::numeric_limits< double >::max();
+        for( size_t m = 0; m < count; m++ )
+        {
+            lowest = std::max( lowest, a_library.getWavelengths( m ).front() );
+            highest = std::min( highest, a_library.getWavelengths( m ).back() );
+        }
+        size_t first = 0;
+        while( first < a_wavelengths.size() && a_wavelengths[ first ] < lowest )
+        {
+            first++;
+        }
+        size_t last = first;
+        while( last < a_wavelengths.size() && a_wavelengths[ last ] <= highest )
+        {
+            last++;
+        }
+        if( last - first < 2 )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+
+        const std::vector< double > target( a_wavelengths.begin() + first, a_wavelengths.begin() + last );
+        std::vector< double > target_fwhm( a_fwhm );
+        if( a_fwhm.size() == a_wavelengths.size() )
+        {
+            target_fwhm.assign( a_fwhm.begin() + first, a_fwhm.begin() + last );
+        }
+
+        const size_t bands = target.size();
+        std::vector< float > resampled( count * bands );
+        for( size_t m = 0; m < count; m++ )
+        {
+            SpectralResampler resampler;
+            HYSPEX_RETURN_IF_ERROR_VAL( resampler.prepareGaussian( a_library.getWavelengths( m ), {}, target, target_fwhm ) );
+            const std::vector< double >& values = a_library.getValues( m );
+            const std::vector< float > source( values.begin(), values.end() );
+            HYSPEX_RETURN_IF_ERROR_VAL( resampler.apply( source.data(), 1, resampled.data() + m * bands ) );
+        }
+        a_resampled->swap( resampled );
+        *a_firstBand = static_cast< uint32_t >( first );
+        *a_bandCount = static_cast< uint32_t >( bands );
+        return HYSPEX_OK;
+    }
+
+    /*!
+    * Metrics for SpectralMatcher.
+    */
+    typedef enum
+    {
+        HYSPEX_MATCH_SAM = 0, //!< Spectral angle in radians, lower is better.
+        HYSPEX_MATCH_SID = 1  //!< Spectral information divergence, lower is better.
+    } MatchMetric;
+
+    /*!
+    * @brief Matches every pixel of every frame against a SpectralLibrary.
+    *
+    * prepare() resamples the library to the camera bands once ( SpectralResampler, Gaussian with the camera FWHM when known ),
+    * restricted to the bands covered by all spectra, and stores it as a normalized spectra x bands matrix.
+    * apply() then scores pixels in blocks of 64 as matrix products ( multiplySpectra() ):
+    * - SAM: unit length library rows, angle = acos( max over spectra of l . x / | x | ).
+    * - SID: sum-normalized rows q and log q, SID = sum( p log p ) - sum( p log q ) + sum( q log q ) - sum( q log p ),
+    *   where the two cross terms are matrix products of x with log q, and of log x with q.
+    * The result is the best spectrum ( -1 if the score is above getMaximumScore() ) and its score per pixel.
+    * BIP frames ( FloatImageReader::setLayout(), pass the layout to apply() ) are gathered into band-major blocks of 64 pixels first, then scored the same way.
+    * Not thread-safe.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SpectralMatcher matcher;
+    * matcher.setMetric( hyspex::HYSPEX_MATCH_SAM );
+    * matcher.setMaximumScore( 0.1f ); // radians
+    * matcher.prepare( library, camera );
+    *
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * if( matcher.apply( image ) == hyspex::HYSPEX_OK )
+    * {
+    *     int32_t best = matcher.getMatches()[ x ]; // index into library, or -1.
+    *     float angle = matcher.getScores()[ x ];
+    * }
+    * @endcode
+    */
+    class SpectralMatcher
+    {
+    public:
+        void setMetric( MatchMetric a_metric ) { m_metric = a_metric; } //!< SAM or SID.
+        void setMaximumScore( float a_score ) { m_maximumScore = a_score; } //!< Pixels with a higher best score are reported as -1.
+        MatchMetric getMetric() const { return m_metric; } //!< SAM or SID.
+        float getMaximumScore() const { return m_maximumScore; } //!< Max accepted score.
+
+        //! Resample a_library to the spectral calibration ( and FWHM, if available ) of a_camera.
+        ReturnCode prepare( const SpectralLibrary& a_library, const Camera* a_camera )
+        {
+            std::vector< double > wavelengths;
+            std::vector< double > fwhm;
+            HYSPEX_RETURN_IF_ERROR_VAL( getCameraWavelengths( a_camera, &wavelengths, &fwhm ) );
+            return prepare( a_library, wavelengths, fwhm );
+        }
+
+        //! Resample a_library to a_wavelengths ( nm, increasing ), with a_fwhm per band ( or one for all, empty for linear interpolation ).
+        ReturnCode prepare( const SpectralLibrary& a_library, const std::vector< double >& a_wavelengths, const std::vector< double >& a_fwhm = {} )
+        {
+            std::vector< float > resampled;
+            uint32_t first = 0;
+            uint32_t bands = 0;
+            HYSPEX_RETURN_IF_ERROR_VAL( resampleLibrary( a_library, a_wavelengths, a_fwhm, &resampled, &first, &bands ) );
+
+            const size_t count = a_library.getCount();
+            m_count = count;
+            m_spectralSize = static_cast< uint32_t >( a_wavelengths.size() );
+            m_firstBand = first;
+            m_bandCount = bands;
+            m_unit.assign( count * bands, 0.0f );
+            m_distribution.assign( count * bands, 0.0f );
+            m_logDistribution.assign( count * bands, 0.0f );
+            m_entropy.assign( count, 0.0f );
+            const float epsilon = SID_EPSILON;
+            for( size_t m = 0; m < count; m++ )
+            {
+                const float* row = resampled.data() + m * bands;
+                double squares = 0.0;
+                double sum = 0.0;
+                for( size_t b = 0; b < bands; b++ )
+                {
+                    squares += static_cast< double >( row[ b ] ) * row[ b ];
+                    sum += std::max( row[ b ], epsilon );
+                }
+                const double norm = squares > 0.0 ? 1.0 / std::sqrt( squares ) : 0.0;
+                double entropy = 0.0;
+                for( size_t b = 0; b < bands; b++ )
+                {
+                    const double q = std::max( row[ b ], epsilon ) / sum;
+                    m_unit[ m * bands + b ] = static_cast< float >( row[ b ] * norm );
+                    m_distribution[ m * bands + b ] = static_cast< float >( q );
+                    m_logDistribution[ m * bands + b ] = static_cast< float >( std::log( q ) );
+                    entropy += q * std::log( q );
+                }
+                m_entropy[ m ] = static_cast< float >( entropy );
+            }
+            m_products.resize( count * BLOCK );
+            m_crossProducts.resize( count * BLOCK );
+            m_block.resize( bands * BLOCK );
+            m_logBlock.resize( bands * BLOCK );
+            m_gathered.resize( bands * BLOCK );
+            return HYSPEX_OK;
+        }
+
+        bool isPrepared() const { return m_count > 0; } //!< prepare() succeeded.
+        size_t getLibrarySize() const { return m_count; } //!< Number of library spectra.
+        uint32_t getFirstBand() const { return m_firstBand; } //!< First camera band used.
+        uint32_t getBandCount() const { return m_bandCount; } //!< Number of camera bands used.
+        const std::vector< int32_t >& getMatches() const { return m_matches; } //!< Best library index per pixel of last frame, -1 for no match.
+        const std::vector< float >& getScores() const { return m_scores; } //!< Best score per pixel of last frame.
+
+        //! Match all pixels of a_image, stored in a_layout ( BIL or BIP ).
+        ReturnCode apply( const ImageLine< float >& a_image, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            return apply( a_image.buffer.data, a_image.buffer.size, a_image.spectral_size, a_image.spatial_size, a_layout );
+        }
+
+        //! Same as above for unsigned short input.
+        ReturnCode apply( const ImageLine< unsigned short >& a_image )
+        {
+            m_converted.resize( a_image.buffer.size );
+            convertToFloat( a_image.buffer.data, m_converted.data(), a_image.buffer.size );
+            return apply( m_converted.data(), a_image.buffer.size, a_image.spectral_size, a_image.spatial_size );
+        }
+
+        //! Match all pixels of a_image, and write matches ( line 0, as float ) and scores ( line 1 ) to a_output, including metadata.
+        ReturnCode apply( const ImageLine< float >& a_image, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( apply( a_image, a_layout ) );
+            a_output.resize( 2, a_image.spatial_size );
+            a_output.copyMetadata( a_image );
+            for( uint32_t x = 0; x < a_image.spatial_size; x++ )
+            {
+                a_output.data()[ x ] = static_cast< float >( m_matches[ x ] );
+                a_output.data()[ a_image.spatial_size + x ] = m_scores[ x ];
+            }
+            return HYSPEX_OK;
+        }
+
+        //! Match all pixels of a frame, spectral x spatial ( BIL ) or spatial x spectral ( BIP ).
+        ReturnCode apply( const float* a_data, size_t a_size, uint32_t a_spectralSize, uint32_t a_spatialSize, ImageLayout a_layout = HYSPEX_LAYOUT_BIL )
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( !a_data || a_spectralSize != m_spectralSize || a_size != static_cast< size_t >( a_spectralSize ) * a_spatialSize ||
+                ( a_layout != HYSPEX_LAYOUT_BIL && a_layout != HYSPEX_LAYOUT_BIP ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            m_matches.resize( a_spatialSize );
+            m_scores.resize( a_spatialSize );
+            for( uint32_t first = 0; first < a_spatialSize; first += BLOCK )
+            {
+                const uint32_t pixels = std::min( static_cast< uint32_t >( BLOCK ), a_spatialSize - first );
+                const float* input = a_data + static_cast< size_t >( m_firstBand ) * a_spatialSize + first;
+                size_t stride = a_spatialSize;
+                if( a_layout == HYSPEX_LAYOUT_BIP )
+                {
+                    gatherBlock( a_data + static_cast< size_t >( first ) * a_spectralSize + m_firstBand, a_spectralSize, pixels );
+                    input = m_gathered.data();
+                    stride = BLOCK;
+                }
+                if( m_metric == HYSPEX_MATCH_SID )
+                {
+                    matchBlockSid( input, stride, pixels, first );
+                }
+                else
+                {
+                    matchBlockSam( input, stride, pixels, first );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        static const uint32_t BLOCK = 64; //!< Pixels matched together.
+        static constexpr float SID_EPSILON = 1e-6f; //!< Smallest value used in SID distributions.
+
+        //! Copy a_pixels BIP spectra ( a_stride apart, used bands from a_input ) into m_gathered, bands x BLOCK.
+        void gatherBlock( const float* a_input, size_t a_stride, uint32_t a_pixels )
+        {
+            const size_t bands = m_bandCount;
+            for( uint32_t x = 0; x < a_pixels; x++ )
+            {
+                const float* spectrum = a_input + x * a_stride;
+                for( size_t b = 0; b < bands; b++ )
+                {
+                    m_gathered[ b * BLOCK + x ] = spectrum[ b ];
+                }
+            }
+        }
+
+        void matchBlockSam( const float* a_input, size_t a_stride, uint32_t a_pixels, uint32_t a_first )
+        {
+            const size_t bands = m_bandCount;
+            multiplySpectra( m_unit.data(), m_count, bands, nullptr, a_input, a_stride, a_pixels, m_products.data(), BLOCK );
+
+            for( uint32_t x = 0; x < a_pixels; x++ )
+            {
+                float squares = 0.0f;
+                for( size_t b = 0; b < bands; b++ )
+                {
+                    const float value = a_input[ b * a_stride + x ];
+                    squares += value * value;
+                }
+                size_t best = 0;
+                for( size_t m = 1; m < m_count; m++ )
+                {
+                    if( m_products[ m * BLOCK + x ] > m_products[ best * BLOCK + x ] )
+                    {
+                        best = m;
+                    }
+                }
+                const float cosine = squares > 0.0f ? m_products[ best * BLOCK + x ] / std::sqrt( squares ) : 0.0f;
+                const float angle = std::acos( std::max( -1.0f, std::min( 1.0f, cosine ) ) );
+                store( a_first + x, best, angle, squares > 0.0f );
+            }
+        }
+
+        void matchBlockSid( const float* a_input, size_t a_stride, uint32_t a_pixels, uint32_t a_first )
+        {
+            const size_t bands = m_bandCount;
+            const float epsilon = SID_EPSILON;
+            float sums[ BLOCK ] = {};
+            float self[ BLOCK ] = {};
+            for( size_t b = 0; b < bands; b++ )
+            {
+                float* block = m_block.data() + b * BLOCK;
+                float* log_block = m_logBlock.data() + b * BLOCK;
+                for( uint32_t x = 0; x < a_pixels; x++ )
+                {
+                    block[ x ] = std::max( a_input[ b * a_stride + x ], epsilon );
+                    log_block[ x ] = std::log( block[ x ] );
+                    sums[ x ] += block[ x ];
+                    self[ x ] += block[ x ] * log_block[ x ];
+                }
+            }
+
+            // cross terms: x . log q and log x . q.
+            multiplySpectra( m_logDistribution.data(), m_count, bands, nullptr, m_block.data(), BLOCK, a_pixels, m_products.data(), BLOCK );
+            multiplySpectra( m_distribution.data(), m_count, bands, nullptr, m_logBlock.data(), BLOCK, a_pixels, m_crossProducts.data(), BLOCK );
+
+            for( uint32_t x = 0; x < a_pixels; x++ )
+            {
+                // sum( p log p ) - sum( p log q ) = ( self - x . log q ) / s - log s, sum( q log p ) = log x . q - log s.
+                const float inverse_sum = 1.0f / sums[ x ];
+                const float pixel_term = self[ x ] * inverse_sum;
+                size_t best = 0;
+                float best_score = std::numeric_limits< float >::max();
+                for( size_t m = 0; m < m_count; m++ )
+                {
+                    const float score = pixel_term - m_products[ m * BLOCK + x ] * inverse_sum + m_entropy[ m ] - m_crossProducts[ m * BLOCK + x ];
+                    if( score < best_score )
+                    {
+                        best_score = score;
+                        best = m;
+                    }
+                }
+                store( a_first + x, best, std::max( best_score, 0.0f ), true );
+            }
+        }
+
+        void store( uint32_t a_pixel, size_t a_best, float a_score, bool a_valid )
+        {
+            const bool accepted = a_valid && a_score <= m_maximumScore;
+            m_matches[ a_pixel ] = accepted ? static_cast< int32_t >( a_best ) : -1;
+            m_scores[ a_pixel ] = a_score;
+        }
+
+        MatchMetric m_metric{ HYSPEX_MATCH_SAM }; //!< SAM or SID.
+        float m_maximumScore{ std::numeric_limits< float >::max() }; //!< Max accepted score.
+        size_t m_count{ 0 }; //!< Library spectra.
+        uint32_t m_spectralSize{ 0 }; //!< Camera bands.
+        uint32_t m_firstBand{ 0 }; //!< First camera band used.
+        uint32_t m_bandCount{ 0 }; //!< Camera bands used.
+        std::vector< float > m_unit; //!< Unit length library, spectra x bands.
+        std::vector< float > m_distribution; //!< Sum-normalized library q, spectra x bands.
+        std::vector< float > m_logDistribution; //!< log q, spectra x bands.
+        std::vector< float > m_entropy; //!< sum( q log q ) per spectrum.
+        std::vector< float > m_products; //!< spectra x BLOCK scratch.
+        std::vector< float > m_crossProducts; //!< spectra x BLOCK scratch.
+        std::vector< float > m_block; //!< bands x BLOCK scratch, clamped input.
+        std::vector< float > m_logBlock; //!< bands x BLOCK scratch, log of clamped input.
+        std::vector< float > m_gathered; //!< bands x BLOCK scratch, BIP input in band-major order.
+        std::vector< float > m_converted; //!< Float copy of unsigned short input.
+        std::vector< int32_t > m_matches; //!< Best spectrum per pixel.
+        std::vector< float > m_scores; //!< Best score per pixel.
+    };
+}
+
+#endif // HYSPEX_SPECTRALMATCHER_H
@@ -0,0 +1,343 @@
+#ifndef HYSPEX_SPECTRALRESAMPLER_H
+#define HYSPEX_SPECTRALRESAMPLER_H
+#pragma once
+#include <cmath>
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Resamples whole frames from the camera bands to another wavelength grid.
+    *
+    * Each output band is a weighted sum of a few neighbouring input bands ( a sparse kernel ).
+    * The kernels are computed once in one of the prepare functions, and apply() evaluates them line by line with SIMD over all spatial pixels.
+    * Target wavelengths outside the source range use the closest edge band.
+    *
+    * Kernels:
+    * - prepareLinear(): linear interpolation between the two closest bands.
+    * - prepareGaussian(): Gaussian spectral response with the given target FWHM. The source FWHM is taken into account,
+    *   so the kernel is the Gaussian that turns a source band into a target band. Where the target is not wider than the
+    *   source ( plus half a band spacing ), the kernel falls back to linear interpolation, as bands can not be sharpened.
+    * - per pixel: same as above, but with one kernel per spatial pixel from HYSPEX_CALIB_SPECTRAL_PER_PIXEL, so smile is removed as well.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::SpectralResampler resampler;
+    * resampler.prepare( camera, target_wavelengths, { 10.0 }, true ); // 10 nm FWHM, per pixel kernels
+    *
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 ); // or convertToFloat() of a camera image.
+    * std::vector< float > output( resampler.getTargetSize() * image.spatial_size );
+    * resampler.apply( image.buffer.data, image.spatial_size, output.data() );
+    * @endcode
+    */
+    class SpectralResampler
+    {
+    public:
+        //! Linear interpolation between the two source bands surrounding each target wavelength. a_source must be increasing.
+        ReturnCode prepareLinear( const std::vector< double >& a_source, const std::vector< double >& a_target )
+        {
+            return prepareGaussian( a_source, {}, a_target, {} );
+        }
+
+        /*!
+        * Gaussian kernels for a_target wavelengths with a_targetFwhm ( one value per target or one value for all ).
+        * a_sourceFwhm is per source band, empty for infinitely narrow source bands. Empty a_targetFwhm gives linear interpolation.
+        */
+        ReturnCode prepareGaussian( const std::vector< double >& a_source, const std::vector< double >& a_sourceFwhm,
+                                    const std::vector< double >& a_target, const std::vector< double >& a_targetFwhm )
+        {
+            if( a_source.empty() || a_target.empty() || !validFwhm( a_sourceFwhm, a_source.size() ) || !validFwhm( a_targetFwhm, a_target.size() ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            clear();
+            m_sourceSize = a_source.size();
+            std::vector< float > weights;
+            for( size_t t = 0; t < a_target.size(); t++ )
+            {
+                uint32_t first = 0;
+                computeKernel( a_source.data(), 1, a_source.size(), a_sourceFwhm,
+                               a_target[ t ], fwhmAt( a_targetFwhm, t ), &first, weights );
+                m_kernels.push_back( Kernel{ first, static_cast< uint32_t >( weights.size() ), m_weights.size() } );
+                m_weights.insert( m_weights.end(), weights.begin(), weights.end() );
+            }
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Same as prepareGaussian(), with source wavelengths per pixel: a_source is a_spectralSize x a_spatialSize,
+        * like HYSPEX_CALIB_SPECTRAL_PER_PIXEL. apply() must then be called with a_spatialSize.
+        */
+        ReturnCode prepareGaussianPerPixel( const double* a_source, uint32_t a_spectralSize, uint32_t a_spatialSize, const std::vector< double >& a_sourceFwhm,
+                                            const std::vector< double >& a_target, const std::vector< double >& a_targetFwhm )
+        {
+            if( !a_source || a_spectralSize == 0 || a_spatialSize == 0 || a_target.empty() ||
+                !validFwhm( a_sourceFwhm, a_spectralSize ) || !validFwhm( a_targetFwhm, a_target.size() ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            clear();
+            m_sourceSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            std::vector< uint32_t > firsts( a_spatialSize );
+            std::vector< std::vector< float > > weights( a_spatialSize );
+            for( size_t t = 0; t < a_target.size(); t++ )
+            {
+                uint32_t first = a_spectralSize;
+                uint32_t last = 0;
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    computeKernel( a_source + x, a_spatialSize, a_spectralSize, a_sourceFwhm,
+                                   a_target[ t ], fwhmAt( a_targetFwhm, t ), &firsts[ x ], weights[ x ] );
+                    first = firsts[ x ] < first ? firsts[ x ] : first;
+                    const uint32_t end = firsts[ x ] + static_cast< uint32_t >( weights[ x ].size() );
+                    last = end > last ? end : last;
+                }
+
+                // union of all pixel kernels, stored as count x spatial weights with zeros outside each pixel kernel.
+                const Kernel kernel{ first, last - first, m_weights.size() };
+                m_weights.resize( m_weights.size() + static_cast< size_t >( kernel.count ) * a_spatialSize, 0.0f );
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    for( size_t k = 0; k < weights[ x ].size(); k++ )
+                    {
+                        m_weights[ kernel.offset + ( firsts[ x ] - first + k ) * a_spatialSize + x ] = weights[ x ][ k ];
+                    }
+                }
+                m_kernels.push_back( kernel );
+            }
+            return HYSPEX_OK;
+        }
+
+        /*!
+        * Prepare from camera calibration: HYSPEX_CALIB_SPECTRAL_PER_BAND or HYSPEX_CALIB_SPECTRAL_PER_PIXEL ( a_perPixel ) as source,
+        * and HYSPEX_CALIB_SPECTRAL_FWHM as source FWHM when available.
+        */
+        ReturnCode prepare( const Camera* a_camera, const std::vector< double >& a_target, const std::vector< double >& a_targetFwhm, bool a_perPixel = false )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+
+            const calib_matrix_e matrix = a_perPixel ? HYSPEX_CALIB_SPECTRAL_PER_PIXEL : HYSPEX_CALIB_SPECTRAL_PER_BAND;
+            if( !a_camera->getCalibrationMatrixAvailable( matrix ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            const ConstBuffer< double >& source = a_camera->getCalibrationMatrix( matrix );
+            std::vector< double > source_fwhm;
+            if( a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_SPECTRAL_FWHM ) )
+            {
+                const ConstBuffer< double >& fwhm = a_camera->getCalibrationMatrix( HYSPEX_CALIB_SPECTRAL_FWHM );
+                source_fwhm.assign( fwhm.data, fwhm.data + fwhm.size );
+            }
+
+            if( !a_perPixel )
+            {
+                return prepareGaussian( std::vector< double >( source.data, source.data + source.size ), source_fwhm, a_target, a_targetFwhm );
+            }
+
+            const uint32_t spatial_size = static_cast< uint32_t >( a_camera->getSpatialSize() );
+            if( spatial_size == 0 || source.size % spatial_size != 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            return prepareGaussianPerPixel( source.data, static_cast< uint32_t >( source.size / spatial_size ), spatial_size, source_fwhm, a_target, a_targetFwhm );
+        }
+
+        size_t getSourceSize() const { return m_sourceSize; } //!< Number of input bands.
+        size_t getTargetSize() const { return m_kernels.size(); } //!< Number of output bands.
+        bool isPerPixel() const { return m_spatialSize != 0; } //!< True if prepared with per pixel kernels.
+
+        /*!
+        * Resample a_input ( getSourceSize() x a_spatialSize ) into a_output ( getTargetSize() x a_spatialSize ).
+        * Layout is the same as for camera images: spectral lines after each other.
+        */
+        ReturnCode apply( const float* a_input, uint32_t a_spatialSize, float* a_output ) const
+        {
+            if( !a_input || !a_output || m_kernels.empty() || ( isPerPixel() && a_spatialSize != m_spatialSize ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            for( size_t t = 0; t < m_kernels.size(); t++ )
+            {
+                const Kernel& kernel = m_kernels[ t ];
+                const float* input = a_input + static_cast< size_t >( kernel.first ) * a_spatialSize;
+                float* output = a_output + t * a_spatialSize;
+                if( isPerPixel() )
+                {
+                    applyPerPixel( input, &m_weights[ kernel.offset ], kernel.count, a_spatialSize, output );
+                }
+                else
+                {
+                    applyPerBand( input, &m_weights[ kernel.offset ], kernel.count, a_spatialSize, output );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        struct Kernel
+        {
+            uint32_t first;  //!< First input band.
+            uint32_t count;  //!< Number of consecutive input bands.
+            size_t offset;   //!< Index of first weight in m_weights.
+        };
+
+        //! Same weights for all pixels.
+        static void applyPerBand( const float* a_input, const float* a_weights, uint32_t a_count, uint32_t a_spatialSize, float* a_output )
+        {
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; x + 8 <= a_spatialSize; x += 8 )
+            {
+                __m256 sum = _mm256_mul_ps( _mm256_set1_ps( a_weights[ 0 ] ), _mm256_loadu_ps( a_input + x ) );
+                for( uint32_t k = 1; k < a_count; k++ )
+                {
+                    sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_set1_ps( a_weights[ k ] ), _mm256_loadu_ps( a_input + k * a_spatialSize + x ) ) );
+                }
+                _mm256_storeu_ps( a_output + x, sum );
+            }
+#endif
+            for( ; x < a_spatialSize; x++ )
+            {
+                float sum = a_weights[ 0 ] * a_input[ x ];
+                for( uint32_t k = 1; k < a_count; k++ )
+                {
+                    sum += a_weights[ k ] * a_input[ k * a_spatialSize + x ];
+                }
+                a_output[ x ] = sum;
+            }
+        }
+
+        //! Weights are a_count x a_spatialSize, laid out like the input.
+        static void applyPerPixel( const float* a_input, const float* a_weights, uint32_t a_count, uint32_t a_spatialSize, float* a_output )
+        {
+            size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+            for( ; x + 8 <= a_spatialSize; x += 8 )
+            {
+                __m256 sum = _mm256_mul_ps( _mm256_loadu_ps( a_weights + x ), _mm256_loadu_ps( a_input + x ) );
+                for( uint32_t k = 1; k < a_count; k++ )
+                {
+                    const size_t offset = static_cast< size_t >( k ) * a_spatialSize + x;
+                    sum = _mm256_add_ps( sum, _mm256_mul_ps( _mm256_loadu_ps( a_weights + offset ), _mm256_loadu_ps( a_input + offset ) ) );
+                }
+                _mm256_storeu_ps( a_output + x, sum );
+            }
+#endif
+            for( ; x < a_spatialSize; x++ )
+            {
+                float sum = a_weights[ x ] * a_input[ x ];
+                for( uint32_t k = 1; k < a_count; k++ )
+                {
+                    const size_t offset = static_cast< size_t >( k ) * a_spatialSize + x;
+                    sum += a_weights[ offset ] * a_input[ offset ];
+                }
+                a_output[ x ] = sum;
+            }
+        }
+
+        /*!
+        * Kernel for one target wavelength from a_size source wavelengths a_stride apart.
+        * Weights sum to one, a_first is the first source band.
+        */
+        static void computeKernel( const double* a_source, size_t a_stride, size_t a_size, const std::vector< double >& a_sourceFwhm,
+                                   double a_center, double a_targetFwhm, uint32_t* a_first, std::vector< float >& a_weights )
+        {
+            a_weights.clear();
+            const double first_wavelength = a_source[ 0 ];
+            const double last_wavelength = a_source[ ( a_size - 1 ) * a_stride ];
+            if( a_size == 1 || a_center <= first_wavelength || a_center >= last_wavelength )
+            {
+                *a_first = ( a_size == 1 || a_center <= first_wavelength ) ? 0 : static_cast< uint32_t >( a_size - 1 );
+                a_weights.push_back( 1.0f );
+                return;
+            }
+
+            size_t upper = 1;
+            while( a_source[ upper * a_stride ] < a_center )
+            {
+                upper++;
+            }
+            const double lower_wavelength = a_source[ ( upper - 1 ) * a_stride ];
+            const double upper_wavelength = a_source[ upper * a_stride ];
+
+            // Gaussian that turns a source band into a target band: target variance minus source variance.
+            const double fwhm_to_sigma = 1.0 / 2.35482;
+            const double target_sigma = a_targetFwhm * fwhm_to_sigma;
+            const double source_sigma = fwhmAt( a_sourceFwhm, upper ) * fwhm_to_sigma;
+            const double half_spacing = 0.5 * ( upper_wavelength - lower_wavelength );
+            const double variance = target_sigma * target_sigma - source_sigma * source_sigma;
+            if( variance <= half_spacing * half_spacing )
+            {
+                const double t = ( a_center - lower_wavelength ) / ( upper_wavelength - lower_wavelength );
+                *a_first = static_cast< uint32_t >( upper - 1 );
+                a_weights.push_back( static_cast< float >( 1.0 - t ) );
+                a_weights.push_back( static_cast< float >( t ) );
+                return;
+            }
+
+            // truncate at 3 sigma.
+            const double sigma = std::sqrt( variance );
+            size_t begin = upper - 1;
+            while( begin > 0 && a_center - a_source[ ( begin - 1 ) * a_stride ] <= 3.0 * sigma )
+            {
+                begin--;
+            }
+            size_t end = upper + 1;
+            while( end < a_size && a_source[ end * a_stride ] - a_center <= 3.0 * sigma )
+            {
+                end++;
+            }
+
+            double sum = 0.0;
+            std::vector< double > weights( end - begin );
+            for( size_t b = begin; b < end; b++ )
+            {
+                const double d = ( a_source[ b * a_stride ] - a_center ) / sigma;
+                weights[ b - begin ] = std::exp( -0.5 * d * d );
+                sum += weights[ b - begin ];
+            }
+            *a_first = static_cast< uint32_t >( begin );
+            for( double weight : weights )
+            {
+                a_weights.push_back( static_cast< float >( weight / sum ) );
+            }
+        }
+
+        static bool validFwhm( const std::vector< double >& a_fwhm, size_t a_size )
+        {
+            return a_fwhm.empty() || a_fwhm.size() == 1 || a_fwhm.size() == a_size;
+        }
+
+        static double fwhmAt( const std::vector< double >& a_fwhm, size_t a_index )
+        {
+            return a_fwhm.empty() ? 0.0 : a_fwhm[ a_fwhm.size() == 1 ? 0 : a_index ];
+        }
+
+        void clear()
+        {
+            m_kernels.clear();
+            m_weights.clear();
+            m_sourceSize = 0;
+            m_spatialSize = 0;
+        }
+
+        std::vector< Kernel > m_kernels; //!< One kernel per output band.
+        std::vector< float > m_weights; //!< Weights for all kernels.
+        size_t m_sourceSize{ 0 }; //!< Number of input bands.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size for per pixel kernels, 0 for per band kernels.
+    };
+}
+
+#endif // HYSPEX_SPECTRALRESAMPLER_H
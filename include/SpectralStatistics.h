@@ -0,0 +1,316 @@
+#ifndef HYSPEX_SPECTRALSTATISTICS_H
+#define HYSPEX_SPECTRALSTATISTICS_H
+#pragma once
+#include <cstddef>
+#include <vector>
+#include "datatypes.h"
+#include "ImageBuffer.h"
+
+namespace hyspex
+{
+    //! Dot product of two float vectors, used by the spectral statistics helpers.
+    inline float dotProduct( const float* a_a, const float* a_b, size_t a_size )
+    {
+        size_t i = 0;
+        float sum = 0.0f;
+#ifdef HYSPEX_PROCESSING_AVX2
+        __m256 acc0 = _mm256_setzero_ps();
+        __m256 acc1 = _mm256_setzero_ps();
+        for( ; i + 16 <= a_size; i += 16 )
+        {
+            acc0 = _mm256_add_ps( acc0, _mm256_mul_ps( _mm256_loadu_ps( a_a + i ), _mm256_loadu_ps( a_b + i ) ) );
+            acc1 = _mm256_add_ps( acc1, _mm256_mul_ps( _mm256_loadu_ps( a_a + i + 8 ), _mm256_loadu_ps( a_b + i + 8 ) ) );
+        }
+        float lanes[ 8 ];
+        _mm256_storeu_ps( lanes, _mm256_add_ps( acc0, acc1 ) );
+        for( int k = 0; k < 8; k++ )
+        {
+            sum += lanes[ k ];
+        }
+#endif
+        for( ; i < a_size; i++ )
+        {
+            sum += a_a[ i ] * a_b[ i ];
+        }
+        return sum;
+    }
+
+    /*!
+    * a_output[ r, x ] = sum over b of a_matrix[ r, b ] * a_input[ b, x ] - a_bias[ r ] ( a_bias may be null ), for a_pixels pixels.
+    * a_matrix is a_rows x a_bands, a_input and a_output are band / row major with the given row strides ( spatial size of a frame ).
+    * Register blocked: 4 rows x 16 pixels per inner loop with AVX2. Used for projections and library matching.
+    */
+    inline void multiplySpectra( const float* a_matrix, size_t a_rows, size_t a_bands, const float* a_bias,
+                                 const float* a_input, size_t a_inputStride, size_t a_pixels, float* a_output, size_t a_outputStride )
+    {
+        const float* m = a_matrix;
+        size_t x = 0;
+#ifdef HYSPEX_PROCESSING_AVX2
+        for( ; x + 16 <= a_pixels; x += 16 )
+        {
+            size_t r = 0;
+            for( ; r + 4 <= a_rows; r += 4 )
+            {
+                __m256 acc[ 8 ];
+                for( int k = 0; k < 8; k++ )
+                {
+                    acc[ k ] = _mm256_setzero_ps();
+                }
+                for( size_t b = 0; b < a_bands; b++ )
+                {
+                    const __m256 in0 = _mm256_loadu_ps( a_input + b * a_inputStride + x );
+                    const __m256 in1 = _mm256_loadu_ps( a_input + b * a_inputStride + x + 8 );
+                    for( int k = 0; k < 4; k++ )
+                    {
+                        const __m256 weight = _mm256_set1_ps( m[ ( r + k ) * a_bands + b ] );
+                        acc[ 2 * k ] = _mm256_add_ps( acc[ 2 * k ], _mm256_mul_ps( weight, in0 ) );
+                        acc[ 2 * k + 1 ] = _mm256_add_ps( acc[ 2 * k + 1 ], _mm256_mul_ps( weight, in1 ) );
+                    }
+                }
+                for( int k = 0; k < 4; k++ )
+                {
+                    const __m256 bias = _mm256_set1_ps( a_bias ? a_bias[ r + k ] : 0.0f );
+                    _mm256_storeu_ps( a_output + ( r + k ) * a_outputStride + x, _mm256_sub_ps( acc[ 2 * k ], bias ) );
+                    _mm256_storeu_ps( a_output + ( r + k ) * a_outputStride + x + 8, _mm256_sub_ps( acc[ 2 * k + 1 ], bias ) );
+                }
+            }
+            for( ; r < a_rows; r++ )
+            {
+                __m256 acc0 = _mm256_setzero_ps();
+                __m256 acc1 = _mm256_setzero_ps();
+                for( size_t b = 0; b < a_bands; b++ )
+                {
+                    const __m256 weight = _mm256_set1_ps( m[ r * a_bands + b ] );
+                    acc0 = _mm256_add_ps( acc0, _mm256_mul_ps( weight, _mm256_loadu_ps( a_input + b * a_inputStride + x ) ) );
+                    acc1 = _mm256_add_ps( acc1, _mm256_mul_ps( weight, _mm256_loadu_ps( a_input + b * a_inputStride + x + 8 ) ) );
+                }
+                const __m256 bias = _mm256_set1_ps( a_bias ? a_bias[ r ] : 0.0f );
+                _mm256_storeu_ps( a_output + r * a_outputStride + x, _mm256_sub_ps( acc0, bias ) );
+                _mm256_storeu_ps( a_output + r * a_outputStride + x + 8, _mm256_sub_ps( acc1, bias ) );
+            }
+        }
+#endif
+        if( x < a_pixels )
+        {
+            for( size_t r = 0; r < a_rows; r++ )
+            {
+                float* output = a_output + r * a_outputStride;
+                const float bias = a_bias ? a_bias[ r ] : 0.0f;
+                for( size_t i = x; i < a_pixels; i++ )
+                {
+                    output[ i ] = -bias;
+                }
+                for( size_t b = 0; b < a_bands; b++ )
+                {
+                    const float weight = m[ r * a_bands + b ];
+                    const float* input = a_input + b * a_inputStride;
+                    for( size_t i = x; i < a_pixels; i++ )
+                    {
+                        output[ i ] += weight * input[ i ];
+                    }
+                }
+            }
+        }
+    }
+
+    /*!
+    * Sums over a range of pixels of one frame, from SpectralCovariance::accumulateRange().
+    */
+    struct SpectralCovarianceRange
+    {
+        std::vector< float > centered; //!< Pixels - reference, spectral x pixels of the range, scratch.
+        std::vector< double > sum;     //!< Sum of pixels - reference.
+        std::vector< double > scatter; //!< Lower triangle of sum of outer products of pixels - reference.
+        double weight{ 0.0 };          //!< Number of pixels.
+    };
+
+    /*!
+    * @brief Incremental mean and covariance of the pixel spectra of frames ( spectral x spatial ).
+    *
+    * Every spatial pixel of a frame is one sample. Sums are kept in double relative to the band means of the first frame,
+    * the per frame scatter matrix is computed in float with SIMD dot products over the spatial pixels.
+    * Optional exponential forgetting scales the old statistics before each frame. Used by RxDetector and SpectralProjection.
+    * accumulate() is beginFrame(), accumulateRange() over all pixels and addRange(); the ranges of a frame can be split over
+    * threads, as accumulateRange() is const. Not thread-safe otherwise.
+    */
+    class SpectralCovariance
+    {
+    public:
+        //! Weight of old statistics per frame ( 0 - 1 ], 1.0 keeps all frames.
+        ReturnCode setForgetting( double a_factor )
+        {
+            if( a_factor <= 0.0 || a_factor > 1.0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_forgetting = a_factor;
+            return HYSPEX_OK;
+        }
+
+        //! Clear statistics.
+        void reset()
+        {
+            m_spectralSize = 0;
+            m_spatialSize = 0;
+            m_weight = 0.0;
+        }
+
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Spectral size of statistics, 0 before first frame.
+        double getWeight() const { return m_weight; } //!< Number of samples ( weighted ) in statistics.
+
+        //! Add all pixels of a_data. A frame of another size resets the statistics.
+        ReturnCode accumulate( const float* a_data, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            HYSPEX_RETURN_IF_ERROR_VAL( beginFrame( a_data, a_spectralSize, a_spatialSize ) );
+            accumulateRange( a_data, 0, a_spatialSize, &m_range );
+            addRange( m_range );
+            return HYSPEX_OK;
+        }
+
+        //! Start adding a_data in ranges: a frame of another size resets the statistics, and forgetting is applied.
+        ReturnCode beginFrame( const float* a_data, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            if( !a_data || a_spectralSize == 0 || a_spatialSize == 0 )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( a_spectralSize != m_spectralSize || a_spatialSize != m_spatialSize )
+            {
+                initialize( a_data, a_spectralSize, a_spatialSize );
+            }
+
+            const size_t n = m_spectralSize;
+            if( m_forgetting < 1.0 )
+            {
+                m_weight *= m_forgetting;
+                for( size_t i = 0; i < n; i++ )
+                {
+                    m_sum[ i ] *= m_forgetting;
+                }
+                for( size_t i = 0; i < n * n; i++ )
+                {
+                    m_scatter[ i ] *= m_forgetting;
+                }
+            }
+
+            return HYSPEX_OK;
+        }
+
+        //! Sums of pixels a_first to a_first + a_count - 1 of a_data, a frame passed to beginFrame(), into a_range.
+        void accumulateRange( const float* a_data, size_t a_first, size_t a_count, SpectralCovarianceRange* a_range ) const
+        {
+            const size_t n = m_spectralSize;
+            const size_t pixels = m_spatialSize;
+            a_range->centered.resize( n * a_count );
+            a_range->sum.assign( n, 0.0 );
+            a_range->scatter.assign( n * n, 0.0 );
+            a_range->weight = static_cast< double >( a_count );
+            for( size_t i = 0; i < n; i++ )
+            {
+                const float reference = static_cast< float >( m_reference[ i ] );
+                const float* input = a_data + i * pixels + a_first;
+                float* centered = a_range->centered.data() + i * a_count;
+                double sum = 0.0;
+                for( size_t x = 0; x < a_count; x++ )
+                {
+                    centered[ x ] = input[ x ] - reference;
+                    sum += centered[ x ];
+                }
+                a_range->sum[ i ] = sum;
+            }
+            const float* centered = a_range->centered.data();
+            for( size_t i = 0; i < n; i++ )
+            {
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    a_range->scatter[ i * n + j ] = dotProduct( centered + i * a_count, centered + j * a_count, a_count );
+                }
+            }
+        }
+
+        //! Add a_range from accumulateRange() to the statistics.
+        void addRange( const SpectralCovarianceRange& a_range )
+        {
+            const size_t n = m_spectralSize;
+            for( size_t i = 0; i < n; i++ )
+            {
+                m_sum[ i ] += a_range.sum[ i ];
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    m_scatter[ i * n + j ] += a_range.scatter[ i * n + j ];
+                }
+            }
+            m_weight += a_range.weight;
+        }
+
+        /*!
+        * Mean ( spectral ) and covariance ( spectral x spectral, both triangles filled ) of the samples so far.
+        * Returns HYSPEX_NOT_ACTIVE with fewer than two samples.
+        */
+        ReturnCode getMeanAndCovariance( std::vector< double >* a_mean, std::vector< double >* a_covariance ) const
+        {
+            if( !a_mean || !a_covariance )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            if( m_spectralSize == 0 || m_weight <= 1.0 )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+
+            const size_t n = m_spectralSize;
+            std::vector< double > offset( n );
+            a_mean->resize( n );
+            for( size_t i = 0; i < n; i++ )
+            {
+                offset[ i ] = m_sum[ i ] / m_weight;
+                ( *a_mean )[ i ] = m_reference[ i ] + offset[ i ];
+            }
+            a_covariance->resize( n * n );
+            for( size_t i = 0; i < n; i++ )
+            {
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    const double value = m_scatter[ i * n + j ] / m_weight - offset[ i ] * offset[ j ];
+                    ( *a_covariance )[ i * n + j ] = value;
+                    ( *a_covariance )[ j * n + i ] = value;
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        void initialize( const float* a_data, uint32_t a_spectralSize, uint32_t a_spatialSize )
+        {
+            m_spectralSize = a_spectralSize;
+            m_spatialSize = a_spatialSize;
+            m_weight = 0.0;
+            const size_t n = a_spectralSize;
+
+            // statistics are accumulated relative to the first frame mean, for precision.
+            m_reference.assign( n, 0.0 );
+            for( size_t i = 0; i < n; i++ )
+            {
+                double sum = 0.0;
+                for( size_t x = 0; x < a_spatialSize; x++ )
+                {
+                    sum += a_data[ i * a_spatialSize + x ];
+                }
+                m_reference[ i ] = sum / a_spatialSize;
+            }
+            m_sum.assign( n, 0.0 );
+            m_scatter.assign( n * n, 0.0 );
+        }
+
+        uint32_t m_spectralSize{ 0 }; //!< Spectral size of statistics.
+        uint32_t m_spatialSize{ 0 }; //!< Spatial size of frames.
+        double m_forgetting{ 1.0 }; //!< Weight of old statistics per frame.
+        double m_weight{ 0.0 }; //!< Number of samples ( weighted ).
+        std::vector< double > m_reference; //!< Offset of accumulated samples.
+        std::vector< double > m_sum; //!< Sum of samples - m_reference.
+        std::vector< double > m_scatter; //!< Lower triangle of sum of outer products of samples - m_reference.
+        SpectralCovarianceRange m_range; //!< Scratch for accumulate().
+    };
+}
+
+#endif // HYSPEX_SPECTRALSTATISTICS_H
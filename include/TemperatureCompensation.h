@@ -0,0 +1,180 @@
+#ifndef HYSPEX_TEMPERATURECOMPENSATION_H
+#define HYSPEX_TEMPERATURECOMPENSATION_H
+#pragma once
+#include <chrono>
+#include <cmath>
+#include <map>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "FloatCorrection.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Live sensor temperature compensation from HYSPEX_CALIB_TEMPERATURE_COMPENSATION_MODEL.
+    *
+    * The model has a slope and an intercept per band: the relative response of band y at sensor temperature T is
+    * slope[ y ] * T + intercept[ y ], and compensation multiplies the band by the reciprocal.
+    * The temperature is sampled at most every getSampleInterval() ms and quantized into buckets of getBucketSize() degrees.
+    * One factor table per bucket is computed once and cached, so nothing is recomputed unless the bucket changes.
+    *
+    * The factors are applied by FloatCorrection::setBandFactors(), i.e. folded into the gain table of the fused correction,
+    * so compensation costs nothing per pixel. FloatImageReader and FloatImageCallback do this when given a TemperatureCompensation,
+    * and withhold images until the first temperature has been read.
+    * Not thread-safe.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::TemperatureCompensation compensation;
+    * compensation.prepare( camera );
+    * compensation.setBucketSize( 0.1 );
+    *
+    * hyspex::FloatImageReader reader( camera );
+    * reader.setTemperatureCompensation( &compensation );
+    * const hyspex::ImageLine< float >& image = reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * @endcode
+    */
+    class TemperatureCompensation
+    {
+    public:
+        //! Read model from a_camera, 2 x spectral: slopes followed by intercepts.
+        ReturnCode prepare( const Camera* a_camera )
+        {
+            if( !a_camera )
+            {
+                return HYSPEX_INVALID_HANDLE;
+            }
+            if( !a_camera->getCalibrationMatrixAvailable( HYSPEX_CALIB_TEMPERATURE_COMPENSATION_MODEL ) )
+            {
+                return HYSPEX_SETTING_NOT_FOUND;
+            }
+
+            const ConstBuffer< double >& model = a_camera->getCalibrationMatrix( HYSPEX_CALIB_TEMPERATURE_COMPENSATION_MODEL );
+            const size_t spectral_size = model.size / 2;
+            return setModel( std::vector< double >( model.data, model.data + spectral_size ),
+                             std::vector< double >( model.data + spectral_size, model.data + 2 * spectral_size ) );
+        }
+
+        //! Set slope and intercept per band.
+        ReturnCode setModel( const std::vector< double >& a_slopes, const std::vector< double >& a_intercepts )
+        {
+            if( a_slopes.empty() || a_slopes.size() != a_intercepts.size() )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_slopes = a_slopes;
+            m_intercepts = a_intercepts;
+            m_tables.clear();
+            m_bucketValid = false;
+            return HYSPEX_OK;
+        }
+
+        //! Quantization of temperature, in degrees. Clears cached tables.
+        void setBucketSize( double a_celsius )
+        {
+            if( a_celsius > 0.0 )
+            {
+                m_bucketSize = a_celsius;
+                m_tables.clear();
+                m_bucketValid = false;
+            }
+        }
+
+        double getBucketSize() const { return m_bucketSize; } //!< Bucket size in degrees.
+        void setSampleInterval( uint32_t a_ms ) { m_sampleIntervalMs = a_ms; } //!< Min time between temperature reads in update().
+        uint32_t getSampleInterval() const { return m_sampleIntervalMs; } //!< Sample interval in ms.
+        size_t getSpectralSize() const { return m_slopes.size(); } //!< Number of bands in model.
+        double getTemperature() const { return m_temperature; } //!< Last sampled temperature.
+
+        /*!
+        * Read sensor temperature from a_camera if the sample interval has passed.
+        * Returns true if the factors changed ( new bucket ), i.e. they must be applied again.
+        */
+        bool update( Camera* a_camera )
+        {
+            const std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if( !a_camera || ( m_sampled && now - m_lastSample < std::chrono::milliseconds( m_sampleIntervalMs ) ) )
+            {
+                return false;
+            }
+
+            double temperature = 0.0;
+            m_lastSample = now;
+            m_sampled = true;
+            if( a_camera->getTemperature( HYSPEX_TEMPERATURE_SENSOR, &temperature ) != HYSPEX_OK )
+            {
+                return false;
+            }
+            return setTemperature( temperature );
+        }
+
+        //! Set temperature directly ( e.g. from recorded metadata ). Returns true if the factors changed.
+        bool setTemperature( double a_temperature )
+        {
+            m_temperature = a_temperature;
+            const int bucket = static_cast< int >( std::floor( a_temperature / m_bucketSize ) );
+            if( m_bucketValid && bucket == m_bucket )
+            {
+                return false;
+            }
+
+            m_bucket = bucket;
+            m_bucketValid = true;
+            std::map< int, std::vector< float > >::iterator table = m_tables.find( bucket );
+            if( table == m_tables.end() )
+            {
+                if( m_tables.size() >= 256 )
+                {
+                    m_tables.clear();
+                }
+                table = m_tables.insert( std::make_pair( bucket, computeFactors( ( bucket + 0.5 ) * m_bucketSize ) ) ).first;
+            }
+            m_factors = &table->second;
+            return true;
+        }
+
+        //! Factor per band for the current bucket, empty before the first temperature.
+        const std::vector< float >& getFactors() const { return m_bucketValid ? *m_factors : m_empty; }
+
+        /*!
+        * Fold current factors into the gains of a_correction. HYSPEX_INVALID_ARGUMENTS if the model bands differ from its tables ( binning, ROI ),
+        * HYSPEX_NOT_ACTIVE before the first temperature has been read ( a_correction is not touched ).
+        */
+        ReturnCode applyTo( FloatCorrection& a_correction ) const
+        {
+            if( !m_bucketValid )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            return a_correction.setBandFactors( m_factors->data(), static_cast< uint32_t >( m_factors->size() ) );
+        }
+
+    private:
+        std::vector< float > computeFactors( double a_temperature ) const
+        {
+            std::vector< float > factors( m_slopes.size(), 1.0f );
+            for( size_t y = 0; y < m_slopes.size(); y++ )
+            {
+                const double response = m_slopes[ y ] * a_temperature + m_intercepts[ y ];
+                factors[ y ] = response > 0.0 ? static_cast< float >( 1.0 / response ) : 1.0f;
+            }
+            return factors;
+        }
+
+        std::vector< double > m_slopes; //!< Slope per band.
+        std::vector< double > m_intercepts; //!< Intercept per band.
+        std::map< int, std::vector< float > > m_tables; //!< Factors per temperature bucket.
+        const std::vector< float >* m_factors{ nullptr }; //!< Factors for current bucket.
+        std::vector< float > m_empty; //!< Returned before first temperature.
+        double m_bucketSize{ 0.1 }; //!< Bucket size in degrees.
+        double m_temperature{ 0.0 }; //!< Last temperature.
+        int m_bucket{ 0 }; //!< Current bucket.
+        bool m_bucketValid{ false }; //!< m_bucket and m_factors are valid.
+        uint32_t m_sampleIntervalMs{ 1000 }; //!< Min time between temperature reads.
+        bool m_sampled{ false }; //!< m_lastSample is valid.
+        std::chrono::steady_clock::time_point m_lastSample; //!< Time of last temperature read.
+    };
+}
+
+#endif // HYSPEX_TEMPERATURECOMPENSATION_H
@@ -0,0 +1,567 @@
+#ifndef HYSPEX_UNMIXING_H
+#define HYSPEX_UNMIXING_H
+#pragma once
+#include <algorithm>
+#include <cmath>
+#include <string>
+#include <thread>
+#include <vector>
+#include "datatypes.h"
+#include "Camera.h"
+#include "FileBatch.h"
+#include "FileReader.h"
+#include "FloatCubeWriter.h"
+#include "ImageBuffer.h"
+#include "SpectralMatcher.h"
+#include "SpectralStatistics.h"
+
+namespace hyspex
+{
+    /*!
+    * @brief Linear unmixing of every pixel into non-negative abundances of a set of endmembers, that sum to one.
+    *
+    * The endmembers ( from a SpectralLibrary resampled to the camera bands, or set directly ) are factorized once:
+    * with E the endmembers x bands matrix, sum-to-one is added as an extra weighted band ( FCLS ), giving the
+    * normal equations G a = E x + w 1 with G = E E' + w 1 1'. G is inverted once, so the unconstrained solution of
+    * a whole frame is one matrix product ( multiplySpectra(), SIMD ), or one dot product per pixel and endmember for BIP
+    * frames ( dotProduct(), contiguous spectra ). Only pixels with a negative abundance are
+    * solved again with an active set NNLS ( Lawson-Hanson ) on G, which works on endmembers x endmembers systems only.
+    *
+    * unmix() is const and can be called from several threads. unmixFile() uses this to unmix a FileReader in batches
+    * of frames across threads.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::Unmixer unmixer;
+    * unmixer.prepare( library, camera );
+    *
+    * hyspex::ImageBuffer< float > abundances;
+    * const hyspex::ImageLine< float >& image = float_reader.getNextImage( hyspex::HYSPEX_RE, 500 );
+    * if( unmixer.apply( image, abundances ) == hyspex::HYSPEX_OK )
+    * {
+    *     float fraction = abundances.data()[ endmember * image.spatial_size + x ];
+    * }
+    * @endcode
+    */
+    class Unmixer
+    {
+    public:
+        /*!
+        * Weight of the sum-to-one band relative to the mean endmember energy ( trace( E E' ) / endmembers ), default 1000.
+        * Higher enforces the sum more strictly, 0 gives non-negative least squares without sum-to-one. Call before prepare().
+        */
+        ReturnCode setSumToOneWeight( double a_weight )
+        {
+            if( a_weight < 0.0 || !std::isfinite( a_weight ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            m_sumToOneWeight = a_weight;
+            return HYSPEX_OK;
+        }
+
+        //! Resample a_library to the spectral calibration ( and FWHM, if available ) of a_camera.
+        ReturnCode prepare( const SpectralLibrary& a_library, const Camera* a_camera )
+        {
+            std::vector< double > wavelengths;
+            std::vector< double > fwhm;
+            HYSPEX_RETURN_IF_ERROR_VAL( getCameraWavelengths( a_camera, &wavelengths, &fwhm ) );
+            return prepare( a_library, wavelengths, fwhm );
+        }
+
+        //! Resample a_library to a_wavelengths ( nm, increasing ), with a_fwhm per band ( or one for all, empty for linear interpolation ).
+        ReturnCode prepare( const SpectralLibrary& a_library, const std::vector< double >& a_wavelengths, const std::vector< double >& a_fwhm = {} )
+        {
+            std::vector< float > resampled;
+            uint32_t first = 0;
+            uint32_t bands = 0;
+            HYSPEX_RETURN_IF_ERROR_VAL( resampleLibrary( a_library, a_wavelengths, a_fwhm, &resampled, &first, &bands ) );
+
+            std::vector< std::string > names( a_library.getCount() );
+            for( size_t m = 0; m < names.size(); m++ )
+            {
+                names[ m ] = a_library.getName( m );
+            }
+            return setEndmembers( resampled, static_cast< uint32_t >( names.size() ), static_cast< uint32_t >( a_wavelengths.size() ), first, bands, names );
+        }
+
+        /*!
+        * Set endmembers directly, a_endmembers is a_count x a_bandCount, for bands [ a_firstBand, a_firstBand + a_bandCount ) of
+        * frames with a_spectralSize bands. a_names are optional.
+        */
+        ReturnCode setEndmembers( const std::vector< float >& a_endmembers, uint32_t a_count, uint32_t a_spectralSize, uint32_t a_firstBand,
+                                  uint32_t a_bandCount, const std::vector< std::string >& a_names = {} )
+        {
+            if( a_count == 0 || a_bandCount == 0 || a_firstBand + static_cast< uint64_t >( a_bandCount ) > a_spectralSize ||
+                a_endmembers.size() != static_cast< size_t >( a_count ) * a_bandCount || ( !a_names.empty() && a_names.size() != a_count ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t k = a_count;
+            const size_t bands = a_bandCount;
+            std::vector< double > gram( k * k, 0.0 );
+            double trace = 0.0;
+            for( size_t i = 0; i < k; i++ )
+            {
+                for( size_t j = 0; j <= i; j++ )
+                {
+                    double sum = 0.0;
+                    for( size_t b = 0; b < bands; b++ )
+                    {
+                        sum += static_cast< double >( a_endmembers[ i * bands + b ] ) * a_endmembers[ j * bands + b ];
+                    }
+                    gram[ i * k + j ] = sum;
+                    gram[ j * k + i ] = sum;
+                }
+                trace += gram[ i * k + i ];
+            }
+            const double weight = m_sumToOneWeight * trace / static_cast< double >( k );
+            for( size_t i = 0; i < k * k; i++ )
+            {
+                gram[ i ] += weight;
+            }
+
+            // G^-1 column by column from the Cholesky factor, fails for linearly dependent endmembers.
+            std::vector< double > factor( gram );
+            if( !choleskyFactor( factor.data(), k, k ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+            std::vector< double > inverse( k * k, 0.0 );
+            std::vector< double > column( k );
+            for( size_t j = 0; j < k; j++ )
+            {
+                std::fill( column.begin(), column.end(), 0.0 );
+                column[ j ] = 1.0;
+                choleskySolve( factor.data(), k, k, column.data() );
+                for( size_t i = 0; i < k; i++ )
+                {
+                    inverse[ i * k + j ] = column[ i ];
+                }
+            }
+
+            // unconstrained solution a = G^-1 E x + w G^-1 1 = unmixing * x - bias.
+            m_unmixing.assign( k * bands, 0.0f );
+            m_bias.assign( k, 0.0f );
+            for( size_t i = 0; i < k; i++ )
+            {
+                double row_sum = 0.0;
+                for( size_t j = 0; j < k; j++ )
+                {
+                    row_sum += inverse[ i * k + j ];
+                }
+                m_bias[ i ] = static_cast< float >( -weight * row_sum );
+                for( size_t b = 0; b < bands; b++ )
+                {
+                    double sum = 0.0;
+                    for( size_t j = 0; j < k; j++ )
+                    {
+                        sum += inverse[ i * k + j ] * a_endmembers[ j * bands + b ];
+                    }
+                    m_unmixing[ i * bands + b ] = static_cast< float >( sum );
+                }
+            }
+
+            m_gram.swap( gram );
+            m_endmembers = a_endmembers;
+            m_names = a_names;
+            m_count = a_count;
+            m_spectralSize = a_spectralSize;
+            m_firstBand = a_firstBand;
+            m_bandCount = a_bandCount;
+            return HYSPEX_OK;
+        }
+
+        bool isPrepared() const { return m_count > 0; } //!< prepare() or setEndmembers() succeeded.
+        uint32_t getEndmemberCount() const { return m_count; } //!< Number of endmembers, bands of the output.
+        uint32_t getSpectralSize() const { return m_spectralSize; } //!< Spectral size of input frames.
+        uint32_t getFirstBand() const { return m_firstBand; } //!< First camera band used.
+        uint32_t getBandCount() const { return m_bandCount; } //!< Number of camera bands used.
+        const std::vector< float >& getEndmembers() const { return m_endmembers; } //!< Endmembers x used bands.
+        const std::vector< std::string >& getNames() const { return m_names; } //!< Endmember names, may be empty.
+
+        //! Unmix all pixels of a_image, stored in a_layout ( BIL or BIP ), into a_output ( endmembers x spatial, BIL ), including metadata.
+        ReturnCode apply( const ImageLine< float >& a_image, ImageBuffer< float >& a_output, ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            a_output.resize( m_count, a_image.spatial_size );
+            a_output.copyMetadata( a_image );
+            return unmix( a_image.buffer.data, a_image.buffer.size, a_image.spectral_size, a_image.spatial_size, a_output.data(),
+                          a_layout );
+        }
+
+        //! Unmix a frame, spectral x spatial ( BIL ) or spatial x spectral ( BIP ), into a_output ( endmembers x spatial ). Thread-safe.
+        ReturnCode unmix( const float* a_data, size_t a_size, uint32_t a_spectralSize, uint32_t a_spatialSize, float* a_output,
+                          ImageLayout a_layout = HYSPEX_LAYOUT_BIL ) const
+        {
+            if( !isPrepared() )
+            {
+                return HYSPEX_NOT_ACTIVE;
+            }
+            if( !a_data || !a_output || a_spectralSize != m_spectralSize || a_size != static_cast< size_t >( a_spectralSize ) * a_spatialSize ||
+                ( a_layout != HYSPEX_LAYOUT_BIL && a_layout != HYSPEX_LAYOUT_BIP ) )
+            {
+                return HYSPEX_INVALID_ARGUMENTS;
+            }
+
+            const size_t k = m_count;
+            if( a_layout == HYSPEX_LAYOUT_BIP )
+            {
+                // each spectrum is contiguous, a dot product with every row of G^-1 E.
+                for( uint32_t x = 0; x < a_spatialSize; x++ )
+                {
+                    const float* spectrum = a_data + static_cast< size_t >( x ) * a_spectralSize + m_firstBand;
+                    for( size_t i = 0; i < k; i++ )
+                    {
+                        a_output[ i * a_spatialSize + x ] = dotProduct( m_unmixing.data() + i * m_bandCount, spectrum, m_bandCount ) - m_bias[ i ];
+                    }
+                }
+            }
+            else
+            {
+                multiplySpectra( m_unmixing.data(), k, m_bandCount, m_bias.data(), a_data + static_cast< size_t >( m_firstBand ) * a_spatialSize,
+                                 a_spatialSize, a_spatialSize, a_output, a_spatialSize );
+            }
+
+            Scratch scratch( k );
+            for( uint32_t x = 0; x < a_spatialSize; x++ )
+            {
+                bool negative = false;
+                for( size_t i = 0; i < k; i++ )
+                {
+                    negative |= a_output[ i * a_spatialSize + x ] < 0.0f;
+                }
+                if( !negative )
+                {
+                    continue;
+                }
+
+                // right hand side E x + w 1 = G a, from the unconstrained solution.
+                for( size_t i = 0; i < k; i++ )
+                {
+                    double sum = 0.0;
+                    for( size_t j = 0; j < k; j++ )
+                    {
+                        sum += m_gram[ i * k + j ] * a_output[ j * a_spatialSize + x ];
+                    }
+                    scratch.rhs[ i ] = sum;
+                }
+                solveNonNegative( scratch );
+                for( size_t i = 0; i < k; i++ )
+                {
+                    a_output[ i * a_spatialSize + x ] = static_cast< float >( scratch.solution[ i ] );
+                }
+            }
+            return HYSPEX_OK;
+        }
+
+    private:
+        //! Per call work space of solveNonNegative().
+        struct Scratch
+        {
+            explicit Scratch( size_t a_count )
+                : rhs( a_count ), solution( a_count ), candidate( a_count ), gradient( a_count ), system( a_count * a_count ), passive( a_count ), indices( a_count )
+            {
+            }
+
+            std::vector< double > rhs;        //!< G a_unconstrained.
+            std::vector< double > solution;   //!< Feasible solution.
+            std::vector< double > candidate;  //!< Solution on passive set.
+            std::vector< double > gradient;   //!< rhs - G solution.
+            std::vector< double > system;     //!< G restricted to passive set, factorized.
+            std::vector< char > passive;      //!< Endmember is in passive set.
+            std::vector< size_t > indices;    //!< Passive endmembers.
+        };
+
+        //! Lower Cholesky factor in place of the leading a_size x a_size block of a_matrix ( row stride a_stride ).
+        static bool choleskyFactor( double* a_matrix, size_t a_size, size_t a_stride )
+        {
+            for( size_t j = 0; j < a_size; j++ )
+            {
+                double diagonal = a_matrix[ j * a_stride + j ];
+                for( size_t p = 0; p < j; p++ )
+                {
+                    diagonal -= a_matrix[ j * a_stride + p ] * a_matrix[ j * a_stride + p ];
+                }
+                if( !( diagonal > 0.0 ) )
+                {
+                    return false;
+                }
+                diagonal = std::sqrt( diagonal );
+                a_matrix[ j * a_stride + j ] = diagonal;
+                for( size_t i = j + 1; i < a_size; i++ )
+                {
+                    double sum = a_matrix[ i * a_stride + j ];
+                    for( size_t p = 0; p < j; p++ )
+                    {
+                        sum -= a_matrix[ i * a_stride + p ] * a_matrix[ j * a_stride + p ];
+                    }
+                    a_matrix[ i * a_stride + j ] = sum / diagonal;
+                }
+            }
+            return true;
+        }
+
+        //! Solve L L' x = a_vector in place, with the factor from choleskyFactor().
+        static void choleskySolve( const double* a_factor, size_t a_size, size_t a_stride, double* a_vector )
+        {
+            for( size_t i = 0; i < a_size; i++ )
+            {
+                double sum = a_vector[ i ];
+                for( size_t p = 0; p < i; p++ )
+                {
+                    sum -= a_factor[ i * a_stride + p ] * a_vector[ p ];
+                }
+                a_vector[ i ] = sum / a_factor[ i * a_stride + i ];
+            }
+            for( size_t i = a_size; i-- > 0; )
+            {
+                double sum = a_vector[ i ];
+                for( size_t p = i + 1; p < a_size; p++ )
+                {
+                    sum -= a_factor[ p * a_stride + i ] * a_vector[ p ];
+                }
+                a_vector[ i ] = sum / a_factor[ i * a_stride + i ];
+            }
+        }
+
+        //! Solve G restricted to the passive set for a_scratch.candidate, false if it is not positive definite.
+        bool solvePassive( Scratch& a_scratch, size_t a_passiveCount ) const
+        {
+            const size_t k = m_count;
+            for( size_t i = 0; i < a_passiveCount; i++ )
+            {
+                for( size_t j = 0; j < a_passiveCount; j++ )
+                {
+                    a_scratch.system[ i * k + j ] = m_gram[ a_scratch.indices[ i ] * k + a_scratch.indices[ j ] ];
+                }
+            }
+            if( !choleskyFactor( a_scratch.system.data(), a_passiveCount, k ) )
+            {
+                return false;
+            }
+            std::vector< double >& candidate = a_scratch.candidate;
+            std::fill( candidate.begin(), candidate.end(), 0.0 );
+            for( size_t i = 0; i < a_passiveCount; i++ )
+            {
+                candidate[ i ] = a_scratch.rhs[ a_scratch.indices[ i ] ];
+            }
+            choleskySolve( a_scratch.system.data(), a_passiveCount, k, candidate.data() );
+            // scatter from passive order to endmember order, backwards so no value is overwritten before it is moved.
+            for( size_t i = a_passiveCount; i-- > 0; )
+            {
+                const double value = candidate[ i ];
+                candidate[ i ] = 0.0;
+                candidate[ a_scratch.indices[ i ] ] = value;
+            }
+            return true;
+        }
+
+        //! Lawson-Hanson: minimize 0.5 a' G a - a' rhs subject to a >= 0, result in a_scratch.solution.
+        void solveNonNegative( Scratch& a_scratch ) const
+        {
+            const size_t k = m_count;
+            std::vector< double >& solution = a_scratch.solution;
+            std::fill( solution.begin(), solution.end(), 0.0 );
+            std::fill( a_scratch.passive.begin(), a_scratch.passive.end(), static_cast< char >( 0 ) );
+
+            double scale = 0.0;
+            for( size_t i = 0; i < k; i++ )
+            {
+                scale = std::max( scale, std::fabs( a_scratch.rhs[ i ] ) );
+            }
+            const double tolerance = 1e-10 * scale;
+
+            for( size_t iteration = 0; iteration < 3 * k; iteration++ )
+            {
+                // most violated endmember outside the passive set.
+                size_t best = k;
+                double best_gradient = tolerance;
+                for( size_t i = 0; i < k; i++ )
+                {
+                    double gradient = a_scratch.rhs[ i ];
+                    for( size_t j = 0; j < k; j++ )
+                    {
+                        gradient -= m_gram[ i * k + j ] * solution[ j ];
+                    }
+                    if( !a_scratch.passive[ i ] && gradient > best_gradient )
+                    {
+                        best = i;
+                        best_gradient = gradient;
+                    }
+                }
+                if( best == k )
+                {
+                    break;
+                }
+                a_scratch.passive[ best ] = 1;
+
+                for( size_t inner = 0; inner <= k; inner++ )
+                {
+                    size_t passive_count = 0;
+                    for( size_t i = 0; i < k; i++ )
+                    {
+                        if( a_scratch.passive[ i ] )
+                        {
+                            a_scratch.indices[ passive_count++ ] = i;
+                        }
+                    }
+                    if( passive_count == 0 || !solvePassive( a_scratch, passive_count ) )
+                    {
+                        return;
+                    }
+
+                    // step towards the candidate until the first passive abundance reaches zero.
+                    double step = 1.0;
+                    for( size_t p = 0; p < passive_count; p++ )
+                    {
+                        const size_t i = a_scratch.indices[ p ];
+                        if( a_scratch.candidate[ i ] <= 0.0 )
+                        {
+                            const double denominator = solution[ i ] - a_scratch.candidate[ i ];
+                            step = std::min( step, denominator > 0.0 ? solution[ i ] / denominator : 0.0 );
+                        }
+                    }
+                    for( size_t p = 0; p < passive_count; p++ )
+                    {
+                        const size_t i = a_scratch.indices[ p ];
+                        solution[ i ] += step * ( a_scratch.candidate[ i ] - solution[ i ] );
+                        if( step < 1.0 && solution[ i ] <= 1e-12 * scale )
+                        {
+                            solution[ i ] = 0.0;
+                            a_scratch.passive[ i ] = 0;
+                        }
+                    }
+                    if( step >= 1.0 )
+                    {
+                        break;
+                    }
+                }
+            }
+        }
+
+        double m_sumToOneWeight{ 1000.0 }; //!< Relative weight of sum-to-one band.
+        uint32_t m_count{ 0 };             //!< Number of endmembers.
+        uint32_t m_spectralSize{ 0 };      //!< Spectral size of input frames.
+        uint32_t m_firstBand{ 0 };         //!< First band used.
+        uint32_t m_bandCount{ 0 };         //!< Number of bands used.
+        std::vector< float > m_endmembers; //!< Endmembers x used bands.
+        std::vector< float > m_unmixing;   //!< G^-1 E, endmembers x used bands.
+        std::vector< float > m_bias;       //!< -w G^-1 1.
+        std::vector< double > m_gram;      //!< G = E E' + w 1 1'.
+        std::vector< std::string > m_names; //!< Endmember names.
+    };
+
+    /*!
+    * Unmix every image of a_reader ( FileReader::getFloatImage() ) with a_unmixer and write the abundances to a_writer, which must be open.
+    * Images are read a_batchSize at a time, unmixed on a_threads threads ( 0 for one per core ) and written in order.
+    * Band names of a_writer are set from the endmember names.
+    *
+    * EXAMPLE:
+    * @code
+    * hyspex::FileReader reader;
+    * reader.open( "scene.hyspex" );
+    * std::vector< double > wavelengths, fwhm;
+    * hyspex::readEnviWavelengths( "scene.hdr", &wavelengths, &fwhm );
+    * hyspex::Unmixer unmixer;
+    * unmixer.prepare( library, wavelengths, fwhm );
+    * hyspex::FloatCubeWriter writer;
+    * writer.open( "scene_abundances" );
+    * hyspex::unmixFile( reader, unmixer, writer );
+    * writer.close();
+    * @endcode
+    */
+    inline ReturnCode unmixFile( FileReader& a_reader, const Unmixer& a_unmixer, FloatCubeWriter& a_writer, unsigned int a_threads = 0, size_t a_batchSize = 64 )
+    {
+        if( !a_unmixer.isPrepared() )
+        {
+            return HYSPEX_NOT_ACTIVE;
+        }
+        if( !a_writer.isOpen() || a_batchSize == 0 )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+        uint32_t spectral_size = 0;
+        uint32_t spatial_size = 0;
+        HYSPEX_RETURN_IF_ERROR_VAL( getFileImageSize( a_reader, &spectral_size, &spatial_size ) );
+        if( spectral_size != a_unmixer.getSpectralSize() )
+        {
+            return HYSPEX_INVALID_ARGUMENTS;
+        }
+        if( a_threads == 0 )
+        {
+            a_threads = std::max( 1u, std::thread::hardware_concurrency() );
+        }
+        if( a_unmixer.getNames().size() == a_unmixer.getEndmemberCount() )
+        {
+            a_writer.setBandNames( a_unmixer.getNames() );
+        }
+        a_writer.setDescription( "abundances" );
+
+        const size_t input_size = static_cast< size_t >( spectral_size ) * spatial_size;
+        const size_t output_size = static_cast< size_t >( a_unmixer.getEndmemberCount() ) * spatial_size;
+        std::vector< float > input( input_size * a_batchSize );
+        std::vector< float > output( output_size * a_batchSize );
+        std::vector< ReturnCode > results( a_threads );
+        std::vector< std::thread > threads;
+
+        ImageLine< float > line = ImageLine< float >();
+        line.spectral_size = a_unmixer.getEndmemberCount();
+        line.spatial_size = spatial_size;
+
+        const size_t count = a_reader.getImageCount();
+        for( size_t first = 0; first < count; first += a_batchSize )
+        {
+            const size_t frames = std::min( a_batchSize, count - first );
+            for( size_t f = 0; f < frames; f++ )
+            {
+                const ConstBuffer< float > image = a_reader.getFloatImage( first + f );
+                if( image.size != input_size )
+                {
+                    return HYSPEX_INVALID_ARGUMENTS;
+                }
+                std::copy( image.data, image.data + input_size, input.begin() + f * input_size );
+            }
+
+            const unsigned int workers = static_cast< unsigned int >( std::min( static_cast< size_t >( a_threads ), frames ) );
+            threads.clear();
+            for( unsigned int t = 0; t < workers; t++ )
+            {
+                threads.emplace_back( [&, t]()
+                {
+                    results[ t ] = HYSPEX_OK;
+                    for( size_t f = t; f < frames && results[ t ] == HYSPEX_OK; f += workers )
+                    {
+                        results[ t ] = a_unmixer.unmix( input.data() + f * input_size, input_size, spectral_size, spatial_size, output.data() + f * output_size );
+                    }
+                } );
+            }
+            for( size_t t = 0; t < threads.size(); t++ )
+            {
+                threads[ t ].join();
+            }
+            for( unsigned int t = 0; t < workers; t++ )
+            {
+                HYSPEX_RETURN_IF_ERROR_VAL( results[ t ] );
+            }
+
+            for( size_t f = 0; f < frames; f++ )
+            {
+                line.buffer.data = output.data() + f * output_size;
+                line.buffer.size = output_size;
+                line.stat.frame_number = first + f;
+                if( !a_writer.writeFrame( line ) )
+                {
+                    return HYSPEX_FAILED_TO_SET_VALUE;
+                }
+            }
+        }
+        return HYSPEX_OK;
+    }
+}
+
+#endif // HYSPEX_UNMIXING_H